@@ -0,0 +1,461 @@
+open Lwt.Infix
+open SyncTypes
+
+module AsyncUtils = Sync_Utils_AsyncUtils
+
+(* Encoding. Integers are little endian. *)
+
+type reader = {
+    data : Lwt_bytes.t ;
+    mutable pos : int ;
+  }
+
+(* Values are encoded into a Bigarray too, so that bigstrings and frames
+ * are blitted instead of going through strings. *)
+type writer = {
+    mutable buffer : Lwt_bytes.t ;
+    mutable length : int ;
+  }
+
+type 'a codec = {
+    write : writer -> 'a -> unit ;
+    read : reader -> 'a ;
+  }
+
+let writer size = { buffer = Lwt_bytes.create size ; length = 0 }
+
+let contents writer = Lwt_bytes.proxy writer.buffer 0 writer.length
+
+(* Makes room for a number of bytes at the end of the writer, and returns
+ * their position. *)
+let reserve writer bytes =
+  let pos = writer.length in
+  if pos + bytes > Lwt_bytes.length writer.buffer then begin
+      let buffer = Lwt_bytes.create (max (pos + bytes) (2 * Lwt_bytes.length writer.buffer)) in
+      Lwt_bytes.blit writer.buffer 0 buffer 0 pos;
+      writer.buffer <- buffer
+    end;
+  writer.length <- pos + bytes;
+  pos
+
+let set_uint data pos bytes n =
+  for i = 0 to bytes - 1 do
+    Lwt_bytes.set data (pos + i) (Char.unsafe_chr ((n asr (8 * i)) land 0xff))
+  done
+
+let add_uint writer bytes n = set_uint writer.buffer (reserve writer bytes) bytes n
+
+let add_char writer c = Lwt_bytes.set writer.buffer (reserve writer 1) c
+
+let add_bigstring writer data =
+  let length = Lwt_bytes.length data in
+  Lwt_bytes.blit data 0 writer.buffer (reserve writer length) length
+
+let get_uint data pos bytes =
+  let n = ref 0 in
+  for i = bytes - 1 downto 0 do
+    n := (!n lsl 8) lor Char.code (Lwt_bytes.get data (pos + i))
+  done;
+  !n
+
+let take reader length =
+  let pos = reader.pos in
+  if length < 0 || pos + length > Lwt_bytes.length reader.data
+  then invalid_arg "BinaryProtocol: truncated value";
+  reader.pos <- pos + length;
+  pos
+
+let unit = {
+    write = (fun _ () -> ()) ;
+    read = (fun _ -> ()) ;
+  }
+
+let bool = {
+    write = (fun writer b -> add_char writer (if b then '\001' else '\000')) ;
+    read = (fun reader -> Lwt_bytes.get reader.data (take reader 1) <> '\000') ;
+  }
+
+let int = {
+    write = (fun buffer n -> add_uint buffer 8 n) ;
+    read = (fun reader -> get_uint reader.data (take reader 8) 8) ;
+  }
+
+let float = {
+    write = (fun buffer x ->
+	     let bits = Int64.bits_of_float x in
+	     add_uint buffer 4 (Int64.to_int (Int64.logand bits 0xffffffffL));
+	     add_uint buffer 4 (Int64.to_int (Int64.shift_right_logical bits 32))) ;
+    read = (fun reader ->
+	    let pos = take reader 8 in
+	    let low = get_uint reader.data pos 4
+	    and high = get_uint reader.data (pos + 4) 4 in
+	    Int64.float_of_bits (Int64.logor (Int64.shift_left (Int64.of_int high) 32)
+					     (Int64.of_int low))) ;
+  }
+
+let string = {
+    write = (fun writer s ->
+	     let length = String.length s in
+	     add_uint writer 4 length;
+	     Lwt_bytes.blit_from_string s 0 writer.buffer (reserve writer length) length) ;
+    read = (fun reader ->
+	    let length = get_uint reader.data (take reader 4) 4 in
+	    let bytes = Bytes.create length in
+	    Lwt_bytes.blit_to_bytes reader.data (take reader length) bytes 0 length;
+	    Bytes.unsafe_to_string bytes) ;
+  }
+
+let bigstring = {
+    write = (fun writer data ->
+	     add_uint writer 4 (Lwt_bytes.length data);
+	     add_bigstring writer data) ;
+    read = (fun reader ->
+	    let length = get_uint reader.data (take reader 4) 4 in
+	    Lwt_bytes.proxy reader.data (take reader length) length) ;
+  }
+
+let option codec = {
+    write = (fun buffer -> function
+	     | None -> bool.write buffer false
+	     | Some x -> bool.write buffer true; codec.write buffer x) ;
+    read = (fun reader -> if bool.read reader then Some (codec.read reader) else None) ;
+  }
+
+let list codec = {
+    write = (fun buffer l ->
+	     add_uint buffer 4 (List.length l);
+	     List.iter (codec.write buffer) l) ;
+    read = (fun reader ->
+	    let length = get_uint reader.data (take reader 4) 4 in
+	    let rec aux accu n =
+	      if n = 0 then List.rev accu else aux (codec.read reader :: accu) (n - 1)
+	    in aux [] length) ;
+  }
+
+let pair a b = {
+    write = (fun buffer (x, y) -> a.write buffer x; b.write buffer y) ;
+    read = (fun reader -> let x = a.read reader in let y = b.read reader in x, y) ;
+  }
+
+let triple a b c = {
+    write = (fun buffer (x, y, z) -> a.write buffer x; b.write buffer y; c.write buffer z) ;
+    read = (fun reader ->
+	    let x = a.read reader in
+	    let y = b.read reader in
+	    let z = c.read reader in
+	    x, y, z) ;
+  }
+
+let map of_value to_value codec = {
+    write = (fun buffer x -> codec.write buffer (of_value x)) ;
+    read = (fun reader -> to_value (codec.read reader)) ;
+  }
+
+let decode codec data =
+  let reader = { data ; pos = 0 } in
+  let value = codec.read reader in
+  if reader.pos <> Lwt_bytes.length data
+  then invalid_arg "BinaryProtocol: trailing bytes";
+  value
+
+(* Frames. After the prefix, that Rpc reads to dispatch them, frames have
+ * a header of:
+ * - the length of the payload, on 4 bytes,
+ * - the identifier of the operation, on 4 bytes,
+ * - the key that matches a response to its request, on 4 bytes,
+ * - the kind of frame, on a byte. *)
+
+type kind = Request | Response | Error
+
+type frame = {
+    operation : int ;
+    key : int ;
+    kind : kind ;
+    payload : Lwt_bytes.t ;
+  }
+
+let prefix = 'B'
+let header_size = 13
+let max_payload_size = 1 lsl 30
+
+let code_of_kind = function
+  | Request -> '\000'
+  | Response -> '\001'
+  | Error -> '\002'
+
+let kind_of_code = function
+  | '\000' -> Request
+  | '\001' -> Response
+  | '\002' -> Error
+  | _ -> failwith "BinaryProtocol: bad frame kind"
+
+let add_header writer ~prefixed operation key kind length =
+  if prefixed then add_char writer prefix;
+  add_uint writer 4 length;
+  add_uint writer 4 operation;
+  add_uint writer 4 key;
+  add_char writer (code_of_kind kind)
+
+(* Encodes a frame at the end of a writer: the length of the payload is
+ * set once it is written. *)
+let encode_frame ~prefixed operation key kind write_payload writer =
+  add_header writer ~prefixed operation key kind 0;
+  let payload = writer.length in
+  write_payload writer;
+  set_uint writer.buffer (payload - header_size) 4 (writer.length - payload)
+
+(* Reads from the channel's own buffer, a Bigarray, into another without
+ * going through strings. *)
+let rec read_into channel buffer offset length =
+  if length = 0
+  then Lwt.return_unit
+  else
+    Lwt_io.direct_access channel
+      begin fun da ->
+	    begin if da.Lwt_io.da_ptr < da.Lwt_io.da_max
+		  then Lwt.return_unit
+		  else da.Lwt_io.da_perform ()
+		       >>= function
+		       | 0 -> Lwt.fail End_of_file
+		       | _ -> Lwt.return_unit
+	    end
+	    >|= fun () ->
+	    let count = min length (da.Lwt_io.da_max - da.Lwt_io.da_ptr) in
+	    Lwt_bytes.blit da.Lwt_io.da_buffer da.Lwt_io.da_ptr buffer offset count;
+	    da.Lwt_io.da_ptr <- da.Lwt_io.da_ptr + count;
+	    count
+      end
+    >>= fun count -> read_into channel buffer (offset + count) (length - count)
+
+(* Writes from a Bigarray into the channel's own buffer. *)
+let rec write_from channel buffer offset length =
+  if length = 0
+  then Lwt.return_unit
+  else
+    Lwt_io.direct_access channel
+      begin fun da ->
+	    begin if da.Lwt_io.da_ptr < da.Lwt_io.da_max
+		  then Lwt.return_unit
+		  else da.Lwt_io.da_perform () >|= ignore
+	    end
+	    >|= fun () ->
+	    let count = min length (da.Lwt_io.da_max - da.Lwt_io.da_ptr) in
+	    Lwt_bytes.blit buffer offset da.Lwt_io.da_buffer da.Lwt_io.da_ptr count;
+	    da.Lwt_io.da_ptr <- da.Lwt_io.da_ptr + count;
+	    count
+      end
+    >>= fun count -> write_from channel buffer (offset + count) (length - count)
+
+let read_frame channel =
+  let header = Lwt_bytes.create header_size in
+  read_into channel header 0 header_size
+  >>= fun () ->
+  let length = get_uint header 0 4 in
+  if length > max_payload_size
+  then Lwt.fail_with "BinaryProtocol: frame too large"
+  else
+    let payload = Lwt_bytes.create length in
+    read_into channel payload 0 length
+    >>= fun () ->
+    Lwt.wrap1 kind_of_code (Lwt_bytes.get header 12)
+    >|= fun kind ->
+    { operation = get_uint header 4 4 ;
+      key = get_uint header 8 4 ;
+      kind ;
+      payload }
+
+(* Frames waiting to be written, by channel. The frames sent before the
+ * scheduler runs again are encoded into the same batch, which is written
+ * and flushed at once. *)
+let batches = ref []
+
+let send output encode =
+  match List.assq output !batches with
+  | batch, written -> encode batch; written
+  | exception Not_found ->
+     let batch = writer 4096 in
+     encode batch;
+     let written =
+       Lwt.pause ()
+       >>= fun () ->
+       batches := List.filter (fun (channel, _) -> channel != output) !batches;
+       Lwt_io.atomic
+	 (fun channel -> write_from channel batch.buffer 0 batch.length
+			 >>= fun () -> Lwt_io.flush channel)
+	 output
+     in
+     batches := (output, (batch, written)) :: !batches;
+     written
+
+(* Operations. *)
+
+type ('a, 'b) operation = {
+    id : int ;
+    request : 'a codec ;
+    response : 'b codec ;
+  }
+
+exception Remote_error of string
+
+(* Implementations of the operations, from the payload of a request to the
+ * writer of the payload of its response. *)
+let operations : (int, Lwt_bytes.t -> connection -> (writer -> unit) Lwt.t) Hashtbl.t =
+  Hashtbl.create 16
+
+let register_operation id request response f =
+  if Hashtbl.mem operations id then invalid_arg "BinaryProtocol.register_operation";
+  Hashtbl.add operations id
+	      begin fun payload connection ->
+		    f (decode request payload) connection
+		    >|= fun result writer -> response.write writer result
+	      end;
+  { id ; request ; response }
+
+let serve frame connection =
+  Lwt.catch
+    begin fun () ->
+	  let f = try Hashtbl.find operations frame.operation
+		  with Not_found -> failwith ("Operation not found: " ^ string_of_int frame.operation)
+	  in
+	  f frame.payload connection >|= fun write -> Response, write
+    end
+    (fun exn -> Lwt.return (Error, fun writer -> string.write writer (Printexc.to_string exn)))
+
+(* Calls waiting for their response on a connection, by key. *)
+type calls = {
+    waiters : (int, frame Lwt.u) Hashtbl.t ;
+    mutable next_key : int ;
+  }
+
+exception Connection_closed
+
+(* Calls by connection. The calls still waiting when the connection closes
+ * fail, instead of waiting for their timeout. *)
+let calls = ref []
+
+let calls_of connection =
+  match List.assq connection !calls with
+  | calls -> calls
+  | exception Not_found ->
+     let pending = { waiters = Hashtbl.create 16 ; next_key = 0 } in
+     calls := (connection, pending) :: !calls;
+     Lwt.on_termination connection.onclose
+			begin fun () ->
+			      calls := List.filter (fun (other, _) -> other != connection) !calls;
+			      let wakeners = Hashtbl.fold (fun _ wakener l -> wakener :: l) pending.waiters [] in
+			      Hashtbl.reset pending.waiters;
+			      List.iter (fun wakener -> Lwt.wakeup_exn wakener Connection_closed) wakeners
+			end;
+     pending
+
+let rec fresh_key calls =
+  let key = calls.next_key in
+  calls.next_key <- (key + 1) land 0xffffffff;
+  if Hashtbl.mem calls.waiters key then fresh_key calls else key
+
+let call_frame ?(settings = Protocol.default_settings) connection operation write_payload =
+  if Lwt.state connection.onclose <> Lwt.Sleep
+  then Lwt.fail Connection_closed
+  else
+    let calls = calls_of connection in
+    let key = fresh_key calls in
+    let waiter, wakener = Lwt.task () in
+    Hashtbl.add calls.waiters key wakener;
+    Lwt.on_cancel waiter (fun () -> Hashtbl.remove calls.waiters key);
+    send connection.output (encode_frame ~prefixed: true operation key Request write_payload)
+    >>= fun () ->
+    Lwt.catch
+      (fun () -> Lwt_unix.with_timeout settings.Protocol.timeout (fun () -> waiter))
+      begin function
+	| Lwt_unix.Timeout ->
+	   Lwt_io.eprintlf "Binary request from %s to %s timed out."
+			   connection.root.root_name connection.peer_name
+	   >>= connection.close
+	   >>= fun () -> Lwt.fail Protocol.Timeout
+	| exn -> Lwt.fail exn
+      end
+
+let call ?settings connection operation argument =
+  call_frame ?settings connection operation.id (fun writer -> operation.request.write writer argument)
+  >|= fun frame ->
+  match frame.kind with
+  | Response -> decode operation.response frame.payload
+  | Error -> raise (Remote_error (decode string frame.payload))
+  | Request -> failwith "BinaryProtocol: request instead of a response"
+
+let respond connection =
+  Lwt_io.atomic read_frame connection.input
+  >|= fun frame ->
+  match frame.kind with
+  | Request ->
+     (* Served concurrently, so that requests pipeline. *)
+     AsyncUtils.async
+       ~onerror: "BinaryProtocol.respond"
+       begin fun () ->
+	     serve frame connection
+	     >>= fun (kind, write) ->
+	     send connection.output (encode_frame ~prefixed: true frame.operation frame.key kind write)
+       end
+  | Response | Error ->
+     let { waiters ; _ } = calls_of connection in
+     match Hashtbl.find waiters frame.key with
+     | wakener -> Hashtbl.remove waiters frame.key; Lwt.wakeup wakener frame
+     | exception Not_found -> () (* Timed out. *)
+
+module Frames = struct
+  type 'a request = frame
+  type 'a response = frame
+
+  let prefix = prefix
+  let default_settings = Protocol.default_settings
+
+  let get_operation frame connection =
+    serve frame connection
+    >|= fun (kind, write) ->
+    let payload = writer 64 in
+    write payload;
+    { frame with kind ; payload = contents payload }
+
+  (* The payload is written after the header, not encoded with it. *)
+  let write channel ~prefixed frame =
+    let header = writer (header_size + 1)
+    and length = Lwt_bytes.length frame.payload in
+    add_header header ~prefixed frame.operation frame.key frame.kind length;
+    Lwt_io.atomic
+      (fun channel -> write_from channel header.buffer 0 header.length
+		      >>= fun () -> write_from channel frame.payload 0 length)
+      channel
+
+  let read_request = read_frame
+  let write_request channel frame = write channel ~prefixed: true frame
+  let read_response = read_frame
+  let write_response channel frame = write channel ~prefixed: false frame
+
+  let respond = respond
+
+  let call ?settings connection frame =
+    call_frame ?settings connection frame.operation
+	       (fun writer -> add_bigstring writer frame.payload)
+end
+
+let () = assert begin
+  let roundtrip codec value =
+    let writer = writer 4 in
+    codec.write writer value;
+    decode codec (contents writer) = value
+  in
+  roundtrip int max_int
+  && roundtrip int min_int
+  && roundtrip int (-1)
+  && roundtrip float 3.25
+  && roundtrip float (-. 1e300)
+  && roundtrip (list (pair string (option bool))) [ "a", Some true ; "", None ; "b", Some false ]
+  && roundtrip (triple unit int string) ((), 42, String.make 300 'x')
+  && Lwt_bytes.to_string (decode bigstring (Lwt_bytes.of_string "\003\000\000\000abc")) = "abc"
+  && (let frame = writer 1 in
+      encode_frame ~prefixed: true 7 9 Response (fun writer -> string.write writer "abc") frame;
+      Lwt_bytes.to_string (contents frame)
+      = "B\007\000\000\000\007\000\000\000\009\000\000\000\001\003\000\000\000abc")
+  && (try ignore (decode string (Lwt_bytes.of_string "\009\000\000\000abc")); false
+      with Invalid_argument _ -> true)
+end
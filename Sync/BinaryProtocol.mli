@@ -0,0 +1,58 @@
+(** Module for the binary protocol.
+
+    Requests name an operation registered under an integer identifier on
+    both peers, and carry its argument encoded by a codec, instead of a
+    marshalled closure: peers only need to agree on the operations, not to
+    run the same binary. Messages are length-prefixed frames.
+
+    Calls are asynchronous, as those of [NativeProtocol.Async]: the frames
+    of the calls made before the scheduler runs again are written together,
+    with a single flush, and requests are served concurrently. *)
+
+open SyncTypes
+
+(** Encoding of the values of a type. *)
+type 'a codec
+
+val unit : unit codec
+val bool : bool codec
+val int : int codec
+val float : float codec
+val string : string codec
+
+(** Decodes without copying: the value shares the frame it came in. *)
+val bigstring : Lwt_bytes.t codec
+
+val option : 'a codec -> 'a option codec
+val list : 'a codec -> 'a list codec
+val pair : 'a codec -> 'b codec -> ('a * 'b) codec
+val triple : 'a codec -> 'b codec -> 'c codec -> ('a * 'b * 'c) codec
+
+(** Codec of a type through a conversion from and to another. *)
+val map : ('b -> 'a) -> ('a -> 'b) -> 'a codec -> 'b codec
+
+(** Operation that takes an ['a] and returns a ['b]. *)
+type ('a, 'b) operation
+
+(** Raised by [call] when the operation failed on the peer, with the
+    printed exception. *)
+exception Remote_error of string
+
+(** Raised by [call] when the connection closes before the response. *)
+exception Connection_closed
+
+(** Registers the implementation of an operation under an identifier,
+    which must be the same on both peers. Raises [Invalid_argument] when
+    the identifier is taken. *)
+val register_operation :
+  int -> 'a codec -> 'b codec -> ('a -> connection -> 'b Lwt.t) -> ('a, 'b) operation
+
+val call : ?settings: Protocol.settings -> connection -> ('a, 'b) operation -> 'a -> 'b Lwt.t
+
+(** Message of the protocol. *)
+type frame
+
+(** The protocol on frames, for [Rpc]. *)
+module Frames : (Protocol.Sig with
+		   type 'a request = frame and
+		   type 'a response = frame)
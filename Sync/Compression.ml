@@ -0,0 +1,238 @@
+open Lwt.Infix
+open SyncTypes
+
+type role = Client | Server
+
+external compress : Lwt_bytes.t -> int -> int -> Lwt_bytes.t -> int -> int
+  = "sync_compression_compress_impl"
+external decompress : Lwt_bytes.t -> int -> int -> Lwt_bytes.t -> int -> int -> int
+  = "sync_compression_decompress_byte" "sync_compression_decompress_impl"
+external entropy : Lwt_bytes.t -> int -> int -> int = "sync_compression_entropy_impl"
+
+let bound length =
+  length + length / 255 + 16
+
+let traffic () =
+  { compressed = false ;
+    raw_sent = 0 ;
+    wire_sent = 0 ;
+    raw_received = 0 ;
+    wire_received = 0 }
+
+(* Largest block, the size of the buffers of compressed channels. *)
+let block_size = 65536
+
+(* Blocks are sent as they are when smaller, or when their sampled entropy
+ * is higher, in thousandths of bits per byte: compressed or encrypted
+ * data is close to 8000. *)
+let min_compressed_size = 128
+let max_entropy = 7200
+
+(* The hello starts with a byte that no protocol of Rpc starts with. *)
+let magic = "\255SZ\001"
+let hello_size = String.length magic + 1
+let lz4 = 1
+
+let hello features =
+  Lwt_bytes.of_string (magic ^ String.make 1 (Char.chr features))
+
+let is_hello data =
+  Lwt_bytes.to_string (Lwt_bytes.proxy data 0 (String.length magic)) = magic
+
+(* Blocks have a header of 4 bytes: the length of the payload, with the
+ * high bit set when it is compressed. *)
+let header_size = 4
+let compressed_bit = 0x80000000
+
+let get_uint32 data offset =
+  let byte i = Char.code (Lwt_bytes.get data (offset + i)) in
+  byte 0 lor (byte 1 lsl 8) lor (byte 2 lsl 16) lor (byte 3 lsl 24)
+
+let set_uint32 data offset n =
+  for i = 0 to 3 do
+    Lwt_bytes.set data (offset + i) (Char.unsafe_chr ((n lsr (8 * i)) land 0xff))
+  done
+
+type stream = {
+    fd : Lwt_unix.file_descr ;
+    traffic : traffic ;
+    role : role ;
+    enabled : bool ;
+    mutable negotiation : bool Lwt.t option ;
+    (* Bytes received but not read yet: the decompressed block, or what
+     * turned out not to be a hello. *)
+    pending : Lwt_bytes.t ;
+    mutable pending_offset : int ;
+    mutable pending_length : int ;
+    (* Block being received, and block being sent. *)
+    input_block : Lwt_bytes.t ;
+    output_block : Lwt_bytes.t ;
+  }
+
+let rec read_exactly fd buffer offset length =
+  if length = 0
+  then Lwt.return_unit
+  else Lwt_bytes.read fd buffer offset length
+       >>= function
+       | 0 -> Lwt.fail End_of_file
+       | n -> read_exactly fd buffer (offset + n) (length - n)
+
+let rec write_exactly fd buffer offset length =
+  if length = 0
+  then Lwt.return_unit
+  else Lwt_bytes.write fd buffer offset length
+       >>= fun n -> write_exactly fd buffer (offset + n) (length - n)
+
+let send_hello s features =
+  s.traffic.wire_sent <- s.traffic.wire_sent + hello_size;
+  write_exactly s.fd (hello features) 0 hello_size
+
+let negotiate s =
+  match s.negotiation with
+  | Some negotiation -> negotiation
+  | None ->
+     let negotiation =
+       match s.role with
+       | Client when not s.enabled -> Lwt.return false
+       | Client ->
+	  send_hello s lz4
+	  >>= fun () -> read_exactly s.fd s.pending 0 hello_size
+	  >|= fun () ->
+	  if is_hello s.pending
+	  then Char.code (Lwt_bytes.get s.pending (hello_size - 1)) land lz4 <> 0
+	  else begin
+	      s.pending_length <- hello_size;
+	      false
+	    end
+       | Server ->
+	  read_exactly s.fd s.pending 0 1
+	  >>= fun () ->
+	  if Lwt_bytes.get s.pending 0 <> magic.[0]
+	  then begin
+	      s.pending_length <- 1;
+	      Lwt.return false
+	    end
+	  else
+	    read_exactly s.fd s.pending 1 (hello_size - 1)
+	    >>= fun () ->
+	    if not (is_hello s.pending)
+	    then Lwt.fail_with "Compression: bad hello"
+	    else
+	      let features = if s.enabled then Char.code (Lwt_bytes.get s.pending (hello_size - 1)) land lz4 else 0 in
+	      send_hello s features
+	      >|= fun () -> features <> 0
+     in
+     let negotiation = negotiation >|= fun compressed -> s.traffic.compressed <- compressed; compressed in
+     s.negotiation <- Some negotiation;
+     negotiation
+
+let rec read s buffer offset length =
+  negotiate s
+  >>= fun compressed ->
+  if s.pending_length > 0
+  then begin
+      let n = min length s.pending_length in
+      Lwt_bytes.blit s.pending s.pending_offset buffer offset n;
+      s.pending_offset <- s.pending_offset + n;
+      s.pending_length <- s.pending_length - n;
+      if s.pending_length = 0 then s.pending_offset <- 0;
+      Lwt.return n
+    end
+  else if not compressed
+  then
+    Lwt_bytes.read s.fd buffer offset length
+    >|= fun n ->
+    s.traffic.wire_received <- s.traffic.wire_received + n;
+    s.traffic.raw_received <- s.traffic.raw_received + n;
+    n
+  else
+    read_exactly s.fd s.input_block 0 header_size
+    >>= fun () ->
+    let header = get_uint32 s.input_block 0 in
+    let size = header land (lnot compressed_bit) in
+    (* Uncompressed blocks are read straight into the pending buffer. *)
+    if size > (if header land compressed_bit = 0 then block_size else Lwt_bytes.length s.input_block)
+    then Lwt.fail_with "Compression: block too large"
+    else
+      begin if header land compressed_bit = 0
+	    then read_exactly s.fd s.pending 0 size >|= fun () -> size
+	    else read_exactly s.fd s.input_block 0 size
+		 >|= fun () -> decompress s.input_block 0 size s.pending 0 block_size
+      end
+      >>= fun decompressed ->
+      if decompressed < 0
+      then Lwt.fail_with "Compression: corrupted block"
+      else begin
+	  s.pending_length <- decompressed;
+	  s.traffic.wire_received <- s.traffic.wire_received + header_size + size;
+	  s.traffic.raw_received <- s.traffic.raw_received + decompressed;
+	  read s buffer offset length
+	end
+
+let write s buffer offset length =
+  negotiate s
+  >>= fun compressed ->
+  if not compressed
+  then
+    Lwt_bytes.write s.fd buffer offset length
+    >|= fun n ->
+    s.traffic.wire_sent <- s.traffic.wire_sent + n;
+    s.traffic.raw_sent <- s.traffic.raw_sent + n;
+    n
+  else
+    let n = min length block_size in
+    let compressed_size =
+      if n < min_compressed_size || entropy buffer offset n > max_entropy
+      then -1
+      else compress buffer offset n s.output_block header_size
+    in
+    let size =
+      if compressed_size > 0 && compressed_size < n - n / 16
+      then begin
+	  set_uint32 s.output_block 0 (compressed_size lor compressed_bit);
+	  compressed_size
+	end
+      else begin
+	  set_uint32 s.output_block 0 n;
+	  Lwt_bytes.blit buffer offset s.output_block header_size n;
+	  n
+	end
+    in
+    write_exactly s.fd s.output_block 0 (header_size + size)
+    >|= fun () ->
+    s.traffic.wire_sent <- s.traffic.wire_sent + header_size + size;
+    s.traffic.raw_sent <- s.traffic.raw_sent + n;
+    n
+
+let channels ?buffer_size ~role ~enabled ~close traffic fd =
+  let s = { fd ; traffic ; role ; enabled ;
+	    negotiation = None ;
+	    pending = Lwt_bytes.create block_size ;
+	    pending_offset = 0 ;
+	    pending_length = 0 ;
+	    input_block = Lwt_bytes.create (bound block_size) ;
+	    output_block = Lwt_bytes.create (header_size + bound block_size) }
+  in
+  let create_buffer () =
+    Lwt_bytes.create
+      begin match buffer_size with
+	    | Some size -> min size block_size
+	    | None -> if enabled then block_size else 1024
+      end
+  in
+  Lwt_io.make ~buffer: (create_buffer ()) ~mode: Lwt_io.input ~close (read s),
+  Lwt_io.make ~buffer: (create_buffer ()) ~mode: Lwt_io.output ~close (write s)
+
+let () = assert begin
+  let text = String.concat "" (Array.to_list (Array.init 2000 (fun i -> "block " ^ string_of_int (i mod 37) ^ "\n"))) in
+  let data = Lwt_bytes.of_string text in
+  let length = Lwt_bytes.length data in
+  let compressed = Lwt_bytes.create (bound length)
+  and decompressed = Lwt_bytes.create length in
+  let size = compress data 0 length compressed 0 in
+  size > 0 && size < length / 2
+  && decompress compressed 0 size decompressed 0 length = length
+  && Lwt_bytes.to_string decompressed = text
+  && decompress compressed 0 (size - 1) decompressed 0 length < length
+  && entropy data 0 length < max_entropy
+end
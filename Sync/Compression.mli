@@ -0,0 +1,43 @@
+(** Streaming compression of the bytes of a connection, negotiated when it
+    opens.
+
+    The client sends a hello, and the server answers with the features it
+    accepts; a server that gets anything else than a hello first, e.g. an
+    HTTP request, serves the connection as it is. Once compression is
+    negotiated, the data flows as blocks, each compressed in the LZ4 block
+    format, or sent as it is when a sample of it looks incompressible or
+    it doesn't shrink. *)
+
+type role = Client | Server
+
+(** Counters of a new connection. *)
+val traffic : unit -> SyncTypes.traffic
+
+(** Channels over a socket, with compression when [enabled] and the peer
+    agrees to it, that count their bytes in the traffic. A client that
+    enables compression must talk to a peer that knows this protocol. *)
+val channels :
+  ?buffer_size: int ->
+  role: role ->
+  enabled: bool ->
+  close: (unit -> unit Lwt.t) ->
+  SyncTypes.traffic ->
+  Lwt_unix.file_descr ->
+  Lwt_io.input_channel * Lwt_io.output_channel
+
+(** Size in bytes that the compression of a block of the given size may
+    take at most. *)
+val bound : int -> int
+
+(** [compress src offset length dst dst_offset] compresses a block and
+    returns the length of the result, or -1 when it doesn't fit in dst. *)
+val compress : Lwt_bytes.t -> int -> int -> Lwt_bytes.t -> int -> int
+
+(** [decompress src offset length dst dst_offset capacity] returns the
+    length of the decompressed block, or -1 when it is corrupted or longer
+    than capacity. *)
+val decompress : Lwt_bytes.t -> int -> int -> Lwt_bytes.t -> int -> int -> int
+
+(** Estimate of the entropy of data, in thousandths of bits per byte, from
+    a sample of it. *)
+val entropy : Lwt_bytes.t -> int -> int -> int
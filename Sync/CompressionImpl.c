@@ -0,0 +1,314 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/bigarray.h>
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Block compression of Compression, in the LZ4 block format: sequences of
+ * literals and of matches at most 64 KiB back, found with a hash table of
+ * 4 byte sequences. Greedy, as LZ4's fast mode, which trades ratio for
+ * speed. */
+
+#define SYNC_LZ4_MIN_MATCH 4
+/* The last match starts 12 bytes before the end of the block at the
+ * latest, and the last 5 bytes are literals, as the format requires. */
+#define SYNC_LZ4_MF_LIMIT 12
+#define SYNC_LZ4_LAST_LITERALS 5
+#define SYNC_LZ4_MAX_DISTANCE 65535
+#define SYNC_LZ4_HASH_BITS 12
+
+static inline uint32_t sync_lz4_read32(const uint8_t* p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline uint64_t sync_lz4_read64(const uint8_t* p)
+{
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+/* Length of the common prefix of p and ref, up to limit, compared 8 bytes
+ * at a time. */
+static inline const uint8_t* sync_lz4_match_end(const uint8_t* p, const uint8_t* ref,
+						const uint8_t* limit)
+{
+  while (p + 8 <= limit) {
+    uint64_t diff = sync_lz4_read64(p) ^ sync_lz4_read64(ref);
+    if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return p + (__builtin_ctzll(diff) >> 3);
+#else
+      return p + (__builtin_clzll(diff) >> 3);
+#endif
+    }
+    p += 8;
+    ref += 8;
+  }
+  while (p < limit && *p == *ref) {
+    p++;
+    ref++;
+  }
+  return p;
+}
+
+static inline uint32_t sync_lz4_hash(uint32_t sequence)
+{
+  return (sequence * 2654435761U) >> (32 - SYNC_LZ4_HASH_BITS);
+}
+
+/* Writes a length of 15 or more as the continuation bytes of a token. */
+static inline uint8_t* sync_lz4_write_length(uint8_t* op, size_t length)
+{
+  for (; length >= 255; length -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (uint8_t) length;
+  return op;
+}
+
+/* Bytes a sequence of literals and a match may take at most. */
+static inline size_t sync_lz4_sequence_size(size_t literals, size_t match)
+{
+  return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+}
+
+/* Returns the length of the compressed block, or -1 when it doesn't fit
+ * in capacity bytes. */
+static long sync_lz4_compress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity)
+{
+  uint32_t table[1 << SYNC_LZ4_HASH_BITS];
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* end = src + length;
+  uint8_t* op = dst;
+  uint8_t* op_end = dst + capacity;
+
+  if (length > SYNC_LZ4_MF_LIMIT) {
+    const uint8_t* mf_limit = end - SYNC_LZ4_MF_LIMIT;
+    const uint8_t* match_limit = end - SYNC_LZ4_LAST_LITERALS;
+    memset(table, 0, sizeof(table));
+    ip++;
+    while (ip < mf_limit) {
+      uint32_t sequence = sync_lz4_read32(ip);
+      uint32_t h = sync_lz4_hash(sequence);
+      const uint8_t* ref = src + table[h];
+      table[h] = (uint32_t) (ip - src);
+      if (ref >= ip || ip - ref > SYNC_LZ4_MAX_DISTANCE || sync_lz4_read32(ref) != sequence) {
+	/* Skips faster through data that doesn't match. */
+	ip += 1 + ((ip - anchor) >> 6);
+	continue;
+      }
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+	ip--;
+	ref--;
+      }
+      const uint8_t* match_end = sync_lz4_match_end(ip + SYNC_LZ4_MIN_MATCH,
+						    ref + SYNC_LZ4_MIN_MATCH, match_limit);
+      size_t literals = ip - anchor;
+      size_t match = match_end - ip - SYNC_LZ4_MIN_MATCH;
+      if ((size_t) (op_end - op) < sync_lz4_sequence_size(literals, match)) {
+	return -1;
+      }
+      uint8_t* token = op++;
+      *token = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+      if (literals >= 15) {
+	op = sync_lz4_write_length(op, literals - 15);
+      }
+      memcpy(op, anchor, literals);
+      op += literals;
+      uint16_t distance = (uint16_t) (ip - ref);
+      *op++ = (uint8_t) distance;
+      *op++ = (uint8_t) (distance >> 8);
+      *token |= (uint8_t) (match < 15 ? match : 15);
+      if (match >= 15) {
+	op = sync_lz4_write_length(op, match - 15);
+      }
+      ip = anchor = match_end;
+      if (ip < mf_limit) {
+	table[sync_lz4_hash(sync_lz4_read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+      }
+    }
+  }
+
+  size_t literals = end - anchor;
+  if ((size_t) (op_end - op) < 1 + literals / 255 + 1 + literals) {
+    return -1;
+  }
+  uint8_t* token = op++;
+  *token = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15) {
+    op = sync_lz4_write_length(op, literals - 15);
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+  return op - dst;
+}
+
+/* Reads the continuation bytes of a length, or returns -1 past the end. */
+static inline long sync_lz4_read_length(const uint8_t** ip, const uint8_t* end, size_t* length)
+{
+  uint8_t byte;
+  do {
+    if (*ip >= end) {
+      return -1;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+/* Returns the length of the decompressed block, or -1 when it is
+ * malformed or doesn't fit in capacity bytes. */
+static long sync_lz4_decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity)
+{
+  const uint8_t* ip = src;
+  const uint8_t* end = src + length;
+  uint8_t* op = dst;
+  uint8_t* op_end = dst + capacity;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && sync_lz4_read_length(&ip, end, &literals) < 0) {
+      return -1;
+    }
+    if (literals <= 16 && end - ip >= 16 && op_end - op >= 16) {
+      /* Fixed size copies of short runs, the most common. */
+      memcpy(op, ip, 16);
+    } else if (literals > (size_t) (end - ip) || literals > (size_t) (op_end - op)) {
+      return -1;
+    } else {
+      memcpy(op, ip, literals);
+    }
+    ip += literals;
+    op += literals;
+    if (ip == end) {
+      break;
+    }
+    if (end - ip < 2) {
+      return -1;
+    }
+    size_t distance = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (distance == 0 || distance > (size_t) (op - dst)) {
+      return -1;
+    }
+    size_t match = token & 15;
+    if (match == 15 && sync_lz4_read_length(&ip, end, &match) < 0) {
+      return -1;
+    }
+    match += SYNC_LZ4_MIN_MATCH;
+    if (match > (size_t) (op_end - op)) {
+      return -1;
+    }
+    const uint8_t* ref = op - distance;
+    if (match <= 16 && distance >= 16 && op_end - op >= 16) {
+      memcpy(op, ref, 16);
+      op += match;
+      continue;
+    }
+    if (distance >= match) {
+      memcpy(op, ref, match);
+      op += match;
+      continue;
+    }
+    /* Overlapping: the match repeats the last distance bytes. Once a
+     * period of 8 bytes or more is written, it is copied 8 bytes at a
+     * time. */
+    size_t period = distance >= 8 ? distance : distance * ((8 + distance - 1) / distance);
+    uint8_t* match_end = op + match;
+    for (size_t i = distance; i < period && op < match_end; i++) {
+      *op++ = *ref++;
+    }
+    ref = op - period;
+    while (match_end - op >= 8) {
+      memcpy(op, ref, 8);
+      op += 8;
+      ref += 8;
+    }
+    while (op < match_end) {
+      *op++ = *ref++;
+    }
+  }
+  return op - dst;
+}
+
+/* Entropy in thousandths of bits per byte of up to 16 windows of 256
+ * bytes spread over the data, enough to tell text from compressed or
+ * encrypted data. */
+static long sync_compression_entropy(const uint8_t* data, size_t length)
+{
+  enum { windows = 16, window = 256 };
+  uint32_t counts[256] = { 0 };
+  size_t sampled = 0;
+  if (length <= windows * window) {
+    for (size_t i = 0; i < length; i++) {
+      counts[data[i]]++;
+    }
+    sampled = length;
+  } else {
+    size_t stride = (length - window) / (windows - 1);
+    for (size_t w = 0; w < windows; w++) {
+      const uint8_t* p = data + w * stride;
+      for (size_t i = 0; i < window; i++) {
+	counts[p[i]]++;
+      }
+    }
+    sampled = windows * window;
+  }
+  if (sampled == 0) {
+    return 0;
+  }
+  double entropy = 0;
+  for (int i = 0; i < 256; i++) {
+    if (counts[i] != 0) {
+      double p = (double) counts[i] / sampled;
+      entropy -= p * log2(p);
+    }
+  }
+  return (long) (entropy * 1000);
+}
+
+#define Bytes_at(v, offset) ((uint8_t*) Caml_ba_data_val(v) + Long_val(offset))
+
+CAMLprim value sync_compression_compress_impl(value src, value src_offset, value length,
+					      value dst, value dst_offset)
+{
+  CAMLparam5(src, src_offset, length, dst, dst_offset);
+  size_t size = Long_val(length);
+  size_t capacity = Caml_ba_array_val(dst)->dim[0] - Long_val(dst_offset);
+  const uint8_t* input = Bytes_at(src, src_offset);
+  uint8_t* output = Bytes_at(dst, dst_offset);
+  CAMLreturn(Val_long(sync_lz4_compress(input, size, output, capacity)));
+}
+
+CAMLprim value sync_compression_decompress_impl(value src, value src_offset, value length,
+						value dst, value dst_offset, value capacity)
+{
+  CAMLparam5(src, src_offset, length, dst, dst_offset);
+  CAMLxparam1(capacity);
+  size_t size = Long_val(length);
+  size_t available = Caml_ba_array_val(dst)->dim[0] - Long_val(dst_offset);
+  size_t limit = (size_t) Long_val(capacity) < available ? (size_t) Long_val(capacity) : available;
+  const uint8_t* input = Bytes_at(src, src_offset);
+  uint8_t* output = Bytes_at(dst, dst_offset);
+  CAMLreturn(Val_long(sync_lz4_decompress(input, size, output, limit)));
+}
+
+CAMLprim value sync_compression_decompress_byte(value* argv, int argn)
+{
+  return sync_compression_decompress_impl(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+CAMLprim value sync_compression_entropy_impl(value data, value offset, value length)
+{
+  return Val_long(sync_compression_entropy(Bytes_at(data, offset), Long_val(length)));
+}
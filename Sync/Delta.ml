@@ -0,0 +1,282 @@
+open Bigarray
+
+type data = (char, int8_unsigned_elt, c_layout) Array1.t
+
+type signature = {
+    block_size : int ;
+    length : int ;
+    weak : int array ;
+    strong : int array ;
+  }
+
+type instruction =
+  | Copy of int * int
+  | Literal of data
+
+type delta = {
+    delta_block_size : int ;
+    delta_start : int ;
+    instructions : instruction list ;
+    delta_end : int ;
+    hash : int option ;
+  }
+
+exception Corrupted
+
+(* Set of weak checksums, looked up by scan while it rolls. *)
+type table = (int64, int64_elt, c_layout) Array1.t
+
+external weak : data -> int -> int -> int = "sync_delta_weak_impl"
+external hash : data -> int -> int -> int = "sync_delta_hash_impl"
+external hash_fd : Unix.file_descr -> int = "sync_delta_hash_fd_impl"
+external read_fd : Unix.file_descr -> int -> data -> int = "sync_delta_read_fd_impl"
+external write_fd : Unix.file_descr -> int -> data -> unit = "sync_delta_write_fd_impl"
+external checksums : data -> int -> int array * int array = "sync_delta_signature_impl"
+external table : int array -> int -> table = "sync_delta_table_impl"
+external scan : data -> int -> int -> table -> int = "sync_delta_scan_impl"
+
+let hash_file path =
+  let fd = Unix.openfile path [ Unix.O_RDONLY ; Unix.O_CLOEXEC ] 0 in
+  match hash_fd fd with
+  | h -> Unix.close fd; h
+  | exception exn -> Unix.close fd; raise exn
+
+let min_block_size = 1024
+and max_block_size = 128 * 1024
+
+let block_size length =
+  let root = int_of_float (sqrt (float_of_int length)) in
+  max min_block_size (min max_block_size (root land (lnot 7)))
+
+(* Files are read a window of whole blocks at a time, so that neither
+   peer holds a whole file in memory. *)
+let window_size block_size = block_size * max 4 (256 * 1024 / block_size)
+
+let signature ?block_size: size fd =
+  let estimate = Int64.to_int (Unix.LargeFile.fstat fd).Unix.LargeFile.st_size in
+  let block_size = match size with Some size -> size | None -> block_size estimate in
+  let window = Array1.create char c_layout (window_size block_size) in
+  let rec read offset weak strong =
+    match read_fd fd offset window with
+    | 0 -> offset, weak, strong
+    | n ->
+       let w, s = checksums (Array1.sub window 0 n) block_size in
+       if n < Array1.dim window
+       then offset + n, w :: weak, s :: strong
+       else read (offset + n) (w :: weak) (s :: strong)
+  in
+  let length, weak, strong = read 0 [] [] in
+  { block_size ; length ;
+    weak = Array.concat (List.rev weak) ;
+    strong = Array.concat (List.rev strong) }
+
+(* Literal bytes a delta ends after: each delta carries them in one
+   message, and its call carries the signature again, which this keeps to
+   a fraction of the message. *)
+let batch_size signature = max (4 * 1024 * 1024) (128 * Array.length signature.weak)
+
+let diff ?(start = 0) ?batch_size: size signature fd =
+  let block_size = signature.block_size in
+  let limit = match size with Some size -> size | None -> batch_size signature in
+  let full_blocks = signature.length / block_size in
+  let table = table signature.weak full_blocks in
+  (* Blocks by weak checksum, for the strong check of what scan finds. *)
+  let blocks = Hashtbl.create (max 16 full_blocks) in
+  for index = full_blocks - 1 downto 0 do
+    Hashtbl.add blocks signature.weak.(index) index
+  done;
+  (* The window holds filled bytes of the file from base. *)
+  let window = Array1.create char c_layout (window_size block_size)
+  and base = ref start
+  and filled = ref 0
+  and at_end = ref false in
+  let find_block pos size candidates =
+    let strong = hash window (pos - !base) size in
+    try Some (List.find (fun index -> signature.strong.(index) = strong) candidates)
+    with Not_found -> None
+  in
+  let instructions = ref []
+  and literal_start = ref start
+  and literals = ref 0 in
+  (* Copies out the bytes before pos that no block matched. *)
+  let flush_literal pos =
+    if pos > !literal_start then begin
+	let literal = Array1.create char c_layout (pos - !literal_start) in
+	Array1.blit (Array1.sub window (!literal_start - !base) (pos - !literal_start)) literal;
+	instructions := Literal literal :: !instructions;
+	literals := !literals + (pos - !literal_start);
+	literal_start := pos
+      end
+  in
+  let emit pos size index =
+    flush_literal pos;
+    instructions := begin match !instructions with
+		    | Copy (first, count) :: rest when first + count = index ->
+		       Copy (first, count + 1) :: rest
+		    | instructions -> Copy (index, 1) :: instructions
+		    end;
+    literal_start := pos + size
+  in
+  (* Moves the start of the window to pos, and reads what follows. *)
+  let slide pos =
+    flush_literal pos;
+    let kept = !base + !filled - pos in
+    Array1.blit (Array1.sub window (pos - !base) kept) (Array1.sub window 0 kept);
+    let wanted = Array1.dim window - kept in
+    let n = read_fd fd (pos + kept) (Array1.sub window kept wanted) in
+    base := pos;
+    filled := kept + n;
+    at_end := n < wanted
+  in
+  (* Returns where the next delta starts, or None at the end of the
+     file. *)
+  let rec search pos =
+    match scan (Array1.sub window 0 !filled) (pos - !base) block_size table with
+    | -1 ->
+       (* The last block_size - 1 bytes may start a block that ends in
+	  the next window. *)
+       if !at_end then None
+       else begin
+	   let next = max pos (!base + !filled - block_size + 1) in
+	   flush_literal next;
+	   if !literals >= limit then Some next
+	   else begin
+	       slide next;
+	       search next
+	     end
+	 end
+    | found ->
+       let found = !base + found in
+       match find_block found block_size
+			(Hashtbl.find_all blocks (weak window (found - !base) block_size))
+       with
+       | Some index -> emit found block_size index; search (found + block_size)
+       | None -> search (found + 1)
+  in
+  let delta delta_end hash =
+    { delta_block_size = block_size ;
+      delta_start = start ;
+      instructions = List.rev !instructions ;
+      delta_end ;
+      hash }
+  in
+  slide start;
+  match search start with
+  | Some next -> delta next None
+  | None ->
+     let length = !base + !filled in
+     (* A shorter last block can only match at the end. *)
+     let tail = signature.length - full_blocks * block_size in
+     if tail > 0 && length - tail >= !literal_start
+	&& weak window (length - tail - !base) tail = signature.weak.(full_blocks)
+	&& find_block (length - tail) tail [ full_blocks ] <> None
+     then emit (length - tail) tail full_blocks;
+     flush_literal length;
+     delta length (Some (hash_fd fd))
+
+let patch ~old delta ~into =
+  let block_size = delta.delta_block_size in
+  let buffer = Array1.create char c_layout (window_size block_size) in
+  (* Copies size bytes of old from offset to pos, a buffer at a time. A
+     short read, from an old file that shrank, fails the length check. *)
+  let rec copy pos offset size =
+    if size <= 0 then pos
+    else
+      let wanted = min size (Array1.dim buffer) in
+      let n = read_fd old offset (Array1.sub buffer 0 wanted) in
+      write_fd into pos (Array1.sub buffer 0 n);
+      if n < wanted then pos + n
+      else copy (pos + n) (offset + n) (size - n)
+  in
+  let apply pos = function
+    | Copy (first, count) ->
+       copy pos (first * block_size) (min (count * block_size) (delta.delta_end - pos))
+    | Literal data ->
+       write_fd into pos data;
+       pos + Array1.dim data
+  in
+  if List.fold_left apply delta.delta_start delta.instructions <> delta.delta_end
+  then raise Corrupted;
+  match delta.hash with
+  | Some hash
+       when Int64.to_int (Unix.LargeFile.fstat into).Unix.LargeFile.st_size <> delta.delta_end
+	    || hash_fd into <> hash ->
+     raise Corrupted
+  | _ -> ()
+
+let () = assert begin
+  let of_string s =
+    let data = Array1.create char c_layout (String.length s) in
+    String.iteri (fun i c -> data.{i} <- c) s;
+    data
+  in
+  let reference s =
+    let a = ref 0 and b = ref 0 and n = String.length s in
+    String.iteri (fun i c -> a := !a + Char.code c; b := !b + (n - i) * Char.code c) s;
+    (!a land 0xffff) lor ((!b land 0xffff) lsl 16)
+  in
+  (* An open file that is already removed. *)
+  let file text =
+    let path = Filename.temp_file "sync-delta" "" in
+    let channel = open_out_bin path in
+    output_string channel text;
+    close_out channel;
+    let fd = Unix.openfile path [ Unix.O_RDWR ] 0 in
+    Sys.remove path;
+    fd
+  in
+  let random = Random.State.make [| 19 |] in
+  (* Larger than a window, with changes on both sides of its end. *)
+  let text = String.init 600000 (fun _ -> Char.chr (Random.State.int random 256)) in
+  let updated = String.sub text 0 3000 ^ "inserted" ^ String.sub text 3100 260000
+		^ "changed" ^ String.sub text 263107 336893 in
+  let other = String.init 600000 (fun _ -> Char.chr (Random.State.int random 256)) in
+  let fd = file updated in
+  (* Patches every delta of fd against old into a new file, and returns
+     the deltas and what the file holds. *)
+  let fetch ?batch_size old =
+    let signature = signature ~block_size: 1024 old
+    and into = file "" in
+    let rec deltas start =
+      let delta = diff ~start ?batch_size signature fd in
+      patch ~old delta ~into;
+      match delta.hash with
+      | None -> delta :: deltas delta.delta_end
+      | Some _ -> [ delta ]
+    in
+    let deltas = deltas 0 in
+    let contents = Array1.create char c_layout (String.length updated + 1) in
+    let n = read_fd into 0 contents in
+    Unix.close into;
+    Unix.close old;
+    deltas, Array1.sub contents 0 n
+  in
+  let deltas, contents = fetch (file text) in
+  let literals = List.fold_left (fun size -> function Literal data -> size + Array1.dim data
+						    | Copy _ -> size)
+  in
+  let literals = List.fold_left (fun size delta -> literals size delta.instructions) 0 deltas in
+  (* Against a file that shares no block, every byte is literal. *)
+  let batched, batched_contents = fetch ~batch_size: 100000 (file other) in
+  Unix.close fd;
+  List.for_all (fun n -> weak (of_string text) 5 n = reference (String.sub text 5 n))
+	       [ 0 ; 1 ; 15 ; 16 ; 33 ; 100 ]
+  && contents = of_string updated
+  && List.length deltas = 1
+  && literals < 4 * 1024
+  && batched_contents = of_string updated
+  && List.length batched > 1
+end
+
+let () = assert begin
+  let path = Filename.temp_file "sync-delta" "" in
+  let text = String.init 100000 (fun i -> Char.chr (i * 7 land 0xff)) in
+  let channel = open_out_bin path in
+  output_string channel text;
+  close_out channel;
+  let data = Array1.create char c_layout (String.length text) in
+  String.iteri (fun i c -> data.{i} <- c) text;
+  let file_hash = hash_file path in
+  Sys.remove path;
+  file_hash = hash data 0 (String.length text)
+end
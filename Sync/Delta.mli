@@ -0,0 +1,70 @@
+(** Block level delta transfer, as rsync does it. The receiver describes
+    the version of a file it has by the checksums of its blocks, the sender
+    finds those blocks anywhere in its own version with a rolling checksum,
+    and only the bytes that match no block travel, with instructions to
+    copy the others.
+
+    Files are read from their descriptors a window of a few blocks at a
+    time, and the checksums run in C without the runtime lock. A delta
+    covers the new file up to a bounded amount of literal bytes, and the
+    next one is computed from where it ends, so that neither peer holds
+    more of the file than a batch. *)
+
+type data = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(** Checksums of the blocks of a file. The last block may be shorter. *)
+type signature = {
+    block_size : int ;
+    length : int ;
+    weak : int array ;    (* Rolling checksums, as rsync's. *)
+    strong : int array ;  (* 64 bit hashes, to the precision of an int. *)
+  }
+
+type instruction =
+  | Copy of int * int  (* A run of blocks of the receiver's file: the
+			  first, and their number. *)
+  | Literal of data    (* Bytes found in no block. *)
+
+(** The instructions for the range of the new file from [delta_start] to
+    [delta_end]. *)
+type delta = {
+    delta_block_size : int ;
+    delta_start : int ;
+    instructions : instruction list ;
+    delta_end : int ;
+    hash : int option ;  (* Of the whole new file, in the delta that ends
+			    it. *)
+  }
+
+(** Raised by [patch] when the result is not the file the delta was
+    computed from, e.g. because the receiver's file changed since its
+    signature. *)
+exception Corrupted
+
+(** Block size for a file of the given length: about its square root,
+    between 1 KiB and 128 KiB. *)
+val block_size : int -> int
+
+val signature : ?block_size: int -> Unix.file_descr -> signature
+
+(** Instructions to rebuild the file from the file of [signature], from
+    [start], 0 by default, until their literal bytes reach [batch_size]
+    or the end of the file. [batch_size] defaults to a few MiB, more for
+    large signatures. *)
+val diff : ?start: int -> ?batch_size: int -> signature -> Unix.file_descr -> delta
+
+(** Writes the range of a delta into [into], reading the blocks to copy
+    from [old], the file whose signature it was computed against. The
+    delta that ends the file also checks that [into] is the file the
+    deltas were computed from. *)
+val patch : old: Unix.file_descr -> delta -> into: Unix.file_descr -> unit
+
+(** Strong hash of a range of data. *)
+val hash : data -> int -> int -> int
+
+(** Strong hash of a whole file, read a buffer at a time without the
+    runtime lock. *)
+val hash_file : string -> int
+
+(** Weak checksum of a range of data. *)
+val weak : data -> int -> int -> int
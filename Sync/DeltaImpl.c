@@ -0,0 +1,543 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/threads.h>
+#include <caml/bigarray.h>
+#include <caml/unixsupport.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SYNC_DELTA_X86 1
+#endif
+
+/* Kernels of Delta. Data is a char Bigarray, which doesn't move, so the
+ * long loops run without the runtime lock. */
+
+/* Below this many bytes, a kernel keeps the runtime lock: releasing it
+ * would cost more than the work. */
+#define SYNC_DELTA_UNLOCKED_SIZE (64 * 1024)
+
+/* The weak checksum of x[0..n) is rsync's: a = sum of x[i], and
+ * b = sum of (n - i) x[i], both mod 2^16, as a + (b << 16). Sliding the
+ * window by a byte only needs the byte that leaves and the one that
+ * enters. b is also n a - sum of i x[i], which the vector kernels
+ * compute a chunk at a time. */
+
+static uint32_t sync_delta_weak_scalar(const uint8_t* p, size_t n)
+{
+  uint32_t a = 0, b = 0;
+  for (size_t i = 0; i < n; i++) {
+    a += p[i];
+    b += (uint32_t) (n - i) * p[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+/* Finishes a vector kernel, given the sum a of the first chunks bytes, in
+ * chunks of width, the sum prev over the chunks of the sum of the chunks
+ * before them, and the sum t of j x[j] within each chunk. Arithmetic is
+ * mod 2^32, which is enough for a result mod 2^16. */
+static uint32_t sync_delta_weak_finish(const uint8_t* p, size_t n, size_t chunks, size_t width,
+				       uint32_t a, uint32_t prev, uint32_t t)
+{
+  uint32_t weighted = chunks ? (uint32_t) width * ((uint32_t) (chunks - 1) * a - prev) + t : 0;
+  for (size_t i = chunks * width; i < n; i++) {
+    a += p[i];
+    weighted += (uint32_t) i * p[i];
+  }
+  uint32_t b = (uint32_t) n * a - weighted;
+  return (a & 0xffff) | (b << 16);
+}
+
+#ifdef SYNC_DELTA_X86
+__attribute__((target("sse2")))
+static uint32_t sync_delta_hsum_sse2(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static uint32_t sync_delta_weak_sse2(const uint8_t* p, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low_weights = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m128i high_weights = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i a = zero, prev = zero, t = zero;
+  size_t chunks = n / 16;
+  for (size_t c = 0; c < chunks; c++) {
+    __m128i x = _mm_loadu_si128((const __m128i*) (p + 16 * c));
+    prev = _mm_add_epi32(prev, a);
+    a = _mm_add_epi32(a, _mm_sad_epu8(x, zero));
+    t = _mm_add_epi32(t, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), low_weights));
+    t = _mm_add_epi32(t, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), high_weights));
+  }
+  return sync_delta_weak_finish(p, n, chunks, 16, sync_delta_hsum_sse2(a),
+				sync_delta_hsum_sse2(prev), sync_delta_hsum_sse2(t));
+}
+
+__attribute__((target("avx2")))
+static uint32_t sync_delta_hsum_avx2(__m256i v)
+{
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t) _mm_cvtsi128_si32(sum);
+}
+
+/* Unpacking works within 128 bit lanes: the low half of each lane holds
+ * bytes 0 to 7 and 16 to 23, the high half bytes 8 to 15 and 24 to 31. */
+__attribute__((target("avx2")))
+static uint32_t sync_delta_weak_avx2(const uint8_t* p, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i low_weights = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7,
+						16, 17, 18, 19, 20, 21, 22, 23);
+  const __m256i high_weights = _mm256_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15,
+						 24, 25, 26, 27, 28, 29, 30, 31);
+  __m256i a = zero, prev = zero, t = zero;
+  size_t chunks = n / 32;
+  for (size_t c = 0; c < chunks; c++) {
+    __m256i x = _mm256_loadu_si256((const __m256i*) (p + 32 * c));
+    prev = _mm256_add_epi32(prev, a);
+    a = _mm256_add_epi32(a, _mm256_sad_epu8(x, zero));
+    t = _mm256_add_epi32(t, _mm256_madd_epi16(_mm256_unpacklo_epi8(x, zero), low_weights));
+    t = _mm256_add_epi32(t, _mm256_madd_epi16(_mm256_unpackhi_epi8(x, zero), high_weights));
+  }
+  return sync_delta_weak_finish(p, n, chunks, 32, sync_delta_hsum_avx2(a),
+				sync_delta_hsum_avx2(prev), sync_delta_hsum_avx2(t));
+}
+#endif
+
+static uint32_t (*sync_delta_weak_kernel)(const uint8_t* p, size_t n) = NULL;
+
+/* Picks the widest kernel the processor runs. */
+static uint32_t sync_delta_weak(const uint8_t* p, size_t n)
+{
+  uint32_t (*kernel)(const uint8_t*, size_t) =
+    __atomic_load_n(&sync_delta_weak_kernel, __ATOMIC_RELAXED);
+  if (kernel == NULL) {
+    kernel = sync_delta_weak_scalar;
+#ifdef SYNC_DELTA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      kernel = sync_delta_weak_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      kernel = sync_delta_weak_sse2;
+    }
+#endif
+    __atomic_store_n(&sync_delta_weak_kernel, kernel, __ATOMIC_RELAXED);
+  }
+  return kernel(p, n);
+}
+
+/* The strong hash is XXH64, with bytes read as little endian so that
+ * peers of either endianness agree on it. */
+#define SYNC_DELTA_PRIME1 0x9E3779B185EBCA87ULL
+#define SYNC_DELTA_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define SYNC_DELTA_PRIME3 0x165667B19E3779F9ULL
+#define SYNC_DELTA_PRIME4 0x85EBCA77C2B2AE63ULL
+#define SYNC_DELTA_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t sync_delta_rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t sync_delta_read64(const uint8_t* p)
+{
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#endif
+  return x;
+}
+
+static uint32_t sync_delta_read32(const uint8_t* p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap32(x);
+#endif
+  return x;
+}
+
+static uint64_t sync_delta_round(uint64_t acc, uint64_t input)
+{
+  acc += input * SYNC_DELTA_PRIME2;
+  return sync_delta_rotl(acc, 31) * SYNC_DELTA_PRIME1;
+}
+
+static uint64_t sync_delta_merge(uint64_t acc, uint64_t v)
+{
+  acc ^= sync_delta_round(0, v);
+  return acc * SYNC_DELTA_PRIME1 + SYNC_DELTA_PRIME4;
+}
+
+/* Initial accumulators, for inputs of 32 bytes or more. */
+static void sync_delta_strong_init(uint64_t v[4])
+{
+  v[0] = SYNC_DELTA_PRIME1 + SYNC_DELTA_PRIME2;
+  v[1] = SYNC_DELTA_PRIME2;
+  v[2] = 0;
+  v[3] = -SYNC_DELTA_PRIME1;
+}
+
+/* Consumes the 32 byte stripes of p[0..n), and returns where they end. */
+static const uint8_t* sync_delta_strong_stripes(uint64_t v[4], const uint8_t* p, size_t n)
+{
+  const uint8_t* end = p + n;
+  for (; p + 32 <= end; p += 32) {
+    v[0] = sync_delta_round(v[0], sync_delta_read64(p));
+    v[1] = sync_delta_round(v[1], sync_delta_read64(p + 8));
+    v[2] = sync_delta_round(v[2], sync_delta_read64(p + 16));
+    v[3] = sync_delta_round(v[3], sync_delta_read64(p + 24));
+  }
+  return p;
+}
+
+/* Hash of an input of total bytes, given its accumulators and its last
+ * total % 32 bytes in p[0..end). */
+static uint64_t sync_delta_strong_finish(const uint64_t v[4], uint64_t total,
+					 const uint8_t* p, const uint8_t* end)
+{
+  uint64_t h;
+  if (total >= 32) {
+    h = sync_delta_rotl(v[0], 1) + sync_delta_rotl(v[1], 7)
+      + sync_delta_rotl(v[2], 12) + sync_delta_rotl(v[3], 18);
+    h = sync_delta_merge(h, v[0]);
+    h = sync_delta_merge(h, v[1]);
+    h = sync_delta_merge(h, v[2]);
+    h = sync_delta_merge(h, v[3]);
+  } else {
+    h = SYNC_DELTA_PRIME5;
+  }
+  h += total;
+  for (; p + 8 <= end; p += 8) {
+    h ^= sync_delta_round(0, sync_delta_read64(p));
+    h = sync_delta_rotl(h, 27) * SYNC_DELTA_PRIME1 + SYNC_DELTA_PRIME4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) sync_delta_read32(p) * SYNC_DELTA_PRIME1;
+    h = sync_delta_rotl(h, 23) * SYNC_DELTA_PRIME2 + SYNC_DELTA_PRIME3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * SYNC_DELTA_PRIME5;
+    h = sync_delta_rotl(h, 11) * SYNC_DELTA_PRIME1;
+  }
+  h ^= h >> 33;
+  h *= SYNC_DELTA_PRIME2;
+  h ^= h >> 29;
+  h *= SYNC_DELTA_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t sync_delta_strong(const uint8_t* p, size_t n)
+{
+  uint64_t v[4];
+  sync_delta_strong_init(v);
+  const uint8_t* tail = sync_delta_strong_stripes(v, p, n);
+  return sync_delta_strong_finish(v, n, tail, p + n);
+}
+
+/* OCaml ints keep the low bits of a hash. */
+#define Val_hash(h) Val_long((intnat) ((h) & (uint64_t) Max_long))
+
+/* Raises Invalid_argument unless [offset, offset + length) is in data. */
+static const uint8_t* sync_delta_range(value data, value offset, value length)
+{
+  intnat dim = Caml_ba_array_val(data)->dim[0];
+  intnat off = Long_val(offset), len = Long_val(length);
+  if (off < 0 || len < 0 || off > dim - len) {
+    caml_invalid_argument("Delta");
+  }
+  return (const uint8_t*) Caml_ba_data_val(data) + off;
+}
+
+CAMLprim value sync_delta_weak_impl(value data, value offset, value length)
+{
+  return Val_long(sync_delta_weak(sync_delta_range(data, offset, length), Long_val(length)));
+}
+
+/* Files are hashed a buffer at a time. */
+#define SYNC_DELTA_READ_SIZE (256 * 1024)
+
+/* Reads fd from offset into p[0..length), and returns how many bytes were
+ * read, fewer at the end of the file, or -1 with errno set when a read
+ * fails. Files are read rather than mapped: a mapped file that
+ * another process truncates raises SIGBUS. */
+static ssize_t sync_delta_read_fd(int fd, off_t offset, uint8_t* p, size_t length)
+{
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = pread(fd, p + done, length - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+CAMLprim value sync_delta_read_fd_impl(value fd, value offset, value data)
+{
+  CAMLparam3(fd, offset, data);
+  int f = Int_val(fd);
+  off_t off = Long_val(offset);
+  uint8_t* p = Caml_ba_data_val(data);
+  size_t length = Caml_ba_array_val(data)->dim[0];
+  if (off < 0) {
+    caml_invalid_argument("Delta.read_fd");
+  }
+  caml_release_runtime_system();
+  ssize_t done = sync_delta_read_fd(f, off, p, length);
+  int error = errno;
+  caml_acquire_runtime_system();
+  if (done < 0) {
+    unix_error(error, "pread", Nothing);
+  }
+  CAMLreturn(Val_long(done));
+}
+
+/* Returns the strong hash of what fd holds from offset 0, or -1 with errno
+ * set when a read fails. */
+static int sync_delta_hash_fd(int fd, uint8_t* buffer, uint64_t* hash)
+{
+  uint64_t v[4], total = 0;
+  size_t buffered = 0;
+  sync_delta_strong_init(v);
+  for (;;) {
+    ssize_t n = pread(fd, buffer + buffered, SYNC_DELTA_READ_SIZE - buffered, total);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    total += n;
+    buffered += n;
+    const uint8_t* tail = sync_delta_strong_stripes(v, buffer, buffered);
+    /* Keeps the partial stripe at the start of the buffer. */
+    buffered = buffer + buffered - tail;
+    memmove(buffer, tail, buffered);
+  }
+  *hash = sync_delta_strong_finish(v, total, buffer, buffer + buffered);
+  return 0;
+}
+
+CAMLprim value sync_delta_hash_fd_impl(value fd)
+{
+  CAMLparam1(fd);
+  uint64_t h = 0;
+  uint8_t* buffer = malloc(SYNC_DELTA_READ_SIZE);
+  if (buffer == NULL) {
+    caml_raise_out_of_memory();
+  }
+  caml_release_runtime_system();
+  int result = sync_delta_hash_fd(Int_val(fd), buffer, &h);
+  int error = errno;
+  caml_acquire_runtime_system();
+  free(buffer);
+  if (result < 0) {
+    unix_error(error, "pread", Nothing);
+  }
+  CAMLreturn(Val_hash(h));
+}
+
+/* Writes p[0..length) to fd at offset, and returns 0, or -1 with errno
+ * set when a write fails. */
+static int sync_delta_write_fd(int fd, off_t offset, const uint8_t* p, size_t length)
+{
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = pwrite(fd, p + done, length - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+CAMLprim value sync_delta_write_fd_impl(value fd, value offset, value data)
+{
+  CAMLparam3(fd, offset, data);
+  int f = Int_val(fd);
+  off_t off = Long_val(offset);
+  const uint8_t* p = Caml_ba_data_val(data);
+  size_t length = Caml_ba_array_val(data)->dim[0];
+  if (off < 0) {
+    caml_invalid_argument("Delta.write_fd");
+  }
+  caml_release_runtime_system();
+  int result = sync_delta_write_fd(f, off, p, length);
+  int error = errno;
+  caml_acquire_runtime_system();
+  if (result < 0) {
+    unix_error(error, "pwrite", Nothing);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value sync_delta_hash_impl(value data, value offset, value length)
+{
+  CAMLparam3(data, offset, length);
+  const uint8_t* p = sync_delta_range(data, offset, length);
+  size_t n = Long_val(length);
+  int unlocked = n >= SYNC_DELTA_UNLOCKED_SIZE;
+  if (unlocked) {
+    caml_release_runtime_system();
+  }
+  uint64_t h = sync_delta_strong(p, n);
+  if (unlocked) {
+    caml_acquire_runtime_system();
+  }
+  CAMLreturn(Val_hash(h));
+}
+
+/* Returns the weak checksums and the strong hashes of the blocks of data,
+ * the last of which may be shorter. */
+CAMLprim value sync_delta_signature_impl(value data, value block_size)
+{
+  CAMLparam2(data, block_size);
+  CAMLlocal3(weak, strong, result);
+  const uint8_t* p = Caml_ba_data_val(data);
+  size_t length = Caml_ba_array_val(data)->dim[0];
+  size_t size = Long_val(block_size);
+  if (size == 0) {
+    caml_invalid_argument("Delta.signature");
+  }
+  size_t blocks = (length + size - 1) / size;
+  uint32_t* weaks = malloc(blocks * sizeof(uint32_t) + 1);
+  uint64_t* strongs = malloc(blocks * sizeof(uint64_t) + 1);
+  if (weaks == NULL || strongs == NULL) {
+    free(weaks);
+    free(strongs);
+    caml_raise_out_of_memory();
+  }
+  caml_release_runtime_system();
+  for (size_t i = 0; i < blocks; i++) {
+    size_t n = length - i * size < size ? length - i * size : size;
+    weaks[i] = sync_delta_weak(p + i * size, n);
+    strongs[i] = sync_delta_strong(p + i * size, n);
+  }
+  caml_acquire_runtime_system();
+  weak = caml_alloc(blocks, 0);
+  strong = caml_alloc(blocks, 0);
+  for (size_t i = 0; i < blocks; i++) {
+    Store_field(weak, i, Val_long(weaks[i]));
+    Store_field(strong, i, Val_hash(strongs[i]));
+  }
+  free(weaks);
+  free(strongs);
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, weak);
+  Store_field(result, 1, strong);
+  CAMLreturn(result);
+}
+
+/* A table of weak checksums is an int64 Bigarray used as an open
+ * addressing set: a slot holds 2^32 + the checksum, or 0 when free. */
+#define SYNC_DELTA_PRESENT (1ULL << 32)
+
+static size_t sync_delta_slot(uint32_t weak, size_t mask)
+{
+  return (size_t) ((weak * 0x9E3779B1U) ^ (weak >> 16)) & mask;
+}
+
+/* Returns a table of the first count checksums of weak. */
+CAMLprim value sync_delta_table_impl(value weak, value count)
+{
+  CAMLparam2(weak, count);
+  CAMLlocal1(table);
+  size_t n = Long_val(count);
+  size_t slots = 16;
+  while (slots < 2 * n) {
+    slots *= 2;
+  }
+  table = caml_ba_alloc_dims(CAML_BA_INT64 | CAML_BA_C_LAYOUT, 1, NULL, (intnat) slots);
+  uint64_t* entries = Caml_ba_data_val(table);
+  memset(entries, 0, slots * sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++) {
+    uint32_t w = Long_val(Field(weak, i));
+    size_t slot = sync_delta_slot(w, slots - 1);
+    while (entries[slot] != 0 && entries[slot] != (SYNC_DELTA_PRESENT | w)) {
+      slot = (slot + 1) & (slots - 1);
+    }
+    entries[slot] = SYNC_DELTA_PRESENT | w;
+  }
+  CAMLreturn(table);
+}
+
+static int sync_delta_member(const uint64_t* entries, size_t mask, uint32_t weak)
+{
+  for (size_t slot = sync_delta_slot(weak, mask); entries[slot] != 0; slot = (slot + 1) & mask) {
+    if (entries[slot] == (SYNC_DELTA_PRESENT | weak)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Rolls a window of block_size bytes over data from start, and returns
+ * the first offset at which its weak checksum is in table, or -1. */
+CAMLprim value sync_delta_scan_impl(value data, value start, value block_size, value table)
+{
+  CAMLparam4(data, start, block_size, table);
+  const uint8_t* p = Caml_ba_data_val(data);
+  size_t length = Caml_ba_array_val(data)->dim[0];
+  size_t n = Long_val(block_size);
+  size_t pos = Long_val(start);
+  const uint64_t* entries = Caml_ba_data_val(table);
+  size_t mask = Caml_ba_array_val(table)->dim[0] - 1;
+  if (n == 0 || pos > length || length - pos < n) {
+    CAMLreturn(Val_long(-1));
+  }
+  int unlocked = length - pos >= SYNC_DELTA_UNLOCKED_SIZE;
+  if (unlocked) {
+    caml_release_runtime_system();
+  }
+  uint32_t weak = sync_delta_weak(p + pos, n);
+  uint32_t a = weak & 0xffff, b = weak >> 16;
+  intnat found = -1;
+  for (;;) {
+    if (sync_delta_member(entries, mask, (a & 0xffff) | (b << 16))) {
+      found = pos;
+      break;
+    }
+    if (pos + n >= length) {
+      break;
+    }
+    a = a - p[pos] + p[pos + n];
+    b = b - (uint32_t) n * p[pos] + a;
+    pos++;
+  }
+  if (unlocked) {
+    caml_acquire_runtime_system();
+  }
+  CAMLreturn(Val_long(found));
+}
@@ -102,7 +102,7 @@ let dynamic_page_handler =
 			  P.Header.chunked ;
 			  P.Header.date () ;
 			  server_header ] ;
-       P.response_body = response }
+       P.response_body = P.Stream response }
      |> Lwt.return
 
 let register () = HttpHandler.register_handler handler_name dynamic_page_handler
@@ -0,0 +1,11 @@
+external configure : float -> float -> unit = "ocamlfuse_attr_cache_configure_impl"
+external invalidate : string -> unit = "ocamlfuse_attr_cache_invalidate_impl"
+external invalidate_tree : string -> unit = "ocamlfuse_attr_cache_invalidate_tree_impl"
+external clear : unit -> unit = "ocamlfuse_attr_cache_clear_impl"
+external stats : unit -> int * int = "ocamlfuse_attr_cache_stats_impl"
+
+let enable ~ttl ~negative_ttl = configure ttl negative_ttl
+
+let disable () =
+  configure 0. 0.;
+  clear ()
@@ -0,0 +1,29 @@
+(** Cache of getattr and access results kept in the C layer of the path
+    based API, so that cached paths are answered without taking the
+    runtime lock. fgetattr always calls the filesystem, as the file of its
+    handle may no longer be the one at its path.
+
+    The cache is disabled until [enable] is called. A filesystem that
+    enables it must invalidate the paths it changes, including the parent
+    folders whose attributes change with their entries.
+
+    Entries are keyed by path alone, so only the first mount of a process
+    uses the cache; the others always call their filesystem. *)
+
+(** Caches attributes for [ttl] seconds, and paths that don't exist for
+    [negative_ttl] seconds. A TTL of 0 disables the corresponding entries. *)
+val enable : ttl: float -> negative_ttl: float -> unit
+
+val disable : unit -> unit
+
+(** Drops the entry of a path. *)
+val invalidate : string -> unit
+
+(** Drops the entries of a path and of everything below it, e.g. when a
+    folder is renamed. *)
+val invalidate_tree : string -> unit
+
+val clear : unit -> unit
+
+(** Number of hits and misses since the start. *)
+val stats : unit -> int * int
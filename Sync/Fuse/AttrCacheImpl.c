@@ -0,0 +1,351 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AttrCacheImpl.h"
+#include "TraceImpl.h"
+
+/* The cache is split into shards, each with its own lock and hash table,
+ * so that FUSE threads only contend when their paths share a shard. A
+ * shard that fills up is swept of expired entries, and cleared if that
+ * isn't enough. */
+#define OCAMLFUSE_ATTR_CACHE_SHARD_BITS 6
+#define OCAMLFUSE_ATTR_CACHE_SHARDS (1 << OCAMLFUSE_ATTR_CACHE_SHARD_BITS)
+#define OCAMLFUSE_ATTR_CACHE_BUCKETS 1024
+#define OCAMLFUSE_ATTR_CACHE_SHARD_ENTRIES 4096
+
+/* Access modes are stored with an extra bit, so that F_OK (0) is a grant
+ * too. */
+#define OCAMLFUSE_ATTR_CACHE_EXISTS 0x100
+
+struct ocamlfuse_attr_entry {
+  struct ocamlfuse_attr_entry* next;
+  uint64_t hash;
+  int64_t expires;
+  int negative;
+  int granted;
+  struct stat stat;
+  size_t length;
+  char path[];
+};
+
+struct ocamlfuse_attr_shard {
+  pthread_rwlock_t lock;
+  uint64_t generation;
+  size_t entries;
+  struct ocamlfuse_attr_entry* buckets[OCAMLFUSE_ATTR_CACHE_BUCKETS];
+};
+
+static struct ocamlfuse_attr_shard ocamlfuse_attr_shards[OCAMLFUSE_ATTR_CACHE_SHARDS];
+static pthread_once_t ocamlfuse_attr_once = PTHREAD_ONCE_INIT;
+
+/* TTLs in nanoseconds; 0 disables the corresponding entries. */
+static int64_t ocamlfuse_attr_ttl = 0;
+static int64_t ocamlfuse_attr_negative_ttl = 0;
+
+static uint64_t ocamlfuse_attr_hits = 0;
+static uint64_t ocamlfuse_attr_misses = 0;
+
+static void ocamlfuse_attr_cache_init(void)
+{
+  for (int i = 0; i < OCAMLFUSE_ATTR_CACHE_SHARDS; i++) {
+    pthread_rwlock_init(&ocamlfuse_attr_shards[i].lock, NULL);
+  }
+}
+
+static int ocamlfuse_attr_cache_enabled(void)
+{
+  return __atomic_load_n(&ocamlfuse_attr_ttl, __ATOMIC_RELAXED)
+    || __atomic_load_n(&ocamlfuse_attr_negative_ttl, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a. The top bits pick the shard, the low bits the bucket. */
+static uint64_t ocamlfuse_attr_hash(const char* path, size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static struct ocamlfuse_attr_shard* ocamlfuse_attr_shard(uint64_t hash)
+{
+  return &ocamlfuse_attr_shards[hash >> (64 - OCAMLFUSE_ATTR_CACHE_SHARD_BITS)];
+}
+
+static struct ocamlfuse_attr_entry** ocamlfuse_attr_bucket(struct ocamlfuse_attr_shard* shard,
+							   uint64_t hash)
+{
+  return &shard->buckets[hash & (OCAMLFUSE_ATTR_CACHE_BUCKETS - 1)];
+}
+
+/* Must be called with the shard locked. */
+static struct ocamlfuse_attr_entry* ocamlfuse_attr_find(struct ocamlfuse_attr_shard* shard,
+							uint64_t hash,
+							const char* path, size_t length)
+{
+  for (struct ocamlfuse_attr_entry* entry = *ocamlfuse_attr_bucket(shard, hash);
+       entry != NULL;
+       entry = entry->next) {
+    if (entry->hash == hash && entry->length == length
+	&& memcmp(entry->path, path, length) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/* Removes the entries for which drop returns true. Must be called with the
+ * shard write-locked. */
+static void ocamlfuse_attr_sweep(struct ocamlfuse_attr_shard* shard,
+				 int (*drop)(struct ocamlfuse_attr_entry*, const void*),
+				 const void* data)
+{
+  for (int i = 0; i < OCAMLFUSE_ATTR_CACHE_BUCKETS; i++) {
+    struct ocamlfuse_attr_entry** link = &shard->buckets[i];
+    while (*link != NULL) {
+      struct ocamlfuse_attr_entry* entry = *link;
+      if (drop(entry, data)) {
+	*link = entry->next;
+	free(entry);
+	shard->entries--;
+      } else {
+	link = &entry->next;
+      }
+    }
+  }
+}
+
+static int ocamlfuse_attr_expired(struct ocamlfuse_attr_entry* entry, const void* now)
+{
+  return entry->expires <= *(const int64_t*) now;
+}
+
+static int ocamlfuse_attr_all(struct ocamlfuse_attr_entry* entry, const void* data)
+{
+  return 1;
+}
+
+/* Matches the path given as data and everything below it. */
+static int ocamlfuse_attr_below(struct ocamlfuse_attr_entry* entry, const void* data)
+{
+  const char* prefix = data;
+  size_t length = strlen(prefix);
+  return entry->length >= length
+    && memcmp(entry->path, prefix, length) == 0
+    && (entry->length == length
+	|| entry->path[length] == '/'
+	|| (length == 1 && prefix[0] == '/'));
+}
+
+int ocamlfuse_attr_cache_getattr(const char* path, struct stat* stbuf)
+{
+  if (!ocamlfuse_attr_cache_enabled()) {
+    return 0;
+  }
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  size_t length = strlen(path);
+  uint64_t hash = ocamlfuse_attr_hash(path, length);
+  struct ocamlfuse_attr_shard* shard = ocamlfuse_attr_shard(hash);
+  int64_t now = ocamlfuse_trace_now();
+  int result = 0;
+  pthread_rwlock_rdlock(&shard->lock);
+  struct ocamlfuse_attr_entry* entry = ocamlfuse_attr_find(shard, hash, path, length);
+  if (entry != NULL && now < entry->expires) {
+    if (entry->negative) {
+      result = -ENOENT;
+    } else {
+      *stbuf = entry->stat;
+      result = 1;
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  __atomic_add_fetch(result ? &ocamlfuse_attr_hits : &ocamlfuse_attr_misses, 1, __ATOMIC_RELAXED);
+  return result;
+}
+
+int ocamlfuse_attr_cache_access(const char* path, int mode)
+{
+  if (!ocamlfuse_attr_cache_enabled()) {
+    return 1;
+  }
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  size_t length = strlen(path);
+  uint64_t hash = ocamlfuse_attr_hash(path, length);
+  struct ocamlfuse_attr_shard* shard = ocamlfuse_attr_shard(hash);
+  int64_t now = ocamlfuse_trace_now();
+  int wanted = mode | OCAMLFUSE_ATTR_CACHE_EXISTS;
+  int result = 1;
+  pthread_rwlock_rdlock(&shard->lock);
+  struct ocamlfuse_attr_entry* entry = ocamlfuse_attr_find(shard, hash, path, length);
+  if (entry != NULL && now < entry->expires) {
+    if (entry->negative) {
+      result = -ENOENT;
+    } else if ((entry->granted & wanted) == wanted) {
+      result = 0;
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  __atomic_add_fetch(result != 1 ? &ocamlfuse_attr_hits : &ocamlfuse_attr_misses, 1, __ATOMIC_RELAXED);
+  return result;
+}
+
+uint64_t ocamlfuse_attr_cache_generation(const char* path)
+{
+  if (!ocamlfuse_attr_cache_enabled()) {
+    return 0;
+  }
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  struct ocamlfuse_attr_shard* shard =
+    ocamlfuse_attr_shard(ocamlfuse_attr_hash(path, strlen(path)));
+  return __atomic_load_n(&shard->generation, __ATOMIC_ACQUIRE);
+}
+
+void ocamlfuse_attr_cache_insert(const char* path, uint64_t generation,
+				 const struct stat* stbuf)
+{
+  int64_t ttl = __atomic_load_n(stbuf ? &ocamlfuse_attr_ttl : &ocamlfuse_attr_negative_ttl,
+				__ATOMIC_RELAXED);
+  if (ttl == 0) {
+    return;
+  }
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  size_t length = strlen(path);
+  uint64_t hash = ocamlfuse_attr_hash(path, length);
+  struct ocamlfuse_attr_shard* shard = ocamlfuse_attr_shard(hash);
+  int64_t now = ocamlfuse_trace_now();
+  pthread_rwlock_wrlock(&shard->lock);
+  if (shard->generation == generation) {
+    struct ocamlfuse_attr_entry* entry = ocamlfuse_attr_find(shard, hash, path, length);
+    if (entry == NULL) {
+      if (shard->entries >= OCAMLFUSE_ATTR_CACHE_SHARD_ENTRIES) {
+	ocamlfuse_attr_sweep(shard, ocamlfuse_attr_expired, &now);
+      }
+      if (shard->entries >= OCAMLFUSE_ATTR_CACHE_SHARD_ENTRIES) {
+	ocamlfuse_attr_sweep(shard, ocamlfuse_attr_all, NULL);
+      }
+      entry = malloc(sizeof(struct ocamlfuse_attr_entry) + length);
+      if (entry != NULL) {
+	entry->hash = hash;
+	entry->length = length;
+	memcpy(entry->path, path, length);
+	struct ocamlfuse_attr_entry** bucket = ocamlfuse_attr_bucket(shard, hash);
+	entry->next = *bucket;
+	*bucket = entry;
+	shard->entries++;
+      }
+    }
+    if (entry != NULL) {
+      entry->expires = now + ttl;
+      entry->negative = stbuf == NULL;
+      entry->granted = stbuf == NULL ? 0 : OCAMLFUSE_ATTR_CACHE_EXISTS;
+      if (stbuf != NULL) {
+	entry->stat = *stbuf;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+void ocamlfuse_attr_cache_grant(const char* path, uint64_t generation, int mode)
+{
+  if (!ocamlfuse_attr_cache_enabled()) {
+    return;
+  }
+  size_t length = strlen(path);
+  uint64_t hash = ocamlfuse_attr_hash(path, length);
+  struct ocamlfuse_attr_shard* shard = ocamlfuse_attr_shard(hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  if (shard->generation == generation) {
+    struct ocamlfuse_attr_entry* entry = ocamlfuse_attr_find(shard, hash, path, length);
+    if (entry != NULL && !entry->negative) {
+      entry->granted |= mode | OCAMLFUSE_ATTR_CACHE_EXISTS;
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+/* Bumps the generation of a shard and drops its entries that match. */
+static void ocamlfuse_attr_invalidate_shard(struct ocamlfuse_attr_shard* shard,
+					    int (*drop)(struct ocamlfuse_attr_entry*, const void*),
+					    const void* data)
+{
+  pthread_rwlock_wrlock(&shard->lock);
+  __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+  ocamlfuse_attr_sweep(shard, drop, data);
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+CAMLprim value ocamlfuse_attr_cache_configure_impl(value ttl, value negative_ttl)
+{
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  __atomic_store_n(&ocamlfuse_attr_ttl, (int64_t) (Double_val(ttl) * 1e9), __ATOMIC_RELAXED);
+  __atomic_store_n(&ocamlfuse_attr_negative_ttl, (int64_t) (Double_val(negative_ttl) * 1e9),
+		   __ATOMIC_RELAXED);
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_attr_cache_invalidate_impl(value path)
+{
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  size_t length = caml_string_length(path);
+  uint64_t hash = ocamlfuse_attr_hash(String_val(path), length);
+  struct ocamlfuse_attr_shard* shard = ocamlfuse_attr_shard(hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+  struct ocamlfuse_attr_entry** link = ocamlfuse_attr_bucket(shard, hash);
+  while (*link != NULL) {
+    struct ocamlfuse_attr_entry* entry = *link;
+    if (entry->hash == hash && entry->length == length
+	&& memcmp(entry->path, String_val(path), length) == 0) {
+      *link = entry->next;
+      free(entry);
+      shard->entries--;
+      break;
+    }
+    link = &entry->next;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return Val_unit;
+}
+
+/* Entries below a path hash to any shard, so all of them are visited. */
+CAMLprim value ocamlfuse_attr_cache_invalidate_tree_impl(value path)
+{
+  CAMLparam1(path);
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  char* prefix = strdup(String_val(path));
+  if (prefix != NULL) {
+    for (int i = 0; i < OCAMLFUSE_ATTR_CACHE_SHARDS; i++) {
+      ocamlfuse_attr_invalidate_shard(&ocamlfuse_attr_shards[i], ocamlfuse_attr_below, prefix);
+    }
+    free(prefix);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocamlfuse_attr_cache_clear_impl(value unit)
+{
+  pthread_once(&ocamlfuse_attr_once, ocamlfuse_attr_cache_init);
+  for (int i = 0; i < OCAMLFUSE_ATTR_CACHE_SHARDS; i++) {
+    ocamlfuse_attr_invalidate_shard(&ocamlfuse_attr_shards[i], ocamlfuse_attr_all, NULL);
+  }
+  return Val_unit;
+}
+
+/* Returns (hits, misses). */
+CAMLprim value ocamlfuse_attr_cache_stats_impl(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, Val_long(__atomic_load_n(&ocamlfuse_attr_hits, __ATOMIC_RELAXED)));
+  Store_field(result, 1, Val_long(__atomic_load_n(&ocamlfuse_attr_misses, __ATOMIC_RELAXED)));
+  CAMLreturn(result);
+}
@@ -0,0 +1,29 @@
+#ifndef OCAMLFUSE_ATTR_CACHE_IMPL_H
+#define OCAMLFUSE_ATTR_CACHE_IMPL_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Cache of getattr and access results keyed by path, answered without
+ * entering OCaml. Disabled until AttrCache.enable sets a TTL. */
+
+/* Returns 1 and fills stbuf on a hit, -ENOENT on a negative hit, and 0 on
+ * a miss. */
+int ocamlfuse_attr_cache_getattr(const char* path, struct stat* stbuf);
+
+/* Returns 0 when the filesystem already allowed mode on path, -ENOENT on a
+ * negative hit, and 1 when the filesystem has to be asked. */
+int ocamlfuse_attr_cache_access(const char* path, int mode);
+
+/* Returns the generation to pass to the insertions that follow a miss, so
+ * that a result computed before an invalidation is not cached after it. */
+uint64_t ocamlfuse_attr_cache_generation(const char* path);
+
+/* Caches stbuf for path, or that it doesn't exist when stbuf is NULL. */
+void ocamlfuse_attr_cache_insert(const char* path, uint64_t generation,
+				 const struct stat* stbuf);
+
+/* Records that the filesystem allowed mode on path. */
+void ocamlfuse_attr_cache_grant(const char* path, uint64_t generation, int mode);
+
+#endif
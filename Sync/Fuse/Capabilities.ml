@@ -0,0 +1,85 @@
+type flags = int
+type t =
+  | ASYNC_READ
+  | POSIX_LOCKS
+  | ATOMIC_O_TRUNC
+  | EXPORT_SUPPORT
+  | BIG_WRITES
+  | DONT_MASK
+  | SPLICE_WRITE
+  | SPLICE_MOVE
+  | SPLICE_READ
+  | FLOCK_LOCKS
+  | IOCTL_DIR
+  | AUTO_INVAL_DATA
+  | READDIRPLUS
+  | READDIRPLUS_AUTO
+  | ASYNC_DIO
+  | WRITEBACK_CACHE
+  | NO_OPEN_SUPPORT
+  | PARALLEL_DIROPS
+
+type conn = {
+    capable              : flags ;
+    want                 : flags ;
+    max_write            : int ;
+    max_readahead        : int ;
+    max_background       : int ;
+    congestion_threshold : int ;
+  }
+
+external ocamlfuse_capabilities_impl : unit -> flags array = "ocamlfuse_capabilities_impl"
+let capabilities = ocamlfuse_capabilities_impl ()
+
+let to_code (capability : t) = capabilities.(Obj.magic capability)
+
+let all_capabilities =
+  [ ASYNC_READ ;
+    POSIX_LOCKS ;
+    ATOMIC_O_TRUNC ;
+    EXPORT_SUPPORT ;
+    BIG_WRITES ;
+    DONT_MASK ;
+    SPLICE_WRITE ;
+    SPLICE_MOVE ;
+    SPLICE_READ ;
+    FLOCK_LOCKS ;
+    IOCTL_DIR ;
+    AUTO_INVAL_DATA ;
+    READDIRPLUS ;
+    READDIRPLUS_AUTO ;
+    ASYNC_DIO ;
+    WRITEBACK_CACHE ;
+    NO_OPEN_SUPPORT ;
+    PARALLEL_DIROPS ]
+
+let has flags capability =
+  let code = to_code capability in
+  code <> 0 && flags land code = code
+
+let of_flags flags = List.filter (has flags) all_capabilities
+
+let to_flags l =
+  let rec aux accu = function
+    | [] -> accu
+    | capability :: q -> aux (accu lor to_code capability) q
+  in aux 0 l
+
+let enable conn l = { conn with want = conn.want lor (to_flags l land conn.capable) }
+
+let disable conn l = { conn with want = conn.want land lnot (to_flags l) }
+
+let () =
+  assert begin
+      let known = List.filter (fun capability -> to_code capability <> 0) all_capabilities in
+      let conn = { capable = to_flags [ ASYNC_READ ; SPLICE_READ ] ;
+		   want = 0 ;
+		   max_write = 4096 ;
+		   max_readahead = 131072 ;
+		   max_background = 12 ;
+		   congestion_threshold = 9 } in
+      let enabled = enable conn [ ASYNC_READ ; WRITEBACK_CACHE ] in
+      of_flags (to_flags known) = known
+      && of_flags enabled.want = [ ASYNC_READ ]
+      && (disable enabled [ ASYNC_READ ]).want = 0
+    end
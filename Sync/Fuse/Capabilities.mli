@@ -0,0 +1,52 @@
+(** Capabilities and limits of a connection, negotiated by the [init]
+    callback of a filesystem. *)
+
+type flags
+type t =
+  | ASYNC_READ          (* reads may be sent in parallel *)
+  | POSIX_LOCKS
+  | ATOMIC_O_TRUNC      (* O_TRUNC is handled by open *)
+  | EXPORT_SUPPORT
+  | BIG_WRITES          (* writes may exceed 4 KiB, always on with FUSE 3 *)
+  | DONT_MASK           (* the umask isn't applied by the kernel *)
+  | SPLICE_WRITE        (* replies may be spliced to the device *)
+  | SPLICE_MOVE
+  | SPLICE_READ         (* writes may be spliced from the device *)
+  | FLOCK_LOCKS
+  | IOCTL_DIR
+  | AUTO_INVAL_DATA     (* cached data is dropped when the mtime changes *)
+  | READDIRPLUS
+  | READDIRPLUS_AUTO
+  | ASYNC_DIO
+  | WRITEBACK_CACHE     (* writes are cached by the kernel, and sent in large
+			   batches *)
+  | NO_OPEN_SUPPORT
+  | PARALLEL_DIROPS
+
+(** What FUSE offers to [init], and what [init] returns to it. *)
+type conn = {
+    capable              : flags ; (* 0. Capabilities offered by the kernel
+					 and libfuse. *)
+    want                 : flags ; (* 1. Capabilities enabled, some by
+					 default. *)
+    max_write            : int ;   (* 2. Largest write, clamped by libfuse
+					 to its buffer. *)
+    max_readahead        : int ;   (* 3. Largest read ahead, at most what
+					 the kernel offers. *)
+    max_background       : int ;   (* 4. Requests the kernel keeps pending
+					 in the background. *)
+    congestion_threshold : int ;   (* 5. Pending background requests above
+					 which the kernel throttles. *)
+  }
+
+(** 0 for a capability the FUSE the binding is built for doesn't know. *)
+val to_code : t -> flags
+val has : flags -> t -> bool
+val of_flags : flags -> t list
+val to_flags : t list -> flags
+
+(** Adds to the capabilities wanted by [conn] those of [capabilities] it
+    offers; the others are ignored. *)
+val enable : conn -> t list -> conn
+
+val disable : conn -> t list -> conn
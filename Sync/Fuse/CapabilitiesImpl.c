@@ -0,0 +1,68 @@
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 29
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+
+#include <fuse_common.h>
+
+/* Capabilities missing from the FUSE the binding is built for are 0. */
+#ifndef FUSE_CAP_BIG_WRITES
+#define FUSE_CAP_BIG_WRITES 0
+#endif
+#ifndef FUSE_CAP_AUTO_INVAL_DATA
+#define FUSE_CAP_AUTO_INVAL_DATA 0
+#endif
+#ifndef FUSE_CAP_READDIRPLUS
+#define FUSE_CAP_READDIRPLUS 0
+#endif
+#ifndef FUSE_CAP_READDIRPLUS_AUTO
+#define FUSE_CAP_READDIRPLUS_AUTO 0
+#endif
+#ifndef FUSE_CAP_ASYNC_DIO
+#define FUSE_CAP_ASYNC_DIO 0
+#endif
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+#define FUSE_CAP_WRITEBACK_CACHE 0
+#endif
+#ifndef FUSE_CAP_NO_OPEN_SUPPORT
+#define FUSE_CAP_NO_OPEN_SUPPORT 0
+#endif
+#ifndef FUSE_CAP_PARALLEL_DIROPS
+#define FUSE_CAP_PARALLEL_DIROPS 0
+#endif
+
+/* Same order as Capabilities.t. */
+static int capabilities_table[] = {
+  FUSE_CAP_ASYNC_READ,
+  FUSE_CAP_POSIX_LOCKS,
+  FUSE_CAP_ATOMIC_O_TRUNC,
+  FUSE_CAP_EXPORT_SUPPORT,
+  FUSE_CAP_BIG_WRITES,
+  FUSE_CAP_DONT_MASK,
+  FUSE_CAP_SPLICE_WRITE,
+  FUSE_CAP_SPLICE_MOVE,
+  FUSE_CAP_SPLICE_READ,
+  FUSE_CAP_FLOCK_LOCKS,
+  FUSE_CAP_IOCTL_DIR,
+  FUSE_CAP_AUTO_INVAL_DATA,
+  FUSE_CAP_READDIRPLUS,
+  FUSE_CAP_READDIRPLUS_AUTO,
+  FUSE_CAP_ASYNC_DIO,
+  FUSE_CAP_WRITEBACK_CACHE,
+  FUSE_CAP_NO_OPEN_SUPPORT,
+  FUSE_CAP_PARALLEL_DIROPS
+};
+
+CAMLprim value ocamlfuse_capabilities_impl(value unit) {
+  CAMLparam1(unit);
+  CAMLlocal1(capabilities);
+  int size = sizeof(capabilities_table) / sizeof(capabilities_table[0]);
+  capabilities = caml_alloc(size, 0);
+  for (int i = 0; i < size; i++) {
+    Field(capabilities, i) = Val_int(capabilities_table[i]);
+  }
+  CAMLreturn (capabilities);
+}
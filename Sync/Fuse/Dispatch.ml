@@ -0,0 +1,6 @@
+external run_impl : int -> unit = "ocamlfuse_dispatch_run_impl"
+external stop : unit -> unit = "ocamlfuse_dispatch_stop_impl"
+
+let run ~batch = run_impl batch
+
+let start ~batch = Thread.create (fun batch -> run ~batch) batch
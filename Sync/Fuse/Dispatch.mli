@@ -0,0 +1,22 @@
+(** Batched dispatch of FUSE operations.
+
+    By default, every FUSE thread takes the runtime lock for each operation
+    it runs, and under parallel load the lock moves between threads on
+    every request. While a worker runs, FUSE threads queue their operations
+    instead, and the worker runs them on its own thread, up to [batch] of
+    them per acquisition of the runtime lock.
+
+    Handlers then run one at a time on the worker thread: a handler that
+    blocks delays every operation queued behind it. *)
+
+(** Serves queued operations on the calling thread until [stop] is called.
+    Raises [Invalid_argument] if [batch] is less than 1, or if a worker is
+    already running. *)
+val run : batch: int -> unit
+
+(** Runs [run] on a new thread. *)
+val start : batch: int -> Thread.t
+
+(** Makes the worker return once the operations it accepted are done.
+    Operations that come later take the runtime lock themselves. *)
+val stop : unit -> unit
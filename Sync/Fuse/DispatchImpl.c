@@ -0,0 +1,195 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/threads.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "DispatchImpl.h"
+#include "StatsImpl.h"
+#include "TraceImpl.h"
+
+/* Iterations a FUSE thread polls for its completion before sleeping: a
+ * worker that is already running usually completes a call sooner than a
+ * sleep and wake up would take. */
+#define OCAMLFUSE_DISPATCH_SPIN 256
+
+/* A queued call. It lives on the stack of the FUSE thread that waits for
+ * it, which only returns after taking mutex once done is set, so the worker
+ * never touches a request that is gone. */
+struct ocamlfuse_request {
+  struct ocamlfuse_request* next;
+  void (*run)(void* data);
+  void* data;
+  int32_t opcode;
+  int done;
+  int64_t queued;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/* Calls run per runtime lock acquisition, or 0 when no worker serves. */
+static int ocamlfuse_dispatch_batch = 0;
+
+/* Calls that saw a worker and haven't completed yet: a stopping worker
+ * serves until there are none left. */
+static int ocamlfuse_dispatch_inflight = 0;
+
+/* Pending requests, newest first. FUSE threads push with a CAS, the worker
+ * takes the whole list at once. */
+static struct ocamlfuse_request* ocamlfuse_dispatch_head = NULL;
+
+static pthread_mutex_t ocamlfuse_dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ocamlfuse_dispatch_cond = PTHREAD_COND_INITIALIZER;
+static int ocamlfuse_dispatch_sleeping = 0;
+
+static void ocamlfuse_dispatch_wake(void)
+{
+  pthread_mutex_lock(&ocamlfuse_dispatch_mutex);
+  pthread_cond_signal(&ocamlfuse_dispatch_cond);
+  pthread_mutex_unlock(&ocamlfuse_dispatch_mutex);
+}
+
+static void ocamlfuse_dispatch_leave(void)
+{
+  if (__atomic_sub_fetch(&ocamlfuse_dispatch_inflight, 1, __ATOMIC_SEQ_CST) == 0
+      && !__atomic_load_n(&ocamlfuse_dispatch_batch, __ATOMIC_SEQ_CST)) {
+    ocamlfuse_dispatch_wake();
+  }
+}
+
+/* Queues a call for the worker and waits until it has run. */
+static void ocamlfuse_dispatch_queued(void (*run)(void* data), void* data)
+{
+  struct ocamlfuse_request request;
+  request.run = run;
+  request.data = data;
+  request.opcode = ocamlfuse_trace_current.opcode;
+  request.done = 0;
+  request.queued = ocamlfuse_trace_now();
+  pthread_mutex_init(&request.mutex, NULL);
+  pthread_cond_init(&request.cond, NULL);
+
+  request.next = __atomic_load_n(&ocamlfuse_dispatch_head, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&ocamlfuse_dispatch_head, &request.next, &request,
+				      1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+  }
+  if (__atomic_load_n(&ocamlfuse_dispatch_sleeping, __ATOMIC_SEQ_CST)) {
+    ocamlfuse_dispatch_wake();
+  }
+
+  for (int i = 0;
+       i < OCAMLFUSE_DISPATCH_SPIN && !__atomic_load_n(&request.done, __ATOMIC_ACQUIRE);
+       i++) {
+  }
+  pthread_mutex_lock(&request.mutex);
+  while (!__atomic_load_n(&request.done, __ATOMIC_ACQUIRE)) {
+    pthread_cond_wait(&request.cond, &request.mutex);
+  }
+  pthread_mutex_unlock(&request.mutex);
+  pthread_cond_destroy(&request.cond);
+  pthread_mutex_destroy(&request.mutex);
+}
+
+void ocamlfuse_dispatch(void (*run)(void* data), void* data)
+{
+  if (__atomic_load_n(&ocamlfuse_dispatch_batch, __ATOMIC_RELAXED)) {
+    __atomic_add_fetch(&ocamlfuse_dispatch_inflight, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ocamlfuse_dispatch_batch, __ATOMIC_SEQ_CST)) {
+      ocamlfuse_dispatch_queued(run, data);
+      ocamlfuse_dispatch_leave();
+      return;
+    }
+    ocamlfuse_dispatch_leave();
+  }
+  caml_c_thread_register();
+  ocamlfuse_acquire_runtime();
+  run(data);
+  caml_release_runtime_system();
+}
+
+/* Waits for pending requests and returns them oldest first, or NULL once
+ * the worker is stopped and every call it accepted has completed. Must be
+ * called without the runtime lock. */
+static struct ocamlfuse_request* ocamlfuse_dispatch_take(void)
+{
+  struct ocamlfuse_request* list;
+  pthread_mutex_lock(&ocamlfuse_dispatch_mutex);
+  __atomic_store_n(&ocamlfuse_dispatch_sleeping, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    list = __atomic_exchange_n(&ocamlfuse_dispatch_head, NULL, __ATOMIC_SEQ_CST);
+    if (list != NULL
+	|| (!__atomic_load_n(&ocamlfuse_dispatch_batch, __ATOMIC_SEQ_CST)
+	    && !__atomic_load_n(&ocamlfuse_dispatch_inflight, __ATOMIC_SEQ_CST))) {
+      break;
+    }
+    pthread_cond_wait(&ocamlfuse_dispatch_cond, &ocamlfuse_dispatch_mutex);
+  }
+  __atomic_store_n(&ocamlfuse_dispatch_sleeping, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&ocamlfuse_dispatch_mutex);
+
+  struct ocamlfuse_request* oldest = NULL;
+  while (list != NULL) {
+    struct ocamlfuse_request* next = list->next;
+    list->next = oldest;
+    oldest = list;
+    list = next;
+  }
+  return oldest;
+}
+
+/* Runs a request on the worker, and wakes its FUSE thread. The time it
+ * spent queued is accounted as the wait for the runtime lock it replaces. */
+static void ocamlfuse_dispatch_complete(struct ocamlfuse_request* request)
+{
+  ocamlfuse_trace_current.opcode = request->opcode;
+  ocamlfuse_stats_add(request->opcode, OCAMLFUSE_PHASE_LOCK,
+		      ocamlfuse_trace_now() - request->queued);
+  request->run(request->data);
+  pthread_mutex_lock(&request->mutex);
+  __atomic_store_n(&request->done, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&request->cond);
+  pthread_mutex_unlock(&request->mutex);
+}
+
+CAMLprim value ocamlfuse_dispatch_run_impl(value batch)
+{
+  CAMLparam1(batch);
+  int expected = 0;
+  if (Int_val(batch) < 1
+      || !__atomic_compare_exchange_n(&ocamlfuse_dispatch_batch, &expected, Int_val(batch),
+				      0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    caml_invalid_argument("Dispatch.run");
+  }
+  int size = Int_val(batch);
+  struct ocamlfuse_request* pending = NULL;
+  for (;;) {
+    if (pending == NULL) {
+      caml_release_runtime_system();
+      pending = ocamlfuse_dispatch_take();
+      caml_acquire_runtime_system();
+      if (pending == NULL) {
+	break;
+      }
+    }
+    for (int i = 0; i < size && pending != NULL; i++) {
+      struct ocamlfuse_request* request = pending;
+      pending = request->next;
+      ocamlfuse_dispatch_complete(request);
+    }
+    if (pending != NULL) {
+      /* Lets other OCaml threads run between batches. */
+      caml_release_runtime_system();
+      caml_acquire_runtime_system();
+    }
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocamlfuse_dispatch_stop_impl(value unit)
+{
+  __atomic_store_n(&ocamlfuse_dispatch_batch, 0, __ATOMIC_SEQ_CST);
+  ocamlfuse_dispatch_wake();
+  return Val_unit;
+}
@@ -0,0 +1,14 @@
+#ifndef OCAMLFUSE_DISPATCH_IMPL_H
+#define OCAMLFUSE_DISPATCH_IMPL_H
+
+/* Runs run(data) with the runtime lock held, and returns once it is done.
+ *
+ * Without a worker, the calling thread takes the runtime lock itself. While
+ * Dispatch.run serves on an OCaml thread, the call is queued instead, and
+ * the worker runs it in a batch with the other pending calls, so that FUSE
+ * threads don't hand the runtime lock to each other on every operation.
+ * run may execute on another thread: it must only touch data, not the
+ * thread-local trace span. */
+void ocamlfuse_dispatch(void (*run)(void* data), void* data);
+
+#endif
@@ -0,0 +1,148 @@
+type t = {
+    path : string ;
+    mutable fd : Unix.file_descr ;
+    pending : Buffer.t ;
+    mutable written : int ;
+    mutable unsynced : bool ;
+  }
+
+external crc : string -> int -> int -> int = "ocamlfuse_journal_crc_impl" [@@noalloc]
+
+let magic = "OFJ1"
+
+(* The magic number, then the generation. *)
+let header_size = 12
+
+(* Records pending beyond this size are written before the commit. *)
+let pending_limit = 1 lsl 20
+
+(* A record is its length and checksum, then its data. *)
+let add_record buffer record =
+  let length = String.length record in
+  Buffer.add_int32_le buffer (Int32.of_int length);
+  Buffer.add_int32_le buffer (Int32.of_int (crc record 0 length));
+  Buffer.add_string buffer record
+
+let get_uint32 data offset = Int32.to_int (String.get_int32_le data offset) land 0xFFFFFFFF
+
+let iter_records data ~offset f =
+  let rec aux offset =
+    if offset + 8 > String.length data then offset
+    else
+      let length = get_uint32 data offset
+      and checksum = get_uint32 data (offset + 4) in
+      if length > String.length data - offset - 8
+	 || crc data (offset + 8) length <> checksum
+      then offset
+      else begin
+	  f (String.sub data (offset + 8) length);
+	  aux (offset + 8 + length)
+	end
+  in
+  aux offset
+
+let read_file path =
+  let channel = open_in_bin path in
+  Fun.protect ~finally: (fun () -> close_in channel)
+	      (fun () -> really_input_string channel (in_channel_length channel))
+
+let write_all fd data =
+  let rec aux offset =
+    if offset < String.length data
+    then aux (offset + Unix.write_substring fd data offset (String.length data - offset))
+  in
+  aux 0
+
+(* Makes a rename in the folder durable. *)
+let sync_folder path =
+  let fd = Unix.openfile (Filename.dirname path) [ Unix.O_RDONLY ; Unix.O_CLOEXEC ] 0 in
+  Fun.protect ~finally: (fun () -> Unix.close fd) (fun () -> Unix.fsync fd)
+
+(* Creates an empty journal in place of the previous one, which a crash
+   leaves whole. *)
+let create path generation =
+  let temporary = path ^ ".new"
+  and header = Buffer.create header_size in
+  Buffer.add_string header magic;
+  Buffer.add_int64_le header (Int64.of_int generation);
+  let fd = Unix.openfile temporary
+			 [ Unix.O_WRONLY ; Unix.O_CREAT ; Unix.O_TRUNC ; Unix.O_CLOEXEC ]
+			 0o644 in
+  write_all fd (Buffer.contents header);
+  Unix.fsync fd;
+  Unix.rename temporary path;
+  sync_folder path;
+  fd
+
+let replay path ~generation f =
+  let data = try read_file path with Sys_error _ -> "" in
+  let pending = Buffer.create 4096 in
+  if String.length data < header_size
+     || String.sub data 0 (String.length magic) <> magic
+     || Int64.to_int (String.get_int64_le data (String.length magic)) <> generation
+  then { path ; fd = create path generation ; pending ; written = header_size ; unsynced = false }
+  else begin
+      let valid = iter_records data ~offset: header_size f in
+      let fd = Unix.openfile path [ Unix.O_WRONLY ; Unix.O_CLOEXEC ] 0 in
+      if valid < String.length data then Unix.ftruncate fd valid;
+      ignore (Unix.lseek fd valid Unix.SEEK_SET);
+      { path ; fd ; pending ; written = valid ; unsynced = false }
+    end
+
+let write_pending t =
+  write_all t.fd (Buffer.contents t.pending);
+  t.written <- t.written + Buffer.length t.pending;
+  t.unsynced <- true;
+  Buffer.clear t.pending
+
+let append t record =
+  add_record t.pending record;
+  if Buffer.length t.pending > pending_limit then write_pending t
+
+let commit t =
+  if Buffer.length t.pending > 0 then write_pending t;
+  if t.unsynced then begin
+      Unix.fsync t.fd;
+      t.unsynced <- false
+    end
+
+let size t = t.written + Buffer.length t.pending
+
+let reset t ~generation =
+  Buffer.clear t.pending;
+  Unix.close t.fd;
+  t.fd <- create t.path generation;
+  t.written <- header_size;
+  t.unsynced <- false
+
+let close t =
+  commit t;
+  Unix.close t.fd
+
+let () =
+  assert begin
+      let path = Filename.temp_file "journal" "" in
+      Fun.protect ~finally: (fun () -> Sys.remove path) begin fun () ->
+	let records generation =
+	  let l = ref [] in
+	  close (replay path ~generation (fun record -> l := record :: !l));
+	  List.rev !l in
+	let t = replay path ~generation: 1 ignore in
+	append t "a";
+	append t "";
+	append t (String.make 100 'b');
+	close t;
+	let whole = records 1 in
+	(* A torn record ends the journal. *)
+	let fd = Unix.openfile path [ Unix.O_WRONLY ] 0 in
+	Unix.ftruncate fd (header_size + 9 + 8 + 50);
+	Unix.close fd;
+	let torn = records 1 in
+	let stale = records 2 in
+	let replaced = records 1 in
+	whole = [ "a" ; "" ; String.make 100 'b' ]
+	&& torn = [ "a" ; "" ]
+	&& stale = []
+	&& replaced = []
+      end
+    end
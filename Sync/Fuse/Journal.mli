@@ -0,0 +1,44 @@
+(** Append-only log of checksummed records, for filesystems that keep their
+    state in memory.
+
+    A journal belongs to a generation, the one of the snapshot it applies
+    to: a journal of another generation is stale, and discarded when
+    opened. Appended records are kept in memory until [commit], which
+    writes and syncs them together, so that the records of many operations
+    share one disk sync. *)
+
+type t
+
+(** Replays the records of the journal at [path] with [f], in order, and
+    returns the journal, opened to append after them. A record left
+    incomplete or corrupted by a crash ends the journal, and is truncated.
+    A missing or stale journal is replaced by an empty one. *)
+val replay : string -> generation: int -> (string -> unit) -> t
+
+(** Adds a record, written by the next [commit]. Records pending beyond a
+    threshold are written right away, but only synced by [commit]. *)
+val append : t -> string -> unit
+
+(** Writes the pending records and syncs them. *)
+val commit : t -> unit
+
+(** Size of the journal on disk, including the pending records. *)
+val size : t -> int
+
+(** Replaces the journal by an empty one of another generation, once the
+    snapshot that contains its records is durable. *)
+val reset : t -> generation: int -> unit
+
+val close : t -> unit
+
+(** Syncs the folder of [path], which makes the creation or the renaming
+    of the file durable. *)
+val sync_folder : string -> unit
+
+(** Adds a framed record to a buffer, the way journals store it. *)
+val add_record : Buffer.t -> string -> unit
+
+(** Calls [f] on the framed records of [data] from [offset], until the end
+    or the first invalid record, and returns the offset where it
+    stopped. *)
+val iter_records : string -> offset: int -> (string -> unit) -> int
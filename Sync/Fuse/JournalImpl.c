@@ -0,0 +1,31 @@
+#include <caml/mlvalues.h>
+
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3) of the records of Journal. */
+
+static uint32_t ocamlfuse_crc_table[256];
+
+static void ocamlfuse_crc_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    ocamlfuse_crc_table[i] = crc;
+  }
+}
+
+CAMLprim value ocamlfuse_journal_crc_impl(value data, value offset, value length)
+{
+  if (ocamlfuse_crc_table[1] == 0) {
+    ocamlfuse_crc_init();
+  }
+  const unsigned char* bytes = (const unsigned char*) String_val(data) + Long_val(offset);
+  uint32_t crc = 0xFFFFFFFF;
+  for (intnat i = Long_val(length); i > 0; i--) {
+    crc = ocamlfuse_crc_table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+  }
+  return Val_long(crc ^ 0xFFFFFFFF);
+}
@@ -15,8 +15,28 @@ type kind =
    }
 
  and handle = int
+ (* How the kernel treats a file opened by open or create. *)
+ and open_option =
+   | DirectIo              (* Reads and writes bypass the page cache, and
+			      reach the filesystem with the caller's sizes. *)
+   | KeepCache             (* Data cached by previous opens stays valid. *)
+   | NonSeekable           (* The file is a stream. *)
+   | ParallelDirectWrites  (* Direct writes may run in parallel, from FUSE
+			      3.15. *)
+ (* Memory owned by the C layer, only valid during the callback it is passed
+    to: the callback must not keep it, nor a sub-array of it. *)
+ and buffer = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+ (* Data of a write, only valid during the callback it is passed to. *)
+ and write_source =
+   | Memory of buffer               (* Data in memory owned by the C layer. *)
+   | Pipe of Unix.file_descr * int  (* Data spliced by the kernel into a pipe,
+				       and its size. *)
+ (* Directory being listed, owned by the C layer and only valid during the
+    readdir callback it is passed to. *)
+ and cursor
  and errcode = ErrCode.errcode
  and openflags = OpenFlags.flags
+ and conn = Capabilities.conn
  and mode = int
  and statfs = {
      bsize   : int ; (* 0. File system block size *)
@@ -34,7 +54,7 @@ type kind =
 
  and filesystem = {
      access     : path: string -> mode: mode -> unit ;
-     create     : path: string -> mode: mode -> handle ;
+     create     : path: string -> mode: mode -> handle * open_option list ;
      mknod      : path: string -> mode: mode -> unit ;
      destroy    : unit -> unit ;
      flush      : path: string -> handle: handle -> unit ;
@@ -42,12 +62,24 @@ type kind =
      fgetattr   : path: string -> handle: handle -> stat ;
      getxattr   : path: string -> key: string -> string ;
      setxattr   : path: string -> key: string -> value: string -> unit ;
-     init       : unit -> unit ;
+     (* Receives the capabilities and limits offered by FUSE, and returns
+	those to use, e.g. through [Capabilities.enable]. *)
+     init       : conn: conn -> conn ;
      mkdir      : path: string -> mode: mode -> unit ;
-     fopen      : path: string -> flags: openflags -> handle ;
+     fopen      : path: string -> flags: openflags -> handle * open_option list ;
      opendir    : path: string -> handle ;
      read       : path: string -> handle: handle -> offset: int -> size: int -> string ;
-     readdir    : path: string -> handle: handle -> string array ;
+     (* Zero-copy variant of [read]: fills the kernel's reply buffer and
+	returns the number of bytes read. *)
+     read_buffer : (path: string -> handle: handle -> offset: int -> buffer: buffer -> int) option ;
+     (* Lists a directory from the cookie [offset], 0 for its first entry.
+	[add] takes the name and attributes of an entry, and the cookie of
+	the entry that follows it, which must be positive. It returns false
+	once the kernel buffer is full, and readdir is called again from the
+	last cookie it accepted. Attributes given here are cached for
+	getattr. *)
+     readdir    : path: string -> handle: handle -> offset: int ->
+		  add: (name: string -> stat: stat option -> next: int -> bool) -> unit ;
      rename     : from_path: string -> to_path: string -> unit ;
      release    : path: string -> handle: handle -> unit ;
      releasedir : path: string -> handle: handle -> unit ;
@@ -59,11 +91,14 @@ type kind =
      ftruncate  : path: string -> handle: handle -> size: int -> unit ;
      unlink     : path: string -> unit ;
      write      : path: string -> handle: handle -> data: string -> offset: int -> int ;
+     (* Zero-copy variant of [write]: reads the data from its source and
+	returns the number of bytes written. *)
+     write_buffer : (path: string -> handle: handle -> source: write_source -> offset: int -> int) option ;
    }
 
  and filesystem_internal = {
      internal_access     : string -> mode -> errcode ;
-     internal_create     : string -> mode -> errcode * handle ;
+     internal_create     : string -> mode -> errcode * (handle * int) ;
      internal_mknod      : string -> mode -> errcode ;
      internal_destroy    : unit -> unit ;
      internal_flush      : string -> handle -> errcode ;
@@ -71,12 +106,13 @@ type kind =
      internal_fgetattr   : string -> handle -> errcode * stat ;
      internal_getxattr   : string -> string -> errcode * string ;
      internal_setxattr   : string -> string -> string -> errcode ;
-     internal_init       : unit -> unit ;
+     internal_init       : conn -> conn ;
      internal_mkdir      : string -> mode -> errcode ;
-     internal_fopen      : string -> openflags -> errcode * handle ;
+     internal_fopen      : string -> openflags -> errcode * (handle * int) ;
      internal_opendir    : string -> errcode * handle ;
      internal_read       : string -> handle -> int -> int -> errcode * string ;
-     internal_readdir    : string -> handle -> errcode * string array ;
+     internal_read_buffer : (string -> handle -> int -> buffer -> errcode * int) option ;
+     internal_readdir    : string -> handle -> int -> cursor -> errcode ;
      internal_rename     : string -> string -> errcode ;
      internal_release    : string -> handle -> errcode ;
      internal_releasedir : string -> handle -> errcode ;
@@ -88,6 +124,7 @@ type kind =
      internal_ftruncate  : string -> handle -> int -> errcode ;
      internal_unlink     : string -> errcode ;
      internal_write      : string -> handle -> string -> int -> errcode * int ;
+     internal_write_buffer : (string -> handle -> write_source -> int -> errcode * int) option ;
    }
 
 let internal_of_stat { kind ; size ; time } =
@@ -97,6 +134,27 @@ let internal_of_stat { kind ; size ; time } =
     size_internal = size ;
     time_internal = time }
 
+external readdir_add_impl : cursor -> string -> stat_internal option -> int -> bool = "ocamlfuse_readdir_add_impl"
+
+let readdir_add cursor ~name ~stat ~next =
+  readdir_add_impl cursor name
+		   (match stat with
+		    | Some stat -> Some (internal_of_stat stat)
+		    | None -> None)
+		   next
+
+(* Same bits as OCAMLFUSE_DIRECT_IO and the others in OCamlFuseImpl.c. *)
+let open_options_code options =
+  List.fold_left (fun code option ->
+		  code lor (match option with
+			    | DirectIo -> 1
+			    | KeepCache -> 2
+			    | NonSeekable -> 4
+			    | ParallelDirectWrites -> 8))
+		 0 options
+
+let internal_of_opened (handle, options) = handle, open_options_code options
+
 let null_handle = 0
 and getattr_error = { kind = REG ; size = -1 ; time = -1 }
 and statfs_error = {
@@ -109,43 +167,61 @@ and statfs_error = {
     namemax = 0 ;
   }
 
-let internal_of_filesystem ~debug fs =
+(** Functions that serialize calls to a filesystem and turn its exceptions
+    into error codes. *)
+type wrappers = {
+    wrap0 : (unit -> unit) -> errcode ;
+    wrap1 : 'a. (unit -> 'a) -> 'a -> errcode * 'a ;
+  }
+
+let make_wrappers ~debug =
   let mutex = Mutex.create () in
+  (* The wait for the mutex, the time spent in f and the words it allocates
+     go to Stats. *)
   let lock f () =
+    let start = Stats.now () in
     Mutex.lock mutex;
+    let locked = Stats.now ()
+    and words = Stats.allocated_words () in
+    let unlock failed =
+      Stats.record
+	~mutex: (locked - start)
+	~handler: (Stats.now () - locked)
+	~words: (Stats.allocated_words () - words)
+	~failed;
+      Mutex.unlock mutex
+    in
     try
       let result = f () in
-      Mutex.unlock mutex;
+      unlock false;
       result
     with exn ->
-      Mutex.unlock mutex;
+      unlock true;
       raise exn
   in
-  let debug =
+  let prerr x =
+    flush_all ();
+    prerr_string x;
+    prerr_newline ();
+    flush_all ()
+  in
+  let debug f () =
     if debug
-    then
-      let prerr x =
-	flush_all ();
-	prerr_string x;
-	prerr_newline ();
-	flush_all ()
-      in fun f () ->
-	 let t = 1 in (*Thread.self () in*)
-	 "let t = string_of_int t in";
-	 prerr ("1 :::: " ^ "t" ^ " ::::  before init gc..." );
-	 Gc.full_major () ;
-	 prerr "2 ::::  after init gc..." ;
-
-	 let result = f () in
-
-	 prerr "3 ::::  before final gc..." ;
-	 Gc.full_major () ;
-	 prerr "4 :::: after final gc..." ;
-	 result
-
-    else fun f () -> f ()
+    then begin
+	prerr "1 ::::  before init gc..." ;
+	Gc.full_major () ;
+	prerr "2 ::::  after init gc..." ;
+
+	let result = f () in
+
+	prerr "3 ::::  before final gc..." ;
+	Gc.full_major () ;
+	prerr "4 :::: after final gc..." ;
+	result
+      end
+    else f ()
   in
-  let run f = debug (lock f) in    
+  let run f = debug (lock f) in
   let wrap0 f = try run f () ; ErrCode.ok with
 		| ErrCode.Error error -> ErrCode.to_errcode error
 		| exn -> prerr_string (Printexc.to_string exn);
@@ -160,22 +236,39 @@ let internal_of_filesystem ~debug fs =
 				       prerr_newline ();
 				       flush_all ();
 				       ErrCode.unknown, default_value
-  in
+  in { wrap0 ; wrap1 }
+
+let internal_of_filesystem ~debug fs =
+  let wrappers = make_wrappers ~debug in
+  let wrap0 f = wrappers.wrap0 f
+  and wrap1 f default_value = wrappers.wrap1 f default_value in
   let internal_access path mode = wrap0 (fun () -> fs.access ~path ~mode)
-  and internal_create path mode = wrap1 (fun () -> fs.create ~path ~mode) null_handle
+  and internal_create path mode =
+    wrap1 (fun () -> internal_of_opened (fs.create ~path ~mode)) (null_handle, 0)
   and internal_mknod path mode = wrap0 (fun () -> fs.mknod ~path ~mode)
   and internal_destroy = fs.destroy
   and internal_flush path handle = wrap0 (fun () -> fs.flush ~path ~handle)
   and internal_getattr path = wrap1 (fun () -> fs.getattr ~path) getattr_error
   and internal_fgetattr path handle = wrap1 (fun () -> fs.fgetattr ~path ~handle) getattr_error
-  and internal_getxattr path key = wrap1 (fun () -> fs.getxattr ~path ~key) ""
+  and internal_getxattr path key =
+    if path = "/" && key = Stats.xattr
+    then ErrCode.ok, Stats.report ()
+    else wrap1 (fun () -> fs.getxattr ~path ~key) ""
   and internal_setxattr path key value = wrap0 (fun () -> fs.setxattr ~path ~key ~value)
-  and internal_init = fs.init
+  and internal_init conn = fs.init ~conn
   and internal_mkdir path mode = wrap0 (fun () -> fs.mkdir ~path ~mode)
-  and internal_fopen path openflags = wrap1 (fun () -> fs.fopen ~path ~flags: openflags) null_handle
+  and internal_fopen path openflags =
+    wrap1 (fun () -> internal_of_opened (fs.fopen ~path ~flags: openflags)) (null_handle, 0)
   and internal_opendir path = wrap1 (fun () -> fs.opendir ~path) null_handle
   and internal_read path handle offset size = wrap1 (fun () -> fs.read ~path ~handle ~offset ~size) ""
-  and internal_readdir path handle = wrap1 (fun () -> fs.readdir ~path ~handle) [||]
+  and internal_read_buffer =
+    match fs.read_buffer with
+    | None -> None
+    | Some read_buffer ->
+       Some (fun path handle offset buffer ->
+	     wrap1 (fun () -> read_buffer ~path ~handle ~offset ~buffer) 0)
+  and internal_readdir path handle offset cursor =
+    wrap0 (fun () -> fs.readdir ~path ~handle ~offset ~add: (readdir_add cursor))
   and internal_rename from_path to_path = wrap0 (fun () -> fs.rename ~from_path ~to_path)
   and internal_release path handle = wrap0 (fun () -> fs.release ~path ~handle)
   and internal_releasedir path handle = wrap0 (fun () -> fs.releasedir ~path ~handle)
@@ -187,6 +280,12 @@ let internal_of_filesystem ~debug fs =
   and internal_ftruncate path handle size = wrap0 (fun () -> fs.ftruncate ~path ~handle ~size)
   and internal_unlink path = wrap0 (fun () -> fs.unlink ~path)
   and internal_write path handle data offset = wrap1 (fun () -> fs.write ~path ~handle ~data ~offset) 0
+  and internal_write_buffer =
+    match fs.write_buffer with
+    | None -> None
+    | Some write_buffer ->
+       Some (fun path handle source offset ->
+	     wrap1 (fun () -> write_buffer ~path ~handle ~source ~offset) 0)
   in { internal_access ;
        internal_create ;
        internal_mknod ;
@@ -201,6 +300,7 @@ let internal_of_filesystem ~debug fs =
        internal_fopen ;
        internal_opendir ;
        internal_read ;
+       internal_read_buffer ;
        internal_readdir ;
        internal_rename ;
        internal_release ;
@@ -212,61 +312,704 @@ let internal_of_filesystem ~debug fs =
        internal_truncate ;
        internal_ftruncate ;
        internal_unlink ;
-       internal_write }
+       internal_write ;
+       internal_write_buffer }
 
-external ocamlfuse_start_impl : string array -> unit = "ocamlfuse_start_impl"
+external ocamlfuse_start_impl : string -> string array -> unit = "ocamlfuse_start_impl"
+external ocamlfuse_version_impl : unit -> int = "ocamlfuse_version_impl"
 
-let start dir options filesystem =
-  let run =
-    if List.mem `Foreground options
-    then fun f -> f ()
-    else fun f ->
-	 if Unix.fork () = 0
-	 then f ()
-	 else ()
+(** Version of the FUSE API the C layer is built for, e.g. 29 or 312. *)
+let version = ocamlfuse_version_impl ()
+
+(** Runs [f] in the current process if [`Foreground] is set, or in a forked
+    child process otherwise. *)
+let daemonize options f =
+  if List.mem `Foreground options
+  then f ()
+  else if Unix.fork () = 0
+  then f ()
+  else ()
+
+(** Command line arguments of libfuse for [options].
+
+    [`EntryTimeout], [`AttrTimeout] and [`NegativeTimeout] are the seconds
+    the kernel caches names, attributes and missing names. [`KernelCache]
+    keeps file contents cached across opens, [`AutoCache] only until the
+    modification time or size of the file changes. [`Batched n] isn't
+    passed to libfuse: operations go through a [Dispatch] worker that runs
+    up to [n] of them per acquisition of the runtime lock.
+
+    The worker pool of the multi-threaded loop, which [`SingleThreaded]
+    replaces with the calling thread, needs FUSE 3: [`CloneFd] gives every
+    worker its own /dev/fuse descriptor instead of one they all contend on,
+    [`MaxIdleThreads n] keeps at most [n] idle workers and, from FUSE 3.12,
+    [`MaxThreads n] runs at most [n] of them. [check_options] rejects them
+    with older versions. *)
+let fuse_options options =
+  List.concat
+    (List.rev_map (function `Debug -> [ "-d" ]
+			  | `Foreground -> [ "-f" ]
+			  | `SingleThreaded -> [ "-s" ]
+			  | `CloneFd -> [ "-o" ; "clone_fd" ]
+			  | `MaxIdleThreads n -> [ "-o" ; Printf.sprintf "max_idle_threads=%d" n ]
+			  | `MaxThreads n -> [ "-o" ; Printf.sprintf "max_threads=%d" n ]
+			  | `EntryTimeout t -> [ "-o" ; Printf.sprintf "entry_timeout=%g" t ]
+			  | `AttrTimeout t -> [ "-o" ; Printf.sprintf "attr_timeout=%g" t ]
+			  | `NegativeTimeout t -> [ "-o" ; Printf.sprintf "negative_timeout=%g" t ]
+			  | `KernelCache -> [ "-o" ; "kernel_cache" ]
+			  | `AutoCache -> [ "-o" ; "auto_cache" ]
+			  | `Batched _ -> [])
+		  options)
+
+(** Low-level mounts served by this process. Their callbacks and session
+    are process-wide in the C layer, so there can be only one. *)
+let lowlevel_mounts = ref 0
+
+(** Raises Invalid_argument when [options] ask for a worker pool that the
+    FUSE version of the C layer doesn't have, or, with [lowlevel], when
+    this process already serves a low-level mount, before anything is
+    mounted or forked. The stubs build for FUSE 2.9 unless compiled with
+    -DFUSE_USE_VERSION=30 or later against libfuse 3. *)
+let check_options ?(lowlevel=false) options =
+  let require name minimum =
+    if version < minimum
+    then invalid_arg (Printf.sprintf "OCamlFuse: %s needs FUSE_USE_VERSION %d or later, \
+				      the C layer is built with %d" name minimum version)
   in
+  if lowlevel && !lowlevel_mounts > 0
+  then invalid_arg "OCamlFuse: a process serves a single low-level mount";
+  List.iter (function `CloneFd -> require "`CloneFd" 30
+		    | `MaxIdleThreads _ -> require "`MaxIdleThreads" 30
+		    | `MaxThreads _ -> require "`MaxThreads" 312
+		    | _ -> ())
+	    options
+
+(** Whether a [Dispatch] worker was started in this process. *)
+let dispatch_started = ref false
+
+(** Starts the [Dispatch] worker requested by [options], if any and if no
+    mount started one already: the worker serves every mount. *)
+let start_dispatch options =
+  List.iter (function `Batched batch when not !dispatch_started ->
+			dispatch_started := true;
+			ignore (Dispatch.start ~batch)
+		    | _ -> ())
+	    options
+
+(** Registers the operations of [filesystem] for the C layer, under names
+    starting with [prefix]. [start] does it before mounting, with a prefix
+    of its own for every mount; programs that call the operations without a
+    mount, such as benchmarks, do it alone, without a prefix. *)
+let register ?(debug=false) ?(prefix="") filesystem =
+  let filesystem = internal_of_filesystem ~debug filesystem in
+  let register name = Callback.register (prefix ^ name) in
+  register "ocamlfuse_access" filesystem.internal_access;
+  register "ocamlfuse_create" filesystem.internal_create;
+  register "ocamlfuse_mknod" filesystem.internal_mknod;
+  register "ocamlfuse_destroy" filesystem.internal_destroy;
+  register "ocamlfuse_flush" filesystem.internal_flush;
+  register "ocamlfuse_getattr"
+	   (let getattr = filesystem.internal_getattr in
+	    fun path -> let errcode, stat = getattr path in
+			errcode, internal_of_stat stat);
+  register "ocamlfuse_fgetattr"
+	   (let fgetattr = filesystem.internal_fgetattr in
+	    fun path handle -> let errcode, stat = fgetattr path handle in
+			       errcode, internal_of_stat stat);
+  register "ocamlfuse_getxattr" filesystem.internal_getxattr;
+  register "ocamlfuse_setxattr" filesystem.internal_setxattr;
+  register "ocamlfuse_init" filesystem.internal_init;
+  register "ocamlfuse_mkdir" filesystem.internal_mkdir;
+  register "ocamlfuse_open" filesystem.internal_fopen;
+  register "ocamlfuse_opendir" filesystem.internal_opendir;
+  register "ocamlfuse_read" filesystem.internal_read;
+  (match filesystem.internal_read_buffer with
+   | Some read_buffer -> register "ocamlfuse_read_buffer" read_buffer
+   | None -> ());
+  register "ocamlfuse_readdir" filesystem.internal_readdir;
+  register "ocamlfuse_rename" filesystem.internal_rename;
+  register "ocamlfuse_release" filesystem.internal_release;
+  register "ocamlfuse_releasedir" filesystem.internal_releasedir;
+  register "ocamlfuse_releasedir" filesystem.internal_releasedir;
+  register "ocamlfuse_rmdir" filesystem.internal_rmdir;
+  register "ocamlfuse_statfs" filesystem.internal_statfs;
+  register "ocamlfuse_sync" filesystem.internal_sync;
+  register "ocamlfuse_syncdir" filesystem.internal_syncdir;
+  register "ocamlfuse_truncate" filesystem.internal_truncate;
+  register "ocamlfuse_ftruncate" filesystem.internal_ftruncate;
+  register "ocamlfuse_unlink" filesystem.internal_unlink;
+  register "ocamlfuse_write" filesystem.internal_write;
+  (match filesystem.internal_write_buffer with
+   | Some write_buffer -> register "ocamlfuse_write_buffer" write_buffer
+   | None -> ())
+
+(** Mounts started so far in this process. *)
+let mounts = ref 0
+
+(** Mounts [filesystem] on [dir], and serves it until it is unmounted.
+    Mounts of other filesystems can be started from other threads, with
+    [`Foreground]: each has its own callbacks, and the [Dispatch] worker of
+    the first one that asks for it serves them all. Only the first one uses
+    the [AttrCache], which is keyed by path, and ends on SIGINT or SIGTERM,
+    which libfuse sends to a single session. *)
+let start dir options filesystem =
+  check_options options;
   let aux () =
-    let filesystem = internal_of_filesystem
-		       ~debug:(List.mem `Debug options)
-		       filesystem in
-    Callback.register "ocamlfuse_access" filesystem.internal_access;
-    Callback.register "ocamlfuse_create" filesystem.internal_create;
-    Callback.register "ocamlfuse_mknod" filesystem.internal_mknod;
-    Callback.register "ocamlfuse_destroy" filesystem.internal_destroy;
-    Callback.register "ocamlfuse_flush" filesystem.internal_flush;
-    Callback.register "ocamlfuse_getattr"
-		      (let getattr = filesystem.internal_getattr in
-		       fun path -> let errcode, stat = getattr path in
-				   errcode, internal_of_stat stat);
-    Callback.register "ocamlfuse_fgetattr"
-		      (let fgetattr = filesystem.internal_fgetattr in
-		       fun path handle -> let errcode, stat = fgetattr path handle in
-					  errcode, internal_of_stat stat);
-    Callback.register "ocamlfuse_getxattr" filesystem.internal_getxattr;
-    Callback.register "ocamlfuse_setxattr" filesystem.internal_setxattr;
-    Callback.register "ocamlfuse_init" filesystem.internal_init;
-    Callback.register "ocamlfuse_mkdir" filesystem.internal_mkdir;
-    Callback.register "ocamlfuse_open" filesystem.internal_fopen;
-    Callback.register "ocamlfuse_opendir" filesystem.internal_opendir;
-    Callback.register "ocamlfuse_read" filesystem.internal_read;
-    Callback.register "ocamlfuse_readdir" filesystem.internal_readdir;
-    Callback.register "ocamlfuse_rename" filesystem.internal_rename;
-    Callback.register "ocamlfuse_release" filesystem.internal_release;
-    Callback.register "ocamlfuse_releasedir" filesystem.internal_releasedir;
-    Callback.register "ocamlfuse_releasedir" filesystem.internal_releasedir;
-    Callback.register "ocamlfuse_rmdir" filesystem.internal_rmdir;
-    Callback.register "ocamlfuse_statfs" filesystem.internal_statfs;
-    Callback.register "ocamlfuse_sync" filesystem.internal_sync;
-    Callback.register "ocamlfuse_syncdir" filesystem.internal_syncdir;
-    Callback.register "ocamlfuse_truncate" filesystem.internal_truncate;
-    Callback.register "ocamlfuse_ftruncate" filesystem.internal_ftruncate;
-    Callback.register "ocamlfuse_unlink" filesystem.internal_unlink;
-    Callback.register "ocamlfuse_write" filesystem.internal_write;
-
-    let options = List.rev_map (function `Debug -> "-d"
-				       | `Foreground -> "-f"
-				       | `SingleThreaded -> "-s")
-			       options
-    in
-    ocamlfuse_start_impl (Array.of_list ([ "OCamlFuse" ; dir ] @ options))
-  in run aux
+    let first = !mounts = 0 in
+    let prefix = if first then "" else Printf.sprintf "%d:" !mounts in
+    incr mounts;
+    register ~debug:(List.mem `Debug options) ~prefix filesystem;
+    start_dispatch options;
+    ocamlfuse_start_impl prefix (Array.of_list ([ "OCamlFuse" ; dir ] @ fuse_options options))
+  in daemonize options aux
+
+(** Inode based filesystems, served through the FUSE low-level API.
+
+    Operations receive inode numbers instead of paths, so the filesystem
+    doesn't have to split and resolve a path on every call. The kernel
+    learns inode numbers through [lookup], [create] and [mkdir], and tells
+    the filesystem when it no longer references them through [forget]. *)
+module Lowlevel =
+  struct
+    type inode = int
+     and entry = {
+	 ino  : inode ; (* Inode number. *)
+	 attr : stat ;  (* Attributes of the inode. *)
+       }
+     and filesystem = {
+	 (* As the [init] of the path based API. *)
+	 init       : conn: conn -> conn ;
+	 destroy    : unit -> unit ;
+	 lookup     : parent: inode -> name: string -> entry ;
+	 forget     : ino: inode -> nlookup: int -> unit ;
+	 getattr    : ino: inode -> stat ;
+	 truncate   : ino: inode -> size: int -> stat ;
+	 access     : ino: inode -> mode: mode -> unit ;
+	 mkdir      : parent: inode -> name: string -> mode: mode -> entry ;
+	 mknod      : parent: inode -> name: string -> mode: mode -> entry ;
+	 create     : parent: inode -> name: string -> mode: mode ->
+		      entry * handle * open_option list ;
+	 unlink     : parent: inode -> name: string -> unit ;
+	 rmdir      : parent: inode -> name: string -> unit ;
+	 rename     : parent: inode -> name: string ->
+		      new_parent: inode -> new_name: string -> unit ;
+	 fopen      : ino: inode -> flags: openflags -> handle * open_option list ;
+	 read       : ino: inode -> handle: handle -> offset: int -> size: int -> string ;
+	 read_buffer : (ino: inode -> handle: handle -> offset: int -> buffer: buffer -> int) option ;
+	 write      : ino: inode -> handle: handle -> data: string -> offset: int -> int ;
+	 write_buffer : (ino: inode -> handle: handle -> source: write_source -> offset: int -> int) option ;
+	 flush      : ino: inode -> handle: handle -> unit ;
+	 release    : ino: inode -> handle: handle -> unit ;
+	 sync       : ino: inode -> handle: handle -> unit ;
+	 opendir    : ino: inode -> handle ;
+	 (* Lists a directory from a cookie, as the path based readdir.
+	    [add] takes the name, inode number and kind of an entry. *)
+	 readdir    : ino: inode -> handle: handle -> offset: int ->
+		      add: (name: string -> ino: inode -> kind: kind -> next: int -> bool) -> unit ;
+	 (* Variant of [readdir] that also gives the kernel the attributes
+	    of the entries, so that it doesn't look them up one by one. Each
+	    entry accepted by [add], except . and .., counts as a lookup of
+	    its inode. Only called with FUSE 3. *)
+	 readdirplus : (ino: inode -> handle: handle -> offset: int ->
+			add: (name: string -> entry: entry -> next: int -> bool) -> unit) option ;
+	 releasedir : ino: inode -> handle: handle -> unit ;
+	 syncdir    : ino: inode -> handle: handle -> unit ;
+	 statfs     : unit -> statfs ;
+	 getxattr   : ino: inode -> key: string -> string ;
+	 setxattr   : ino: inode -> key: string -> value: string -> unit ;
+       }
+
+     and entry_internal = inode * stat_internal
+
+     and filesystem_internal = {
+	 internal_init       : conn -> conn ;
+	 internal_destroy    : unit -> unit ;
+	 internal_lookup     : inode -> string -> errcode * entry_internal ;
+	 internal_forget     : inode -> int -> unit ;
+	 internal_getattr    : inode -> errcode * stat_internal ;
+	 internal_truncate   : inode -> int -> errcode * stat_internal ;
+	 internal_access     : inode -> mode -> errcode ;
+	 internal_mkdir      : inode -> string -> mode -> errcode * entry_internal ;
+	 internal_mknod      : inode -> string -> mode -> errcode * entry_internal ;
+	 internal_create     : inode -> string -> mode -> errcode * (entry_internal * handle * int) ;
+	 internal_unlink     : inode -> string -> errcode ;
+	 internal_rmdir      : inode -> string -> errcode ;
+	 internal_rename     : inode -> string -> inode -> string -> errcode ;
+	 internal_fopen      : inode -> openflags -> errcode * (handle * int) ;
+	 internal_read       : inode -> handle -> int -> int -> errcode * string ;
+	 internal_read_buffer : (inode -> handle -> int -> buffer -> errcode * int) option ;
+	 internal_write      : inode -> handle -> string -> int -> errcode * int ;
+	 internal_write_buffer : (inode -> handle -> write_source -> int -> errcode * int) option ;
+	 internal_flush      : inode -> handle -> errcode ;
+	 internal_release    : inode -> handle -> errcode ;
+	 internal_sync       : inode -> handle -> errcode ;
+	 internal_opendir    : inode -> errcode * handle ;
+	 internal_readdir    : inode -> handle -> int -> cursor -> errcode ;
+	 internal_readdirplus : (inode -> handle -> int -> cursor -> errcode) option ;
+	 internal_releasedir : inode -> handle -> errcode ;
+	 internal_syncdir    : inode -> handle -> errcode ;
+	 internal_statfs     : unit -> errcode * statfs ;
+	 internal_getxattr   : inode -> string -> errcode * string ;
+	 internal_setxattr   : inode -> string -> string -> errcode ;
+       }
+
+    (** Inode number of the root folder. *)
+    let root_ino = 1
+
+    let entry_error = 0, internal_of_stat getattr_error
+
+    let internal_of_entry { ino ; attr } = ino, internal_of_stat attr
+
+    external readdir_add_impl : cursor -> string -> inode -> mode -> int -> bool = "ocamlfuse_ll_readdir_add_impl"
+    external readdirplus_add_impl : cursor -> string -> entry_internal -> int -> bool = "ocamlfuse_ll_readdirplus_add_impl"
+
+    let readdir_add cursor ~name ~ino ~kind ~next =
+      readdir_add_impl cursor name ino
+		       (internal_of_stat { kind ; size = 0 ; time = 0 }).mode_internal
+		       next
+
+    let readdirplus_add cursor ~name ~entry ~next =
+      readdirplus_add_impl cursor name (internal_of_entry entry) next
+
+    let internal_of_filesystem ~debug fs =
+      let wrappers = make_wrappers ~debug in
+      let wrap0 f = wrappers.wrap0 f
+      and wrap1 f default_value = wrappers.wrap1 f default_value in
+      let entry f () = internal_of_entry (f ())
+      and attr f () = internal_of_stat (f ()) in
+      let internal_init conn = fs.init ~conn
+      and internal_destroy = fs.destroy
+      and internal_lookup parent name =
+	wrap1 (entry (fun () -> fs.lookup ~parent ~name)) entry_error
+      and internal_forget ino nlookup =
+	ignore (wrap0 (fun () -> fs.forget ~ino ~nlookup))
+      and internal_getattr ino =
+	wrap1 (attr (fun () -> fs.getattr ~ino)) (internal_of_stat getattr_error)
+      and internal_truncate ino size =
+	wrap1 (attr (fun () -> fs.truncate ~ino ~size)) (internal_of_stat getattr_error)
+      and internal_access ino mode = wrap0 (fun () -> fs.access ~ino ~mode)
+      and internal_mkdir parent name mode =
+	wrap1 (entry (fun () -> fs.mkdir ~parent ~name ~mode)) entry_error
+      and internal_mknod parent name mode =
+	wrap1 (entry (fun () -> fs.mknod ~parent ~name ~mode)) entry_error
+      and internal_create parent name mode =
+	wrap1 (fun () -> let entry, handle, options = fs.create ~parent ~name ~mode in
+			 internal_of_entry entry, handle, open_options_code options)
+	      (entry_error, null_handle, 0)
+      and internal_unlink parent name = wrap0 (fun () -> fs.unlink ~parent ~name)
+      and internal_rmdir parent name = wrap0 (fun () -> fs.rmdir ~parent ~name)
+      and internal_rename parent name new_parent new_name =
+	wrap0 (fun () -> fs.rename ~parent ~name ~new_parent ~new_name)
+      and internal_fopen ino flags =
+	wrap1 (fun () -> internal_of_opened (fs.fopen ~ino ~flags)) (null_handle, 0)
+      and internal_read ino handle offset size =
+	wrap1 (fun () -> fs.read ~ino ~handle ~offset ~size) ""
+      and internal_read_buffer =
+	match fs.read_buffer with
+	| None -> None
+	| Some read_buffer ->
+	   Some (fun ino handle offset buffer ->
+		 wrap1 (fun () -> read_buffer ~ino ~handle ~offset ~buffer) 0)
+      and internal_write ino handle data offset =
+	wrap1 (fun () -> fs.write ~ino ~handle ~data ~offset) 0
+      and internal_write_buffer =
+	match fs.write_buffer with
+	| None -> None
+	| Some write_buffer ->
+	   Some (fun ino handle source offset ->
+		 wrap1 (fun () -> write_buffer ~ino ~handle ~source ~offset) 0)
+      and internal_flush ino handle = wrap0 (fun () -> fs.flush ~ino ~handle)
+      and internal_release ino handle = wrap0 (fun () -> fs.release ~ino ~handle)
+      and internal_sync ino handle = wrap0 (fun () -> fs.sync ~ino ~handle)
+      and internal_opendir ino = wrap1 (fun () -> fs.opendir ~ino) null_handle
+      and internal_readdir ino handle offset cursor =
+	wrap0 (fun () -> fs.readdir ~ino ~handle ~offset ~add: (readdir_add cursor))
+      and internal_readdirplus =
+	match fs.readdirplus with
+	| None -> None
+	| Some readdirplus ->
+	   Some (fun ino handle offset cursor ->
+		 wrap0 (fun () -> readdirplus ~ino ~handle ~offset ~add: (readdirplus_add cursor)))
+      and internal_releasedir ino handle = wrap0 (fun () -> fs.releasedir ~ino ~handle)
+      and internal_syncdir ino handle = wrap0 (fun () -> fs.syncdir ~ino ~handle)
+      and internal_statfs () = wrap1 fs.statfs statfs_error
+      and internal_getxattr ino key =
+	if ino = root_ino && key = Stats.xattr
+	then ErrCode.ok, Stats.report ()
+	else wrap1 (fun () -> fs.getxattr ~ino ~key) ""
+      and internal_setxattr ino key value = wrap0 (fun () -> fs.setxattr ~ino ~key ~value)
+      in { internal_init ;
+	   internal_destroy ;
+	   internal_lookup ;
+	   internal_forget ;
+	   internal_getattr ;
+	   internal_truncate ;
+	   internal_access ;
+	   internal_mkdir ;
+	   internal_mknod ;
+	   internal_create ;
+	   internal_unlink ;
+	   internal_rmdir ;
+	   internal_rename ;
+	   internal_fopen ;
+	   internal_read ;
+	   internal_read_buffer ;
+	   internal_write ;
+	   internal_write_buffer ;
+	   internal_flush ;
+	   internal_release ;
+	   internal_sync ;
+	   internal_opendir ;
+	   internal_readdir ;
+	   internal_readdirplus ;
+	   internal_releasedir ;
+	   internal_syncdir ;
+	   internal_statfs ;
+	   internal_getxattr ;
+	   internal_setxattr }
+
+    (** Kernel cache settings of a mount: its entry, attribute and
+        negative timeouts, and whether files keep their cached data when
+        they are opened again. *)
+    type cache = float * float * float * bool
+
+    external ocamlfuse_lowlevel_start_impl : string array -> cache -> unit = "ocamlfuse_lowlevel_start_impl"
+
+    (** Pushes cache invalidations to the kernel, for changes that don't
+        come through the mount, such as those of a remote peer. They fail
+        with [ENOTCONN] when no session is running. *)
+    module Notify =
+      struct
+	external inval_inode_impl : inode -> int -> int -> errcode = "ocamlfuse_ll_notify_inval_inode_impl"
+	external inval_entry_impl : inode -> string -> errcode = "ocamlfuse_ll_notify_inval_entry_impl"
+	external store_impl : inode -> int -> string -> errcode = "ocamlfuse_ll_notify_store_impl"
+
+	let check code =
+	  if code <> ErrCode.ok
+	  then ErrCode.throw (ErrCode.from_errcode code)
+
+	(** Drops the attributes of [ino], and its cached data from [offset]
+	    on, for [length] bytes or to the end if [length] is 0. A negative
+	    [offset] only drops the attributes. *)
+	let inval_inode ~ino ~offset ~length =
+	  check (inval_inode_impl ino offset length)
+
+	(** Drops the name [name] in the directory [parent]. *)
+	let inval_entry ~parent ~name =
+	  check (inval_entry_impl parent name)
+
+	(** Replaces the cached data of [ino] at [offset] by [data]. *)
+	let store ~ino ~offset ~data =
+	  check (store_impl ino offset data)
+      end
+
+    (** Removes the cache options, which the low-level API doesn't parse,
+        from [options], and returns them, for the session of the mount,
+        with the other options. [`AutoCache] can't watch modification
+        times here, so it keeps the cache like [`KernelCache]: changes must
+        be pushed through [Notify]. *)
+    let configure options =
+      let entry_timeout = ref 1. and attr_timeout = ref 1.
+      and negative_timeout = ref 0. and keep_cache = ref false in
+      let options =
+	List.filter (function `EntryTimeout t -> entry_timeout := t; false
+			    | `AttrTimeout t -> attr_timeout := t; false
+			    | `NegativeTimeout t -> negative_timeout := t; false
+			    | `KernelCache | `AutoCache -> keep_cache := true; false
+			    | _ -> true)
+		    options in
+      (!entry_timeout, !attr_timeout, !negative_timeout, !keep_cache), options
+
+    (** Mounts [filesystem] on [dir], and serves it until it is unmounted.
+        Raises Invalid_argument if this process already serves a low-level
+        mount. *)
+    let start dir options filesystem =
+      check_options ~lowlevel: true options;
+      let aux () =
+	incr lowlevel_mounts;
+	let filesystem = internal_of_filesystem
+			   ~debug:(List.mem `Debug options)
+			   filesystem in
+	let cache, options = configure options in
+	Callback.register "ocamlfuse_ll_init" filesystem.internal_init;
+	Callback.register "ocamlfuse_ll_destroy" filesystem.internal_destroy;
+	Callback.register "ocamlfuse_ll_lookup" filesystem.internal_lookup;
+	Callback.register "ocamlfuse_ll_forget" filesystem.internal_forget;
+	Callback.register "ocamlfuse_ll_getattr" filesystem.internal_getattr;
+	Callback.register "ocamlfuse_ll_truncate" filesystem.internal_truncate;
+	Callback.register "ocamlfuse_ll_access" filesystem.internal_access;
+	Callback.register "ocamlfuse_ll_mkdir" filesystem.internal_mkdir;
+	Callback.register "ocamlfuse_ll_mknod" filesystem.internal_mknod;
+	Callback.register "ocamlfuse_ll_create" filesystem.internal_create;
+	Callback.register "ocamlfuse_ll_unlink" filesystem.internal_unlink;
+	Callback.register "ocamlfuse_ll_rmdir" filesystem.internal_rmdir;
+	Callback.register "ocamlfuse_ll_rename" filesystem.internal_rename;
+	Callback.register "ocamlfuse_ll_open" filesystem.internal_fopen;
+	Callback.register "ocamlfuse_ll_read" filesystem.internal_read;
+	(match filesystem.internal_read_buffer with
+	 | Some read_buffer -> Callback.register "ocamlfuse_ll_read_buffer" read_buffer
+	 | None -> ());
+	Callback.register "ocamlfuse_ll_write" filesystem.internal_write;
+	(match filesystem.internal_write_buffer with
+	 | Some write_buffer -> Callback.register "ocamlfuse_ll_write_buffer" write_buffer
+	 | None -> ());
+	Callback.register "ocamlfuse_ll_flush" filesystem.internal_flush;
+	Callback.register "ocamlfuse_ll_release" filesystem.internal_release;
+	Callback.register "ocamlfuse_ll_sync" filesystem.internal_sync;
+	Callback.register "ocamlfuse_ll_opendir" filesystem.internal_opendir;
+	Callback.register "ocamlfuse_ll_readdir" filesystem.internal_readdir;
+	(match filesystem.internal_readdirplus with
+	 | Some readdirplus -> Callback.register "ocamlfuse_ll_readdirplus" readdirplus
+	 | None -> ());
+	Callback.register "ocamlfuse_ll_releasedir" filesystem.internal_releasedir;
+	Callback.register "ocamlfuse_ll_syncdir" filesystem.internal_syncdir;
+	Callback.register "ocamlfuse_ll_statfs" filesystem.internal_statfs;
+	Callback.register "ocamlfuse_ll_getxattr" filesystem.internal_getxattr;
+	Callback.register "ocamlfuse_ll_setxattr" filesystem.internal_setxattr;
+
+	start_dispatch options;
+	ocamlfuse_lowlevel_start_impl
+	  (Array.of_list ([ "OCamlFuse" ; dir ] @ fuse_options options))
+	  cache
+      in daemonize options aux
+
+    (** Inode based filesystems whose handlers return promises.
+
+        FUSE threads don't wait for the handlers: they queue their requests
+        for the thread running [start], which answers each of them when its
+        promise resolves. A slow handler only delays its own request, and
+        any number of requests can be pending at once. Handlers run on the
+        Lwt thread, so they aren't serialized by a mutex: they interleave
+        at their blocking points. *)
+    module Async =
+      struct
+	type filesystem = {
+	    (* As the [init] of the synchronous API, on a FUSE thread when
+	       the session starts, so it doesn't return a promise. *)
+	    negotiate  : conn: conn -> conn ;
+	    init       : unit -> unit Lwt.t ;
+	    destroy    : unit -> unit Lwt.t ;
+	    lookup     : parent: inode -> name: string -> entry Lwt.t ;
+	    forget     : ino: inode -> nlookup: int -> unit Lwt.t ;
+	    getattr    : ino: inode -> stat Lwt.t ;
+	    truncate   : ino: inode -> size: int -> stat Lwt.t ;
+	    access     : ino: inode -> mode: mode -> unit Lwt.t ;
+	    mkdir      : parent: inode -> name: string -> mode: mode -> entry Lwt.t ;
+	    mknod      : parent: inode -> name: string -> mode: mode -> entry Lwt.t ;
+	    create     : parent: inode -> name: string -> mode: mode ->
+			 (entry * handle * open_option list) Lwt.t ;
+	    unlink     : parent: inode -> name: string -> unit Lwt.t ;
+	    rmdir      : parent: inode -> name: string -> unit Lwt.t ;
+	    rename     : parent: inode -> name: string ->
+			 new_parent: inode -> new_name: string -> unit Lwt.t ;
+	    fopen      : ino: inode -> flags: openflags -> (handle * open_option list) Lwt.t ;
+	    read       : ino: inode -> handle: handle -> offset: int -> size: int -> string Lwt.t ;
+	    write      : ino: inode -> handle: handle -> data: string -> offset: int -> int Lwt.t ;
+	    flush      : ino: inode -> handle: handle -> unit Lwt.t ;
+	    release    : ino: inode -> handle: handle -> unit Lwt.t ;
+	    sync       : ino: inode -> handle: handle -> unit Lwt.t ;
+	    opendir    : ino: inode -> handle Lwt.t ;
+	    (* As the synchronous [readdir]: the entries accepted by [add]
+	       are sent once the promise resolves. *)
+	    readdir    : ino: inode -> handle: handle -> offset: int ->
+			 add: (name: string -> ino: inode -> kind: kind -> next: int -> bool) ->
+			 unit Lwt.t ;
+	    releasedir : ino: inode -> handle: handle -> unit Lwt.t ;
+	    syncdir    : ino: inode -> handle: handle -> unit Lwt.t ;
+	    statfs     : unit -> statfs Lwt.t ;
+	    getxattr   : ino: inode -> key: string -> string Lwt.t ;
+	    setxattr   : ino: inode -> key: string -> value: string -> unit Lwt.t ;
+	  }
+
+	(* A request waiting for its reply, owned by the C side until one of
+	   the reply functions frees it. *)
+	type request = int
+
+	external reply_err_impl : request -> errcode -> unit = "ocamlfuse_ll_async_reply_err_impl"
+	external reply_entry_impl : request -> errcode -> entry_internal -> unit = "ocamlfuse_ll_async_reply_entry_impl"
+	external reply_create_impl : request -> errcode -> entry_internal -> handle -> int -> unit = "ocamlfuse_ll_async_reply_create_impl"
+	external reply_attr_impl : request -> errcode -> stat_internal -> unit = "ocamlfuse_ll_async_reply_attr_impl"
+	external reply_open_impl : request -> errcode -> handle -> int -> unit = "ocamlfuse_ll_async_reply_open_impl"
+	external reply_data_impl : request -> errcode -> string -> unit = "ocamlfuse_ll_async_reply_data_impl"
+	external reply_xattr_impl : request -> errcode -> string -> unit = "ocamlfuse_ll_async_reply_xattr_impl"
+	external reply_write_impl : request -> errcode -> int -> unit = "ocamlfuse_ll_async_reply_write_impl"
+	external reply_statfs_impl : request -> errcode -> statfs -> unit = "ocamlfuse_ll_async_reply_statfs_impl"
+	external cursor_impl : request -> cursor = "ocamlfuse_ll_async_cursor_impl"
+	external reply_readdir_impl : request -> cursor -> errcode -> unit = "ocamlfuse_ll_async_reply_readdir_impl"
+	external ocamlfuse_lowlevel_async_start_impl : string array -> cache -> unit = "ocamlfuse_lowlevel_async_start_impl"
+	external abandoned_request_impl : unit -> request = "ocamlfuse_ll_async_abandoned_request_impl"
+	external outstanding_impl : unit -> int = "ocamlfuse_ll_async_outstanding_impl"
+
+	(* Late replies to requests the end of a session answered: each only
+	   claims its request and frees it. *)
+	let () =
+	  assert begin
+	      let outstanding = outstanding_impl () in
+	      reply_err_impl (abandoned_request_impl ()) ErrCode.eio;
+	      reply_data_impl (abandoned_request_impl ()) ErrCode.ok "data";
+	      reply_write_impl (abandoned_request_impl ()) ErrCode.ok 4;
+	      let request = abandoned_request_impl () in
+	      reply_readdir_impl request (cursor_impl request) ErrCode.ok;
+	      outstanding_impl () = outstanding
+	    end
+
+	(* Jobs queued by FUSE threads, and the notification that has the Lwt
+	   thread start them. *)
+	let jobs = Queue.create ()
+	and jobs_mutex = Mutex.create ()
+	and notification = ref (-1)
+
+	let start_jobs () =
+	  let started = Queue.create () in
+	  Mutex.lock jobs_mutex;
+	  Queue.transfer jobs started;
+	  Mutex.unlock jobs_mutex;
+	  Queue.iter Lwt.async started
+
+	(** Queues [f] for the Lwt thread, and passes its result to [reply]
+	    with [ErrCode.ok], or [default] with the error code of its
+	    exception. Other exceptions are logged, as those of
+	    [AsyncUtils.async], and answered with [ErrCode.eio]. Called on
+	    FUSE threads. *)
+	let submit reply f default =
+	  let job () =
+	    Lwt.map
+	      (fun (errcode, result) -> reply errcode result)
+	      (Lwt.catch
+		 (fun () -> Lwt.map (fun result -> ErrCode.ok, result) (f ()))
+		 (function
+		   | ErrCode.Error error -> Lwt.return (ErrCode.to_errcode error, default)
+		   | exn -> Lwt.map (fun () -> ErrCode.eio, default)
+				    (Lwt_io.eprintlf "Failure in FUSE request: %s"
+						     (Printexc.to_string exn))))
+	  in
+	  Mutex.lock jobs_mutex;
+	  Queue.push job jobs;
+	  Mutex.unlock jobs_mutex;
+	  Lwt_unix.send_notification !notification
+
+	let register fs =
+	  let reply_unit request errcode () = reply_err_impl request errcode
+	  and entry promise = Lwt.map internal_of_entry promise
+	  and attr promise = Lwt.map internal_of_stat promise in
+	  Callback.register "ocamlfuse_ll_init" (fun conn -> fs.negotiate ~conn);
+	  Callback.register "ocamlfuse_ll_lookup"
+			    (fun request parent name ->
+			     submit (reply_entry_impl request)
+				    (fun () -> entry (fs.lookup ~parent ~name)) entry_error);
+	  Callback.register "ocamlfuse_ll_forget"
+			    (fun ino nlookup ->
+			     submit (fun _ () -> ()) (fun () -> fs.forget ~ino ~nlookup) ());
+	  Callback.register "ocamlfuse_ll_getattr"
+			    (fun request ino ->
+			     submit (reply_attr_impl request)
+				    (fun () -> attr (fs.getattr ~ino))
+				    (internal_of_stat getattr_error));
+	  Callback.register "ocamlfuse_ll_truncate"
+			    (fun request ino size ->
+			     submit (reply_attr_impl request)
+				    (fun () -> attr (fs.truncate ~ino ~size))
+				    (internal_of_stat getattr_error));
+	  Callback.register "ocamlfuse_ll_access"
+			    (fun request ino mode ->
+			     submit (reply_unit request) (fun () -> fs.access ~ino ~mode) ());
+	  Callback.register "ocamlfuse_ll_mkdir"
+			    (fun request parent name mode ->
+			     submit (reply_entry_impl request)
+				    (fun () -> entry (fs.mkdir ~parent ~name ~mode)) entry_error);
+	  Callback.register "ocamlfuse_ll_mknod"
+			    (fun request parent name mode ->
+			     submit (reply_entry_impl request)
+				    (fun () -> entry (fs.mknod ~parent ~name ~mode)) entry_error);
+	  Callback.register "ocamlfuse_ll_create"
+			    (fun request parent name mode ->
+			     submit (fun errcode (entry, handle, options) ->
+				     reply_create_impl request errcode entry handle options)
+				    (fun () -> Lwt.map (fun (entry, handle, options) ->
+							internal_of_entry entry, handle,
+							open_options_code options)
+						       (fs.create ~parent ~name ~mode))
+				    (entry_error, null_handle, 0));
+	  Callback.register "ocamlfuse_ll_unlink"
+			    (fun request parent name ->
+			     submit (reply_unit request) (fun () -> fs.unlink ~parent ~name) ());
+	  Callback.register "ocamlfuse_ll_rmdir"
+			    (fun request parent name ->
+			     submit (reply_unit request) (fun () -> fs.rmdir ~parent ~name) ());
+	  Callback.register "ocamlfuse_ll_rename"
+			    (fun request parent name new_parent new_name ->
+			     submit (reply_unit request)
+				    (fun () -> fs.rename ~parent ~name ~new_parent ~new_name) ());
+	  Callback.register "ocamlfuse_ll_open"
+			    (fun request ino flags ->
+			     submit (fun errcode (handle, options) ->
+				     reply_open_impl request errcode handle options)
+				    (fun () -> Lwt.map internal_of_opened (fs.fopen ~ino ~flags))
+				    (null_handle, 0));
+	  Callback.register "ocamlfuse_ll_read"
+			    (fun request ino handle offset size ->
+			     submit (reply_data_impl request)
+				    (fun () -> fs.read ~ino ~handle ~offset ~size) "");
+	  Callback.register "ocamlfuse_ll_write"
+			    (fun request ino handle data offset ->
+			     submit (reply_write_impl request)
+				    (fun () -> fs.write ~ino ~handle ~data ~offset) 0);
+	  Callback.register "ocamlfuse_ll_flush"
+			    (fun request ino handle ->
+			     submit (reply_unit request) (fun () -> fs.flush ~ino ~handle) ());
+	  Callback.register "ocamlfuse_ll_release"
+			    (fun request ino handle ->
+			     submit (reply_unit request) (fun () -> fs.release ~ino ~handle) ());
+	  Callback.register "ocamlfuse_ll_sync"
+			    (fun request ino handle ->
+			     submit (reply_unit request) (fun () -> fs.sync ~ino ~handle) ());
+	  Callback.register "ocamlfuse_ll_opendir"
+			    (fun request ino ->
+			     submit (fun errcode handle -> reply_open_impl request errcode handle 0)
+				    (fun () -> fs.opendir ~ino) null_handle);
+	  Callback.register "ocamlfuse_ll_readdir"
+			    (fun request ino handle offset ->
+			     let cursor = cursor_impl request in
+			     submit (fun errcode () -> reply_readdir_impl request cursor errcode)
+				    (fun () -> fs.readdir ~ino ~handle ~offset ~add: (readdir_add cursor)) ());
+	  Callback.register "ocamlfuse_ll_releasedir"
+			    (fun request ino handle ->
+			     submit (reply_unit request) (fun () -> fs.releasedir ~ino ~handle) ());
+	  Callback.register "ocamlfuse_ll_syncdir"
+			    (fun request ino handle ->
+			     submit (reply_unit request) (fun () -> fs.syncdir ~ino ~handle) ());
+	  Callback.register "ocamlfuse_ll_statfs"
+			    (fun request ->
+			     submit (reply_statfs_impl request) fs.statfs statfs_error);
+	  Callback.register "ocamlfuse_ll_getxattr"
+			    (fun request ino key ->
+			     submit (reply_xattr_impl request)
+				    (fun () -> if ino = root_ino && key = Stats.xattr
+					       then Lwt.return (Stats.report ())
+					       else fs.getxattr ~ino ~key) "");
+	  Callback.register "ocamlfuse_ll_setxattr"
+			    (fun request ino key value ->
+			     submit (reply_unit request) (fun () -> fs.setxattr ~ino ~key ~value) ())
+
+	(** Mounts [filesystem] on [dir], and serves it on the calling thread
+	    with [Lwt_main.run] until it is unmounted. The FUSE session runs on
+	    a [Lwt_preemptive] thread. Raises Invalid_argument if this process
+	    already serves a low-level mount. *)
+	let start dir options filesystem =
+	  check_options ~lowlevel: true options;
+	  let aux () =
+	    incr lowlevel_mounts;
+	    let cache, options = configure options in
+	    register filesystem;
+	    start_dispatch options;
+	    let argv = Array.of_list ([ "OCamlFuse" ; dir ] @ fuse_options options) in
+	    Lwt_main.run
+	      (notification := Lwt_unix.make_notification start_jobs;
+	       Lwt.bind (filesystem.init ()) begin fun () ->
+	       Lwt.bind (Lwt_preemptive.detach (ocamlfuse_lowlevel_async_start_impl argv) cache) begin fun () ->
+	       Lwt_unix.stop_notification !notification;
+	       filesystem.destroy ()
+	       end end)
+	  in daemonize options aux
+      end
+  end
@@ -1,4 +1,6 @@
-#define FUSE_USE_VERSION 26
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 29
+#endif
 
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
@@ -7,65 +9,272 @@
 #include <caml/callback.h>
 #include <caml/custom.h>
 #include <caml/threads.h>
+#include <caml/bigarray.h>
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <memory.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 
-static value* ocamlfuse_access_callback;
-static value* ocamlfuse_create_callback;
-static value* ocamlfuse_mknod_callback;
-static value* ocamlfuse_destroy_callback;
-static value* ocamlfuse_flush_callback;
-static value* ocamlfuse_getattr_callback;
-static value* ocamlfuse_fgetattr_callback;
-static value* ocamlfuse_getxattr_callback;
-static value* ocamlfuse_setxattr_callback;
-static value* ocamlfuse_init_callback;
-static value* ocamlfuse_mkdir_callback;
-static value* ocamlfuse_open_callback;
-static value* ocamlfuse_opendir_callback;
-static value* ocamlfuse_read_callback;
-static value* ocamlfuse_readdir_callback;
-static value* ocamlfuse_rename_callback;
-static value* ocamlfuse_release_callback;
-static value* ocamlfuse_releasedir_callback;
-static value* ocamlfuse_rmdir_callback;
-static value* ocamlfuse_statfs_callback;
-static value* ocamlfuse_sync_callback;
-static value* ocamlfuse_syncdir_callback;
-static value* ocamlfuse_truncate_callback;
-static value* ocamlfuse_ftruncate_callback;
-static value* ocamlfuse_unlink_callback;
-static value* ocamlfuse_write_callback;
-
-#define OCAMLFUSE_DEBUG(args...) fprintf (stderr, args)
-// #define OCAMLFUSE_DEBUG(args...) /* args */
+#include "AttrCacheImpl.h"
+#include "DispatchImpl.h"
+#include "OCamlFuseImpl.h"
+#include "ReadAheadImpl.h"
+#include "StatsImpl.h"
+#include "TraceImpl.h"
+
+/* Callbacks of a mount of the path based API, registered by
+ * OCamlFuse.register under a prefix of its own, so that mounts of different
+ * filesystems can run in one process. */
+struct ocamlfuse_mount {
+  value* access;
+  value* create;
+  value* mknod;
+  value* destroy;
+  value* flush;
+  value* getattr;
+  value* fgetattr;
+  value* getxattr;
+  value* setxattr;
+  value* init;
+  value* mkdir;
+  value* open;
+  value* opendir;
+  value* read;
+  value* read_buffer;
+  value* readdir;
+  value* rename;
+  value* release;
+  value* releasedir;
+  value* rmdir;
+  value* statfs;
+  value* sync;
+  value* syncdir;
+  value* truncate;
+  value* ftruncate;
+  value* unlink;
+  value* write;
+  value* write_buffer;
+  /* Whether the mount uses the attribute cache, which is keyed by path and
+   * so can only serve one of them. */
+  int cached;
+  /* Kernel cache settings of a low-level mount, which libfuse doesn't
+   * parse from its options. A negative timeout of 0 disables negative
+   * lookup caching. */
+  double entry_timeout;
+  double attr_timeout;
+  double negative_timeout;
+  int keep_cache;
+  struct fuse_operations operations;
+};
+
+/* Mount of the callbacks registered without a prefix, for programs that
+ * call the operations without mounting. */
+static struct ocamlfuse_mount ocamlfuse_default_mount;
+
+/* Sessions running, whose operations find their mount in the context. */
+static int ocamlfuse_sessions = 0;
+
+/* Returns the mount of the current operation. */
+static struct ocamlfuse_mount* ocamlfuse_mount(void)
+{
+  if (!__atomic_load_n(&ocamlfuse_sessions, __ATOMIC_ACQUIRE)) {
+    return &ocamlfuse_default_mount;
+  }
+  return fuse_get_context()->private_data;
+}
+
+/* Calls into OCaml go through ocamlfuse_dispatch, which may run them on
+ * another thread: an operation describes its call in a struct, and reads
+ * the results from it once the call returns. */
+
+/* An argument of a callback. data, when not NULL, is copied into an OCaml
+ * string of number bytes; otherwise number is passed as an int. */
+struct ocamlfuse_arg {
+  const char* data;
+  long number;
+};
+
+#define OCAMLFUSE_INT(n) { NULL, (n) }
+#define OCAMLFUSE_DATA(data, size) { (data), (size) }
+#define OCAMLFUSE_STRING(s) { (s), strlen(s) }
+
+#define OCAMLFUSE_MAX_ARGS 5
+
+/* Must be called with the runtime lock held. */
+static value ocamlfuse_arg_value(const struct ocamlfuse_arg* arg)
+{
+  if (arg->data == NULL) {
+    return Val_long(arg->number);
+  }
+  value data = caml_alloc_string(arg->number);
+  memcpy((char*) String_val(data), arg->data, arg->number);
+  return data;
+}
+
+/* A callback that returns an errcode, or an errcode * result. */
+struct ocamlfuse_call {
+  value* callback;
+  int argc;
+  struct ocamlfuse_arg args[OCAMLFUSE_MAX_ARGS];
+  /* Copies the result of a successful call, while it is live, into out,
+   * which holds size bytes. Without it, an int result goes to result. */
+  void (*extract)(struct ocamlfuse_call* call, value data);
+  void* out;
+  long size;
+  int result_code;
+  long result;
+};
+
+static void ocamlfuse_run_call(void* data)
+{
+  CAMLparam0();
+  CAMLlocalN(args, OCAMLFUSE_MAX_ARGS);
+  CAMLlocal1(result);
+  struct ocamlfuse_call* call = data;
+  for (int i = 0; i < call->argc; i++) {
+    args[i] = ocamlfuse_arg_value(&call->args[i]);
+  }
+  result = caml_callbackN(*call->callback, call->argc, args);
+  if (Is_long(result)) {
+    call->result_code = Int_val(result);
+  } else {
+    call->result_code = Int_val(Field(result, 0));
+    if (!call->result_code) {
+      if (call->extract) {
+	call->extract(call, Field(result, 1));
+      } else {
+	call->result = Long_val(Field(result, 1));
+      }
+    }
+  }
+  CAMLreturn0;
+}
+
+/* Runs a call, and returns its error code. */
+static int ocamlfuse_invoke(struct ocamlfuse_call* call)
+{
+  ocamlfuse_dispatch(ocamlfuse_run_call, call);
+  return call->result_code;
+}
+
+/* Fills stbuf from an OCaml stat_internal. */
+static void ocamlfuse_fill_stat(value stat, struct stat* stbuf)
+{
+  long time = Long_val(Field(stat, 2));
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_mode = Int_val(Field(stat, 0));
+  stbuf->st_size = Long_val(Field(stat, 1));
+  stbuf->st_mtime = time;
+  stbuf->st_atime = time;
+  stbuf->st_ctime = time;
+  stbuf->st_nlink = 1;
+}
+
+static void ocamlfuse_extract_stat(struct ocamlfuse_call* call, value stat)
+{
+  ocamlfuse_fill_stat(stat, call->out);
+}
+
+static void ocamlfuse_extract_statfs(struct ocamlfuse_call* call, value statfs)
+{
+  struct statvfs* statfsbuf = call->out;
+  statfsbuf->f_bsize = Long_val(Field(statfs, 0));
+  statfsbuf->f_blocks = Long_val(Field(statfs, 1));
+  statfsbuf->f_bfree = Long_val(Field(statfs, 2));
+  statfsbuf->f_bavail = Long_val(Field(statfs, 3));
+  statfsbuf->f_files = Long_val(Field(statfs, 4));
+  statfsbuf->f_ffree = Long_val(Field(statfs, 5));
+  statfsbuf->f_namemax = Long_val(Field(statfs, 6));
+}
+
+/* Copies as much of a string result as fits, and sets result to its full
+ * length. */
+static void ocamlfuse_extract_data(struct ocamlfuse_call* call, value data)
+{
+  long length = caml_string_length(data);
+  memcpy(call->out, String_val(data), length < call->size ? length : call->size);
+  call->result = length;
+}
+
+/* Bits of the options returned with a handle by open and create, in the
+ * order of OCamlFuse.open_option. */
+#define OCAMLFUSE_DIRECT_IO 1
+#define OCAMLFUSE_KEEP_CACHE 2
+#define OCAMLFUSE_NONSEEKABLE 4
+#define OCAMLFUSE_PARALLEL_DIRECT_WRITES 8
+
+/* Sets the flags of fi asked for by options, leaving the others as they
+ * are, e.g. keep_cache from the mount options. */
+static void ocamlfuse_apply_options(struct fuse_file_info* fi, int options)
+{
+  if (options & OCAMLFUSE_DIRECT_IO) {
+    fi->direct_io = 1;
+  }
+  if (options & OCAMLFUSE_KEEP_CACHE) {
+    fi->keep_cache = 1;
+  }
+  if (options & OCAMLFUSE_NONSEEKABLE) {
+    fi->nonseekable = 1;
+  }
+#if FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 15)
+  if (options & OCAMLFUSE_PARALLEL_DIRECT_WRITES) {
+    fi->parallel_direct_writes = 1;
+  }
+#endif
+}
+
+/* Sets result to the handle of an opened file, and applies its options to
+ * out, the fuse_file_info of the open. */
+static void ocamlfuse_extract_opened(struct ocamlfuse_call* call, value opened)
+{
+  call->result = Long_val(Field(opened, 0));
+  ocamlfuse_apply_options(call->out, Int_val(Field(opened, 1)));
+}
 
 static int ocamlfuse_access(const char* path, int mode)
 {
-  OCAMLFUSE_DEBUG("C: ACCESS path=%s mode=%d\n", path, mode);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_access_callback,
-		   caml_copy_string(path),
-		   Val_int(mode));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: ACCESS SUCCESS path=%s mode=%d result=%d\n", path, mode, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_ACCESS, 0, 0, 0);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  int cached = mount->cached ? ocamlfuse_attr_cache_access(path, mode) : 1;
+  if (cached <= 0) {
+    OCAMLFUSE_TRACE_RESULT(cached);
+    return cached;
+  }
+  uint64_t generation = ocamlfuse_attr_cache_generation(path);
+  struct ocamlfuse_call call = {
+    .callback = mount->access, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(mode) } };
+  int result_code = ocamlfuse_invoke(&call);
+  if (!result_code && mount->cached) {
+    ocamlfuse_attr_cache_grant(path, generation, mode);
+  }
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_chmod(const char* path, mode_t mode, struct fuse_file_info* fi)
+#else
 static int ocamlfuse_chmod(const char* path, mode_t mode)
+#endif
 {
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_CHMOD, 0, 0, 0);
   return 0;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi)
+#else
 static int ocamlfuse_chown(const char* path, uid_t uid, gid_t gid)
+#endif
 {
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_CHOWN, 0, 0, 0);
   return 0;
 }
 
@@ -73,392 +282,543 @@ static int ocamlfuse_create(const char* path,
 			    mode_t mode,
 			    struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: CREATE path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_create_callback,
-		   caml_copy_string(path),
-		   Val_int(mode));
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: CREATE FAIL path=%s, result=%d\n", path, result_code);
-    return -result_code;
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_CREATE, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->create, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(mode) },
+    .extract = ocamlfuse_extract_opened, .out = fi };
+  int result_code = ocamlfuse_invoke(&call);
+  if (!result_code) {
+    fi->fh = call.result;
   }
-  long handle = Long_val(Field(result, 1));
-  caml_release_runtime_system();
-  fi->fh = handle;
-  OCAMLFUSE_DEBUG("C: CREATE SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_mknod(const char* path,
 			   mode_t mode, dev_t dev)
 {
-  OCAMLFUSE_DEBUG("C: MKNOD path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback(*ocamlfuse_mknod_callback,
-		  caml_copy_string(path));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: MKNOD SUCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_MKNOD, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->mknod, .argc = 1,
+    .args = { OCAMLFUSE_STRING(path) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static void ocamlfuse_destroy(void* data)
 {
-  OCAMLFUSE_DEBUG("C: DESTROY\n");
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  caml_callback(*ocamlfuse_destroy_callback, Val_unit);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: DESTROY SUCESS\n");
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_DESTROY, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->destroy, .argc = 1,
+    .args = { OCAMLFUSE_INT(0) } };
+  ocamlfuse_invoke(&call);
 }
 
 static int ocamlfuse_flush(const char* path, struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: FLUSH path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_flush_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: FLUSH SUCCESS path=%s, result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FLUSH, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->flush, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
+  return -result_code;
+}
+
+/* The handle may belong to a file unlinked, or replaced, since it was
+ * opened, so fgetattr neither reads nor fills the path-keyed cache. */
+static int ocamlfuse_fgetattr(const char* path, struct stat* stbuf,
+			      struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FGETATTR, fi->fh, 0, 0);
+  memset(stbuf, 0, sizeof(struct stat));
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->fgetattr, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh) },
+    .extract = ocamlfuse_extract_stat, .out = stbuf };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
+/* FUSE 3 merges fgetattr into getattr, which gets fi for an open file.
+ * getattr is answered from the cache of the mount, or through the
+ * filesystem, whose result is cached. */
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_getattr(const char* path, struct stat* stbuf,
+			     struct fuse_file_info* fi)
+{
+  if (fi != NULL) {
+    return ocamlfuse_fgetattr(path, stbuf, fi);
+  }
+#else
 static int ocamlfuse_getattr(const char* path, struct stat* stbuf)
 {
-  OCAMLFUSE_DEBUG("C: GETATTR path=%s\n", path);
+#endif
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_GETATTR, 0, 0, 0);
   memset(stbuf, 0, sizeof(struct stat));
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback(*ocamlfuse_getattr_callback,
-		  caml_copy_string(path));
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: GETATTR FAIL path=%s, result=%d\n", path, result_code);
-    return -result_code;
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  int cached = mount->cached ? ocamlfuse_attr_cache_getattr(path, stbuf) : 0;
+  if (cached) {
+    OCAMLFUSE_TRACE_RESULT(cached < 0 ? cached : 0);
+    return cached < 0 ? cached : 0;
   }
-  value result_stat = Field(result, 1);
-  int mode = Int_val(Field(result_stat, 0));
-  long size = Long_val(Field(result_stat, 1));
-  long time = Long_val(Field(result_stat, 2));
-  caml_release_runtime_system();
-
-  stbuf->st_mode = mode;
-  stbuf->st_size = size;
-  stbuf->st_mtime = time;
-  stbuf->st_atime = time;
-  stbuf->st_ctime = time;
-  stbuf->st_nlink = 1;
-  OCAMLFUSE_DEBUG("C: GETATTR SUCCESS path=%s, result=%d, mode=%d, size=%ld\n", path, result_code, mode, size);
+  uint64_t generation = ocamlfuse_attr_cache_generation(path);
+  struct ocamlfuse_call call = {
+    .callback = mount->getattr, .argc = 1,
+    .args = { OCAMLFUSE_STRING(path) },
+    .extract = ocamlfuse_extract_stat, .out = stbuf };
+  int result_code = ocamlfuse_invoke(&call);
+  if (mount->cached && (!result_code || result_code == ENOENT)) {
+    ocamlfuse_attr_cache_insert(path, generation, result_code ? NULL : stbuf);
+  }
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
-static int ocamlfuse_fgetattr(const char* path, struct stat* stbuf,
-			      struct fuse_file_info* fi)
+#ifdef __APPLE__
+static int ocamlfuse_getxattr(const char* path, const char* key, char* buf, size_t size,
+			      uint32_t position)
+#else
+static int ocamlfuse_getxattr(const char* path, const char* key, char* buf, size_t size)
+#endif
 {
-  OCAMLFUSE_DEBUG("C: FGETATTR path=%s\n", path);
-  memset(stbuf, 0, sizeof(struct stat));
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_fgetattr_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(Field(result, 0));
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_GETXATTR, 0, 0, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->getxattr, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_STRING(key) },
+    .extract = ocamlfuse_extract_data, .out = buf, .size = size };
+  int result_code = ocamlfuse_invoke(&call);
   if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: FGETATTR FAIL path=%s, result=%d\n", path, result_code);
+    OCAMLFUSE_TRACE_RESULT(-result_code);
     return -result_code;
   }
-  value result_stat = Field(result, 1);
-  int mode = Int_val(Field(result_stat, 0));
-  int size = Int_val(Field(result_stat, 1));
-  int time = Int_val(Field(result_stat, 2));
-  caml_release_runtime_system();
+  OCAMLFUSE_TRACE_RESULT(call.result);
+  return call.result;
+}
 
-  stbuf->st_mode = mode;
-  stbuf->st_size = size;
-  stbuf->st_mtime = time;
-  stbuf->st_atime = time;
-  stbuf->st_ctime = time;
-  stbuf->st_nlink = 1;
-  OCAMLFUSE_DEBUG("C: FGETATTR SUCCESS path=%s, result=%d, mode=%d, size=%d\n", path, result_code, mode, size);
+#ifdef __APPLE__
+static int ocamlfuse_setxattr(const char* path, const char* key, const char* data, size_t size,
+			      int flags, uint32_t position)
+#else
+static int ocamlfuse_setxattr(const char* path, const char* key, const char* data, size_t size,
+			      int flags)
+#endif
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_SETXATTR, 0, 0, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->setxattr, .argc = 3,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_STRING(key), OCAMLFUSE_DATA(data, size) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
-static int ocamlfuse_getxattr(const char* path, const char* key, char* buf, size_t size, uint32_t position)
+/* An init call: the callback gets conn as a Capabilities.conn, and
+ * returns the one to apply to it. */
+struct ocamlfuse_init_call {
+  value* callback;
+  struct fuse_conn_info* conn;
+};
+
+static void ocamlfuse_run_init(void* data)
 {
-  OCAMLFUSE_DEBUG("C: GETXATTR path=%s key=%s\n", path, key);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_getxattr_callback,
-		   caml_copy_string(path),
-		   caml_copy_string(key));
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: GETXATTR FAIL path=%s, key=%s, result=%d\n", path, key, result_code);
-    return -result_code;
-  }
-  value result_data = Field(result, 1);
-  long result_data_size = caml_string_length(result_data);
-  const char* result_data_c = String_val(result_data);
-  memcpy(buf,
-	 result_data_c,
-	 result_data_size < size
-	   ? result_data_size
-	   : size);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: GETXATTR SUCCESS path=%s key=%s result=%d data=%s\n", path, key, result_code, result_data_c);
-  return result_data_size;
+  CAMLparam0();
+  CAMLlocal2(offer, result);
+  struct ocamlfuse_init_call* call = data;
+  struct fuse_conn_info* conn = call->conn;
+  offer = caml_alloc_tuple(6);
+  Store_field(offer, 0, Val_long(conn->capable));
+  Store_field(offer, 1, Val_long(conn->want));
+  Store_field(offer, 2, Val_long(conn->max_write));
+  Store_field(offer, 3, Val_long(conn->max_readahead));
+  Store_field(offer, 4, Val_long(conn->max_background));
+  Store_field(offer, 5, Val_long(conn->congestion_threshold));
+  result = caml_callback(*call->callback, offer);
+  /* FUSE fails the mount on capabilities it didn't offer. */
+  conn->want = Long_val(Field(result, 1)) & conn->capable;
+  conn->max_write = Long_val(Field(result, 2));
+  conn->max_readahead = Long_val(Field(result, 3));
+  conn->max_background = Long_val(Field(result, 4));
+  conn->congestion_threshold = Long_val(Field(result, 5));
+  CAMLreturn0;
 }
 
-static int ocamlfuse_setxattr(const char* path, const char* key, const char* data, size_t size, int flags, uint32_t position)
+/* Negotiates conn with callback, once the defaults of the binding are set
+ * in it. write_buffer is the callback of write_buf, if any. */
+static void ocamlfuse_negotiate(value* callback, value* write_buffer,
+				struct fuse_conn_info* conn)
 {
-  OCAMLFUSE_DEBUG("C: SETXATTR path=%s key=%s data=%s\n", path, key, data);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value data_string = caml_alloc_string(size);
-  char* data_string_p = String_val(data_string);
-  memcpy(data_string_p, data, size);
-  value result =
-    caml_callback3(*ocamlfuse_setxattr_callback,
-		   caml_copy_string(path),
-		   caml_copy_string(key),
-		   data_string);
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: SETXATTR SUCCESS path=%s key=%s data=%s\n", path, key, data);
-  return result_code;
+#ifdef FUSE_CAP_SPLICE_READ
+  /* Lets writes reach write_buffer as a pipe filled by the kernel. */
+  if (write_buffer && (conn->capable & FUSE_CAP_SPLICE_READ)) {
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  }
+#endif
+  struct ocamlfuse_init_call call = { callback, conn };
+  ocamlfuse_dispatch(ocamlfuse_run_init, &call);
 }
 
+/* Returns the mount, which FUSE then keeps as the private data of the
+ * context of every operation. */
+#if FUSE_USE_VERSION >= 30
+static void* ocamlfuse_init(struct fuse_conn_info* conn, struct fuse_config* config)
+#else
 static void* ocamlfuse_init(struct fuse_conn_info* conn)
+#endif
 {
-  OCAMLFUSE_DEBUG("C: INIT\n");
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  caml_callback(*ocamlfuse_init_callback, Val_unit);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: INIT SUCESS\n");
-  return NULL;
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_INIT, 0, 0, 0);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  ocamlfuse_negotiate(mount->init, mount->write_buffer, conn);
+  return mount;
 }
 
 static int ocamlfuse_mkdir(const char* path, mode_t mode)
 {
-  OCAMLFUSE_DEBUG("C: MKDIR path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_mkdir_callback,
-		   caml_copy_string(path),
-		   Val_int(mode));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: MKDIR SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_MKDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->mkdir, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(mode) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_open(const char* path, struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: OPEN path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_open_callback,
-		   caml_copy_string(path),
-		   Val_int(fi->flags));
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: OPEN FAIL path=%s result=%d\n", path, result_code);
-    return -result_code;
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_OPEN, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->open, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->flags) },
+    .extract = ocamlfuse_extract_opened, .out = fi };
+  int result_code = ocamlfuse_invoke(&call);
+  if (!result_code) {
+    fi->fh = call.result;
   }
-  fi->fh = Long_val(Field(result, 1));
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: OPEN SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_opendir(const char* path, struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: OPENDIR path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback(*ocamlfuse_opendir_callback,
-		  caml_copy_string(path));
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_OPENDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->opendir, .argc = 1,
+    .args = { OCAMLFUSE_STRING(path) } };
+  int result_code = ocamlfuse_invoke(&call);
+  if (!result_code) {
+    fi->fh = call.result;
+  }
+  OCAMLFUSE_TRACE_RESULT(-result_code);
+  return -result_code;
+}
+
+/* Calls a read_buffer callback with a Bigarray view of buf, so that OCaml
+ * writes straight into memory owned by FUSE. The callback must not keep
+ * the view or a sub-array of it: emptying the view before returning only
+ * catches later uses of the view itself, while a sub-array still points
+ * into buf. Returns the number of bytes read, clamped to 0..size, or a
+ * negative error code.
+ * Must be called with the runtime lock held. */
+static long ocamlfuse_read_into(value callback, value key, long handle,
+				char* buf, size_t size, off_t offset)
+{
+  CAMLparam2(callback, key);
+  CAMLlocal2(buffer, result);
+  buffer = caml_ba_alloc_dims(CAML_BA_CHAR | CAML_BA_C_LAYOUT, 1, buf, (intnat) size);
+  value args[4];
+  args[0] = key;
+  args[1] = Val_long(handle);
+  args[2] = Val_long(offset);
+  args[3] = buffer;
+  result = caml_callbackN(callback, 4, args);
+  Caml_ba_array_val(buffer)->dim[0] = 0;
+  Caml_ba_array_val(buffer)->data = NULL;
   int result_code = Int_val(Field(result, 0));
   if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: OPENDIR FAIL path=%s result=%d\n", path, result_code);
+    CAMLreturnT(long, -result_code);
+  }
+  long read = Long_val(Field(result, 1));
+  CAMLreturnT(long, read < 0 ? 0 : read < (long) size ? read : (long) size);
+}
+
+/* A read_buffer call, keyed by a path or an inode. */
+struct ocamlfuse_read_call {
+  value* callback;
+  struct ocamlfuse_arg key;
+  long handle;
+  char* buf;
+  size_t size;
+  off_t offset;
+  long read;
+};
+
+static void ocamlfuse_run_read(void* data)
+{
+  struct ocamlfuse_read_call* call = data;
+  call->read = ocamlfuse_read_into(*call->callback, ocamlfuse_arg_value(&call->key),
+				   call->handle, call->buf, call->size, call->offset);
+}
+
+/* The file a read_ahead fill reads from. */
+struct ocamlfuse_read_source {
+  struct ocamlfuse_mount* mount;
+  const char* path;
+  long handle;
+};
+
+/* Reads size bytes at offset through the read_buffer callback of the
+ * mount, or its read callback. Returns the number of bytes read, or a
+ * negative error code. */
+static long ocamlfuse_read_from(void* data, char* buf, size_t size, off_t offset)
+{
+  struct ocamlfuse_read_source* source = data;
+  if (source->mount->read_buffer) {
+    struct ocamlfuse_read_call call = {
+      source->mount->read_buffer, OCAMLFUSE_STRING(source->path), source->handle,
+      buf, size, offset };
+    ocamlfuse_dispatch(ocamlfuse_run_read, &call);
+    return call.read;
+  }
+  struct ocamlfuse_call call = {
+    .callback = source->mount->read, .argc = 4,
+    .args = { OCAMLFUSE_STRING(source->path), OCAMLFUSE_INT(source->handle),
+	      OCAMLFUSE_INT(offset), OCAMLFUSE_INT(size) },
+    .extract = ocamlfuse_extract_data, .out = buf, .size = size };
+  int result_code = ocamlfuse_invoke(&call);
+  if (result_code) {
     return -result_code;
   }
-  fi->fh = Long_val(Field(result, 1));
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: OPENDIR SUCCESS path=%s result=%d\n", path, result_code);
-  return -result_code;
+  return call.result < (long) size ? call.result : (long) size;
 }
 
+/* Sequential reads of a handle are served from its read-ahead chunk, in
+ * which case neither the runtime lock nor the filesystem is needed. */
 static int ocamlfuse_read(const char* path,
 			  char* buf, size_t size, off_t offset,
 			  struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: READ path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value args[5];
-  args[0] = caml_copy_string(path);
-  args[1] = Val_long(fi->fh);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READ, fi->fh, offset, size);
+  struct ocamlfuse_read_source source = { ocamlfuse_mount(), path, fi->fh };
+  long read;
+  if (!ocamlfuse_read_ahead(source.mount, fi->fh, path, buf, size, offset,
+			    ocamlfuse_read_from, &source, &read)) {
+    read = ocamlfuse_read_from(&source, buf, size, offset);
+  }
+  OCAMLFUSE_TRACE_RESULT(read);
+  return read;
+}
+
+/* C state of a readdir, reached from OCaml through a cursor: an abstract
+ * block holding its address. */
+#define Cursor_val(v) (*((void**) &Field(v, 0)))
+
+/* Calls a readdir callback with a cursor on state, for the add functions
+ * to fill the reply. The cursor is emptied before returning: adding to a
+ * cursor that escaped the callback fails. Returns the error code of the callback.
+ * Must be called with the runtime lock held. */
+static int ocamlfuse_readdir_with(value callback, value key, long handle,
+				  off_t offset, void* state)
+{
+  CAMLparam2(callback, key);
+  CAMLlocal2(cursor, result);
+  cursor = caml_alloc_small(1, Abstract_tag);
+  Cursor_val(cursor) = state;
+  value args[4];
+  args[0] = key;
+  args[1] = Val_long(handle);
   args[2] = Val_long(offset);
-  args[3] = Val_long(size);
-  value result = caml_callbackN(*ocamlfuse_read_callback, 4, args);
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: READ FAILED path=%s result=%d\n", path, result_code);
-    return -result_code;
+  args[3] = cursor;
+  result = caml_callbackN(callback, 4, args);
+  Cursor_val(cursor) = NULL;
+  CAMLreturnT(int, Int_val(result));
+}
+
+/* A readdir call, keyed by a path or an inode. */
+struct ocamlfuse_readdir_call {
+  value* callback;
+  struct ocamlfuse_arg key;
+  long handle;
+  off_t offset;
+  void* state;
+  int result_code;
+};
+
+static void ocamlfuse_run_readdir(void* data)
+{
+  struct ocamlfuse_readdir_call* call = data;
+  call->result_code = ocamlfuse_readdir_with(*call->callback, ocamlfuse_arg_value(&call->key),
+					     call->handle, call->offset, call->state);
+}
+
+/* The filler of FUSE 3 takes flags, which only matter to readdirplus:
+ * entries with attributes are marked when the kernel asked for them. */
+#if FUSE_USE_VERSION >= 30
+#define OCAMLFUSE_FILL(state, name, stbuf, next) \
+  (state)->filler((state)->buf, (name), (stbuf), (next), \
+		  (stbuf) ? (enum fuse_fill_dir_flags) (state)->fill_flags : 0)
+#else
+#define OCAMLFUSE_FILL(state, name, stbuf, next) \
+  (state)->filler((state)->buf, (name), (stbuf), (next))
+#endif
+
+/* cached is read here rather than from the context: the add functions may
+ * run on a Dispatch worker. */
+struct ocamlfuse_readdir_state {
+  const char* path;
+  void* buf;
+  fuse_fill_dir_t filler;
+  int cached;
+  int fill_flags;
+};
+
+/* Caches the attributes readdir gave for name in the folder path. The
+ * generation is taken here: handlers are serialized, so no invalidation
+ * can come between the filesystem computing them and this insertion. */
+static void ocamlfuse_readdir_cache(const char* path, const char* name,
+				    const struct stat* stbuf)
+{
+  if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+    return;
   }
-  value result_data = Field(result, 1);
-  long result_data_size = caml_string_length(result_data);
-  const char* result_data_c = String_val(result_data);
-  memcpy(buf,
-	 result_data_c,
-	 result_data_size < size
-	   ? result_data_size
-	   : size);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: READ SUCCESS path=%s result=%d result_data_size=%ld size=%zu\n", path, result_code, result_data_size, size);
-  return result_data_size;
+  char child[PATH_MAX];
+  int length = snprintf(child, sizeof(child), "%s/%s",
+			strcmp(path, "/") ? path : "", name);
+  if (length < 0 || length >= (int) sizeof(child)) {
+    return;
+  }
+  ocamlfuse_attr_cache_insert(child, ocamlfuse_attr_cache_generation(child), stbuf);
 }
 
+/* Adds an entry to the reply of ocamlfuse_readdir. Returns false when the
+ * buffer is full. */
+CAMLprim value ocamlfuse_readdir_add_impl(value cursor, value name, value stat, value next)
+{
+  struct ocamlfuse_readdir_state* state = Cursor_val(cursor);
+  if (state == NULL) {
+    return Val_false;
+  }
+  const char* name_c = String_val(name);
+  if (Is_long(stat)) {
+    return Val_bool(!OCAMLFUSE_FILL(state, name_c, NULL, Long_val(next)));
+  }
+  struct stat stbuf;
+  ocamlfuse_fill_stat(Field(stat, 0), &stbuf);
+  if (OCAMLFUSE_FILL(state, name_c, &stbuf, Long_val(next))) {
+    return Val_false;
+  }
+  if (state->cached) {
+    ocamlfuse_readdir_cache(state->path, name_c, &stbuf);
+  }
+  return Val_true;
+}
+
+/* The OCaml callback adds entries from offset until the buffer is full,
+ * with their own offsets, so that FUSE asks for the rest in later calls. */
 static int ocamlfuse_readdir(const char* path,
 			     void* buf,
 			     fuse_fill_dir_t filler,
 			     off_t offset,
+#if FUSE_USE_VERSION >= 30
+			     struct fuse_file_info* fi,
+			     enum fuse_readdir_flags flags)
+#else
 			     struct fuse_file_info* fi)
+#endif
 {
-  (void) offset;
-  (void) fi;
-  OCAMLFUSE_DEBUG("C: READDIR path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_readdir_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: READDIR FAILED path=%s result=%d\n", path, result_code);
-    return -result_code;
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READDIR, fi->fh, offset, 0);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  struct ocamlfuse_readdir_state state = { path, buf, filler, mount->cached, 0 };
+#if FUSE_USE_VERSION >= 30
+  if (flags & FUSE_READDIR_PLUS) {
+    state.fill_flags = FUSE_FILL_DIR_PLUS;
   }
-  value result_dir = Field(result, 1);
-  long size = Wosize_val(result_dir);
-  for (long i = 0; i < size; i++) {
-    filler(buf, String_val(Field(result_dir, i)), NULL, 0);
-  }
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: READDIR SUCCESS path=%s result=%d\n", path, result_code);
-  return -result_code;
+#endif
+  struct ocamlfuse_readdir_call call = {
+    mount->readdir, OCAMLFUSE_STRING(path), fi->fh, offset, &state };
+  ocamlfuse_dispatch(ocamlfuse_run_readdir, &call);
+  OCAMLFUSE_TRACE_RESULT(-call.result_code);
+  return -call.result_code;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_rename(const char* from_path,
+			    const char* to_path,
+			    unsigned int flags)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RENAME, 0, 0, 0);
+  /* Neither RENAME_NOREPLACE nor RENAME_EXCHANGE is supported. */
+  if (flags) {
+    OCAMLFUSE_TRACE_RESULT(-EINVAL);
+    return -EINVAL;
+  }
+#else
 static int ocamlfuse_rename(const char* from_path,
 			    const char* to_path)
 {
-  OCAMLFUSE_DEBUG("C: RENAME from=%s to=%s\n", from_path, to_path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_rename_callback,
-		   caml_copy_string(from_path),
-		   caml_copy_string(to_path));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: RENAME SUCCESS from=%s to=%s result=%d\n", from_path, to_path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RENAME, 0, 0, 0);
+#endif
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  struct ocamlfuse_call call = {
+    .callback = mount->rename, .argc = 2,
+    .args = { OCAMLFUSE_STRING(from_path), OCAMLFUSE_STRING(to_path) } };
+  int result_code = ocamlfuse_invoke(&call);
+  /* Chunks are found by the paths of their handles, which may all have
+   * moved with a folder. */
+  ocamlfuse_read_ahead_invalidate_all(mount);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_release(const char* path,
 			     struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: RELEASE path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_release_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: RELEASE SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RELEASE, fi->fh, 0, 0);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  ocamlfuse_read_ahead_release(mount, fi->fh);
+  struct ocamlfuse_call call = {
+    .callback = mount->release, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_releasedir(const char* path,
 				struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: RELEASEDIR path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_releasedir_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: RELEASEDIR SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RELEASEDIR, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->releasedir, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_rmdir(const char* path)
 {
-  OCAMLFUSE_DEBUG("C: RMDIR path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback(*ocamlfuse_rmdir_callback,
-		  caml_copy_string(path));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: RMDIR SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RMDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->rmdir, .argc = 1,
+    .args = { OCAMLFUSE_STRING(path) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_statfs(const char* path, struct statvfs* statfsbuf)
 {
-  OCAMLFUSE_DEBUG("C: STATFS path=%s\n", path);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_STATFS, 0, 0, 0);
   memset(statfsbuf, 0, sizeof(struct statvfs));
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result = caml_callback(*ocamlfuse_statfs_callback, Val_unit);
-  int result_code = Int_val(Field(result, 0));
-  if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: STATFS FAIL path=%s result=%d\n", path, result_code);
-    return -result_code;
-  }
-  value result_statfs = Field(result, 1);
-  statfsbuf->f_bsize = Long_val(Field(result_statfs, 0));
-  statfsbuf->f_blocks = Long_val(Field(result_statfs, 1));
-  statfsbuf->f_bfree = Long_val(Field(result_statfs, 2));
-  statfsbuf->f_bavail = Long_val(Field(result_statfs, 3));
-  statfsbuf->f_files = Long_val(Field(result_statfs, 4));
-  statfsbuf->f_ffree = Long_val(Field(result_statfs, 5));
-  statfsbuf->f_namemax = Long_val(Field(result_statfs, 6));
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: STATFS SUCCESS path=%s result=%d\n", path, result_code);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->statfs, .argc = 1,
+    .args = { OCAMLFUSE_INT(0) },
+    .extract = ocamlfuse_extract_statfs, .out = statfsbuf };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
@@ -466,16 +826,12 @@ static int ocamlfuse_sync(const char* path,
 			  int datasync,
 			  struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: SYNC path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_sync_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: SYNC SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FSYNC, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->sync, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
@@ -483,68 +839,73 @@ static int ocamlfuse_syncdir(const char* path,
 			     int datasync,
 			     struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: SYNCDIR path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_syncdir_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: SYNCDIR SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FSYNCDIR, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->syncdir, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
-static int ocamlfuse_truncate(const char* path,
-			      off_t offset)
+static int ocamlfuse_ftruncate(const char* path,
+			       off_t offset,
+			       struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: TRUNCATE path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback2(*ocamlfuse_truncate_callback,
-		   caml_copy_string(path),
-		   Val_long(offset));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: TRUNCATE SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FTRUNCATE, fi->fh, 0, offset);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  struct ocamlfuse_call call = {
+    .callback = mount->ftruncate, .argc = 3,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh), OCAMLFUSE_INT(offset) } };
+  int result_code = ocamlfuse_invoke(&call);
+  ocamlfuse_read_ahead_invalidate(mount, path);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
-static int ocamlfuse_ftruncate(const char* path,
-			       off_t offset,
-			       struct fuse_file_info* fi)
+/* FUSE 3 merges ftruncate into truncate, as fgetattr into getattr. */
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_truncate(const char* path,
+			      off_t offset,
+			      struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: FTRUNCATE path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback3(*ocamlfuse_ftruncate_callback,
-		   caml_copy_string(path),
-		   Val_long(fi->fh),
-		   Val_long(offset));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: FTRUNCATE SUCCESS path=%s result=%d\n", path, result_code);
+  if (fi != NULL) {
+    return ocamlfuse_ftruncate(path, offset, fi);
+  }
+#else
+static int ocamlfuse_truncate(const char* path,
+			      off_t offset)
+{
+#endif
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_TRUNCATE, 0, 0, offset);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  struct ocamlfuse_call call = {
+    .callback = mount->truncate, .argc = 2,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(offset) } };
+  int result_code = ocamlfuse_invoke(&call);
+  ocamlfuse_read_ahead_invalidate(mount, path);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
 static int ocamlfuse_unlink(const char* path)
 {
-  OCAMLFUSE_DEBUG("C: UNLINK path=%s\n", path);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
-  value result =
-    caml_callback(*ocamlfuse_unlink_callback,
-		  caml_copy_string(path));
-  int result_code = Int_val(result);
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: UNLINK SUCCESS path=%s result=%d\n", path, result_code);
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_UNLINK, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_mount()->unlink, .argc = 1,
+    .args = { OCAMLFUSE_STRING(path) } };
+  int result_code = ocamlfuse_invoke(&call);
+  OCAMLFUSE_TRACE_RESULT(-result_code);
   return -result_code;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_utimens(const char* path, const struct timespec tv[2],
+			     struct fuse_file_info* fi) {
+#else
 static int ocamlfuse_utimens(const char* path, const struct timespec tv[2]) {
+#endif
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_UTIMENS, 0, 0, 0);
   return 0;
 }
 
@@ -552,40 +913,157 @@ static int ocamlfuse_write(const char* path,
 			   const char* data, size_t size, off_t offset,
 			   struct fuse_file_info* fi)
 {
-  OCAMLFUSE_DEBUG("C: WRITE path=%s size=%zu offset=%lld\n", path, size, offset);
-  caml_c_thread_register();
-  caml_acquire_runtime_system();
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_WRITE, fi->fh, offset, size);
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  struct ocamlfuse_call call = {
+    .callback = mount->write, .argc = 4,
+    .args = { OCAMLFUSE_STRING(path), OCAMLFUSE_INT(fi->fh),
+	      OCAMLFUSE_DATA(data, size), OCAMLFUSE_INT(offset) } };
+  int result_code = ocamlfuse_invoke(&call);
+  /* After the write, so that a chunk filled before it is dropped, or not
+   * installed. */
+  ocamlfuse_read_ahead_invalidate(mount, path);
+  if (result_code) {
+    OCAMLFUSE_TRACE_RESULT(-result_code);
+    return -result_code;
+  }
+  OCAMLFUSE_TRACE_RESULT(call.result);
+  return call.result;
+}
+
+/* Reduces bufv to a single buffer that ocamlfuse_write_from can hand to
+ * OCaml. Data split across several buffers, or held in a seekable file, is
+ * gathered into *gathered, which the caller frees. Returns 0 or a negative
+ * error code. Must be called without the runtime lock: gathering may block
+ * on a pipe. */
+static int ocamlfuse_single_buf(struct fuse_bufvec* bufv,
+				struct fuse_buf* single, char** gathered)
+{
+  *gathered = NULL;
+  if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_FD_SEEK)) {
+    *single = bufv->buf[0];
+    return 0;
+  }
+  size_t size = fuse_buf_size(bufv);
+  *gathered = malloc(size);
+  if (*gathered == NULL) {
+    return -ENOMEM;
+  }
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem = *gathered;
+  ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+  if (copied < 0) {
+    free(*gathered);
+    *gathered = NULL;
+    return copied;
+  }
+  *single = dst.buf[0];
+  single->size = copied;
+  return 0;
+}
+
+/* Calls a write_buffer callback on buf without copying its data: memory is
+ * passed as a Memory Bigarray view, which the callback must not keep, as
+ * in ocamlfuse_read_into, and a pipe is passed as Pipe (fd, size) for
+ * OCaml to read from. Returns the number of bytes written, clamped to
+ * 0..size, or a negative error code.
+ * Must be called with the runtime lock held. */
+static long ocamlfuse_write_from(value callback, value key, long handle,
+				 const struct fuse_buf* buf, off_t offset)
+{
+  CAMLparam2(callback, key);
+  CAMLlocal3(buffer, source, result);
+  int is_fd = buf->flags & FUSE_BUF_IS_FD;
+  if (is_fd) {
+    source = caml_alloc(2, 1);
+    Store_field(source, 0, Val_int(buf->fd));
+    Store_field(source, 1, Val_long(buf->size));
+  } else {
+    buffer = caml_ba_alloc_dims(CAML_BA_CHAR | CAML_BA_C_LAYOUT, 1, buf->mem, (intnat) buf->size);
+    source = caml_alloc(1, 0);
+    Store_field(source, 0, buffer);
+  }
   value args[4];
-  args[0] = caml_copy_string(path);
-  args[1] = Val_long(fi->fh);
-  args[2] = caml_alloc_string(size);
-  char* data_string_p = String_val(args[2]);
-  memcpy(data_string_p, data, size);
+  args[0] = key;
+  args[1] = Val_long(handle);
+  args[2] = source;
   args[3] = Val_long(offset);
-  OCAMLFUSE_DEBUG("C: WRITE path=%s size=%zu offset=%lld CALLING OCAML CODE\n", path, size, offset);
-  value result = caml_callbackN(*ocamlfuse_write_callback, 4, args);
+  result = caml_callbackN(callback, 4, args);
+  if (!is_fd) {
+    Caml_ba_array_val(buffer)->dim[0] = 0;
+    Caml_ba_array_val(buffer)->data = NULL;
+  }
   int result_code = Int_val(Field(result, 0));
   if (result_code) {
-    caml_release_runtime_system();
-    OCAMLFUSE_DEBUG("C: WRITE FAIL path=%s size=%zu offset=%lld result=%d\n", path, size, offset, result_code);
-    return -result_code;
+    CAMLreturnT(long, -result_code);
   }
   long written = Long_val(Field(result, 1));
-  caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: WRITE SUCCESS path=%s size=%zu offset=%lld written=%ld\n", path, size, offset, written);
-  return written;
+  CAMLreturnT(long, written < 0 ? 0
+	      : written < (long) buf->size ? written : (long) buf->size);
 }
 
-static struct fuse_operations ocamlfuse_operations = {
-  .access       = ocamlfuse_access,
-  .chmod        = ocamlfuse_chmod,
-  .chown        = ocamlfuse_chown,
-  .create       = ocamlfuse_create,
+/* Tells FUSE that a pipe was drained by OCaml, so that it doesn't have to
+ * discard the pipe before the next request. */
+static void ocamlfuse_consumed(struct fuse_bufvec* bufv,
+			       const struct fuse_buf* buf, long written)
+{
+  if ((buf->flags & FUSE_BUF_IS_FD) && written == (long) buf->size) {
+    bufv->idx = bufv->count;
+  }
+}
+
+/* A write_buffer call, keyed by a path or an inode. */
+struct ocamlfuse_write_call {
+  value* callback;
+  struct ocamlfuse_arg key;
+  long handle;
+  const struct fuse_buf* buf;
+  off_t offset;
+  long written;
+};
+
+static void ocamlfuse_run_write(void* data)
+{
+  struct ocamlfuse_write_call* call = data;
+  call->written = ocamlfuse_write_from(*call->callback, ocamlfuse_arg_value(&call->key),
+				       call->handle, call->buf, call->offset);
+}
+
+static int ocamlfuse_write_buf(const char* path,
+			       struct fuse_bufvec* bufv, off_t offset,
+			       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_WRITE, fi->fh, offset, fuse_buf_size(bufv));
+  struct fuse_buf buf;
+  char* gathered;
+  int res = ocamlfuse_single_buf(bufv, &buf, &gathered);
+  if (res < 0) {
+    OCAMLFUSE_TRACE_RESULT(res);
+    return res;
+  }
+  struct ocamlfuse_mount* mount = ocamlfuse_mount();
+  struct ocamlfuse_write_call call = {
+    mount->write_buffer, OCAMLFUSE_STRING(path), fi->fh, &buf, offset };
+  ocamlfuse_dispatch(ocamlfuse_run_write, &call);
+  ocamlfuse_read_ahead_invalidate(mount, path);
+  free(gathered);
+  ocamlfuse_consumed(bufv, &buf, call.written);
+  OCAMLFUSE_TRACE_RESULT(call.written);
+  return call.written;
+}
+
+static const struct fuse_operations ocamlfuse_operations = {
+  .access       = ocamlfuse_access,
+  .chmod        = ocamlfuse_chmod,
+  .chown        = ocamlfuse_chown,
+  .create       = ocamlfuse_create,
   .mknod        = ocamlfuse_mknod,
   .destroy      = ocamlfuse_destroy,
   .flush        = ocamlfuse_flush,
   .getattr      = ocamlfuse_getattr,
+#if FUSE_USE_VERSION < 30
   .fgetattr     = ocamlfuse_fgetattr,
+#endif
   .setxattr     = ocamlfuse_setxattr,
   .getxattr     = ocamlfuse_getxattr,
   .init         = ocamlfuse_init,
@@ -602,14 +1080,163 @@ static struct fuse_operations ocamlfuse_operations = {
   .fsync        = ocamlfuse_sync,
   .fsyncdir     = ocamlfuse_syncdir,
   .truncate     = ocamlfuse_truncate,
+#if FUSE_USE_VERSION < 30
   .ftruncate    = ocamlfuse_ftruncate,
+#endif
   .unlink       = ocamlfuse_unlink,
   .utimens      = ocamlfuse_utimens,
   .write        = ocamlfuse_write,
 };
 
-CAMLprim value ocamlfuse_start_impl(value fuse_argv) {
-  CAMLparam1(fuse_argv);
+/* Looks up the callback registered as prefix ^ "ocamlfuse_" ^ name. */
+static value* ocamlfuse_named_value(const char* prefix, const char* name)
+{
+  char full[128];
+  snprintf(full, sizeof(full), "%socamlfuse_%s", prefix, name);
+  return caml_named_value(full);
+}
+
+/* Fills mount with the callbacks registered under prefix. Only the mount
+ * of the empty prefix uses the attribute cache. */
+static void ocamlfuse_find_callbacks(struct ocamlfuse_mount* mount, const char* prefix)
+{
+  mount->access = ocamlfuse_named_value(prefix, "access");
+  mount->create = ocamlfuse_named_value(prefix, "create");
+  mount->mknod = ocamlfuse_named_value(prefix, "mknod");
+  mount->destroy = ocamlfuse_named_value(prefix, "destroy");
+  mount->flush = ocamlfuse_named_value(prefix, "flush");
+  mount->getattr = ocamlfuse_named_value(prefix, "getattr");
+  mount->fgetattr = ocamlfuse_named_value(prefix, "fgetattr");
+  mount->getxattr = ocamlfuse_named_value(prefix, "getxattr");
+  mount->setxattr = ocamlfuse_named_value(prefix, "setxattr");
+  mount->init = ocamlfuse_named_value(prefix, "init");
+  mount->mkdir = ocamlfuse_named_value(prefix, "mkdir");
+  mount->open = ocamlfuse_named_value(prefix, "open");
+  mount->opendir = ocamlfuse_named_value(prefix, "opendir");
+  mount->read = ocamlfuse_named_value(prefix, "read");
+  mount->read_buffer = ocamlfuse_named_value(prefix, "read_buffer");
+  mount->readdir = ocamlfuse_named_value(prefix, "readdir");
+  mount->rename = ocamlfuse_named_value(prefix, "rename");
+  mount->release = ocamlfuse_named_value(prefix, "release");
+  mount->releasedir = ocamlfuse_named_value(prefix, "releasedir");
+  mount->rmdir = ocamlfuse_named_value(prefix, "rmdir");
+  mount->statfs = ocamlfuse_named_value(prefix, "statfs");
+  mount->sync = ocamlfuse_named_value(prefix, "sync");
+  mount->syncdir = ocamlfuse_named_value(prefix, "syncdir");
+  mount->truncate = ocamlfuse_named_value(prefix, "truncate");
+  mount->ftruncate = ocamlfuse_named_value(prefix, "ftruncate");
+  mount->unlink = ocamlfuse_named_value(prefix, "unlink");
+  mount->write = ocamlfuse_named_value(prefix, "write");
+  mount->write_buffer = ocamlfuse_named_value(prefix, "write_buffer");
+  mount->cached = prefix[0] == '\0';
+  mount->operations = ocamlfuse_operations;
+  /* FUSE prefers write_buf over write whenever it is set. */
+  mount->operations.write_buf = mount->write_buffer ? ocamlfuse_write_buf : NULL;
+}
+
+const struct fuse_operations* ocamlfuse_path_operations(void)
+{
+  ocamlfuse_find_callbacks(&ocamlfuse_default_mount, "");
+  return &ocamlfuse_default_mount.operations;
+}
+
+#if FUSE_USE_VERSION >= 30
+/* Runs the multi-threaded loop of fuse, or of se without fuse, with the
+ * worker pool given by the clone_fd, max_idle_threads and, from FUSE 3.12,
+ * max_threads options. */
+static int ocamlfuse_loop_mt(struct fuse* fuse, struct fuse_session* se,
+			     const struct fuse_cmdline_opts* opts)
+{
+#if FUSE_USE_VERSION >= 312
+  struct fuse_loop_config* config = fuse_loop_cfg_create();
+  if (config == NULL) {
+    return -1;
+  }
+  fuse_loop_cfg_set_clone_fd(config, opts->clone_fd);
+  fuse_loop_cfg_set_max_threads(config, opts->max_threads);
+  fuse_loop_cfg_set_idle_threads(config, opts->max_idle_threads);
+  int res = fuse ? fuse_loop_mt(fuse, config) : fuse_session_loop_mt(se, config);
+  fuse_loop_cfg_destroy(config);
+  return res;
+#elif FUSE_USE_VERSION >= 32
+  struct fuse_loop_config config = {
+    .clone_fd = opts->clone_fd, .max_idle_threads = opts->max_idle_threads };
+  return fuse ? fuse_loop_mt(fuse, &config) : fuse_session_loop_mt(se, &config);
+#else
+  return fuse ? fuse_loop_mt(fuse, opts->clone_fd) : fuse_session_loop_mt(se, opts->clone_fd);
+#endif
+}
+#endif
+
+/* Mounts with the options of args, and serves the requests of mount until
+ * it is unmounted. libfuse sends signals to a single session, so only the
+ * mount that uses the attribute cache handles them; the others end when
+ * they are unmounted. Must be called without the runtime lock. */
+static void ocamlfuse_session(struct ocamlfuse_mount* mount, struct fuse_args* args)
+{
+  int signals = mount->cached;
+  __atomic_add_fetch(&ocamlfuse_sessions, 1, __ATOMIC_RELEASE);
+#if FUSE_USE_VERSION >= 30
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(args, &opts) == 0) {
+    struct fuse* fuse = fuse_new(args, &mount->operations,
+				 sizeof(struct fuse_operations), mount);
+    if (fuse != NULL) {
+      struct fuse_session* se = fuse_get_session(fuse);
+      if (fuse_mount(fuse, opts.mountpoint) == 0) {
+	if (fuse_daemonize(opts.foreground) == 0
+	    && (!signals || fuse_set_signal_handlers(se) == 0)) {
+	  if (opts.singlethread) {
+	    fuse_loop(fuse);
+	  } else {
+	    ocamlfuse_loop_mt(fuse, NULL, &opts);
+	  }
+	  if (signals) {
+	    fuse_remove_signal_handlers(se);
+	  }
+	}
+	fuse_unmount(fuse);
+      }
+      fuse_destroy(fuse);
+    }
+    free(opts.mountpoint);
+  }
+#else
+  char* mountpoint = NULL;
+  int multithreaded = 0;
+  int foreground = 0;
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != -1) {
+    struct fuse_chan* ch = fuse_mount(mountpoint, args);
+    if (ch != NULL) {
+      struct fuse* fuse = fuse_new(ch, args, &mount->operations,
+				   sizeof(struct fuse_operations), mount);
+      if (fuse != NULL) {
+	struct fuse_session* se = fuse_get_session(fuse);
+	if (fuse_daemonize(foreground) == 0
+	    && (!signals || fuse_set_signal_handlers(se) == 0)) {
+	  if (multithreaded) {
+	    fuse_loop_mt(fuse);
+	  } else {
+	    fuse_loop(fuse);
+	  }
+	  if (signals) {
+	    fuse_remove_signal_handlers(se);
+	  }
+	}
+      }
+      fuse_unmount(mountpoint, ch);
+      if (fuse != NULL) {
+	fuse_destroy(fuse);
+      }
+    }
+    free(mountpoint);
+  }
+#endif
+  __atomic_sub_fetch(&ocamlfuse_sessions, 1, __ATOMIC_RELEASE);
+}
+
+CAMLprim value ocamlfuse_start_impl(value prefix, value fuse_argv) {
+  CAMLparam2(prefix, fuse_argv);
   CAMLlocal1(fuse_arg);
 
   int argc = Wosize_val(fuse_argv);
@@ -623,36 +1250,14 @@ CAMLprim value ocamlfuse_start_impl(value fuse_argv) {
     memcpy(argv[i], arg, arg_size);
   }
 
-  ocamlfuse_access_callback = caml_named_value("ocamlfuse_access");
-  ocamlfuse_create_callback = caml_named_value("ocamlfuse_create");
-  ocamlfuse_mknod_callback = caml_named_value("ocamlfuse_mknod");
-  ocamlfuse_destroy_callback = caml_named_value("ocamlfuse_destroy");
-  ocamlfuse_flush_callback = caml_named_value("ocamlfuse_flush");
-  ocamlfuse_getattr_callback = caml_named_value("ocamlfuse_getattr");
-  ocamlfuse_fgetattr_callback = caml_named_value("ocamlfuse_fgetattr");
-  ocamlfuse_getxattr_callback = caml_named_value("ocamlfuse_getxattr");
-  ocamlfuse_setxattr_callback = caml_named_value("ocamlfuse_setxattr");
-  ocamlfuse_init_callback = caml_named_value("ocamlfuse_init");
-  ocamlfuse_mkdir_callback = caml_named_value("ocamlfuse_mkdir");
-  ocamlfuse_open_callback = caml_named_value("ocamlfuse_open");
-  ocamlfuse_opendir_callback = caml_named_value("ocamlfuse_opendir");
-  ocamlfuse_read_callback = caml_named_value("ocamlfuse_read");
-  ocamlfuse_readdir_callback = caml_named_value("ocamlfuse_readdir");
-  ocamlfuse_rename_callback = caml_named_value("ocamlfuse_rename");
-  ocamlfuse_release_callback = caml_named_value("ocamlfuse_release");
-  ocamlfuse_releasedir_callback = caml_named_value("ocamlfuse_releasedir");
-  ocamlfuse_rmdir_callback = caml_named_value("ocamlfuse_rmdir");
-  ocamlfuse_statfs_callback = caml_named_value("ocamlfuse_statfs");
-  ocamlfuse_sync_callback = caml_named_value("ocamlfuse_sync");
-  ocamlfuse_syncdir_callback = caml_named_value("ocamlfuse_syncdir");
-  ocamlfuse_truncate_callback = caml_named_value("ocamlfuse_truncate");
-  ocamlfuse_ftruncate_callback = caml_named_value("ocamlfuse_ftruncate");
-  ocamlfuse_unlink_callback = caml_named_value("ocamlfuse_unlink");
-  ocamlfuse_write_callback = caml_named_value("ocamlfuse_write");
+  struct ocamlfuse_mount* mount = malloc(sizeof(struct ocamlfuse_mount));
+  ocamlfuse_find_callbacks(mount, String_val(prefix));
 
   caml_release_runtime_system();
-  OCAMLFUSE_DEBUG("C: FUSE system starting.\n");
-  fuse_main(argc, argv, &ocamlfuse_operations, NULL);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  ocamlfuse_session(mount, &args);
+  fuse_opt_free_args(&args);
+  free(mount);
   for (int i = 0; i < argc; i++) {
     free (argv[i]);
   }
@@ -661,3 +1266,1679 @@ CAMLprim value ocamlfuse_start_impl(value fuse_argv) {
   caml_acquire_runtime_system();
   CAMLreturn (Val_unit);
 }
+
+/* Version of the FUSE API the binding is built for, e.g. 29 or 312. */
+CAMLprim value ocamlfuse_version_impl(value unit)
+{
+  return Val_int(FUSE_USE_VERSION);
+}
+
+
+/* Low-level API.
+ *
+ * Operations are keyed by inode numbers: the kernel resolves paths one
+ * component at a time through lookup, and every other operation receives
+ * the inode directly. Results are copied out of OCaml values by the
+ * dispatched call, and replies are sent by the FUSE thread once it
+ * returns, without the runtime lock. */
+
+static value* ocamlfuse_ll_init_callback;
+static value* ocamlfuse_ll_destroy_callback;
+static value* ocamlfuse_ll_lookup_callback;
+static value* ocamlfuse_ll_forget_callback;
+static value* ocamlfuse_ll_getattr_callback;
+static value* ocamlfuse_ll_truncate_callback;
+static value* ocamlfuse_ll_access_callback;
+static value* ocamlfuse_ll_mkdir_callback;
+static value* ocamlfuse_ll_mknod_callback;
+static value* ocamlfuse_ll_create_callback;
+static value* ocamlfuse_ll_unlink_callback;
+static value* ocamlfuse_ll_rmdir_callback;
+static value* ocamlfuse_ll_rename_callback;
+static value* ocamlfuse_ll_open_callback;
+static value* ocamlfuse_ll_read_callback;
+static value* ocamlfuse_ll_read_buffer_callback;
+static value* ocamlfuse_ll_write_callback;
+static value* ocamlfuse_ll_write_buffer_callback;
+static value* ocamlfuse_ll_flush_callback;
+static value* ocamlfuse_ll_release_callback;
+static value* ocamlfuse_ll_sync_callback;
+static value* ocamlfuse_ll_opendir_callback;
+static value* ocamlfuse_ll_readdir_callback;
+static value* ocamlfuse_ll_readdirplus_callback;
+static value* ocamlfuse_ll_releasedir_callback;
+static value* ocamlfuse_ll_syncdir_callback;
+static value* ocamlfuse_ll_statfs_callback;
+static value* ocamlfuse_ll_getxattr_callback;
+static value* ocamlfuse_ll_setxattr_callback;
+
+/* The low-level mount of the process, whose kernel cache settings are set
+ * when its session begins. It is the userdata of the session, which
+ * handlers find with fuse_req_userdata. */
+static struct ocamlfuse_mount ocamlfuse_ll_mount;
+
+static const struct ocamlfuse_mount* ocamlfuse_ll_mount_of(fuse_req_t req)
+{
+  return fuse_req_userdata(req);
+}
+
+/* Channel of the running session, for notifications: FUSE 3 notifies
+ * through the session itself. */
+#if FUSE_USE_VERSION >= 30
+static struct fuse_session* ocamlfuse_ll_chan = NULL;
+#else
+static struct fuse_chan* ocamlfuse_ll_chan = NULL;
+#endif
+
+/* Fills e from an OCaml entry_internal. Its timeouts are left to
+ * ocamlfuse_ll_set_timeouts. */
+static void ocamlfuse_ll_fill_entry(value entry, struct fuse_entry_param* e)
+{
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = Long_val(Field(entry, 0));
+  ocamlfuse_fill_stat(Field(entry, 1), &e->attr);
+  e->attr.st_ino = e->ino;
+}
+
+static void ocamlfuse_ll_set_timeouts(const struct ocamlfuse_mount* mount,
+				      struct fuse_entry_param* e)
+{
+  e->attr_timeout = mount->attr_timeout;
+  e->entry_timeout = mount->entry_timeout;
+}
+
+static void ocamlfuse_ll_extract_entry(struct ocamlfuse_call* call, value entry)
+{
+  ocamlfuse_ll_fill_entry(entry, call->out);
+}
+
+/* Out of a create: the entry of the file, and the fuse_file_info of the
+ * open. */
+struct ocamlfuse_ll_created {
+  struct fuse_entry_param e;
+  struct fuse_file_info* fi;
+};
+
+/* Fills the entry of a created file, sets result to its handle, and
+ * applies its options. */
+static void ocamlfuse_ll_extract_created(struct ocamlfuse_call* call, value created)
+{
+  struct ocamlfuse_ll_created* out = call->out;
+  ocamlfuse_ll_fill_entry(Field(created, 0), &out->e);
+  call->result = Long_val(Field(created, 1));
+  ocamlfuse_apply_options(out->fi, Int_val(Field(created, 2)));
+}
+
+static void ocamlfuse_ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_INIT, 0, 0, 0);
+  ocamlfuse_negotiate(ocamlfuse_ll_init_callback, ocamlfuse_ll_write_buffer_callback, conn);
+}
+
+static void ocamlfuse_ll_destroy(void* userdata)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_DESTROY, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_destroy_callback, .argc = 1,
+    .args = { OCAMLFUSE_INT(0) } };
+  ocamlfuse_invoke(&call);
+}
+
+/* Replies with e, or with the error result_code. */
+static void ocamlfuse_ll_reply_entry(fuse_req_t req, int result_code,
+				     struct fuse_entry_param* e)
+{
+  OCAMLFUSE_TRACE_RESULT(-result_code);
+  if (result_code) {
+    fuse_reply_err(req, result_code);
+  } else {
+    ocamlfuse_ll_set_timeouts(ocamlfuse_ll_mount_of(req), e);
+    fuse_reply_entry(req, e);
+  }
+}
+
+/* Replies with stbuf, or with the error result_code. */
+static void ocamlfuse_ll_reply_attr(fuse_req_t req, int result_code,
+				    const struct stat* stbuf)
+{
+  OCAMLFUSE_TRACE_RESULT(-result_code);
+  if (result_code) {
+    fuse_reply_err(req, result_code);
+  } else {
+    fuse_reply_attr(req, stbuf, ocamlfuse_ll_mount_of(req)->attr_timeout);
+  }
+}
+
+/* Replies to an open whose handle is handle, or with the error
+ * result_code. */
+static void ocamlfuse_ll_reply_open(fuse_req_t req, int result_code, long handle,
+				    struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE_RESULT(-result_code);
+  if (result_code) {
+    fuse_reply_err(req, result_code);
+  } else {
+    fi->fh = handle;
+    fuse_reply_open(req, fi);
+  }
+}
+
+/* Replies with the error result_code, 0 on success. */
+static void ocamlfuse_ll_reply_err(fuse_req_t req, int result_code)
+{
+  OCAMLFUSE_TRACE_RESULT(-result_code);
+  fuse_reply_err(req, result_code);
+}
+
+static void ocamlfuse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_LOOKUP, 0, 0, 0);
+  struct fuse_entry_param e;
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_lookup_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name) },
+    .extract = ocamlfuse_ll_extract_entry, .out = &e };
+  int result_code = ocamlfuse_invoke(&call);
+  double negative_timeout = ocamlfuse_ll_mount_of(req)->negative_timeout;
+  if (result_code == ENOENT && negative_timeout > 0) {
+    /* An entry with inode 0 lets the kernel cache the missing name. */
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.entry_timeout = negative_timeout;
+    OCAMLFUSE_TRACE_RESULT(-ENOENT);
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  ocamlfuse_ll_reply_entry(req, result_code, &e);
+}
+
+static void ocamlfuse_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FORGET, 0, 0, nlookup);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_forget_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(nlookup) } };
+  ocamlfuse_invoke(&call);
+  fuse_reply_none(req);
+}
+
+static void ocamlfuse_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+				 struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_GETATTR, 0, 0, 0);
+  struct stat stbuf;
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_getattr_callback, .argc = 1,
+    .args = { OCAMLFUSE_INT(ino) },
+    .extract = ocamlfuse_extract_stat, .out = &stbuf };
+  int result_code = ocamlfuse_invoke(&call);
+  stbuf.st_ino = ino;
+  ocamlfuse_ll_reply_attr(req, result_code, &stbuf);
+}
+
+/* Only size changes are forwarded to the filesystem; mode, owner and times
+ * are accepted and ignored, like chmod/chown/utimens in the high-level API. */
+static void ocamlfuse_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+				 struct stat* attr, int to_set,
+				 struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_SETATTR, 0, 0, 0);
+  struct stat stbuf;
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_getattr_callback, .argc = 1,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(attr->st_size) },
+    .extract = ocamlfuse_extract_stat, .out = &stbuf };
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    call.callback = ocamlfuse_ll_truncate_callback;
+    call.argc = 2;
+  }
+  int result_code = ocamlfuse_invoke(&call);
+  stbuf.st_ino = ino;
+  ocamlfuse_ll_reply_attr(req, result_code, &stbuf);
+}
+
+static void ocamlfuse_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_ACCESS, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_access_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(mask) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+			       const char* name, mode_t mode)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_MKDIR, 0, 0, 0);
+  struct fuse_entry_param e;
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_mkdir_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name), OCAMLFUSE_INT(mode) },
+    .extract = ocamlfuse_ll_extract_entry, .out = &e };
+  ocamlfuse_ll_reply_entry(req, ocamlfuse_invoke(&call), &e);
+}
+
+static void ocamlfuse_ll_mknod(fuse_req_t req, fuse_ino_t parent,
+			       const char* name, mode_t mode, dev_t rdev)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_MKNOD, 0, 0, 0);
+  struct fuse_entry_param e;
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_mknod_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name), OCAMLFUSE_INT(mode) },
+    .extract = ocamlfuse_ll_extract_entry, .out = &e };
+  ocamlfuse_ll_reply_entry(req, ocamlfuse_invoke(&call), &e);
+}
+
+static void ocamlfuse_ll_create(fuse_req_t req, fuse_ino_t parent,
+				const char* name, mode_t mode,
+				struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_CREATE, 0, 0, 0);
+  struct ocamlfuse_ll_created created = { .fi = fi };
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_create_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name), OCAMLFUSE_INT(mode) },
+    .extract = ocamlfuse_ll_extract_created, .out = &created };
+  fi->keep_cache = ocamlfuse_ll_mount_of(req)->keep_cache;
+  int result_code = ocamlfuse_invoke(&call);
+  if (result_code) {
+    OCAMLFUSE_TRACE_RESULT(-result_code);
+    fuse_reply_err(req, result_code);
+  } else {
+    fi->fh = call.result;
+    ocamlfuse_ll_set_timeouts(ocamlfuse_ll_mount_of(req), &created.e);
+    fuse_reply_create(req, &created.e, fi);
+  }
+}
+
+static void ocamlfuse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_UNLINK, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_unlink_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RMDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_rmdir_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+#if FUSE_USE_VERSION >= 30
+static void ocamlfuse_ll_rename(fuse_req_t req,
+				fuse_ino_t parent, const char* name,
+				fuse_ino_t new_parent, const char* new_name,
+				unsigned int flags)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RENAME, 0, 0, 0);
+  if (flags) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+#else
+static void ocamlfuse_ll_rename(fuse_req_t req,
+				fuse_ino_t parent, const char* name,
+				fuse_ino_t new_parent, const char* new_name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RENAME, 0, 0, 0);
+#endif
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_rename_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name),
+	      OCAMLFUSE_INT(new_parent), OCAMLFUSE_STRING(new_name) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_open(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_OPEN, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_open_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->flags) },
+    .extract = ocamlfuse_extract_opened, .out = fi };
+  fi->keep_cache = ocamlfuse_ll_mount_of(req)->keep_cache;
+  int result_code = ocamlfuse_invoke(&call);
+  ocamlfuse_ll_reply_open(req, result_code, call.result, fi);
+}
+
+static void ocamlfuse_ll_read(fuse_req_t req, fuse_ino_t ino,
+			      size_t size, off_t offset,
+			      struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READ, fi->fh, offset, size);
+  if (ocamlfuse_ll_read_buffer_callback) {
+    char* buf = malloc(size);
+    if (buf == NULL) {
+      OCAMLFUSE_TRACE_RESULT(-ENOMEM);
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+    struct ocamlfuse_read_call call = {
+      ocamlfuse_ll_read_buffer_callback, OCAMLFUSE_INT(ino), fi->fh, buf, size, offset };
+    ocamlfuse_dispatch(ocamlfuse_run_read, &call);
+    OCAMLFUSE_TRACE_RESULT(call.read);
+    if (call.read < 0) {
+      fuse_reply_err(req, -call.read);
+    } else {
+      fuse_reply_buf(req, buf, call.read);
+    }
+    free(buf);
+    return;
+  }
+  /* The string is copied out while the call holds the runtime lock, so
+   * that the reply is written to the kernel without it. */
+  char* buf = malloc(size);
+  if (buf == NULL) {
+    OCAMLFUSE_TRACE_RESULT(-ENOMEM);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_read_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh),
+	      OCAMLFUSE_INT(offset), OCAMLFUSE_INT(size) },
+    .extract = ocamlfuse_extract_data, .out = buf, .size = size };
+  int result_code = ocamlfuse_invoke(&call);
+  if (result_code) {
+    OCAMLFUSE_TRACE_RESULT(-result_code);
+    fuse_reply_err(req, result_code);
+  } else {
+    long length = call.result < (long) size ? call.result : (long) size;
+    OCAMLFUSE_TRACE_RESULT(length);
+    fuse_reply_buf(req, buf, length);
+  }
+  free(buf);
+}
+
+static void ocamlfuse_ll_write(fuse_req_t req, fuse_ino_t ino,
+			       const char* data, size_t size, off_t offset,
+			       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_WRITE, fi->fh, offset, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_write_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh),
+	      OCAMLFUSE_DATA(data, size), OCAMLFUSE_INT(offset) } };
+  int result_code = ocamlfuse_invoke(&call);
+  if (result_code) {
+    OCAMLFUSE_TRACE_RESULT(-result_code);
+    fuse_reply_err(req, result_code);
+  } else {
+    OCAMLFUSE_TRACE_RESULT(call.result);
+    fuse_reply_write(req, call.result);
+  }
+}
+
+static void ocamlfuse_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+				   struct fuse_bufvec* bufv, off_t offset,
+				   struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_WRITE, fi->fh, offset, fuse_buf_size(bufv));
+  struct fuse_buf buf;
+  char* gathered;
+  int res = ocamlfuse_single_buf(bufv, &buf, &gathered);
+  if (res < 0) {
+    OCAMLFUSE_TRACE_RESULT(res);
+    fuse_reply_err(req, -res);
+    return;
+  }
+  struct ocamlfuse_write_call call = {
+    ocamlfuse_ll_write_buffer_callback, OCAMLFUSE_INT(ino), fi->fh, &buf, offset };
+  ocamlfuse_dispatch(ocamlfuse_run_write, &call);
+  free(gathered);
+  ocamlfuse_consumed(bufv, &buf, call.written);
+  OCAMLFUSE_TRACE_RESULT(call.written);
+  if (call.written < 0) {
+    fuse_reply_err(req, -call.written);
+  } else {
+    fuse_reply_write(req, call.written);
+  }
+}
+
+static void ocamlfuse_ll_flush(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FLUSH, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_flush_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_release(fuse_req_t req, fuse_ino_t ino,
+				 struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RELEASE, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_release_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FSYNC, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_sync_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+				 struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_OPENDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_opendir_callback, .argc = 1,
+    .args = { OCAMLFUSE_INT(ino) } };
+  int result_code = ocamlfuse_invoke(&call);
+  ocamlfuse_ll_reply_open(req, result_code, call.result, fi);
+}
+
+struct ocamlfuse_ll_readdir_state {
+  fuse_req_t req;
+  char* buf;
+  size_t size;
+  size_t used;
+  const struct ocamlfuse_mount* mount;
+};
+
+/* Adds an entry to the reply of ocamlfuse_ll_readdir. Returns false when
+ * the buffer is full. */
+CAMLprim value ocamlfuse_ll_readdir_add_impl(value cursor, value name, value ino,
+					     value mode, value next)
+{
+  struct ocamlfuse_ll_readdir_state* state = Cursor_val(cursor);
+  if (state == NULL) {
+    return Val_false;
+  }
+  struct stat stbuf;
+  memset(&stbuf, 0, sizeof(struct stat));
+  stbuf.st_ino = Long_val(ino);
+  stbuf.st_mode = Int_val(mode);
+  size_t entry_size = fuse_add_direntry(state->req, state->buf + state->used,
+					state->size - state->used,
+					String_val(name), &stbuf, Long_val(next));
+  if (entry_size > state->size - state->used) {
+    return Val_false;
+  }
+  state->used += entry_size;
+  return Val_true;
+}
+
+#if FUSE_MAJOR_VERSION >= 3
+/* Adds an entry with its attributes to the reply of
+ * ocamlfuse_ll_readdirplus. . and .. are sent without an inode, so that
+ * the kernel doesn't count them as lookups. */
+CAMLprim value ocamlfuse_ll_readdirplus_add_impl(value cursor, value name, value entry,
+						 value next)
+{
+  struct ocamlfuse_ll_readdir_state* state = Cursor_val(cursor);
+  if (state == NULL) {
+    return Val_false;
+  }
+  const char* name_c = String_val(name);
+  struct fuse_entry_param e;
+  ocamlfuse_ll_fill_entry(entry, &e);
+  ocamlfuse_ll_set_timeouts(state->mount, &e);
+  if (name_c[0] == '.' && (name_c[1] == '\0' || (name_c[1] == '.' && name_c[2] == '\0'))) {
+    e.ino = 0;
+  }
+  size_t entry_size = fuse_add_direntry_plus(state->req, state->buf + state->used,
+					     state->size - state->used,
+					     name_c, &e, Long_val(next));
+  if (entry_size > state->size - state->used) {
+    return Val_false;
+  }
+  state->used += entry_size;
+  return Val_true;
+}
+#else
+CAMLprim value ocamlfuse_ll_readdirplus_add_impl(value cursor, value name, value entry,
+						 value next)
+{
+  return Val_false;
+}
+#endif
+
+
+/* Lists a directory into a reply buffer of size bytes, through the add
+ * function that matches callback. */
+static void ocamlfuse_ll_readdir_reply(fuse_req_t req, value* callback, fuse_ino_t ino,
+				       size_t size, off_t offset,
+				       struct fuse_file_info* fi)
+{
+  char* buf = malloc(size);
+  if (buf == NULL) {
+    OCAMLFUSE_TRACE_RESULT(-ENOMEM);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct ocamlfuse_ll_readdir_state state = { req, buf, size, 0, ocamlfuse_ll_mount_of(req) };
+  struct ocamlfuse_readdir_call call = {
+    callback, OCAMLFUSE_INT(ino), fi->fh, offset, &state };
+  ocamlfuse_dispatch(ocamlfuse_run_readdir, &call);
+  if (call.result_code) {
+    OCAMLFUSE_TRACE_RESULT(-call.result_code);
+    fuse_reply_err(req, call.result_code);
+  } else {
+    OCAMLFUSE_TRACE_RESULT(state.used);
+    fuse_reply_buf(req, buf, state.used);
+  }
+  free(buf);
+}
+
+static void ocamlfuse_ll_readdir(fuse_req_t req, fuse_ino_t ino,
+				 size_t size, off_t offset,
+				 struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READDIR, fi->fh, offset, size);
+  ocamlfuse_ll_readdir_reply(req, ocamlfuse_ll_readdir_callback, ino, size, offset, fi);
+}
+
+#if FUSE_MAJOR_VERSION >= 3
+static void ocamlfuse_ll_readdirplus(fuse_req_t req, fuse_ino_t ino,
+				     size_t size, off_t offset,
+				     struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READDIR, fi->fh, offset, size);
+  ocamlfuse_ll_readdir_reply(req, ocamlfuse_ll_readdirplus_callback, ino, size, offset, fi);
+}
+#endif
+
+static void ocamlfuse_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+				    struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RELEASEDIR, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_releasedir_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+				  struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FSYNCDIR, fi->fh, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_syncdir_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+static void ocamlfuse_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_STATFS, 0, 0, 0);
+  struct statvfs statfsbuf;
+  memset(&statfsbuf, 0, sizeof(struct statvfs));
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_statfs_callback, .argc = 1,
+    .args = { OCAMLFUSE_INT(0) },
+    .extract = ocamlfuse_extract_statfs, .out = &statfsbuf };
+  int result_code = ocamlfuse_invoke(&call);
+  if (result_code) {
+    OCAMLFUSE_TRACE_RESULT(-result_code);
+    fuse_reply_err(req, result_code);
+  } else {
+    fuse_reply_statfs(req, &statfsbuf);
+  }
+}
+
+#ifdef __APPLE__
+static void ocamlfuse_ll_getxattr(fuse_req_t req, fuse_ino_t ino,
+				  const char* key, size_t size, uint32_t position)
+#else
+static void ocamlfuse_ll_getxattr(fuse_req_t req, fuse_ino_t ino,
+				  const char* key, size_t size)
+#endif
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_GETXATTR, 0, 0, size);
+  /* As for read, the value is replied from a copy, without the runtime
+   * lock. */
+  char* buf = NULL;
+  if (size > 0 && (buf = malloc(size)) == NULL) {
+    OCAMLFUSE_TRACE_RESULT(-ENOMEM);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_getxattr_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_STRING(key) },
+    .extract = ocamlfuse_extract_data, .out = buf, .size = size };
+  int result_code = ocamlfuse_invoke(&call);
+  if (result_code) {
+    OCAMLFUSE_TRACE_RESULT(-result_code);
+    fuse_reply_err(req, result_code);
+  } else if (size == 0) {
+    OCAMLFUSE_TRACE_RESULT(call.result);
+    fuse_reply_xattr(req, call.result);
+  } else if (call.result > (long) size) {
+    OCAMLFUSE_TRACE_RESULT(-ERANGE);
+    fuse_reply_err(req, ERANGE);
+  } else {
+    OCAMLFUSE_TRACE_RESULT(call.result);
+    fuse_reply_buf(req, buf, call.result);
+  }
+  free(buf);
+}
+
+#ifdef __APPLE__
+static void ocamlfuse_ll_setxattr(fuse_req_t req, fuse_ino_t ino,
+				  const char* key, const char* data,
+				  size_t size, int flags, uint32_t position)
+#else
+static void ocamlfuse_ll_setxattr(fuse_req_t req, fuse_ino_t ino,
+				  const char* key, const char* data,
+				  size_t size, int flags)
+#endif
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_SETXATTR, 0, 0, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_setxattr_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_STRING(key), OCAMLFUSE_DATA(data, size) } };
+  ocamlfuse_ll_reply_err(req, ocamlfuse_invoke(&call));
+}
+
+/* Asynchronous low-level API.
+ *
+ * Operations don't wait for their result: the FUSE thread hands the
+ * request to OCaml, which queues it for the thread running Lwt and
+ * returns at once. The request is answered later, when its promise
+ * resolves, through one of the ocamlfuse_ll_async_reply functions. The
+ * callbacks are those of the synchronous API, registered with a request
+ * as first argument, and traces only cover the submission. */
+
+/* A request waiting for its reply. It is passed to OCaml as an int, which
+ * holds any user space address, and freed by the reply. fi is a copy, as
+ * the one FUSE passes is only valid during the operation. Until a reply
+ * claims it, it is linked in the pending list, from which the end of the
+ * session can answer it instead, and mark it abandoned. */
+struct ocamlfuse_ll_request {
+  fuse_req_t req;
+  const struct ocamlfuse_mount* mount;
+  fuse_ino_t ino;
+  size_t size;
+  int lookup;
+  int abandoned;
+  struct fuse_file_info fi;
+  struct ocamlfuse_ll_readdir_state dir;
+  struct ocamlfuse_ll_request* prev;
+  struct ocamlfuse_ll_request* next;
+};
+
+#define Request_val(v) ((struct ocamlfuse_ll_request*) Long_val(v))
+
+/* Requests not answered yet, and those of them no reply has claimed. A
+ * session waits for them before it is destroyed, as replying needs it. */
+static long ocamlfuse_ll_outstanding = 0;
+static struct ocamlfuse_ll_request* ocamlfuse_ll_pending = NULL;
+static pthread_mutex_t ocamlfuse_ll_outstanding_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ocamlfuse_ll_outstanding_cond = PTHREAD_COND_INITIALIZER;
+
+/* Seconds the end of a session waits for the promises of its requests,
+ * e.g. from a peer that is gone, before answering them with EIO. */
+#define OCAMLFUSE_LL_OUTSTANDING_TIMEOUT 10
+
+/* Flags of a request. A missing name found by a lookup can be cached by
+ * the kernel, and a readdir needs a reply buffer. */
+#define OCAMLFUSE_LL_LOOKUP 1
+#define OCAMLFUSE_LL_READDIR 2
+
+/* Links request into the pending list, and counts it as outstanding. */
+static void ocamlfuse_ll_request_track(struct ocamlfuse_ll_request* request)
+{
+  pthread_mutex_lock(&ocamlfuse_ll_outstanding_mutex);
+  ocamlfuse_ll_outstanding++;
+  request->next = ocamlfuse_ll_pending;
+  if (ocamlfuse_ll_pending != NULL) {
+    ocamlfuse_ll_pending->prev = request;
+  }
+  ocamlfuse_ll_pending = request;
+  pthread_mutex_unlock(&ocamlfuse_ll_outstanding_mutex);
+}
+
+/* Takes request out of the pending list. Must be called with
+ * ocamlfuse_ll_outstanding_mutex held. */
+static void ocamlfuse_ll_request_unlink(struct ocamlfuse_ll_request* request)
+{
+  if (request->prev != NULL) {
+    request->prev->next = request->next;
+  } else {
+    ocamlfuse_ll_pending = request->next;
+  }
+  if (request->next != NULL) {
+    request->next->prev = request->prev;
+  }
+  request->prev = request->next = NULL;
+}
+
+/* Leaves request to its reply, which only frees it: it no longer counts
+ * as outstanding. Must be called with ocamlfuse_ll_outstanding_mutex
+ * held. */
+static void ocamlfuse_ll_request_abandon(struct ocamlfuse_ll_request* request)
+{
+  ocamlfuse_ll_request_unlink(request);
+  request->abandoned = 1;
+  ocamlfuse_ll_outstanding--;
+}
+
+/* Allocates a request for req, and passes it as the first argument of
+ * call. Replies ENOMEM when allocation fails. */
+static void ocamlfuse_ll_async_submit(struct ocamlfuse_call* call, fuse_req_t req,
+				      fuse_ino_t ino, size_t size,
+				      const struct fuse_file_info* fi, int flags)
+{
+  struct ocamlfuse_ll_request* request = calloc(1, sizeof(struct ocamlfuse_ll_request));
+  if (request != NULL && (flags & OCAMLFUSE_LL_READDIR)) {
+    request->dir.buf = malloc(size);
+    if (request->dir.buf == NULL) {
+      free(request);
+      request = NULL;
+    }
+  }
+  if (request == NULL) {
+    OCAMLFUSE_TRACE_RESULT(-ENOMEM);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  request->req = req;
+  request->mount = ocamlfuse_ll_mount_of(req);
+  request->ino = ino;
+  request->size = size;
+  request->lookup = flags & OCAMLFUSE_LL_LOOKUP;
+  if (fi != NULL) {
+    request->fi = *fi;
+  }
+  request->dir.req = req;
+  request->dir.size = size;
+  request->dir.mount = request->mount;
+  ocamlfuse_ll_request_track(request);
+  call->args[0] = (struct ocamlfuse_arg) OCAMLFUSE_INT((intnat) request);
+  ocamlfuse_invoke(call);
+}
+
+static void ocamlfuse_ll_request_free(struct ocamlfuse_ll_request* request)
+{
+  free(request->dir.buf);
+  free(request);
+  pthread_mutex_lock(&ocamlfuse_ll_outstanding_mutex);
+  if (--ocamlfuse_ll_outstanding == 0) {
+    pthread_cond_broadcast(&ocamlfuse_ll_outstanding_cond);
+  }
+  pthread_mutex_unlock(&ocamlfuse_ll_outstanding_mutex);
+}
+
+/* Returns the request to reply to, taken out of the pending list, or
+ * NULL when the session already answered it: the request is then freed,
+ * and the reply dropped. */
+static struct ocamlfuse_ll_request* ocamlfuse_ll_request_claim(value request)
+{
+  struct ocamlfuse_ll_request* r = Request_val(request);
+  pthread_mutex_lock(&ocamlfuse_ll_outstanding_mutex);
+  int abandoned = r->abandoned;
+  if (!abandoned) {
+    ocamlfuse_ll_request_unlink(r);
+  }
+  pthread_mutex_unlock(&ocamlfuse_ll_outstanding_mutex);
+  if (abandoned) {
+    free(r->dir.buf);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+/* Waits until every request was answered, for at most
+ * OCAMLFUSE_LL_OUTSTANDING_TIMEOUT seconds. Requests no reply has claimed
+ * by then are answered with EIO and abandoned; their replies only free
+ * them. Replies under way are still waited for. Must be called without
+ * the runtime lock. */
+static void ocamlfuse_ll_wait_outstanding(void)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += OCAMLFUSE_LL_OUTSTANDING_TIMEOUT;
+  pthread_mutex_lock(&ocamlfuse_ll_outstanding_mutex);
+  while (ocamlfuse_ll_outstanding > 0) {
+    if (pthread_cond_timedwait(&ocamlfuse_ll_outstanding_cond, &ocamlfuse_ll_outstanding_mutex,
+			       &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  while (ocamlfuse_ll_pending != NULL) {
+    struct ocamlfuse_ll_request* r = ocamlfuse_ll_pending;
+    fuse_reply_err(r->req, EIO);
+    ocamlfuse_ll_request_abandon(r);
+  }
+  while (ocamlfuse_ll_outstanding > 0) {
+    pthread_cond_wait(&ocamlfuse_ll_outstanding_cond, &ocamlfuse_ll_outstanding_mutex);
+  }
+  pthread_mutex_unlock(&ocamlfuse_ll_outstanding_mutex);
+}
+
+/* Returns a request already abandoned, as by the end of a session, for
+ * the self-tests of the replies: they must claim and free it without
+ * answering. */
+CAMLprim value ocamlfuse_ll_async_abandoned_request_impl(value unit)
+{
+  struct ocamlfuse_ll_request* request = calloc(1, sizeof(struct ocamlfuse_ll_request));
+  if (request == NULL) {
+    caml_raise_out_of_memory();
+  }
+  ocamlfuse_ll_request_track(request);
+  pthread_mutex_lock(&ocamlfuse_ll_outstanding_mutex);
+  ocamlfuse_ll_request_abandon(request);
+  pthread_mutex_unlock(&ocamlfuse_ll_outstanding_mutex);
+  return Val_long((intnat) request);
+}
+
+CAMLprim value ocamlfuse_ll_async_outstanding_impl(value unit)
+{
+  pthread_mutex_lock(&ocamlfuse_ll_outstanding_mutex);
+  long outstanding = ocamlfuse_ll_outstanding;
+  pthread_mutex_unlock(&ocamlfuse_ll_outstanding_mutex);
+  return Val_long(outstanding);
+}
+
+/* The replies below run on the Lwt thread. They read what they need out
+ * of their OCaml arguments first, then answer FUSE without the runtime
+ * lock, as sending a reply is a write to the FUSE device. */
+
+/* Replies to request with the error code, and frees it. */
+static void ocamlfuse_ll_async_reply_error(struct ocamlfuse_ll_request* request, int code)
+{
+  caml_release_runtime_system();
+  fuse_reply_err(request->req, code);
+  ocamlfuse_ll_request_free(request);
+  caml_acquire_runtime_system();
+}
+
+/* Replies to request with the first length bytes of data, copied out of
+ * the OCaml heap, and frees it. */
+static void ocamlfuse_ll_async_reply_buf(struct ocamlfuse_ll_request* request, value data,
+					 size_t length)
+{
+  char* buf = malloc(length > 0 ? length : 1);
+  if (buf != NULL) {
+    memcpy(buf, String_val(data), length);
+  }
+  caml_release_runtime_system();
+  if (buf != NULL) {
+    fuse_reply_buf(request->req, buf, length);
+  } else {
+    fuse_reply_err(request->req, ENOMEM);
+  }
+  ocamlfuse_ll_request_free(request);
+  free(buf);
+  caml_acquire_runtime_system();
+}
+
+/* Replies to request with the error code, and frees it, unless code is
+ * 0. Returns whether it did. */
+static int ocamlfuse_ll_async_failed(struct ocamlfuse_ll_request* request, value code)
+{
+  int result_code = Int_val(code);
+  if (!result_code) {
+    return 0;
+  }
+  ocamlfuse_ll_async_reply_error(request, result_code);
+  return 1;
+}
+
+CAMLprim value ocamlfuse_ll_async_reply_err_impl(value request, value code)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  ocamlfuse_ll_async_reply_error(r, Int_val(code));
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_ll_async_reply_entry_impl(value request, value code, value entry)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  struct fuse_entry_param e;
+  if (r->lookup && Int_val(code) == ENOENT && r->mount->negative_timeout > 0) {
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.entry_timeout = r->mount->negative_timeout;
+  } else if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  } else {
+    ocamlfuse_ll_fill_entry(entry, &e);
+    ocamlfuse_ll_set_timeouts(r->mount, &e);
+  }
+  caml_release_runtime_system();
+  fuse_reply_entry(r->req, &e);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_ll_async_reply_create_impl(value request, value code,
+						    value entry, value handle, value options)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  struct fuse_entry_param e;
+  ocamlfuse_ll_fill_entry(entry, &e);
+  ocamlfuse_ll_set_timeouts(r->mount, &e);
+  r->fi.fh = Long_val(handle);
+  r->fi.keep_cache = r->mount->keep_cache;
+  ocamlfuse_apply_options(&r->fi, Int_val(options));
+  caml_release_runtime_system();
+  fuse_reply_create(r->req, &e, &r->fi);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_ll_async_reply_attr_impl(value request, value code, value stat)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  struct stat stbuf;
+  ocamlfuse_fill_stat(stat, &stbuf);
+  stbuf.st_ino = r->ino;
+  caml_release_runtime_system();
+  fuse_reply_attr(r->req, &stbuf, r->mount->attr_timeout);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+/* Replies to an open or an opendir, whose options are 0. */
+CAMLprim value ocamlfuse_ll_async_reply_open_impl(value request, value code, value handle,
+						  value options)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  r->fi.fh = Long_val(handle);
+  ocamlfuse_apply_options(&r->fi, Int_val(options));
+  caml_release_runtime_system();
+  fuse_reply_open(r->req, &r->fi);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+/* Replies to a read with at most the size requested. */
+CAMLprim value ocamlfuse_ll_async_reply_data_impl(value request, value code, value data)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  size_t length = caml_string_length(data);
+  ocamlfuse_ll_async_reply_buf(r, data, length < r->size ? length : r->size);
+  return Val_unit;
+}
+
+/* Replies to a getxattr with the length of the value when the size
+ * requested is 0, ERANGE when it is too small, or the value. */
+CAMLprim value ocamlfuse_ll_async_reply_xattr_impl(value request, value code, value data)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  size_t length = caml_string_length(data);
+  if (r->size == 0) {
+    caml_release_runtime_system();
+    fuse_reply_xattr(r->req, length);
+    ocamlfuse_ll_request_free(r);
+    caml_acquire_runtime_system();
+  } else if (length > r->size) {
+    ocamlfuse_ll_async_reply_error(r, ERANGE);
+  } else {
+    ocamlfuse_ll_async_reply_buf(r, data, length);
+  }
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_ll_async_reply_write_impl(value request, value code, value written)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  size_t count = Long_val(written);
+  caml_release_runtime_system();
+  fuse_reply_write(r->req, count);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_ll_async_reply_statfs_impl(value request, value code, value statfs)
+{
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  struct statvfs statfsbuf;
+  memset(&statfsbuf, 0, sizeof(struct statvfs));
+  struct ocamlfuse_call call = { .out = &statfsbuf };
+  ocamlfuse_extract_statfs(&call, statfs);
+  caml_release_runtime_system();
+  fuse_reply_statfs(r->req, &statfsbuf);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+/* Returns a cursor on the reply buffer of a readdir request, for the add
+ * functions of the synchronous API. */
+CAMLprim value ocamlfuse_ll_async_cursor_impl(value request)
+{
+  value cursor = caml_alloc_small(1, Abstract_tag);
+  Cursor_val(cursor) = &Request_val(request)->dir;
+  return cursor;
+}
+
+/* Replies to a readdir with the entries added through cursor, which is
+ * emptied first. */
+CAMLprim value ocamlfuse_ll_async_reply_readdir_impl(value request, value cursor, value code)
+{
+  Cursor_val(cursor) = NULL;
+  struct ocamlfuse_ll_request* r = ocamlfuse_ll_request_claim(request);
+  if (r == NULL) {
+    return Val_unit;
+  }
+  if (ocamlfuse_ll_async_failed(r, code)) {
+    return Val_unit;
+  }
+  caml_release_runtime_system();
+  fuse_reply_buf(r->req, r->dir.buf, r->dir.used);
+  ocamlfuse_ll_request_free(r);
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+static void ocamlfuse_ll_async_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_LOOKUP, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_lookup_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, NULL, OCAMLFUSE_LL_LOOKUP);
+}
+
+/* Forgetting has no reply: the request is answered at once, and the
+ * callback doesn't take it. */
+static void ocamlfuse_ll_async_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FORGET, 0, 0, nlookup);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_forget_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(ino), OCAMLFUSE_INT(nlookup) } };
+  ocamlfuse_invoke(&call);
+  fuse_reply_none(req);
+}
+
+static void ocamlfuse_ll_async_getattr(fuse_req_t req, fuse_ino_t ino,
+				       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_GETATTR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_getattr_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_setattr(fuse_req_t req, fuse_ino_t ino,
+				       struct stat* attr, int to_set,
+				       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_SETATTR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_getattr_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(attr->st_size) } };
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    call.callback = ocamlfuse_ll_truncate_callback;
+    call.argc = 3;
+  }
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_ACCESS, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_access_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(mask) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_mkdir(fuse_req_t req, fuse_ino_t parent,
+				     const char* name, mode_t mode)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_MKDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_mkdir_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name),
+	      OCAMLFUSE_INT(mode) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_mknod(fuse_req_t req, fuse_ino_t parent,
+				     const char* name, mode_t mode, dev_t rdev)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_MKNOD, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_mknod_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name),
+	      OCAMLFUSE_INT(mode) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_create(fuse_req_t req, fuse_ino_t parent,
+				      const char* name, mode_t mode,
+				      struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_CREATE, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_create_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name),
+	      OCAMLFUSE_INT(mode) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, fi, 0);
+}
+
+static void ocamlfuse_ll_async_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_UNLINK, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_unlink_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RMDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_rmdir_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, NULL, 0);
+}
+
+#if FUSE_USE_VERSION >= 30
+static void ocamlfuse_ll_async_rename(fuse_req_t req,
+				      fuse_ino_t parent, const char* name,
+				      fuse_ino_t new_parent, const char* new_name,
+				      unsigned int flags)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RENAME, 0, 0, 0);
+  if (flags) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+#else
+static void ocamlfuse_ll_async_rename(fuse_req_t req,
+				      fuse_ino_t parent, const char* name,
+				      fuse_ino_t new_parent, const char* new_name)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RENAME, 0, 0, 0);
+#endif
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_rename_callback, .argc = 5,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(parent), OCAMLFUSE_STRING(name),
+	      OCAMLFUSE_INT(new_parent), OCAMLFUSE_STRING(new_name) } };
+  ocamlfuse_ll_async_submit(&call, req, parent, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_open(fuse_req_t req, fuse_ino_t ino,
+				    struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_OPEN, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_open_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->flags) } };
+  fi->keep_cache = ocamlfuse_ll_mount_of(req)->keep_cache;
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, fi, 0);
+}
+
+static void ocamlfuse_ll_async_read(fuse_req_t req, fuse_ino_t ino,
+				    size_t size, off_t offset,
+				    struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READ, fi->fh, offset, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_read_callback, .argc = 5,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh),
+	      OCAMLFUSE_INT(offset), OCAMLFUSE_INT(size) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, size, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_write(fuse_req_t req, fuse_ino_t ino,
+				     const char* data, size_t size, off_t offset,
+				     struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_WRITE, fi->fh, offset, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_write_callback, .argc = 5,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh),
+	      OCAMLFUSE_DATA(data, size), OCAMLFUSE_INT(offset) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, size, NULL, 0);
+}
+
+/* Submits an operation on an open file or folder, whose callback takes
+ * the inode and the handle. */
+static void ocamlfuse_ll_async_handle(value* callback, fuse_req_t req, fuse_ino_t ino,
+				      struct fuse_file_info* fi)
+{
+  struct ocamlfuse_call call = {
+    .callback = callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, NULL, 0);
+}
+
+static void ocamlfuse_ll_async_flush(fuse_req_t req, fuse_ino_t ino,
+				     struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FLUSH, fi->fh, 0, 0);
+  ocamlfuse_ll_async_handle(ocamlfuse_ll_flush_callback, req, ino, fi);
+}
+
+static void ocamlfuse_ll_async_release(fuse_req_t req, fuse_ino_t ino,
+				       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RELEASE, fi->fh, 0, 0);
+  ocamlfuse_ll_async_handle(ocamlfuse_ll_release_callback, req, ino, fi);
+}
+
+static void ocamlfuse_ll_async_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+				     struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FSYNC, fi->fh, 0, 0);
+  ocamlfuse_ll_async_handle(ocamlfuse_ll_sync_callback, req, ino, fi);
+}
+
+static void ocamlfuse_ll_async_opendir(fuse_req_t req, fuse_ino_t ino,
+				       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_OPENDIR, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_opendir_callback, .argc = 2,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, fi, 0);
+}
+
+static void ocamlfuse_ll_async_readdir(fuse_req_t req, fuse_ino_t ino,
+				       size_t size, off_t offset,
+				       struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_READDIR, fi->fh, offset, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_readdir_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_INT(fi->fh),
+	      OCAMLFUSE_INT(offset) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, size, NULL, OCAMLFUSE_LL_READDIR);
+}
+
+static void ocamlfuse_ll_async_releasedir(fuse_req_t req, fuse_ino_t ino,
+					  struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_RELEASEDIR, fi->fh, 0, 0);
+  ocamlfuse_ll_async_handle(ocamlfuse_ll_releasedir_callback, req, ino, fi);
+}
+
+static void ocamlfuse_ll_async_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+					struct fuse_file_info* fi)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_FSYNCDIR, fi->fh, 0, 0);
+  ocamlfuse_ll_async_handle(ocamlfuse_ll_syncdir_callback, req, ino, fi);
+}
+
+static void ocamlfuse_ll_async_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_STATFS, 0, 0, 0);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_statfs_callback, .argc = 1,
+    .args = { OCAMLFUSE_INT(0) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, 0, NULL, 0);
+}
+
+#ifdef __APPLE__
+static void ocamlfuse_ll_async_getxattr(fuse_req_t req, fuse_ino_t ino,
+					const char* key, size_t size, uint32_t position)
+#else
+static void ocamlfuse_ll_async_getxattr(fuse_req_t req, fuse_ino_t ino,
+					const char* key, size_t size)
+#endif
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_GETXATTR, 0, 0, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_getxattr_callback, .argc = 3,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_STRING(key) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, size, NULL, 0);
+}
+
+#ifdef __APPLE__
+static void ocamlfuse_ll_async_setxattr(fuse_req_t req, fuse_ino_t ino,
+					const char* key, const char* data,
+					size_t size, int flags, uint32_t position)
+#else
+static void ocamlfuse_ll_async_setxattr(fuse_req_t req, fuse_ino_t ino,
+					const char* key, const char* data,
+					size_t size, int flags)
+#endif
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_SETXATTR, 0, 0, size);
+  struct ocamlfuse_call call = {
+    .callback = ocamlfuse_ll_setxattr_callback, .argc = 4,
+    .args = { OCAMLFUSE_INT(0), OCAMLFUSE_INT(ino), OCAMLFUSE_STRING(key),
+	      OCAMLFUSE_DATA(data, size) } };
+  ocamlfuse_ll_async_submit(&call, req, ino, size, NULL, 0);
+}
+
+/* Notifications. They write to the FUSE device, so they run without the
+ * runtime lock, and return an errno, 0 on success. */
+
+CAMLprim value ocamlfuse_ll_notify_inval_inode_impl(value ino, value offset, value length)
+{
+  if (ocamlfuse_ll_chan == NULL) {
+    return Val_int(ENOTCONN);
+  }
+  caml_release_runtime_system();
+  int res = fuse_lowlevel_notify_inval_inode(ocamlfuse_ll_chan, Long_val(ino),
+					     Long_val(offset), Long_val(length));
+  caml_acquire_runtime_system();
+  return Val_int(-res);
+}
+
+CAMLprim value ocamlfuse_ll_notify_inval_entry_impl(value parent, value name)
+{
+  CAMLparam2(parent, name);
+  if (ocamlfuse_ll_chan == NULL) {
+    CAMLreturn(Val_int(ENOTCONN));
+  }
+  size_t length = caml_string_length(name);
+  char* name_c = malloc(length + 1);
+  if (name_c == NULL) {
+    CAMLreturn(Val_int(ENOMEM));
+  }
+  memcpy(name_c, String_val(name), length + 1);
+  caml_release_runtime_system();
+  int res = fuse_lowlevel_notify_inval_entry(ocamlfuse_ll_chan, Long_val(parent),
+					     name_c, length);
+  caml_acquire_runtime_system();
+  free(name_c);
+  CAMLreturn(Val_int(-res));
+}
+
+CAMLprim value ocamlfuse_ll_notify_store_impl(value ino, value offset, value data)
+{
+  CAMLparam3(ino, offset, data);
+  if (ocamlfuse_ll_chan == NULL) {
+    CAMLreturn(Val_int(ENOTCONN));
+  }
+  size_t size = caml_string_length(data);
+  char* data_c = malloc(size);
+  if (data_c == NULL) {
+    CAMLreturn(Val_int(ENOMEM));
+  }
+  memcpy(data_c, String_val(data), size);
+  struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+  bufv.buf[0].mem = data_c;
+  caml_release_runtime_system();
+  int res = fuse_lowlevel_notify_store(ocamlfuse_ll_chan, Long_val(ino),
+				       Long_val(offset), &bufv, 0);
+  caml_acquire_runtime_system();
+  free(data_c);
+  CAMLreturn(Val_int(-res));
+}
+
+static struct fuse_lowlevel_ops ocamlfuse_ll_operations = {
+  .init         = ocamlfuse_ll_init,
+  .destroy      = ocamlfuse_ll_destroy,
+  .lookup       = ocamlfuse_ll_lookup,
+  .forget       = ocamlfuse_ll_forget,
+  .getattr      = ocamlfuse_ll_getattr,
+  .setattr      = ocamlfuse_ll_setattr,
+  .access       = ocamlfuse_ll_access,
+  .mkdir        = ocamlfuse_ll_mkdir,
+  .mknod        = ocamlfuse_ll_mknod,
+  .create       = ocamlfuse_ll_create,
+  .unlink       = ocamlfuse_ll_unlink,
+  .rmdir        = ocamlfuse_ll_rmdir,
+  .rename       = ocamlfuse_ll_rename,
+  .open         = ocamlfuse_ll_open,
+  .read         = ocamlfuse_ll_read,
+  .write        = ocamlfuse_ll_write,
+  .flush        = ocamlfuse_ll_flush,
+  .release      = ocamlfuse_ll_release,
+  .fsync        = ocamlfuse_ll_fsync,
+  .opendir      = ocamlfuse_ll_opendir,
+  .readdir      = ocamlfuse_ll_readdir,
+  .releasedir   = ocamlfuse_ll_releasedir,
+  .fsyncdir     = ocamlfuse_ll_fsyncdir,
+  .statfs       = ocamlfuse_ll_statfs,
+  .getxattr     = ocamlfuse_ll_getxattr,
+  .setxattr     = ocamlfuse_ll_setxattr,
+};
+
+/* The init and destroy of the filesystem are run by Lowlevel.Async.start,
+ * around the session: init here only negotiates the connection, with its
+ * negotiate callback. Writes arrive as data, not through write_buf. */
+static void ocamlfuse_ll_async_init(void* userdata, struct fuse_conn_info* conn)
+{
+  OCAMLFUSE_TRACE(OCAMLFUSE_OP_INIT, 0, 0, 0);
+  ocamlfuse_negotiate(ocamlfuse_ll_init_callback, NULL, conn);
+}
+
+static struct fuse_lowlevel_ops ocamlfuse_ll_async_operations = {
+  .init         = ocamlfuse_ll_async_init,
+  .lookup       = ocamlfuse_ll_async_lookup,
+  .forget       = ocamlfuse_ll_async_forget,
+  .getattr      = ocamlfuse_ll_async_getattr,
+  .setattr      = ocamlfuse_ll_async_setattr,
+  .access       = ocamlfuse_ll_async_access,
+  .mkdir        = ocamlfuse_ll_async_mkdir,
+  .mknod        = ocamlfuse_ll_async_mknod,
+  .create       = ocamlfuse_ll_async_create,
+  .unlink       = ocamlfuse_ll_async_unlink,
+  .rmdir        = ocamlfuse_ll_async_rmdir,
+  .rename       = ocamlfuse_ll_async_rename,
+  .open         = ocamlfuse_ll_async_open,
+  .read         = ocamlfuse_ll_async_read,
+  .write        = ocamlfuse_ll_async_write,
+  .flush        = ocamlfuse_ll_async_flush,
+  .release      = ocamlfuse_ll_async_release,
+  .fsync        = ocamlfuse_ll_async_fsync,
+  .opendir      = ocamlfuse_ll_async_opendir,
+  .readdir      = ocamlfuse_ll_async_readdir,
+  .releasedir   = ocamlfuse_ll_async_releasedir,
+  .fsyncdir     = ocamlfuse_ll_async_fsyncdir,
+  .statfs       = ocamlfuse_ll_async_statfs,
+  .getxattr     = ocamlfuse_ll_async_getxattr,
+  .setxattr     = ocamlfuse_ll_async_setxattr,
+};
+
+/* Looks up the callbacks registered by Lowlevel.start or
+ * Lowlevel.Async.start. They are process-wide, as the session is:
+ * check_options rejects a second low-level mount. */
+static void ocamlfuse_ll_find_callbacks(void)
+{
+  ocamlfuse_ll_init_callback = caml_named_value("ocamlfuse_ll_init");
+  ocamlfuse_ll_destroy_callback = caml_named_value("ocamlfuse_ll_destroy");
+  ocamlfuse_ll_lookup_callback = caml_named_value("ocamlfuse_ll_lookup");
+  ocamlfuse_ll_forget_callback = caml_named_value("ocamlfuse_ll_forget");
+  ocamlfuse_ll_getattr_callback = caml_named_value("ocamlfuse_ll_getattr");
+  ocamlfuse_ll_truncate_callback = caml_named_value("ocamlfuse_ll_truncate");
+  ocamlfuse_ll_access_callback = caml_named_value("ocamlfuse_ll_access");
+  ocamlfuse_ll_mkdir_callback = caml_named_value("ocamlfuse_ll_mkdir");
+  ocamlfuse_ll_mknod_callback = caml_named_value("ocamlfuse_ll_mknod");
+  ocamlfuse_ll_create_callback = caml_named_value("ocamlfuse_ll_create");
+  ocamlfuse_ll_unlink_callback = caml_named_value("ocamlfuse_ll_unlink");
+  ocamlfuse_ll_rmdir_callback = caml_named_value("ocamlfuse_ll_rmdir");
+  ocamlfuse_ll_rename_callback = caml_named_value("ocamlfuse_ll_rename");
+  ocamlfuse_ll_open_callback = caml_named_value("ocamlfuse_ll_open");
+  ocamlfuse_ll_read_callback = caml_named_value("ocamlfuse_ll_read");
+  ocamlfuse_ll_read_buffer_callback = caml_named_value("ocamlfuse_ll_read_buffer");
+  ocamlfuse_ll_write_callback = caml_named_value("ocamlfuse_ll_write");
+  ocamlfuse_ll_write_buffer_callback = caml_named_value("ocamlfuse_ll_write_buffer");
+  ocamlfuse_ll_flush_callback = caml_named_value("ocamlfuse_ll_flush");
+  ocamlfuse_ll_release_callback = caml_named_value("ocamlfuse_ll_release");
+  ocamlfuse_ll_sync_callback = caml_named_value("ocamlfuse_ll_sync");
+  ocamlfuse_ll_opendir_callback = caml_named_value("ocamlfuse_ll_opendir");
+  ocamlfuse_ll_readdir_callback = caml_named_value("ocamlfuse_ll_readdir");
+  ocamlfuse_ll_readdirplus_callback = caml_named_value("ocamlfuse_ll_readdirplus");
+  ocamlfuse_ll_releasedir_callback = caml_named_value("ocamlfuse_ll_releasedir");
+  ocamlfuse_ll_syncdir_callback = caml_named_value("ocamlfuse_ll_syncdir");
+  ocamlfuse_ll_statfs_callback = caml_named_value("ocamlfuse_ll_statfs");
+  ocamlfuse_ll_getxattr_callback = caml_named_value("ocamlfuse_ll_getxattr");
+  ocamlfuse_ll_setxattr_callback = caml_named_value("ocamlfuse_ll_setxattr");
+}
+
+/* Runs a session with operations, on the mount point and options in
+ * fuse_argv, until it is unmounted. cache holds the kernel cache settings
+ * of the mount, as Lowlevel.configure returns them. */
+static void ocamlfuse_ll_session(value fuse_argv, value cache,
+				 const struct fuse_lowlevel_ops* operations)
+{
+  CAMLparam2(fuse_argv, cache);
+  CAMLlocal1(fuse_arg);
+
+  struct ocamlfuse_mount* mount = &ocamlfuse_ll_mount;
+  mount->entry_timeout = Double_val(Field(cache, 0));
+  mount->attr_timeout = Double_val(Field(cache, 1));
+  mount->negative_timeout = Double_val(Field(cache, 2));
+  mount->keep_cache = Bool_val(Field(cache, 3));
+
+  int argc = Wosize_val(fuse_argv);
+  char** argv = malloc(argc * sizeof(char*));
+
+  for (int i = 0; i < argc; i++) {
+    fuse_arg = Field(fuse_argv, i);
+    char* arg = String_val(fuse_arg);
+    long arg_size = caml_string_length(fuse_arg) + 1;
+    argv[i] = malloc(arg_size);
+    memcpy(argv[i], arg, arg_size);
+  }
+
+  caml_release_runtime_system();
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+#if FUSE_USE_VERSION >= 30
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(&args, &opts) == 0) {
+    struct fuse_session* se =
+      fuse_session_new(&args, operations, sizeof(struct fuse_lowlevel_ops), mount);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+	if (fuse_session_mount(se, opts.mountpoint) == 0) {
+	  ocamlfuse_ll_chan = se;
+	  if (opts.singlethread) {
+	    fuse_session_loop(se);
+	  } else {
+	    ocamlfuse_loop_mt(NULL, se, &opts);
+	  }
+	  ocamlfuse_ll_chan = NULL;
+	  ocamlfuse_ll_wait_outstanding();
+	  fuse_session_unmount(se);
+	}
+	fuse_remove_signal_handlers(se);
+      }
+      fuse_session_destroy(se);
+    }
+    free(opts.mountpoint);
+  }
+#else
+  char* mountpoint = NULL;
+  int multithreaded = 0;
+  int foreground = 0;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+    struct fuse_chan* ch = fuse_mount(mountpoint, &args);
+    if (ch != NULL) {
+      struct fuse_session* se =
+	fuse_lowlevel_new(&args, operations,
+			  sizeof(struct fuse_lowlevel_ops), mount);
+      if (se != NULL) {
+	if (fuse_set_signal_handlers(se) != -1) {
+	  fuse_session_add_chan(se, ch);
+	  ocamlfuse_ll_chan = ch;
+	  if (multithreaded) {
+	    fuse_session_loop_mt(se);
+	  } else {
+	    fuse_session_loop(se);
+	  }
+	  ocamlfuse_ll_chan = NULL;
+	  ocamlfuse_ll_wait_outstanding();
+	  fuse_remove_signal_handlers(se);
+	  fuse_session_remove_chan(ch);
+	}
+	fuse_session_destroy(se);
+      }
+      fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+  }
+#endif
+  fuse_opt_free_args(&args);
+  for (int i = 0; i < argc; i++) {
+    free (argv[i]);
+  }
+  free (argv);
+
+  caml_acquire_runtime_system();
+  CAMLreturn0;
+}
+
+CAMLprim value ocamlfuse_lowlevel_start_impl(value fuse_argv, value cache)
+{
+  ocamlfuse_ll_find_callbacks();
+  ocamlfuse_ll_operations.write_buf =
+    ocamlfuse_ll_write_buffer_callback ? ocamlfuse_ll_write_buf : NULL;
+#if FUSE_MAJOR_VERSION >= 3
+  /* FUSE asks the kernel for readdirplus whenever it is set. */
+  ocamlfuse_ll_operations.readdirplus =
+    ocamlfuse_ll_readdirplus_callback ? ocamlfuse_ll_readdirplus : NULL;
+#endif
+  ocamlfuse_ll_session(fuse_argv, cache, &ocamlfuse_ll_operations);
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_lowlevel_async_start_impl(value fuse_argv, value cache)
+{
+  ocamlfuse_ll_find_callbacks();
+  ocamlfuse_ll_session(fuse_argv, cache, &ocamlfuse_ll_async_operations);
+  return Val_unit;
+}
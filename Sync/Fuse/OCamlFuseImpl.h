@@ -0,0 +1,12 @@
+#ifndef OCAMLFUSE_OCAMLFUSE_IMPL_H
+#define OCAMLFUSE_OCAMLFUSE_IMPL_H
+
+struct fuse_operations;
+
+/* Returns the operations of the path based API, bound to the callbacks
+ * registered by OCamlFuse.register without a prefix, for programs that
+ * call them without mounting, e.g. benchmarks. Must be called with the
+ * runtime lock held, and again after registering other callbacks. */
+const struct fuse_operations* ocamlfuse_path_operations(void);
+
+#endif
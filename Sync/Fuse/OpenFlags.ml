@@ -14,6 +14,10 @@ type t =
   | SYMLINK       (* allow open of symlinks *)
   | EVTONLY       (* descriptor requested for event notifications only *)
   | CLOEXEC       (* mark as close-on-exec *)
+  | DIRECT        (* bypass the page cache, Linux only *)
+  | NOATIME       (* do not update the access time, Linux only *)
+  | SYNC          (* write data and metadata synchronously *)
+  | DSYNC         (* write data synchronously *)
 
 external ocamlfuse_openflags_impl : unit -> flags array = "ocamlfuse_openflags_impl"
 let openflags = ocamlfuse_openflags_impl ()
@@ -33,6 +37,10 @@ and nofollow = to_code NOFOLLOW
 and symlink  = to_code SYMLINK
 and evtonly  = to_code EVTONLY
 and cloexec  = to_code CLOEXEC
+and direct   = to_code DIRECT
+and noatime  = to_code NOATIME
+and sync     = to_code SYNC
+and dsync    = to_code DSYNC
 let access_flags = rdonly lor wronly lor rdwr
 
 let all_flags =
@@ -49,13 +57,18 @@ let all_flags =
     NOFOLLOW ;
     SYMLINK ;
     EVTONLY ;
-    CLOEXEC ]
+    CLOEXEC ;
+    DIRECT ;
+    NOATIME ;
+    SYNC ;
+    DSYNC ]
 
+(* Flags missing on the platform have code 0, and are never set. *)
 let has flags flag =
   if flag = RDONLY
   then flags land access_flags = rdonly
   else let code = to_code flag in
-       flags land code = code
+       code <> 0 && flags land code = code
 
 let of_flags flags = List.filter (has flags) all_flags
 
@@ -71,7 +84,8 @@ let _ =
   for i = 0 to Array.length openflags - 1 do
     let flag : t = Obj.magic i in
     let result = of_flags (to_flags [flag]) in
-    if ([flag] <> result) && ([RDONLY; flag] <> result)
+    (* O_SYNC includes the bits of O_DSYNC on Linux. *)
+    if to_code flag <> 0 && not (List.mem flag result)
     then failwith (Printf.sprintf "Fail: flag=%i code=%i" i (to_code flag))
   done;
   let all =
@@ -87,6 +101,11 @@ let _ =
        SYMLINK ;
        EVTONLY ;
        CLOEXEC ;
+       DIRECT ;
+       NOATIME ;
+       SYNC ;
+       DSYNC ;
     ] in
+  let all = List.filter (fun flag -> flag = RDONLY || to_code flag <> 0) all in
   assert (of_flags (to_flags all) = all)
 *)
@@ -14,6 +14,10 @@ type t =
   | SYMLINK
   | EVTONLY
   | CLOEXEC
+  | DIRECT
+  | NOATIME
+  | SYNC
+  | DSYNC
 
 val rdonly : flags
 val wronly : flags
@@ -29,8 +33,13 @@ val nofollow : flags
 val symlink : flags
 val evtonly : flags
 val cloexec : flags
+val direct : flags
+val noatime : flags
+val sync : flags
+val dsync : flags
 
 val to_code : t -> flags
+(* Flags the platform doesn't have are never set. *)
 val has : flags -> t -> bool
 val of_flags : flags -> t list
 val to_flags : t list -> flags
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
 #include <caml/alloc.h>
@@ -8,6 +10,29 @@
 
 #include <sys/fcntl.h>
 
+/* Flags of another platform are 0, which OpenFlags.has never reports. */
+#ifndef O_SHLOCK
+#define O_SHLOCK 0
+#endif
+#ifndef O_EXLOCK
+#define O_EXLOCK 0
+#endif
+#ifndef O_SYMLINK
+#define O_SYMLINK 0
+#endif
+#ifndef O_EVTONLY
+#define O_EVTONLY 0
+#endif
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+#ifndef O_DSYNC
+#define O_DSYNC 0
+#endif
+
 static int openflags_table[] = {
   O_RDONLY,
   O_WRONLY,
@@ -22,7 +47,11 @@ static int openflags_table[] = {
   O_NOFOLLOW,
   O_SYMLINK,
   O_EVTONLY,
-  O_CLOEXEC
+  O_CLOEXEC,
+  O_DIRECT,
+  O_NOATIME,
+  O_SYNC,
+  O_DSYNC
 };
 
 CAMLprim value ocamlfuse_openflags_impl(value unit) {
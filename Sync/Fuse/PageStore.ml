@@ -0,0 +1,65 @@
+type t
+
+type image
+
+type buffer = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(* Same as OCAMLFUSE_PAGE_SIZE in PageStoreImpl.c. *)
+let page_size = 4096
+
+external create : unit -> t = "ocamlfuse_page_create_impl"
+external size : t -> int = "ocamlfuse_page_size_impl" [@@noalloc]
+external read_impl : t -> int -> int -> string = "ocamlfuse_page_read_impl"
+external read_into_impl : t -> int -> buffer -> int = "ocamlfuse_page_read_into_impl"
+external write_impl : t -> int -> string -> unit = "ocamlfuse_page_write_impl"
+external write_from_impl : t -> int -> buffer -> unit = "ocamlfuse_page_write_from_impl"
+external truncate_impl : t -> int -> unit = "ocamlfuse_page_truncate_impl"
+external clear : t -> unit = "ocamlfuse_page_clear_impl" [@@noalloc]
+external copy : t -> t = "ocamlfuse_page_copy_impl"
+external usage : unit -> int * int = "ocamlfuse_page_usage_impl"
+external map : Unix.file_descr -> int -> image = "ocamlfuse_page_map_impl"
+external attach_impl : t -> image -> int -> int -> unit = "ocamlfuse_page_attach_impl"
+
+let check_offset offset =
+  if offset < 0 then invalid_arg "PageStore: negative offset"
+
+let read t ~offset ~size =
+  check_offset offset;
+  read_impl t offset size
+
+let read_into t ~offset ~buffer =
+  check_offset offset;
+  read_into_impl t offset buffer
+
+let write t ~offset ~data =
+  check_offset offset;
+  write_impl t offset data
+
+let write_from t ~offset ~buffer =
+  check_offset offset;
+  write_from_impl t offset buffer
+
+let truncate t size =
+  check_offset size;
+  truncate_impl t size
+
+let attach t image ~offset ~size = attach_impl t image offset size
+
+let () =
+  assert begin
+      let t = create () in
+      write t ~offset: 10 ~data: "abc";
+      let written = size t = 13 && read t ~offset: 8 ~size: 10 = "\000\000abc" in
+      write t ~offset: (page_size - 1) ~data: "xy";
+      let straddling = read t ~offset: (page_size - 2) ~size: 4 = "\000xy" in
+      let c = copy t in
+      write c ~offset: 10 ~data: "A";
+      let copied = read t ~offset: 10 ~size: 1 = "a" && read c ~offset: 10 ~size: 3 = "Abc" in
+      truncate t 11;
+      truncate t 20;
+      let truncated = read t ~offset: 10 ~size: 10 = "a" ^ String.make 9 '\000'
+		      && read c ~offset: (page_size - 1) ~size: 2 = "xy" in
+      clear t;
+      clear c;
+      written && straddling && copied && truncated && size t = 0
+    end
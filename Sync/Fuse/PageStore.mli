@@ -0,0 +1,60 @@
+(** File contents kept outside of the OCaml heap, in pages of
+    [page_size] bytes, so that writing to a file costs the size of the
+    write rather than the size of the file.
+
+    Ranges that were never written are holes, which take no pages and read
+    as zeros. Copies share their pages until either side writes to them.
+
+    A file can also start from a region of an image, a read-only mapping of
+    a file on disk, whose pages are loaded on first read and copied on
+    first write. *)
+
+type t
+
+type image
+
+type buffer = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+val page_size : int
+
+(** An empty file. *)
+val create : unit -> t
+
+val size : t -> int
+
+(** Reads up to [size] bytes from [offset], fewer at the end of the file. *)
+val read : t -> offset: int -> size: int -> string
+
+(** Reads into [buffer] from [offset], and returns the number of bytes read,
+    without allocating on the OCaml heap. *)
+val read_into : t -> offset: int -> buffer: buffer -> int
+
+(** Writes at [offset], extending the file if needed. A write past the end
+    leaves a hole between the end and [offset]. *)
+val write : t -> offset: int -> data: string -> unit
+
+val write_from : t -> offset: int -> buffer: buffer -> unit
+
+(** Shrinking releases the pages past the new size, extending leaves a
+    hole. *)
+val truncate : t -> int -> unit
+
+(** Releases all the pages, leaving an empty file. The pages of a file are
+    otherwise released when it is garbage collected. *)
+val clear : t -> unit
+
+(** Maps the first [length] bytes of a file, which can be closed
+    afterwards. The mapping lasts as long as the image or a file attached
+    to it. *)
+val map : Unix.file_descr -> int -> image
+
+(** Replaces the contents of the file with the [size] bytes of the image
+    from [offset]. *)
+val attach : t -> image -> offset: int -> size: int -> unit
+
+(** A copy of the file, sharing its pages. *)
+val copy : t -> t
+
+(** Number of pages used by all the files, and number of pages allocated
+    from the system, which are never returned to it. *)
+val usage : unit -> int * int
@@ -0,0 +1,532 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* File contents kept off the OCaml heap, in fixed size pages. A file maps
+ * page indexes to pages through a radix tree, in which a missing page is
+ * a hole that reads as zeros. Pages are reference counted, so that copies
+ * of a file share them until one side writes.
+ *
+ * A file can also be attached to a region of an image, a read-only mapping
+ * of a file on disk: the pages missing from its tree are read from the
+ * region, which the system loads on first access, and copied into the tree
+ * on first write.
+ *
+ * Every function runs under the runtime lock, which serializes them. */
+
+/* Must match PageStore.page_size. */
+#define OCAMLFUSE_PAGE_BITS 12
+#define OCAMLFUSE_PAGE_SIZE (1 << OCAMLFUSE_PAGE_BITS)
+
+/* Pages are carved out of slabs mapped this many at a time. Slabs are never
+ * unmapped: freed pages go to a free list for the next allocations. */
+#define OCAMLFUSE_SLAB_PAGES 256
+
+#define OCAMLFUSE_RADIX_BITS 6
+#define OCAMLFUSE_RADIX_SLOTS (1 << OCAMLFUSE_RADIX_BITS)
+
+struct ocamlfuse_page {
+  union {
+    struct ocamlfuse_page* next_free;
+    uint32_t refs;
+  };
+  char* data;
+};
+
+struct ocamlfuse_radix_node {
+  void* slots[OCAMLFUSE_RADIX_SLOTS];
+};
+
+/* Unmapped when the last file attached to it, or its OCaml value, is
+ * released. */
+struct ocamlfuse_page_image {
+  intnat refs;
+  char* data;
+  size_t length;
+};
+
+/* root is a page when height is 0, and a node whose slots cover
+ * OCAMLFUSE_RADIX_SLOTS^height pages otherwise. The first base_size bytes
+ * missing from the tree are read from base, in image. */
+struct ocamlfuse_page_file {
+  void* root;
+  int height;
+  int64_t size;
+  struct ocamlfuse_page_image* image;
+  const char* base;
+  int64_t base_size;
+};
+
+static struct ocamlfuse_page* ocamlfuse_page_free_list = NULL;
+static intnat ocamlfuse_pages_used = 0;
+static intnat ocamlfuse_pages_mapped = 0;
+
+#define File_val(v) (*((struct ocamlfuse_page_file**) Data_custom_val(v)))
+#define Image_val(v) (*((struct ocamlfuse_page_image**) Data_custom_val(v)))
+
+/* Maps a new slab, and adds its pages to the free list. Returns false when
+ * memory is exhausted. */
+static int ocamlfuse_page_grow(void)
+{
+  struct ocamlfuse_page* pages = malloc(OCAMLFUSE_SLAB_PAGES * sizeof(struct ocamlfuse_page));
+  if (pages == NULL) {
+    return 0;
+  }
+  char* data = mmap(NULL, (size_t) OCAMLFUSE_SLAB_PAGES * OCAMLFUSE_PAGE_SIZE,
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    free(pages);
+    return 0;
+  }
+  for (int i = OCAMLFUSE_SLAB_PAGES - 1; i >= 0; i--) {
+    pages[i].data = data + (size_t) i * OCAMLFUSE_PAGE_SIZE;
+    pages[i].next_free = ocamlfuse_page_free_list;
+    ocamlfuse_page_free_list = &pages[i];
+  }
+  ocamlfuse_pages_mapped += OCAMLFUSE_SLAB_PAGES;
+  return 1;
+}
+
+/* Returns a page with one reference and undefined contents. */
+static struct ocamlfuse_page* ocamlfuse_page_alloc(void)
+{
+  if (ocamlfuse_page_free_list == NULL && !ocamlfuse_page_grow()) {
+    caml_raise_out_of_memory();
+  }
+  struct ocamlfuse_page* page = ocamlfuse_page_free_list;
+  ocamlfuse_page_free_list = page->next_free;
+  page->refs = 1;
+  ocamlfuse_pages_used++;
+  return page;
+}
+
+static void ocamlfuse_page_unref(struct ocamlfuse_page* page)
+{
+  if (--page->refs == 0) {
+    page->next_free = ocamlfuse_page_free_list;
+    ocamlfuse_page_free_list = page;
+    ocamlfuse_pages_used--;
+  }
+}
+
+/* Pages covered by a subtree of the given height. */
+static int64_t ocamlfuse_radix_span(int height)
+{
+  return (int64_t) 1 << (OCAMLFUSE_RADIX_BITS * height);
+}
+
+static int ocamlfuse_radix_slot(int64_t index, int level)
+{
+  return (index >> (OCAMLFUSE_RADIX_BITS * (level - 1))) & (OCAMLFUSE_RADIX_SLOTS - 1);
+}
+
+/* Returns the page at index, or NULL for a hole. */
+static struct ocamlfuse_page* ocamlfuse_page_find(struct ocamlfuse_page_file* file, int64_t index)
+{
+  if (index >= ocamlfuse_radix_span(file->height)) {
+    return NULL;
+  }
+  void* slot = file->root;
+  for (int level = file->height; level > 0 && slot != NULL; level--) {
+    slot = ((struct ocamlfuse_radix_node*) slot)->slots[ocamlfuse_radix_slot(index, level)];
+  }
+  return slot;
+}
+
+/* Returns the slot of the page at index, adding the levels and nodes that
+ * lead to it. */
+static struct ocamlfuse_page** ocamlfuse_page_slot(struct ocamlfuse_page_file* file, int64_t index)
+{
+  while (index >= ocamlfuse_radix_span(file->height)) {
+    if (file->root != NULL) {
+      struct ocamlfuse_radix_node* node = calloc(1, sizeof(struct ocamlfuse_radix_node));
+      if (node == NULL) {
+	caml_raise_out_of_memory();
+      }
+      node->slots[0] = file->root;
+      file->root = node;
+    }
+    file->height++;
+  }
+  void** slot = &file->root;
+  for (int level = file->height; level > 0; level--) {
+    if (*slot == NULL) {
+      *slot = calloc(1, sizeof(struct ocamlfuse_radix_node));
+      if (*slot == NULL) {
+	caml_raise_out_of_memory();
+      }
+    }
+    slot = &((struct ocamlfuse_radix_node*) *slot)->slots[ocamlfuse_radix_slot(index, level)];
+  }
+  return (struct ocamlfuse_page**) slot;
+}
+
+static void ocamlfuse_page_image_unref(struct ocamlfuse_page_image* image)
+{
+  if (image != NULL && --image->refs == 0) {
+    if (image->length > 0) {
+      munmap(image->data, image->length);
+    }
+    free(image);
+  }
+}
+
+static void ocamlfuse_page_detach(struct ocamlfuse_page_file* file)
+{
+  ocamlfuse_page_image_unref(file->image);
+  file->image = NULL;
+  file->base = NULL;
+  file->base_size = 0;
+}
+
+/* Copies size bytes at position, which are missing from the tree, from the
+ * base of the file, or zeros past it. */
+static void ocamlfuse_page_fill(struct ocamlfuse_page_file* file, int64_t position,
+				int64_t size, char* data)
+{
+  int64_t from_base = file->base_size - position;
+  if (from_base <= 0) {
+    memset(data, 0, size);
+  } else if (from_base >= size) {
+    memcpy(data, file->base + position, size);
+  } else {
+    memcpy(data, file->base + position, from_base);
+    memset(data + from_base, 0, size - from_base);
+  }
+}
+
+/* Returns the data of the page at index for writing: a missing page is
+ * added, and filled from the base unless the caller overwrites it whole,
+ * and a shared page is copied first. */
+static char* ocamlfuse_page_writable(struct ocamlfuse_page_file* file, int64_t index, int whole)
+{
+  struct ocamlfuse_page** slot = ocamlfuse_page_slot(file, index);
+  struct ocamlfuse_page* page = *slot;
+  if (page == NULL) {
+    page = ocamlfuse_page_alloc();
+    if (!whole) {
+      ocamlfuse_page_fill(file, index << OCAMLFUSE_PAGE_BITS, OCAMLFUSE_PAGE_SIZE, page->data);
+    }
+    *slot = page;
+  } else if (page->refs > 1) {
+    struct ocamlfuse_page* copy = ocamlfuse_page_alloc();
+    if (!whole) {
+      memcpy(copy->data, page->data, OCAMLFUSE_PAGE_SIZE);
+    }
+    ocamlfuse_page_unref(page);
+    *slot = copy;
+    page = copy;
+  }
+  return page->data;
+}
+
+/* Drops the pages from index first on in the subtree at slot, which covers
+ * the pages from base on, and the nodes left without pages. */
+static void ocamlfuse_page_release(void** slot, int level, int64_t base, int64_t first)
+{
+  if (*slot == NULL) {
+    return;
+  }
+  if (level == 0) {
+    if (base >= first) {
+      ocamlfuse_page_unref(*slot);
+      *slot = NULL;
+    }
+    return;
+  }
+  struct ocamlfuse_radix_node* node = *slot;
+  int64_t span = ocamlfuse_radix_span(level - 1);
+  for (int i = 0; i < OCAMLFUSE_RADIX_SLOTS; i++) {
+    if (base + (i + 1) * span > first) {
+      ocamlfuse_page_release(&node->slots[i], level - 1, base + i * span, first);
+    }
+  }
+  if (base >= first) {
+    free(node);
+    *slot = NULL;
+  }
+}
+
+/* Copies a subtree, sharing its pages. */
+static void* ocamlfuse_page_share(void* slot, int level)
+{
+  if (slot == NULL) {
+    return NULL;
+  }
+  if (level == 0) {
+    ((struct ocamlfuse_page*) slot)->refs++;
+    return slot;
+  }
+  struct ocamlfuse_radix_node* node = slot;
+  struct ocamlfuse_radix_node* copy = malloc(sizeof(struct ocamlfuse_radix_node));
+  if (copy == NULL) {
+    caml_raise_out_of_memory();
+  }
+  for (int i = 0; i < OCAMLFUSE_RADIX_SLOTS; i++) {
+    copy->slots[i] = ocamlfuse_page_share(node->slots[i], level - 1);
+  }
+  return copy;
+}
+
+static void ocamlfuse_page_file_finalize(value v)
+{
+  struct ocamlfuse_page_file* file = File_val(v);
+  ocamlfuse_page_release(&file->root, file->height, 0, 0);
+  ocamlfuse_page_detach(file);
+  free(file);
+}
+
+static struct custom_operations ocamlfuse_page_file_ops = {
+  "ocamlfuse.page_file",
+  ocamlfuse_page_file_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+};
+
+static value ocamlfuse_page_file_alloc(struct ocamlfuse_page_file* file)
+{
+  value v = caml_alloc_custom(&ocamlfuse_page_file_ops, sizeof(struct ocamlfuse_page_file*), 0, 1);
+  File_val(v) = file;
+  return v;
+}
+
+CAMLprim value ocamlfuse_page_create_impl(value unit)
+{
+  struct ocamlfuse_page_file* file = calloc(1, sizeof(struct ocamlfuse_page_file));
+  if (file == NULL) {
+    caml_raise_out_of_memory();
+  }
+  return ocamlfuse_page_file_alloc(file);
+}
+
+CAMLprim value ocamlfuse_page_copy_impl(value v)
+{
+  CAMLparam1(v);
+  struct ocamlfuse_page_file* file = File_val(v);
+  struct ocamlfuse_page_file* copy = malloc(sizeof(struct ocamlfuse_page_file));
+  if (copy == NULL) {
+    caml_raise_out_of_memory();
+  }
+  copy->root = ocamlfuse_page_share(file->root, file->height);
+  copy->height = file->height;
+  copy->size = file->size;
+  copy->image = file->image;
+  copy->base = file->base;
+  copy->base_size = file->base_size;
+  if (copy->image != NULL) {
+    copy->image->refs++;
+  }
+  CAMLreturn(ocamlfuse_page_file_alloc(copy));
+}
+
+CAMLprim value ocamlfuse_page_size_impl(value v)
+{
+  return Val_long(File_val(v)->size);
+}
+
+/* Copies size bytes from offset, clipped to the file, into data. Returns
+ * the number of bytes copied. */
+static int64_t ocamlfuse_page_read(struct ocamlfuse_page_file* file, int64_t offset,
+				   int64_t size, char* data)
+{
+  if (offset >= file->size || size <= 0) {
+    return 0;
+  }
+  if (size > file->size - offset) {
+    size = file->size - offset;
+  }
+  int64_t done = 0;
+  while (done < size) {
+    int64_t position = offset + done;
+    int64_t in_page = position & (OCAMLFUSE_PAGE_SIZE - 1);
+    int64_t chunk = OCAMLFUSE_PAGE_SIZE - in_page;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+    struct ocamlfuse_page* page = ocamlfuse_page_find(file, position >> OCAMLFUSE_PAGE_BITS);
+    if (page == NULL) {
+      ocamlfuse_page_fill(file, position, chunk, data + done);
+    } else {
+      memcpy(data + done, page->data + in_page, chunk);
+    }
+    done += chunk;
+  }
+  return size;
+}
+
+/* Copies size bytes of data at offset, extending the file as needed. */
+static void ocamlfuse_page_write(struct ocamlfuse_page_file* file, int64_t offset,
+				 int64_t size, const char* data)
+{
+  int64_t done = 0;
+  while (done < size) {
+    int64_t position = offset + done;
+    int64_t in_page = position & (OCAMLFUSE_PAGE_SIZE - 1);
+    int64_t chunk = OCAMLFUSE_PAGE_SIZE - in_page;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+    char* page = ocamlfuse_page_writable(file, position >> OCAMLFUSE_PAGE_BITS,
+					 chunk == OCAMLFUSE_PAGE_SIZE);
+    memcpy(page + in_page, data + done, chunk);
+    done += chunk;
+  }
+  if (offset + size > file->size) {
+    file->size = offset + size;
+  }
+}
+
+CAMLprim value ocamlfuse_page_read_impl(value v, value offset, value size)
+{
+  CAMLparam3(v, offset, size);
+  CAMLlocal1(data);
+  struct ocamlfuse_page_file* file = File_val(v);
+  int64_t start = Long_val(offset);
+  int64_t length = Long_val(size);
+  if (start >= file->size || length <= 0) {
+    CAMLreturn(caml_alloc_string(0));
+  }
+  if (length > file->size - start) {
+    length = file->size - start;
+  }
+  data = caml_alloc_string(length);
+  ocamlfuse_page_read(File_val(v), start, length, (char*) Bytes_val(data));
+  CAMLreturn(data);
+}
+
+CAMLprim value ocamlfuse_page_read_into_impl(value v, value offset, value buffer)
+{
+  return Val_long(ocamlfuse_page_read(File_val(v), Long_val(offset),
+				      Caml_ba_array_val(buffer)->dim[0],
+				      Caml_ba_data_val(buffer)));
+}
+
+CAMLprim value ocamlfuse_page_write_impl(value v, value offset, value data)
+{
+  ocamlfuse_page_write(File_val(v), Long_val(offset), caml_string_length(data),
+		       String_val(data));
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_page_write_from_impl(value v, value offset, value buffer)
+{
+  ocamlfuse_page_write(File_val(v), Long_val(offset), Caml_ba_array_val(buffer)->dim[0],
+		       Caml_ba_data_val(buffer));
+  return Val_unit;
+}
+
+/* Shrinking drops the pages past the end, and zeroes the end of the last
+ * one, so that extending the file again reads zeros. Extending only moves
+ * the size: the new range is a hole. */
+CAMLprim value ocamlfuse_page_truncate_impl(value v, value size)
+{
+  struct ocamlfuse_page_file* file = File_val(v);
+  int64_t new_size = Long_val(size);
+  if (new_size < file->size) {
+    int64_t first = (new_size + OCAMLFUSE_PAGE_SIZE - 1) >> OCAMLFUSE_PAGE_BITS;
+    ocamlfuse_page_release(&file->root, file->height, 0, first);
+    if (file->root == NULL) {
+      file->height = 0;
+    }
+    if (file->base_size > new_size) {
+      file->base_size = new_size;
+    }
+    int64_t in_page = new_size & (OCAMLFUSE_PAGE_SIZE - 1);
+    if (in_page && ocamlfuse_page_find(file, new_size >> OCAMLFUSE_PAGE_BITS) != NULL) {
+      char* page = ocamlfuse_page_writable(file, new_size >> OCAMLFUSE_PAGE_BITS, 0);
+      memset(page + in_page, 0, OCAMLFUSE_PAGE_SIZE - in_page);
+    }
+  }
+  file->size = new_size;
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_page_clear_impl(value v)
+{
+  struct ocamlfuse_page_file* file = File_val(v);
+  ocamlfuse_page_release(&file->root, file->height, 0, 0);
+  ocamlfuse_page_detach(file);
+  file->height = 0;
+  file->size = 0;
+  return Val_unit;
+}
+
+static void ocamlfuse_page_image_finalize(value v)
+{
+  ocamlfuse_page_image_unref(Image_val(v));
+}
+
+static struct custom_operations ocamlfuse_page_image_ops = {
+  "ocamlfuse.page_image",
+  ocamlfuse_page_image_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+};
+
+/* Maps the first length bytes of a file descriptor, which can be closed
+ * afterwards. */
+CAMLprim value ocamlfuse_page_map_impl(value fd, value length)
+{
+  struct ocamlfuse_page_image* image = malloc(sizeof(struct ocamlfuse_page_image));
+  if (image == NULL) {
+    caml_raise_out_of_memory();
+  }
+  image->refs = 1;
+  image->length = Long_val(length);
+  image->data = NULL;
+  if (image->length > 0) {
+    image->data = mmap(NULL, image->length, PROT_READ, MAP_SHARED, Int_val(fd), 0);
+    if (image->data == MAP_FAILED) {
+      free(image);
+      caml_failwith("PageStore.map");
+    }
+  }
+  value v = caml_alloc_custom(&ocamlfuse_page_image_ops, sizeof(struct ocamlfuse_page_image*), 0, 1);
+  Image_val(v) = image;
+  return v;
+}
+
+/* Replaces the contents of a file with size bytes of image from offset. */
+CAMLprim value ocamlfuse_page_attach_impl(value v, value image_v, value offset, value size)
+{
+  struct ocamlfuse_page_file* file = File_val(v);
+  struct ocamlfuse_page_image* image = Image_val(image_v);
+  int64_t start = Long_val(offset);
+  int64_t length = Long_val(size);
+  if (start < 0 || length < 0 || (size_t) (start + length) > image->length) {
+    caml_invalid_argument("PageStore.attach");
+  }
+  image->refs++;
+  ocamlfuse_page_release(&file->root, file->height, 0, 0);
+  ocamlfuse_page_detach(file);
+  file->height = 0;
+  file->image = image;
+  file->base = image->data + start;
+  file->base_size = length;
+  file->size = length;
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_page_usage_impl(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, Val_long(ocamlfuse_pages_used));
+  Store_field(result, 1, Val_long(ocamlfuse_pages_mapped));
+  CAMLreturn(result);
+}
@@ -0,0 +1,32 @@
+(** Evaluate throughput of FUSE operations with and without a dispatch
+    worker, under parallel load. *)
+
+module Dispatch = Sync_Fuse_Dispatch
+
+external run : int -> int -> float = "ocamlfuse_dispatch_perf_run_impl"
+
+let threads = 8
+let ops = 100 * 1000
+
+(* A cheap handler, so that the cost measured is the one of reaching it. *)
+let total = ref 0
+let () = Callback.register "ocamlfuse_dispatch_perf" (fun i -> total := !total + i; i)
+
+let print name time =
+  Printf.printf "%s: %f (%.0f ops/s)\n%!"
+    name
+    time
+    (float_of_int (threads * ops) /. time)
+
+let perf () =
+  print "Direct" (run threads ops);
+  List.iter begin fun batch ->
+	      let worker = Dispatch.start ~batch in
+	      let time = run threads ops in
+	      Dispatch.stop ();
+	      Thread.join worker;
+	      print (Printf.sprintf "Batch %d" batch) time
+	      end
+	    [ 1 ; 8 ; 64 ]
+
+let () = perf ()
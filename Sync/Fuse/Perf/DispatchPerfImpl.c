@@ -0,0 +1,69 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/callback.h>
+#include <caml/threads.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../DispatchImpl.h"
+
+/* Stands in for FUSE: threads that each dispatch ops calls to the handler
+ * registered as "ocamlfuse_dispatch_perf", an int -> int. */
+
+struct ocamlfuse_perf_call {
+  value* callback;
+  long argument;
+  long result;
+};
+
+static void ocamlfuse_perf_run(void* data)
+{
+  struct ocamlfuse_perf_call* call = data;
+  call->result = Long_val(caml_callback(*call->callback, Val_long(call->argument)));
+}
+
+struct ocamlfuse_perf_thread {
+  pthread_t thread;
+  value* callback;
+  long ops;
+};
+
+static void* ocamlfuse_perf_thread(void* data)
+{
+  struct ocamlfuse_perf_thread* thread = data;
+  for (long i = 0; i < thread->ops; i++) {
+    struct ocamlfuse_perf_call call = { thread->callback, i, 0 };
+    ocamlfuse_dispatch(ocamlfuse_perf_run, &call);
+  }
+  caml_c_thread_unregister();
+  return NULL;
+}
+
+/* Runs threads threads of ops calls each, and returns the seconds they
+ * took. */
+CAMLprim value ocamlfuse_dispatch_perf_run_impl(value threads, value ops)
+{
+  CAMLparam2(threads, ops);
+  value* callback = caml_named_value("ocamlfuse_dispatch_perf");
+  int count = Int_val(threads);
+  struct ocamlfuse_perf_thread* workers = calloc(count, sizeof(struct ocamlfuse_perf_thread));
+  struct timespec start, end;
+  caml_release_runtime_system();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < count; i++) {
+    workers[i].callback = callback;
+    workers[i].ops = Long_val(ops);
+    pthread_create(&workers[i].thread, NULL, ocamlfuse_perf_thread, &workers[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  caml_acquire_runtime_system();
+  free(workers);
+  CAMLreturn(caml_copy_double((end.tv_sec - start.tv_sec)
+			      + (end.tv_nsec - start.tv_nsec) / 1e9));
+}
@@ -0,0 +1,80 @@
+(** Drives the path based operations of MemFs from C threads, the way FUSE
+    calls them but without a mount, and prints the throughput, latency
+    percentiles and allocation of each workload as JSON, for comparison
+    across revisions. *)
+
+module OCamlFuse = Sync_Fuse_OCamlFuse
+module MemFs = Sync_MemFs
+module ReadAhead = Sync_Fuse_ReadAhead
+
+(* Same order as enum ocamlfuse_perf_workload in OperationsPerfImpl.c. *)
+type workload =
+  | Metadata
+  | SequentialWrite
+  | SequentialRead
+  | RandomWrite
+  | Churn
+
+external init : unit -> unit = "ocamlfuse_operations_perf_init_impl"
+external run : workload -> int -> int -> int -> float * int * int * int * int
+  = "ocamlfuse_operations_perf_run_impl"
+
+let threads, ops =
+  let threads = ref 8
+  and ops = ref (100 * 1000) in
+  let specs = [ "threads", Arg.Set_int threads,
+		"<n> Threads calling the operations" ;
+		"ops", Arg.Set_int ops,
+		"<n> Operations per thread, scaled down for blocks over 4 KiB" ]
+  in
+  Sync_Utils_CommandLine.parse specs;
+  !threads, !ops
+
+let name = function
+  | Metadata -> "metadata"
+  | SequentialWrite -> "sequential_write"
+  | SequentialRead -> "sequential_read"
+  | RandomWrite -> "random_write"
+  | Churn -> "churn"
+
+(* Words allocated on the OCaml heap, by every thread. *)
+let allocated () =
+  let minor, promoted, major = Gc.counters () in
+  minor +. major -. promoted
+
+(* Sequential reads are also measured through the C read-ahead, which
+   answers most of them without calling MemFs. *)
+let read_ahead_size = 1024 * 1024
+
+let measure (workload, block_size, read_ahead) =
+  if read_ahead then ReadAhead.enable ~chunk_size: read_ahead_size else ReadAhead.disable ();
+  let ops = max 100 (ops * 4096 / max 4096 block_size) in
+  let words = allocated () in
+  let seconds, p50, p99, p999, errors = run workload threads ops block_size in
+  let total = float_of_int (threads * ops) in
+  `Assoc [ "workload", `String (name workload) ;
+	   "block_size", `Int block_size ;
+	   "read_ahead", `Int (if read_ahead then read_ahead_size else 0) ;
+	   "threads", `Int threads ;
+	   "ops", `Int (threads * ops) ;
+	   "errors", `Int errors ;
+	   "ops_per_second", `Float (total /. seconds) ;
+	   "p50_ns", `Int p50 ;
+	   "p99_ns", `Int p99 ;
+	   "p999_ns", `Int p999 ;
+	   "words_per_op", `Float ((allocated () -. words) /. total) ]
+
+let perf () =
+  OCamlFuse.register MemFs.filesystem;
+  init ();
+  let sizes = [ 4096 ; 65536 ; 1024 * 1024 ] in
+  let runs =
+    [ Metadata, 0, false ]
+    @ List.map (fun size -> SequentialWrite, size, false) sizes
+    @ List.map (fun size -> SequentialRead, size, false) sizes
+    @ List.map (fun size -> SequentialRead, size, true) [ 4096 ; 65536 ]
+    @ [ RandomWrite, 4096, false ; Churn, 0, false ] in
+  let results = List.map measure runs in
+  print_endline (Yojson.Basic.pretty_to_string (`List results))
+
+let () = perf ()
@@ -0,0 +1,303 @@
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 29
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/threads.h>
+
+#include <fuse.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../OCamlFuseImpl.h"
+
+/* Stands in for the kernel and libfuse: threads that call the path based
+ * operations directly, each in its own folder, and time every call. */
+
+/* Same order as OperationsPerf.workload. */
+enum ocamlfuse_perf_workload {
+  OCAMLFUSE_PERF_METADATA,
+  OCAMLFUSE_PERF_SEQUENTIAL_WRITE,
+  OCAMLFUSE_PERF_SEQUENTIAL_READ,
+  OCAMLFUSE_PERF_RANDOM_WRITE,
+  OCAMLFUSE_PERF_CHURN,
+};
+
+/* Files per folder listed by the metadata workload. */
+#define OCAMLFUSE_PERF_FILES 64
+
+/* Blocks in the file of the sequential workloads, which wrap around. */
+#define OCAMLFUSE_PERF_BLOCKS 256
+
+/* The random workload writes 4 KiB blocks in a file of this many. */
+#define OCAMLFUSE_PERF_RANDOM_BLOCKS 4096
+#define OCAMLFUSE_PERF_RANDOM_SIZE 4096
+
+static const struct fuse_operations* ocamlfuse_perf_operations;
+
+struct ocamlfuse_perf_thread {
+  pthread_t thread;
+  int index;
+  enum ocamlfuse_perf_workload workload;
+  long ops;
+  size_t block_size;
+  char* block;
+  int64_t* latencies;
+  long errors;
+};
+
+static int64_t ocamlfuse_perf_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Listings are made as readdirplus on FUSE 3, so every entry MemFs gives
+ * attributes for must reach the kernel with them. */
+#if FUSE_USE_VERSION >= 30
+static int ocamlfuse_perf_filler(void* buf, const char* name, const struct stat* stbuf, off_t off,
+				 enum fuse_fill_dir_flags flags)
+#else
+static int ocamlfuse_perf_filler(void* buf, const char* name, const struct stat* stbuf, off_t off)
+#endif
+{
+#if FUSE_USE_VERSION >= 30
+  assert(stbuf == NULL || flags == FUSE_FILL_DIR_PLUS);
+#endif
+  (*(long*) buf)++;
+  return 0;
+}
+
+static int ocamlfuse_perf_write(const char* path, const char* data, size_t size, off_t offset,
+				struct fuse_file_info* fi)
+{
+  const struct fuse_operations* ops = ocamlfuse_perf_operations;
+  if (ops->write_buf) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void*) data;
+    return ops->write_buf(path, &bufv, offset, fi);
+  }
+  return ops->write(path, data, size, offset, fi);
+}
+
+/* Creates the folder of a thread, and the files its workload needs. */
+static void ocamlfuse_perf_prepare(struct ocamlfuse_perf_thread* thread)
+{
+  const struct fuse_operations* ops = ocamlfuse_perf_operations;
+  char path[64];
+  struct fuse_file_info fi;
+  snprintf(path, sizeof(path), "/t%d", thread->index);
+  ops->mkdir(path, 0755);
+  switch (thread->workload) {
+  case OCAMLFUSE_PERF_METADATA:
+    for (int i = 0; i < OCAMLFUSE_PERF_FILES; i++) {
+      snprintf(path, sizeof(path), "/t%d/f%d", thread->index, i);
+      memset(&fi, 0, sizeof(fi));
+      if (ops->create(path, 0644, &fi) == 0) {
+	ops->release(path, &fi);
+      }
+    }
+    break;
+  case OCAMLFUSE_PERF_SEQUENTIAL_READ:
+    snprintf(path, sizeof(path), "/t%d/sequential", thread->index);
+    memset(&fi, 0, sizeof(fi));
+    if (ops->create(path, 0644, &fi) == 0 || ops->open(path, &fi) == 0) {
+      for (long i = 0; i < OCAMLFUSE_PERF_BLOCKS; i++) {
+	ocamlfuse_perf_write(path, thread->block, thread->block_size,
+			     i * thread->block_size, &fi);
+      }
+      ops->release(path, &fi);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static int ocamlfuse_perf_op(struct ocamlfuse_perf_thread* thread, long i,
+			     struct fuse_file_info* fi, unsigned int* seed)
+{
+  const struct fuse_operations* ops = ocamlfuse_perf_operations;
+  char path[64];
+  switch (thread->workload) {
+  case OCAMLFUSE_PERF_METADATA:
+    if (i % 16 == 0) {
+      /* A listing, as the kernel makes it. */
+      long entries = 0;
+      struct fuse_file_info dir;
+      memset(&dir, 0, sizeof(dir));
+      snprintf(path, sizeof(path), "/t%d", thread->index);
+      int res = ops->opendir(path, &dir);
+      if (res == 0) {
+#if FUSE_USE_VERSION >= 30
+	res = ops->readdir(path, &entries, ocamlfuse_perf_filler, 0, &dir, FUSE_READDIR_PLUS);
+#else
+	res = ops->readdir(path, &entries, ocamlfuse_perf_filler, 0, &dir);
+#endif
+	ops->releasedir(path, &dir);
+      }
+      return res;
+    } else {
+      struct stat stbuf;
+      snprintf(path, sizeof(path), "/t%d/f%ld", thread->index, i % OCAMLFUSE_PERF_FILES);
+#if FUSE_USE_VERSION >= 30
+      return ops->getattr(path, &stbuf, NULL);
+#else
+      return ops->getattr(path, &stbuf);
+#endif
+    }
+  case OCAMLFUSE_PERF_SEQUENTIAL_WRITE:
+    snprintf(path, sizeof(path), "/t%d/sequential", thread->index);
+    return ocamlfuse_perf_write(path, thread->block, thread->block_size,
+				(i % OCAMLFUSE_PERF_BLOCKS) * thread->block_size, fi);
+  case OCAMLFUSE_PERF_SEQUENTIAL_READ:
+    snprintf(path, sizeof(path), "/t%d/sequential", thread->index);
+    return ops->read(path, thread->block, thread->block_size,
+		     (i % OCAMLFUSE_PERF_BLOCKS) * thread->block_size, fi);
+  case OCAMLFUSE_PERF_RANDOM_WRITE:
+    snprintf(path, sizeof(path), "/t%d/random", thread->index);
+    return ocamlfuse_perf_write(path, thread->block, OCAMLFUSE_PERF_RANDOM_SIZE,
+				(off_t) (rand_r(seed) % OCAMLFUSE_PERF_RANDOM_BLOCKS)
+				* OCAMLFUSE_PERF_RANDOM_SIZE, fi);
+  case OCAMLFUSE_PERF_CHURN: {
+    struct fuse_file_info churn;
+    memset(&churn, 0, sizeof(churn));
+    snprintf(path, sizeof(path), "/t%d/c%ld", thread->index, i);
+    int res = ops->create(path, 0644, &churn);
+    if (res == 0) {
+      ops->release(path, &churn);
+      res = ops->unlink(path);
+    }
+    return res;
+  }
+  }
+  return -EINVAL;
+}
+
+static void* ocamlfuse_perf_thread(void* data)
+{
+  struct ocamlfuse_perf_thread* thread = data;
+  const struct fuse_operations* ops = ocamlfuse_perf_operations;
+  unsigned int seed = thread->index;
+  char path[64];
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  const char* file = NULL;
+  if (thread->workload == OCAMLFUSE_PERF_SEQUENTIAL_WRITE
+      || thread->workload == OCAMLFUSE_PERF_SEQUENTIAL_READ) {
+    file = "sequential";
+  } else if (thread->workload == OCAMLFUSE_PERF_RANDOM_WRITE) {
+    file = "random";
+  }
+  if (file) {
+    snprintf(path, sizeof(path), "/t%d/%s", thread->index, file);
+    fi.flags = O_RDWR;
+    if (ops->open(path, &fi) != 0) {
+      ops->create(path, 0644, &fi);
+    }
+  }
+  for (long i = 0; i < thread->ops; i++) {
+    int64_t start = ocamlfuse_perf_now();
+    int res = ocamlfuse_perf_op(thread, i, &fi, &seed);
+    thread->latencies[i] = ocamlfuse_perf_now() - start;
+    if (res < 0) {
+      thread->errors++;
+    }
+  }
+  if (file) {
+    ops->release(path, &fi);
+  }
+  caml_c_thread_unregister();
+  return NULL;
+}
+
+static int ocamlfuse_perf_compare(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+  return (x > y) - (x < y);
+}
+
+CAMLprim value ocamlfuse_operations_perf_init_impl(value unit)
+{
+  struct fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  ocamlfuse_perf_operations = ocamlfuse_path_operations();
+  caml_release_runtime_system();
+#if FUSE_USE_VERSION >= 30
+  struct fuse_config config;
+  memset(&config, 0, sizeof(config));
+  ocamlfuse_perf_operations->init(&conn, &config);
+#else
+  ocamlfuse_perf_operations->init(&conn);
+#endif
+  caml_acquire_runtime_system();
+  return Val_unit;
+}
+
+/* Runs threads threads of ops operations of a workload each, and returns
+ * the seconds they took, the 50th, 99th and 99.9th percentiles of the
+ * latency of an operation in nanoseconds, and the number of errors. */
+CAMLprim value ocamlfuse_operations_perf_run_impl(value workload, value threads,
+						  value ops, value block_size)
+{
+  CAMLparam4(workload, threads, ops, block_size);
+  CAMLlocal1(result);
+  int count = Int_val(threads);
+  long per_thread = Long_val(ops);
+  struct ocamlfuse_perf_thread* workers = calloc(count, sizeof(struct ocamlfuse_perf_thread));
+  int64_t* latencies = malloc(count * per_thread * sizeof(int64_t));
+  if (workers == NULL || latencies == NULL) {
+    free(workers);
+    free(latencies);
+    caml_raise_out_of_memory();
+  }
+  for (int i = 0; i < count; i++) {
+    workers[i].index = i;
+    workers[i].workload = Int_val(workload);
+    workers[i].ops = per_thread;
+    workers[i].block_size = Long_val(block_size);
+    workers[i].block = malloc(Long_val(block_size));
+    memset(workers[i].block, 'a' + i % 26, Long_val(block_size));
+    workers[i].latencies = latencies + i * per_thread;
+  }
+
+  caml_release_runtime_system();
+  for (int i = 0; i < count; i++) {
+    ocamlfuse_perf_prepare(&workers[i]);
+  }
+  int64_t start = ocamlfuse_perf_now();
+  for (int i = 0; i < count; i++) {
+    pthread_create(&workers[i].thread, NULL, ocamlfuse_perf_thread, &workers[i]);
+  }
+  long errors = 0;
+  for (int i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    errors += workers[i].errors;
+    free(workers[i].block);
+  }
+  int64_t elapsed = ocamlfuse_perf_now() - start;
+  long total = count * per_thread;
+  qsort(latencies, total, sizeof(int64_t), ocamlfuse_perf_compare);
+  caml_acquire_runtime_system();
+
+  result = caml_alloc_tuple(5);
+  Store_field(result, 0, caml_copy_double(elapsed / 1e9));
+  Store_field(result, 1, Val_long(total ? latencies[total * 50 / 100] : 0));
+  Store_field(result, 2, Val_long(total ? latencies[total * 99 / 100] : 0));
+  Store_field(result, 3, Val_long(total ? latencies[total * 999 / 1000] : 0));
+  Store_field(result, 4, Val_long(errors));
+  free(latencies);
+  free(workers);
+  CAMLreturn(result);
+}
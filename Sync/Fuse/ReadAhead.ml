@@ -0,0 +1,10 @@
+external configure : int -> unit = "ocamlfuse_read_ahead_configure_impl"
+external invalidate : string -> unit = "ocamlfuse_read_ahead_invalidate_impl"
+external clear : unit -> unit = "ocamlfuse_read_ahead_clear_impl"
+external stats : unit -> int * int * int = "ocamlfuse_read_ahead_stats_impl"
+
+let enable ~chunk_size =
+  if chunk_size <= 0 then invalid_arg "ReadAhead.enable";
+  configure chunk_size
+
+let disable () = configure 0
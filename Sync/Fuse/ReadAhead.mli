@@ -0,0 +1,25 @@
+(** Read-ahead kept in the C layer of the path based API. Once a handle is
+    read sequentially, its next reads are answered from a chunk that the
+    filesystem filled in one call, without taking the runtime lock: a
+    filesystem whose reads are round trips to a peer pays one per chunk
+    rather than one per kernel request.
+
+    Read-ahead is disabled until [enable] is called. Chunks are dropped
+    when their file is written or truncated through the mount, on rename,
+    and when their handle is released. A filesystem whose files also change
+    by other means must invalidate them. *)
+
+(** Reads ahead in chunks of [chunk_size] bytes, e.g. 1 to 4 MiB, aligned
+    on their size. Reads of a chunk or more are never read ahead. *)
+val enable : chunk_size: int -> unit
+
+val disable : unit -> unit
+
+(** Drops the chunks of the handles of a path, in every mount. *)
+val invalidate : string -> unit
+
+val clear : unit -> unit
+
+(** Reads answered from a chunk, chunks filled, and reads passed to the
+    filesystem since the start. *)
+val stats : unit -> int * int * int
@@ -0,0 +1,265 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ReadAheadImpl.h"
+
+/* Handles are mapped directly to a slot, which holds the chunk of one of
+ * them: two handles read sequentially on the same slot take it in turns,
+ * and so read ahead less. The slots bound the memory used to as many
+ * chunks. */
+#define OCAMLFUSE_READ_AHEAD_SLOT_BITS 6
+#define OCAMLFUSE_READ_AHEAD_SLOTS (1 << OCAMLFUSE_READ_AHEAD_SLOT_BITS)
+
+struct ocamlfuse_read_ahead_slot {
+  pthread_mutex_t lock;
+  /* Key of the slot, NULL when free. */
+  const void* owner;
+  uint64_t handle;
+  uint64_t path_hash;
+  /* Bumped whenever the chunk is dropped, so that a fill that started
+   * before isn't installed after. */
+  uint64_t generation;
+  /* Offset that follows the last read, -1 before the first. */
+  off_t next;
+  /* Chunk of length bytes at start, or NULL. A chunk shorter than asked
+   * for ends at the end of the file. */
+  char* data;
+  off_t start;
+  size_t length;
+  int eof;
+};
+
+static struct ocamlfuse_read_ahead_slot ocamlfuse_read_ahead_slots[OCAMLFUSE_READ_AHEAD_SLOTS];
+static pthread_once_t ocamlfuse_read_ahead_once = PTHREAD_ONCE_INIT;
+
+/* Size of a chunk in bytes, 0 when disabled. */
+static size_t ocamlfuse_read_ahead_size = 0;
+
+/* Chunks held and fills running, so that writes skip the slots when no
+ * chunk could be stale. */
+static int ocamlfuse_read_ahead_busy = 0;
+
+static uint64_t ocamlfuse_read_ahead_hits = 0;
+static uint64_t ocamlfuse_read_ahead_fills = 0;
+static uint64_t ocamlfuse_read_ahead_misses = 0;
+
+static void ocamlfuse_read_ahead_init(void)
+{
+  for (int i = 0; i < OCAMLFUSE_READ_AHEAD_SLOTS; i++) {
+    pthread_mutex_init(&ocamlfuse_read_ahead_slots[i].lock, NULL);
+  }
+}
+
+/* FNV-1a, as the attribute cache. */
+static uint64_t ocamlfuse_read_ahead_hash(const char* path, size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static struct ocamlfuse_read_ahead_slot* ocamlfuse_read_ahead_slot(const void* owner,
+								   uint64_t handle)
+{
+  uint64_t hash = ((uint64_t) (uintptr_t) owner ^ handle) * 0x9E3779B97F4A7C15ULL;
+  return &ocamlfuse_read_ahead_slots[hash >> (64 - OCAMLFUSE_READ_AHEAD_SLOT_BITS)];
+}
+
+/* Must be called with the slot locked. */
+static void ocamlfuse_read_ahead_drop(struct ocamlfuse_read_ahead_slot* slot)
+{
+  if (slot->data != NULL) {
+    free(slot->data);
+    slot->data = NULL;
+    __atomic_sub_fetch(&ocamlfuse_read_ahead_busy, 1, __ATOMIC_SEQ_CST);
+  }
+  slot->generation++;
+}
+
+/* Copies the part of a chunk that a read asks for into buf, and returns
+ * its length, or -1 when the chunk doesn't hold it. */
+static long ocamlfuse_read_ahead_copy(const char* data, off_t start, size_t length, int eof,
+				      char* buf, size_t size, off_t offset)
+{
+  off_t end = start + (off_t) length;
+  if (data == NULL || offset < start || (offset + (off_t) size > end && !eof)) {
+    return -1;
+  }
+  long copied = offset >= end ? 0 : (long) (end - offset < (off_t) size ? end - offset : (off_t) size);
+  memcpy(buf, data + (offset - start), copied);
+  return copied;
+}
+
+int ocamlfuse_read_ahead(const void* owner, uint64_t handle, const char* path,
+			 char* buf, size_t size, off_t offset,
+			 long (*read)(void* data, char* buf, size_t size, off_t offset),
+			 void* data, long* result)
+{
+  size_t chunk = __atomic_load_n(&ocamlfuse_read_ahead_size, __ATOMIC_RELAXED);
+  if (chunk == 0 || size >= chunk) {
+    return 0;
+  }
+  pthread_once(&ocamlfuse_read_ahead_once, ocamlfuse_read_ahead_init);
+  uint64_t path_hash = ocamlfuse_read_ahead_hash(path, strlen(path));
+  struct ocamlfuse_read_ahead_slot* slot = ocamlfuse_read_ahead_slot(owner, handle);
+  pthread_mutex_lock(&slot->lock);
+  if (slot->owner != owner || slot->handle != handle || slot->path_hash != path_hash) {
+    ocamlfuse_read_ahead_drop(slot);
+    slot->owner = owner;
+    slot->handle = handle;
+    slot->path_hash = path_hash;
+    slot->next = -1;
+  }
+  long copied = ocamlfuse_read_ahead_copy(slot->data, slot->start, slot->length, slot->eof,
+					  buf, size, offset);
+  int sequential = offset == 0 || offset == slot->next;
+  slot->next = offset + size;
+  if (copied >= 0 || !sequential) {
+    pthread_mutex_unlock(&slot->lock);
+    __atomic_add_fetch(copied >= 0 ? &ocamlfuse_read_ahead_hits : &ocamlfuse_read_ahead_misses,
+		       1, __ATOMIC_RELAXED);
+    *result = copied;
+    return copied >= 0;
+  }
+  /* Counted before the filesystem reads, so that a write that completes
+   * from now on finds the slot and bumps its generation. */
+  uint64_t generation = slot->generation;
+  __atomic_add_fetch(&ocamlfuse_read_ahead_busy, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&slot->lock);
+
+  /* Chunks are aligned on their size, unless the read straddles two. */
+  off_t start = offset - offset % (off_t) chunk;
+  if (offset + (off_t) size > start + (off_t) chunk) {
+    start = offset;
+  }
+  char* fill = malloc(chunk);
+  if (fill == NULL) {
+    __atomic_sub_fetch(&ocamlfuse_read_ahead_busy, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ocamlfuse_read_ahead_misses, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  long length = read(data, fill, chunk, start);
+  __atomic_add_fetch(&ocamlfuse_read_ahead_fills, 1, __ATOMIC_RELAXED);
+  if (length < 0) {
+    free(fill);
+    __atomic_sub_fetch(&ocamlfuse_read_ahead_busy, 1, __ATOMIC_SEQ_CST);
+    *result = length;
+    return 1;
+  }
+  int eof = (size_t) length < chunk;
+  *result = ocamlfuse_read_ahead_copy(fill, start, length, eof, buf, size, offset);
+
+  char* unused = fill;
+  pthread_mutex_lock(&slot->lock);
+  if (slot->owner == owner && slot->handle == handle && slot->generation == generation
+      && __atomic_load_n(&ocamlfuse_read_ahead_size, __ATOMIC_RELAXED) == chunk) {
+    unused = slot->data;
+    slot->data = fill;
+    slot->start = start;
+    slot->length = length;
+    slot->eof = eof;
+  }
+  pthread_mutex_unlock(&slot->lock);
+  if (unused != NULL) {
+    free(unused);
+    __atomic_sub_fetch(&ocamlfuse_read_ahead_busy, 1, __ATOMIC_SEQ_CST);
+  }
+  return 1;
+}
+
+/* Drops the chunks of the slots of owner, or of any owner when it is NULL,
+ * for which matches returns true. */
+static void ocamlfuse_read_ahead_sweep(const void* owner,
+				       int (*matches)(struct ocamlfuse_read_ahead_slot*, uint64_t),
+				       uint64_t data)
+{
+  if (!__atomic_load_n(&ocamlfuse_read_ahead_busy, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  pthread_once(&ocamlfuse_read_ahead_once, ocamlfuse_read_ahead_init);
+  for (int i = 0; i < OCAMLFUSE_READ_AHEAD_SLOTS; i++) {
+    struct ocamlfuse_read_ahead_slot* slot = &ocamlfuse_read_ahead_slots[i];
+    pthread_mutex_lock(&slot->lock);
+    if (slot->owner != NULL && (owner == NULL || slot->owner == owner) && matches(slot, data)) {
+      ocamlfuse_read_ahead_drop(slot);
+    }
+    pthread_mutex_unlock(&slot->lock);
+  }
+}
+
+static int ocamlfuse_read_ahead_path(struct ocamlfuse_read_ahead_slot* slot, uint64_t path_hash)
+{
+  return slot->path_hash == path_hash;
+}
+
+static int ocamlfuse_read_ahead_all(struct ocamlfuse_read_ahead_slot* slot, uint64_t data)
+{
+  return 1;
+}
+
+void ocamlfuse_read_ahead_invalidate(const void* owner, const char* path)
+{
+  ocamlfuse_read_ahead_sweep(owner, ocamlfuse_read_ahead_path,
+			     ocamlfuse_read_ahead_hash(path, strlen(path)));
+}
+
+void ocamlfuse_read_ahead_invalidate_all(const void* owner)
+{
+  ocamlfuse_read_ahead_sweep(owner, ocamlfuse_read_ahead_all, 0);
+}
+
+void ocamlfuse_read_ahead_release(const void* owner, uint64_t handle)
+{
+  if (!__atomic_load_n(&ocamlfuse_read_ahead_busy, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  pthread_once(&ocamlfuse_read_ahead_once, ocamlfuse_read_ahead_init);
+  struct ocamlfuse_read_ahead_slot* slot = ocamlfuse_read_ahead_slot(owner, handle);
+  pthread_mutex_lock(&slot->lock);
+  if (slot->owner == owner && slot->handle == handle) {
+    ocamlfuse_read_ahead_drop(slot);
+    slot->owner = NULL;
+  }
+  pthread_mutex_unlock(&slot->lock);
+}
+
+CAMLprim value ocamlfuse_read_ahead_configure_impl(value chunk_size)
+{
+  __atomic_store_n(&ocamlfuse_read_ahead_size, (size_t) Long_val(chunk_size), __ATOMIC_RELAXED);
+  if (Long_val(chunk_size) == 0) {
+    ocamlfuse_read_ahead_invalidate_all(NULL);
+  }
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_read_ahead_invalidate_impl(value path)
+{
+  ocamlfuse_read_ahead_invalidate(NULL, String_val(path));
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_read_ahead_clear_impl(value unit)
+{
+  ocamlfuse_read_ahead_invalidate_all(NULL);
+  return Val_unit;
+}
+
+/* Returns (hits, fills, misses). */
+CAMLprim value ocamlfuse_read_ahead_stats_impl(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+  result = caml_alloc_tuple(3);
+  Store_field(result, 0, Val_long(__atomic_load_n(&ocamlfuse_read_ahead_hits, __ATOMIC_RELAXED)));
+  Store_field(result, 1, Val_long(__atomic_load_n(&ocamlfuse_read_ahead_fills, __ATOMIC_RELAXED)));
+  Store_field(result, 2, Val_long(__atomic_load_n(&ocamlfuse_read_ahead_misses, __ATOMIC_RELAXED)));
+  CAMLreturn(result);
+}
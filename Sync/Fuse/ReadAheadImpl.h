@@ -0,0 +1,33 @@
+#ifndef OCAMLFUSE_READ_AHEAD_IMPL_H
+#define OCAMLFUSE_READ_AHEAD_IMPL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Read-ahead of the path based API: a chunk per open handle, read in one
+ * call of the filesystem once the handle is read sequentially, and served
+ * without entering OCaml. Disabled until ReadAhead.enable sets a chunk
+ * size. owner tells the handles of different mounts apart. */
+
+/* Reads size bytes of handle at offset into buf, with read filling a
+ * chunk when the read continues a sequential stream. Returns 1 and sets
+ * *result to the number of bytes read or a negative error code, or 0 when
+ * the caller has to read itself. Must be called without the runtime
+ * lock. */
+int ocamlfuse_read_ahead(const void* owner, uint64_t handle, const char* path,
+			 char* buf, size_t size, off_t offset,
+			 long (*read)(void* data, char* buf, size_t size, off_t offset),
+			 void* data, long* result);
+
+/* Drops the chunks of the handles of path, after it was written or
+ * truncated. */
+void ocamlfuse_read_ahead_invalidate(const void* owner, const char* path);
+
+/* Drops every chunk of owner, e.g. after a rename moved paths under the
+ * handles. */
+void ocamlfuse_read_ahead_invalidate_all(const void* owner);
+
+/* Drops the chunk of a released handle. */
+void ocamlfuse_read_ahead_release(const void* owner, uint64_t handle);
+
+#endif
@@ -0,0 +1,97 @@
+(* Same order as enum ocamlfuse_phase in StatsImpl.h. *)
+type phase =
+  | Lock
+  | Mutex
+  | Handler
+
+type histogram = {
+    count : int ;
+    sum : int ;
+    max : int ;
+    buckets : int array ;
+  }
+
+type op_stats = {
+    opcode : Trace.opcode ;
+    calls : int ;
+    errors : int ;
+    words : int ;
+    lock : histogram ;
+    mutex : histogram ;
+    handler : histogram ;
+  }
+
+external now : unit -> int = "ocamlfuse_stats_now_impl" [@@noalloc]
+external record_impl : int -> int -> int -> bool -> unit = "ocamlfuse_stats_record_impl" [@@noalloc]
+external bucket_value : int -> int = "ocamlfuse_stats_bucket_value_impl" [@@noalloc]
+external counters : Trace.opcode -> int * int * int = "ocamlfuse_stats_counters_impl"
+external histogram : Trace.opcode -> phase -> histogram = "ocamlfuse_stats_histogram_impl"
+external reset : unit -> unit = "ocamlfuse_stats_reset_impl"
+
+(* Includes allocations of other threads that run while the handler is
+   blocked, so it is an upper bound for a single handler. *)
+let allocated_words () =
+  let { Gc.minor_words ; promoted_words ; major_words } = Gc.quick_stat () in
+  int_of_float (minor_words +. major_words -. promoted_words)
+
+let record ~mutex ~handler ~words ~failed = record_impl mutex handler words failed
+
+let opcodes : Trace.opcode list =
+  let rec aux n accu =
+    if n < 0 then accu else aux (n - 1) (Obj.magic n :: accu)
+  in aux (Obj.magic Trace.Setattr) []
+
+let snapshot () =
+  List.fold_right
+    begin fun opcode accu ->
+    let calls, errors, words = counters opcode
+    and lock = histogram opcode Lock in
+    if calls = 0 && lock.count = 0 then accu
+    else { opcode ; calls ; errors ; words ; lock ;
+	   mutex = histogram opcode Mutex ;
+	   handler = histogram opcode Handler } :: accu
+    end
+    opcodes
+    []
+
+let percentile { count ; buckets } p =
+  let target = max 1 (int_of_float (ceil (p *. float_of_int count))) in
+  let rec aux i seen =
+    if i >= Array.length buckets then 0
+    else
+      let seen = seen + buckets.(i) in
+      if seen >= target then bucket_value i
+      else aux (i + 1) seen
+  in
+  if count = 0 then 0 else aux 0 0
+
+let () =
+  assert begin
+      let buckets = Array.make 16 0 in
+      buckets.(3) <- 9;
+      buckets.(12) <- 1;
+      let h = { count = 10 ; sum = 39 ; max = 12 ; buckets } in
+      percentile h 0.5 = 3 && percentile h 0.99 = 12 && percentile h 1. = 12
+    end
+
+let xattr = "user.ocamlfuse.stats"
+
+let string_of_histogram ({ count ; sum ; max } as h) =
+  Printf.sprintf "n=%d avg=%d p50=%d p99=%d p999=%d max=%d"
+		 count (if count = 0 then 0 else sum / count)
+		 (percentile h 0.5) (percentile h 0.99) (percentile h 0.999) max
+
+let report () =
+  let buffer = Buffer.create 4096 in
+  List.iter
+    begin fun { opcode ; calls ; errors ; words ; lock ; mutex ; handler } ->
+    Printf.bprintf buffer
+		   "%s calls=%d errors=%d words/call=%d\n  lock %s\n  mutex %s\n  handler %s\n"
+		   (Trace.string_of_opcode opcode) calls errors
+		   (if calls = 0 then 0 else words / calls)
+		   (string_of_histogram lock)
+		   (string_of_histogram mutex)
+		   (string_of_histogram handler)
+    end
+    (snapshot ());
+  Buffer.contents buffer
@@ -0,0 +1,54 @@
+(** Per-operation statistics of a mount.
+
+    Every operation is split into three phases, each with its own latency
+    histogram: waiting for the OCaml runtime lock, waiting for the
+    filesystem mutex, and running the handler. *)
+
+(** Phases of an operation. *)
+type phase =
+  | Lock
+  | Mutex
+  | Handler
+
+(** A log-bucketed latency histogram, in nanoseconds. *)
+type histogram = {
+    count : int ;
+    sum : int ;
+    max : int ;
+    buckets : int array ;
+  }
+
+type op_stats = {
+    opcode : Trace.opcode ;
+    calls : int ;
+    errors : int ;
+    words : int ;  (* Words allocated by the handlers. *)
+    lock : histogram ;
+    mutex : histogram ;
+    handler : histogram ;
+  }
+
+(** Monotonic time in nanoseconds, on the same clock as Trace. *)
+val now : unit -> int
+
+(** Words allocated so far by the program. *)
+val allocated_words : unit -> int
+
+(** Records the end of a callback for the operation running on the current
+    FUSE thread. *)
+val record : mutex: int -> handler: int -> words: int -> failed: bool -> unit
+
+(** Statistics of the operations that were called at least once. *)
+val snapshot : unit -> op_stats list
+
+val reset : unit -> unit
+
+(** Smallest value below which a fraction [p] of the samples fall, to the
+    precision of the buckets. *)
+val percentile : histogram -> float -> int
+
+(** Extended attribute of the mount root that returns [report ()]. *)
+val xattr : string
+
+(** Human readable summary of [snapshot ()], one line per operation. *)
+val report : unit -> string
@@ -0,0 +1,140 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+
+#include <string.h>
+
+#include "StatsImpl.h"
+
+/* Histograms are log-bucketed: values below OCAMLFUSE_STATS_SUB get a bucket
+ * each, larger ones are split into OCAMLFUSE_STATS_SUB buckets per power of
+ * 2, which keeps every bucket within 12.5% of its values. The last bucket
+ * holds everything above 2^40ns. */
+#define OCAMLFUSE_STATS_SUB_BITS 3
+#define OCAMLFUSE_STATS_SUB (1 << OCAMLFUSE_STATS_SUB_BITS)
+#define OCAMLFUSE_STATS_BUCKETS (38 * OCAMLFUSE_STATS_SUB)
+
+struct ocamlfuse_stats_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[OCAMLFUSE_STATS_BUCKETS];
+};
+
+struct ocamlfuse_stats_op {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t words;
+  struct ocamlfuse_stats_histogram phases[OCAMLFUSE_PHASE_COUNT];
+};
+
+/* Updated with relaxed atomics from every FUSE thread. */
+static struct ocamlfuse_stats_op ocamlfuse_stats[OCAMLFUSE_OP_COUNT];
+
+static int ocamlfuse_stats_bucket(uint64_t v)
+{
+  if (v < OCAMLFUSE_STATS_SUB) {
+    return v;
+  }
+  int e = 63 - __builtin_clzll(v);
+  int sub = (v >> (e - OCAMLFUSE_STATS_SUB_BITS)) & (OCAMLFUSE_STATS_SUB - 1);
+  int i = (e - OCAMLFUSE_STATS_SUB_BITS + 1) * OCAMLFUSE_STATS_SUB + sub;
+  return i < OCAMLFUSE_STATS_BUCKETS ? i : OCAMLFUSE_STATS_BUCKETS - 1;
+}
+
+/* Smallest value that falls into bucket i. */
+static uint64_t ocamlfuse_stats_bucket_value(int i)
+{
+  if (i < OCAMLFUSE_STATS_SUB) {
+    return i;
+  }
+  int e = i / OCAMLFUSE_STATS_SUB + OCAMLFUSE_STATS_SUB_BITS - 1;
+  uint64_t sub = i % OCAMLFUSE_STATS_SUB;
+  return (OCAMLFUSE_STATS_SUB + sub) << (e - OCAMLFUSE_STATS_SUB_BITS);
+}
+
+void ocamlfuse_stats_add(int opcode, int phase, int64_t ns)
+{
+  if (opcode < 0 || opcode >= OCAMLFUSE_OP_COUNT || ns < 0) {
+    return;
+  }
+  struct ocamlfuse_stats_histogram* h = &ocamlfuse_stats[opcode].phases[phase];
+  __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->buckets[ocamlfuse_stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while ((uint64_t) ns > max
+	 && !__atomic_compare_exchange_n(&h->max, &max, ns, 1,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+CAMLprim value ocamlfuse_stats_now_impl(value unit)
+{
+  return Val_long(ocamlfuse_trace_now());
+}
+
+/* Called by the OCaml wrappers at the end of a callback, on the FUSE thread
+ * that runs the operation. */
+CAMLprim value ocamlfuse_stats_record_impl(value mutex, value handler,
+					   value words, value failed)
+{
+  int opcode = ocamlfuse_trace_current.opcode;
+  if (opcode < 0 || opcode >= OCAMLFUSE_OP_COUNT) {
+    return Val_unit;
+  }
+  struct ocamlfuse_stats_op* op = &ocamlfuse_stats[opcode];
+  __atomic_add_fetch(&op->calls, 1, __ATOMIC_RELAXED);
+  if (Bool_val(failed)) {
+    __atomic_add_fetch(&op->errors, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&op->words, Long_val(words), __ATOMIC_RELAXED);
+  ocamlfuse_stats_add(opcode, OCAMLFUSE_PHASE_MUTEX, Long_val(mutex));
+  ocamlfuse_stats_add(opcode, OCAMLFUSE_PHASE_HANDLER, Long_val(handler));
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_stats_bucket_value_impl(value i)
+{
+  return Val_long(ocamlfuse_stats_bucket_value(Int_val(i)));
+}
+
+/* Returns (calls, errors, words) for an opcode. */
+CAMLprim value ocamlfuse_stats_counters_impl(value opcode)
+{
+  CAMLparam1(opcode);
+  CAMLlocal1(result);
+  struct ocamlfuse_stats_op* op = &ocamlfuse_stats[Int_val(opcode)];
+  result = caml_alloc_tuple(3);
+  Store_field(result, 0, Val_long(__atomic_load_n(&op->calls, __ATOMIC_RELAXED)));
+  Store_field(result, 1, Val_long(__atomic_load_n(&op->errors, __ATOMIC_RELAXED)));
+  Store_field(result, 2, Val_long(__atomic_load_n(&op->words, __ATOMIC_RELAXED)));
+  CAMLreturn(result);
+}
+
+/* Returns a Stats.histogram for an opcode and a phase. */
+CAMLprim value ocamlfuse_stats_histogram_impl(value opcode, value phase)
+{
+  CAMLparam2(opcode, phase);
+  CAMLlocal2(result, buckets);
+  struct ocamlfuse_stats_histogram* h =
+    &ocamlfuse_stats[Int_val(opcode)].phases[Int_val(phase)];
+  buckets = caml_alloc(OCAMLFUSE_STATS_BUCKETS, 0);
+  for (int i = 0; i < OCAMLFUSE_STATS_BUCKETS; i++) {
+    Store_field(buckets, i, Val_long(__atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED)));
+  }
+  result = caml_alloc_tuple(4);
+  Store_field(result, 0, Val_long(__atomic_load_n(&h->count, __ATOMIC_RELAXED)));
+  Store_field(result, 1, Val_long(__atomic_load_n(&h->sum, __ATOMIC_RELAXED)));
+  Store_field(result, 2, Val_long(__atomic_load_n(&h->max, __ATOMIC_RELAXED)));
+  Store_field(result, 3, buckets);
+  CAMLreturn(result);
+}
+
+/* Not atomic with respect to running operations: a few samples may survive
+ * or be half cleared. */
+CAMLprim value ocamlfuse_stats_reset_impl(value unit)
+{
+  memset(ocamlfuse_stats, 0, sizeof(ocamlfuse_stats));
+  return Val_unit;
+}
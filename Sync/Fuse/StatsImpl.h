@@ -0,0 +1,28 @@
+#ifndef OCAMLFUSE_STATS_IMPL_H
+#define OCAMLFUSE_STATS_IMPL_H
+
+#include <caml/mlvalues.h>
+#include <caml/threads.h>
+
+#include "TraceImpl.h"
+
+/* Phases of an operation. The order must match Stats.phase. */
+enum ocamlfuse_phase {
+  OCAMLFUSE_PHASE_LOCK,     /* waiting in caml_acquire_runtime_system */
+  OCAMLFUSE_PHASE_MUTEX,    /* waiting on the filesystem mutex */
+  OCAMLFUSE_PHASE_HANDLER,  /* running the OCaml handler */
+  OCAMLFUSE_PHASE_COUNT
+};
+
+void ocamlfuse_stats_add(int opcode, int phase, int64_t ns);
+
+/* caml_acquire_runtime_system, timed for the operation in progress. */
+static inline void ocamlfuse_acquire_runtime(void)
+{
+  int64_t start = ocamlfuse_trace_now();
+  caml_acquire_runtime_system();
+  ocamlfuse_stats_add(ocamlfuse_trace_current.opcode, OCAMLFUSE_PHASE_LOCK,
+		      ocamlfuse_trace_now() - start);
+}
+
+#endif
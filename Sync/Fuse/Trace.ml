@@ -0,0 +1,137 @@
+(* Same order as enum ocamlfuse_opcode in TraceImpl.h. *)
+type opcode =
+  | Access
+  | Chmod
+  | Chown
+  | Create
+  | Mknod
+  | Destroy
+  | Flush
+  | Getattr
+  | Fgetattr
+  | Getxattr
+  | Setxattr
+  | Init
+  | Mkdir
+  | Open
+  | Opendir
+  | Read
+  | Readdir
+  | Rename
+  | Release
+  | Releasedir
+  | Rmdir
+  | Statfs
+  | Fsync
+  | Fsyncdir
+  | Truncate
+  | Ftruncate
+  | Unlink
+  | Utimens
+  | Write
+  | Lookup
+  | Forget
+  | Setattr
+
+type record = {
+    opcode : opcode ;
+    thread : int ;
+    start : int ;
+    stop : int ;
+    handle : int ;
+    offset : int ;
+    size : int ;
+    result : int ;
+  }
+
+external set_enabled : bool -> unit = "ocamlfuse_trace_set_enabled_impl"
+external enabled : unit -> bool = "ocamlfuse_trace_enabled_impl"
+external drain : unit -> string = "ocamlfuse_trace_drain_impl"
+external dropped : unit -> int = "ocamlfuse_trace_dropped_impl"
+
+let enable () = set_enabled true
+let disable () = set_enabled false
+
+let dump channel = output_string channel (drain ())
+
+(* struct ocamlfuse_trace_record: five int64 followed by four int32. *)
+let record_size = 56
+
+(* Reads a little endian integer of size bytes. *)
+let int_at data offset size =
+  let rec aux i accu =
+    if i < 0 then accu
+    else aux (i - 1) ((accu lsl 8) lor Char.code data.[offset + i])
+  in aux (size - 1) 0
+
+let int32_at data offset =
+  let n = int_at data offset 4 in
+  if n land 0x8000_0000 <> 0 then n - 0x1_0000_0000 else n
+
+let () =
+  assert begin
+      int_at "\x01\x02\x00\x00" 0 4 = 0x201
+      && int32_at "\xfe\xff\xff\xff" 0 = -2
+    end
+
+let opcode_of_int (n : int) : opcode =
+  if n < 0 || n > Obj.magic Setattr then failwith ("Unknown trace opcode " ^ string_of_int n);
+  Obj.magic n
+
+let decode data =
+  let length = String.length data in
+  if length mod record_size <> 0 then failwith "Truncated trace";
+  let rec aux offset accu =
+    if offset < 0 then accu
+    else
+      let record =
+	{ start = int_at data offset 8 ;
+	  stop = int_at data (offset + 8) 8 ;
+	  handle = int_at data (offset + 16) 8 ;
+	  offset = int_at data (offset + 24) 8 ;
+	  size = int_at data (offset + 32) 8 ;
+	  opcode = opcode_of_int (int32_at data (offset + 40)) ;
+	  result = int32_at data (offset + 44) ;
+	  thread = int32_at data (offset + 48) }
+      in aux (offset - record_size) (record :: accu)
+  in aux (length - record_size) []
+
+let string_of_opcode = function
+  | Access -> "ACCESS"
+  | Chmod -> "CHMOD"
+  | Chown -> "CHOWN"
+  | Create -> "CREATE"
+  | Mknod -> "MKNOD"
+  | Destroy -> "DESTROY"
+  | Flush -> "FLUSH"
+  | Getattr -> "GETATTR"
+  | Fgetattr -> "FGETATTR"
+  | Getxattr -> "GETXATTR"
+  | Setxattr -> "SETXATTR"
+  | Init -> "INIT"
+  | Mkdir -> "MKDIR"
+  | Open -> "OPEN"
+  | Opendir -> "OPENDIR"
+  | Read -> "READ"
+  | Readdir -> "READDIR"
+  | Rename -> "RENAME"
+  | Release -> "RELEASE"
+  | Releasedir -> "RELEASEDIR"
+  | Rmdir -> "RMDIR"
+  | Statfs -> "STATFS"
+  | Fsync -> "FSYNC"
+  | Fsyncdir -> "FSYNCDIR"
+  | Truncate -> "TRUNCATE"
+  | Ftruncate -> "FTRUNCATE"
+  | Unlink -> "UNLINK"
+  | Utimens -> "UTIMENS"
+  | Write -> "WRITE"
+  | Lookup -> "LOOKUP"
+  | Forget -> "FORGET"
+  | Setattr -> "SETATTR"
+
+let to_string { opcode ; thread ; start ; stop ; handle ; offset ; size ; result } =
+  Printf.sprintf "%d.%09d [%d] %s fh=%d offset=%d size=%d result=%d time=%dns"
+		 (start / 1_000_000_000) (start mod 1_000_000_000)
+		 thread (string_of_opcode opcode) handle offset size result
+		 (stop - start)
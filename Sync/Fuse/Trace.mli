@@ -0,0 +1,73 @@
+(** Binary tracing of FUSE operations.
+
+    Each FUSE thread appends a fixed-size record per operation to its own
+    lock-free ring buffer. Tracing is off until [enable] is called; records
+    are kept until [drain] collects them. *)
+
+(** Traced operations. *)
+type opcode =
+  | Access
+  | Chmod
+  | Chown
+  | Create
+  | Mknod
+  | Destroy
+  | Flush
+  | Getattr
+  | Fgetattr
+  | Getxattr
+  | Setxattr
+  | Init
+  | Mkdir
+  | Open
+  | Opendir
+  | Read
+  | Readdir
+  | Rename
+  | Release
+  | Releasedir
+  | Rmdir
+  | Statfs
+  | Fsync
+  | Fsyncdir
+  | Truncate
+  | Ftruncate
+  | Unlink
+  | Utimens
+  | Write
+  | Lookup
+  | Forget
+  | Setattr
+
+(** A traced operation. Times are monotonic nanoseconds; [result] is a byte
+    count or 0 on success, and a negated errno on failure. *)
+type record = {
+    opcode : opcode ;
+    thread : int ;
+    start : int ;
+    stop : int ;
+    handle : int ;
+    offset : int ;
+    size : int ;
+    result : int ;
+  }
+
+val enable : unit -> unit
+val disable : unit -> unit
+val enabled : unit -> bool
+
+(** Removes the pending records of all threads and returns them in their
+    binary form, to be decoded with [decode]. *)
+val drain : unit -> string
+
+(** Number of records lost because a ring buffer was full. *)
+val dropped : unit -> int
+
+(** Drains the pending records to a channel. *)
+val dump : out_channel -> unit
+
+(** Decodes the output of [drain], or the concatenation of several. *)
+val decode : string -> record list
+
+val string_of_opcode : opcode -> string
+val to_string : record -> string
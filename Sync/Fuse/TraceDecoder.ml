@@ -0,0 +1,44 @@
+(* Decodes files written by Trace.dump, as text or as Chrome trace JSON
+   (chrome://tracing, Perfetto). *)
+
+module Y = Yojson.Basic
+
+let read_file filename =
+  let channel = open_in_bin filename in
+  let data = really_input_string channel (in_channel_length channel) in
+  close_in channel;
+  data
+
+(* A complete event; Chrome trace times are in microseconds. *)
+let chrome_event { Trace.opcode ; thread ; start ; stop ; handle ; offset ; size ; result } =
+  `Assoc [ "name", `String (Trace.string_of_opcode opcode) ;
+	   "ph", `String "X" ;
+	   "pid", `Int 0 ;
+	   "tid", `Int thread ;
+	   "ts", `Float (float_of_int start /. 1000.) ;
+	   "dur", `Float (float_of_int (stop - start) /. 1000.) ;
+	   "args", `Assoc [ "fh", `Int handle ;
+			    "offset", `Int offset ;
+			    "size", `Int size ;
+			    "result", `Int result ] ]
+
+let () =
+  let chrome = ref false
+  and files = ref [] in
+  Arg.parse
+    ([ "-chrome", Arg.Set chrome, " Output Chrome trace JSON instead of text." ]
+     |> Arg.align)
+    (fun file -> files := file :: !files)
+    "TraceDecoder.exe [-chrome] <trace file>...";
+  let records =
+    List.rev !files
+    |> List.map (fun file -> read_file file |> Trace.decode)
+    |> List.concat
+    |> List.stable_sort (fun r1 r2 -> compare r1.Trace.start r2.Trace.start)
+  in
+  if !chrome
+  then begin
+    Y.to_channel stdout (`Assoc [ "traceEvents", `List (List.map chrome_event records) ]);
+    print_newline ()
+  end
+  else List.iter (fun record -> print_endline (Trace.to_string record)) records
@@ -0,0 +1,186 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "TraceImpl.h"
+
+/* Records kept per thread until drained. A power of 2. When a ring is full,
+ * new records are dropped and counted. */
+#define OCAMLFUSE_TRACE_RING_SIZE 4096
+
+/* Single producer, single consumer ring: only its FUSE thread writes head,
+ * and only the drainer writes tail. Rings are never freed, so that a drain
+ * can walk the list while threads come and go: owned is cleared when the
+ * thread exits, and a new thread takes over a ring that is not owned once
+ * it is drained, so that idle workers retired by the session loop don't
+ * leave rings behind. */
+struct ocamlfuse_trace_ring {
+  struct ocamlfuse_trace_record records[OCAMLFUSE_TRACE_RING_SIZE];
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  int32_t thread;
+  int32_t owned;
+  struct ocamlfuse_trace_ring* next;
+};
+
+int ocamlfuse_trace_enabled = 0;
+__thread struct ocamlfuse_trace_span ocamlfuse_trace_current;
+
+static __thread struct ocamlfuse_trace_ring* ocamlfuse_trace_ring;
+static struct ocamlfuse_trace_ring* ocamlfuse_trace_rings = NULL;
+static int32_t ocamlfuse_trace_threads = 0;
+
+/* Its destructor releases the ring of an exiting thread. */
+static pthread_key_t ocamlfuse_trace_key;
+static pthread_once_t ocamlfuse_trace_key_once = PTHREAD_ONCE_INIT;
+
+int64_t ocamlfuse_trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ocamlfuse_trace_release(void* data)
+{
+  struct ocamlfuse_trace_ring* ring = data;
+  ocamlfuse_trace_ring = NULL;
+  __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ocamlfuse_trace_create_key(void)
+{
+  pthread_key_create(&ocamlfuse_trace_key, ocamlfuse_trace_release);
+}
+
+/* Takes over a drained ring that no thread owns, or returns NULL. */
+static struct ocamlfuse_trace_ring* ocamlfuse_trace_reuse_ring(void)
+{
+  for (struct ocamlfuse_trace_ring* ring =
+	 __atomic_load_n(&ocamlfuse_trace_rings, __ATOMIC_ACQUIRE);
+       ring != NULL;
+       ring = ring->next) {
+    int32_t unowned = 0;
+    if (__atomic_load_n(&ring->owned, __ATOMIC_RELAXED) == 0
+	&& __atomic_compare_exchange_n(&ring->owned, &unowned, 1,
+				       0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head) {
+	return ring;
+      }
+      /* Records of the previous thread are still pending. */
+      __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+/* Returns the ring of the current thread, reusing a released one or
+ * allocating and publishing a new one on first use. */
+static struct ocamlfuse_trace_ring* ocamlfuse_trace_get_ring(void)
+{
+  struct ocamlfuse_trace_ring* ring = ocamlfuse_trace_ring;
+  if (ring != NULL) {
+    return ring;
+  }
+  pthread_once(&ocamlfuse_trace_key_once, ocamlfuse_trace_create_key);
+  ring = ocamlfuse_trace_reuse_ring();
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(struct ocamlfuse_trace_ring));
+    if (ring == NULL) {
+      return NULL;
+    }
+    ring->owned = 1;
+    ring->next = __atomic_load_n(&ocamlfuse_trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ocamlfuse_trace_rings, &ring->next, ring,
+					1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  ring->thread = __atomic_add_fetch(&ocamlfuse_trace_threads, 1, __ATOMIC_RELAXED);
+  pthread_setspecific(ocamlfuse_trace_key, ring);
+  ocamlfuse_trace_ring = ring;
+  return ring;
+}
+
+void ocamlfuse_trace_push(const struct ocamlfuse_trace_span* span, int64_t end)
+{
+  struct ocamlfuse_trace_ring* ring = ocamlfuse_trace_get_ring();
+  if (ring == NULL) {
+    return;
+  }
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == OCAMLFUSE_TRACE_RING_SIZE) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  struct ocamlfuse_trace_record* record =
+    &ring->records[head & (OCAMLFUSE_TRACE_RING_SIZE - 1)];
+  record->start = span->start;
+  record->end = end;
+  record->fh = span->fh;
+  record->offset = span->offset;
+  record->size = span->size;
+  record->opcode = span->opcode;
+  record->result = span->result;
+  record->thread = ring->thread;
+  record->unused = 0;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+CAMLprim value ocamlfuse_trace_set_enabled_impl(value enabled)
+{
+  __atomic_store_n(&ocamlfuse_trace_enabled, Bool_val(enabled), __ATOMIC_RELAXED);
+  return Val_unit;
+}
+
+CAMLprim value ocamlfuse_trace_enabled_impl(value unit)
+{
+  return Val_bool(__atomic_load_n(&ocamlfuse_trace_enabled, __ATOMIC_RELAXED));
+}
+
+/* Moves the pending records of every ring into a string. Drains are
+ * serialized by the runtime lock, which is held throughout. */
+CAMLprim value ocamlfuse_trace_drain_impl(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+  struct ocamlfuse_trace_ring* rings =
+    __atomic_load_n(&ocamlfuse_trace_rings, __ATOMIC_ACQUIRE);
+  size_t count = 0;
+  for (struct ocamlfuse_trace_ring* ring = rings; ring != NULL; ring = ring->next) {
+    count += __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+  }
+  result = caml_alloc_string(count * sizeof(struct ocamlfuse_trace_record));
+  char* data = (char*) String_val(result);
+  size_t copied = 0;
+  for (struct ocamlfuse_trace_ring* ring = rings;
+       ring != NULL && copied < count;
+       ring = ring->next) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    for (; tail != head && copied < count; tail++, copied++) {
+      memcpy(data + copied * sizeof(struct ocamlfuse_trace_record),
+	     &ring->records[tail & (OCAMLFUSE_TRACE_RING_SIZE - 1)],
+	     sizeof(struct ocamlfuse_trace_record));
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+  CAMLreturn(result);
+}
+
+CAMLprim value ocamlfuse_trace_dropped_impl(value unit)
+{
+  uint64_t dropped = 0;
+  for (struct ocamlfuse_trace_ring* ring =
+	 __atomic_load_n(&ocamlfuse_trace_rings, __ATOMIC_ACQUIRE);
+       ring != NULL;
+       ring = ring->next) {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  return Val_long(dropped);
+}
@@ -0,0 +1,109 @@
+#ifndef OCAMLFUSE_TRACE_IMPL_H
+#define OCAMLFUSE_TRACE_IMPL_H
+
+#include <stdint.h>
+
+/* Traced operations. The order must match Trace.opcode. */
+enum ocamlfuse_opcode {
+  OCAMLFUSE_OP_ACCESS,
+  OCAMLFUSE_OP_CHMOD,
+  OCAMLFUSE_OP_CHOWN,
+  OCAMLFUSE_OP_CREATE,
+  OCAMLFUSE_OP_MKNOD,
+  OCAMLFUSE_OP_DESTROY,
+  OCAMLFUSE_OP_FLUSH,
+  OCAMLFUSE_OP_GETATTR,
+  OCAMLFUSE_OP_FGETATTR,
+  OCAMLFUSE_OP_GETXATTR,
+  OCAMLFUSE_OP_SETXATTR,
+  OCAMLFUSE_OP_INIT,
+  OCAMLFUSE_OP_MKDIR,
+  OCAMLFUSE_OP_OPEN,
+  OCAMLFUSE_OP_OPENDIR,
+  OCAMLFUSE_OP_READ,
+  OCAMLFUSE_OP_READDIR,
+  OCAMLFUSE_OP_RENAME,
+  OCAMLFUSE_OP_RELEASE,
+  OCAMLFUSE_OP_RELEASEDIR,
+  OCAMLFUSE_OP_RMDIR,
+  OCAMLFUSE_OP_STATFS,
+  OCAMLFUSE_OP_FSYNC,
+  OCAMLFUSE_OP_FSYNCDIR,
+  OCAMLFUSE_OP_TRUNCATE,
+  OCAMLFUSE_OP_FTRUNCATE,
+  OCAMLFUSE_OP_UNLINK,
+  OCAMLFUSE_OP_UTIMENS,
+  OCAMLFUSE_OP_WRITE,
+  OCAMLFUSE_OP_LOOKUP,
+  OCAMLFUSE_OP_FORGET,
+  OCAMLFUSE_OP_SETATTR,
+  OCAMLFUSE_OP_COUNT
+};
+
+/* One traced operation, as returned by Trace.drain: fixed size, native
+ * endianness. Times are CLOCK_MONOTONIC nanoseconds. result is what the
+ * operation returned to FUSE: a byte count or 0, or a negated errno. */
+struct ocamlfuse_trace_record {
+  int64_t start;
+  int64_t end;
+  int64_t fh;
+  int64_t offset;
+  int64_t size;
+  int32_t opcode;
+  int32_t result;
+  int32_t thread;
+  int32_t unused;
+};
+
+/* Operation in progress on the current thread. opcode is always set, so
+ * that statistics can be attributed to it. start is 0 when tracing was
+ * disabled as the operation began, and nothing is recorded for it. */
+struct ocamlfuse_trace_span {
+  int64_t start;
+  int64_t fh;
+  int64_t offset;
+  int64_t size;
+  int32_t opcode;
+  int32_t result;
+};
+
+extern int ocamlfuse_trace_enabled;
+extern __thread struct ocamlfuse_trace_span ocamlfuse_trace_current;
+
+int64_t ocamlfuse_trace_now(void);
+void ocamlfuse_trace_push(const struct ocamlfuse_trace_span* span, int64_t end);
+
+static inline int ocamlfuse_trace_begin(int opcode, int64_t fh,
+					int64_t offset, int64_t size)
+{
+  struct ocamlfuse_trace_span* span = &ocamlfuse_trace_current;
+  span->opcode = opcode;
+  span->result = 0;
+  if (!__atomic_load_n(&ocamlfuse_trace_enabled, __ATOMIC_RELAXED)) {
+    span->start = 0;
+    return 0;
+  }
+  span->fh = fh;
+  span->offset = offset;
+  span->size = size;
+  span->start = ocamlfuse_trace_now();
+  return 0;
+}
+
+static inline void ocamlfuse_trace_end(int* scope)
+{
+  struct ocamlfuse_trace_span* span = &ocamlfuse_trace_current;
+  if (span->start) {
+    ocamlfuse_trace_push(span, ocamlfuse_trace_now());
+  }
+}
+
+/* Traces the enclosing function: the record is pushed whichever way it
+ * returns, with the last result given to OCAMLFUSE_TRACE_RESULT. */
+#define OCAMLFUSE_TRACE(opcode, fh, offset, size)			\
+  int ocamlfuse_trace_scope __attribute__((cleanup(ocamlfuse_trace_end), unused)) = \
+    ocamlfuse_trace_begin(opcode, fh, offset, size)
+
+#define OCAMLFUSE_TRACE_RESULT(code) (ocamlfuse_trace_current.result = (code))
+
+#endif
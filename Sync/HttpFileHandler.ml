@@ -47,22 +47,11 @@ let get_content_type =
   try Hashtbl.find h (file_extension |> String.lowercase_ascii)
   with Not_found -> ContentTypes.plain_text
 
-let read_file file =
-  Lwt_io.open_file ~flags: [Unix.O_RDONLY]
-		   ~mode: Lwt_io.Input
-		   (root ^ File.to_string file)
-  >|= fun channel ->
-  begin fun () ->
-  Lwt.catch
-    begin fun () -> Lwt_io.read ~count: 1000 channel
-                    >>= (function
-	                 | "" -> Lwt_io.close channel >>= fun () -> Lwt.return_none
-	                 | chunk -> Lwt.return_some chunk)
-    end
-    begin fun e -> Lwt_io.close channel
-                   >>= fun () -> Lwt.fail e
-    end
-  end |> Lwt_stream.from
+(* Files are sent with sendfile, unless the connection is compressed. *)
+let socket_of_connection connection =
+  if SendFile.available && not connection.traffic.compressed
+  then Some connection.socket
+  else None
 
 let reply_not_found, reply_bad_request =
   let module P = HttpProtocol in
@@ -75,27 +64,57 @@ let reply_not_found, reply_bad_request =
 			 P.Header.chunked ;
 			 P.Header.date () ;
 			 server_header ] ;
-      P.response_body = Lwt_stream.of_list [message] ;
+      P.response_body = P.Stream (Lwt_stream.of_list [message]) ;
     } |> Lwt.return
   in
   (fun _ -> aux P.ResponseCode.NotFound "Not found"),
   (fun _ -> aux P.ResponseCode.BadRequest "BadRequest")
 
-let reply_regular_file file =
-  read_file file
-  >>= fun body ->
-  let content_type = file |> File.extension |> get_content_type in
+let reply_regular_file request connection file =
+  Lwt_unix.openfile (root ^ File.to_string file) [ Unix.O_RDONLY ; Unix.O_CLOEXEC ] 0
+  >>= fun file_descr ->
+  Lwt.catch
+    (fun () -> Lwt_unix.fstat file_descr)
+    (fun e -> Lwt_unix.close file_descr >>= fun () -> Lwt.fail e)
+  >>= fun stat ->
+  let size = stat.Unix.st_size
+  and content_type = file |> File.extension |> get_content_type in
   let module P = HttpProtocol in
-  { P.status_line =
-      { P.response_http_version = P.HttpVersion.HTTP_1_1 ;
-	P.response_code = P.ResponseCode.OK } ;
-    P.response_headers =
-      P.Headers.from [ content_type ;
-		       P.Header.chunked ;
-		       P.Header.date () ;
-		       server_header ] ;
-    P.response_body = body ;
-  } |> Lwt.return
+  let range = P.ByteRange.parse request.P.request_headers size in
+  let response response_code headers response_body =
+    { P.status_line =
+	{ P.response_http_version = P.HttpVersion.HTTP_1_1 ;
+	  P.response_code } ;
+      P.response_headers =
+	P.Headers.from ([ content_type ;
+			  (P.Header.AcceptRanges, "bytes") ;
+			  P.Header.date () ;
+			  server_header ] @ headers) ;
+      P.response_body ;
+    } |> Lwt.return
+  and file_body file_offset file_length =
+    P.File { P.file_descr ;
+	     P.file_offset ;
+	     P.file_length ;
+	     P.socket = socket_of_connection connection }
+  in
+  match range with
+  | P.ByteRange.Whole ->
+     response P.ResponseCode.OK
+	      [ P.Header.content_length size ]
+	      (file_body 0 size)
+  | P.ByteRange.Bytes (first, last) ->
+     response P.ResponseCode.PartialContent
+	      [ P.Header.content_length (last - first + 1) ;
+		P.ByteRange.content_range range size ]
+	      (file_body first (last - first + 1))
+  | P.ByteRange.Unsatisfiable ->
+     Lwt_unix.close file_descr
+     >>= fun () ->
+     response P.ResponseCode.RangeNotSatisfiable
+	      [ P.Header.content_length 0 ;
+		P.ByteRange.content_range range size ]
+	      (P.Stream P.Body.empty)
 
 let file_template =
   let module H = HtmlParser in
@@ -159,7 +178,7 @@ let reply_dir dir =
   let body =
     let b = Buffer.create 1024 in
     directory_template (dir, files) b;
-    Lwt_stream.of_list [ Buffer.contents b ]
+    HttpProtocol.Stream (Lwt_stream.of_list [ Buffer.contents b ])
   in
   let module P = HttpProtocol in
   { P.status_line =
@@ -182,7 +201,7 @@ let file_handler request connection =
       begin fun () -> Lwt_unix.stat (root ^ File.to_string file)
                       >>= fun stat ->
                       match stat.Unix.st_kind with
-                      | Unix.S_REG -> reply_regular_file file
+                      | Unix.S_REG -> reply_regular_file request connection file
                       | Unix.S_DIR -> reply_dir file
                       | _ -> reply_not_found ()
       end
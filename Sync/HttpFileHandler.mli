@@ -13,8 +13,12 @@ val is_forbidden_file : string -> bool
 (** Returns the 'Content-Type' header for the requested file. *)
 val get_content_type : string -> HttpProtocol.Header.t * string
 
-(** Callback used to handle regular files. *)
-val reply_regular_file : File.t -> HttpProtocol.http_response Lwt.t
+(** Callback used to handle regular files. Serves the byte range of the
+    request if any, and sends the file with sendfile when it can. *)
+val reply_regular_file : HttpProtocol.http_request ->
+			 SyncTypes.connection ->
+			 File.t ->
+			 HttpProtocol.http_response Lwt.t
 
 (** Callback used to handle folders. *)
 val reply_dir : File.t -> HttpProtocol.http_response Lwt.t
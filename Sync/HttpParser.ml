@@ -0,0 +1,274 @@
+open Lwt.Infix
+
+external scan : Lwt_bytes.t -> int -> int -> int = "sync_http_parser_scan_impl" [@@noalloc]
+
+let buffer_size = 65536
+let max_headers = 128
+
+(* Slices are pairs of offset and length in the buffer: the method, the
+ * target and the version, then the name and the value of each header. *)
+let method_slice = 0
+let target_slice = 2
+let version_slice = 4
+let first_header = 6
+
+type t = {
+    data : Lwt_bytes.t ;
+    (* Start of the request being parsed, and end of the data. *)
+    mutable start : int ;
+    mutable length : int ;
+    mutable scanned : int ;
+    mutable line_start : int ;
+    mutable request_line : bool ;
+    mutable headers : int ;
+    (* End of the head once complete, -1 until then. *)
+    mutable head_end : int ;
+    slices : int array ;
+  }
+
+let create () =
+  { data = Lwt_bytes.create buffer_size ;
+    start = 0 ;
+    length = 0 ;
+    scanned = 0 ;
+    line_start = 0 ;
+    request_line = false ;
+    headers = 0 ;
+    head_end = -1 ;
+    slices = Array.make (first_header + 4 * max_headers) 0 }
+
+let restart t =
+  t.scanned <- t.start;
+  t.line_start <- t.start;
+  t.request_line <- false;
+  t.headers <- 0;
+  t.head_end <- -1
+
+let clear t =
+  t.start <- 0;
+  t.length <- 0;
+  restart t
+
+let next t =
+  if t.head_end >= 0
+  then begin
+      t.start <- t.head_end;
+      restart t
+    end
+
+(* Moves the request being parsed to the start of the buffer. *)
+let compact t =
+  let shift = t.start in
+  if shift > 0
+  then begin
+      Lwt_bytes.blit t.data shift t.data 0 (t.length - shift);
+      t.start <- 0;
+      t.length <- t.length - shift;
+      t.scanned <- t.scanned - shift;
+      t.line_start <- t.line_start - shift;
+      if t.head_end >= 0 then t.head_end <- t.head_end - shift;
+      let slices = if t.request_line then first_header + 4 * t.headers else 0 in
+      for i = 0 to slices / 2 - 1 do
+	t.slices.(2 * i) <- t.slices.(2 * i) - shift
+      done
+    end
+
+let add t buffer offset length =
+  if t.length + length > buffer_size then compact t;
+  let n = min length (buffer_size - t.length) in
+  Lwt_bytes.blit buffer offset t.data t.length n;
+  t.length <- t.length + n;
+  n
+
+let is_space c = c = ' ' || c = '\t'
+
+let index t first last c =
+  let rec loop i =
+    if i = last then -1 else if Lwt_bytes.unsafe_get t.data i = c then i else loop (i + 1)
+  in
+  loop first
+
+let rindex t first last c =
+  let rec loop i =
+    if i < first then -1 else if Lwt_bytes.unsafe_get t.data i = c then i else loop (i - 1)
+  in
+  loop (last - 1)
+
+let rec trim_left t first last =
+  if first < last && is_space (Lwt_bytes.unsafe_get t.data first)
+  then trim_left t (first + 1) last
+  else first
+
+let rec trim_right t first last =
+  if last > first && is_space (Lwt_bytes.unsafe_get t.data (last - 1))
+  then trim_right t first (last - 1)
+  else last
+
+let set_slice t i offset length =
+  t.slices.(i) <- offset;
+  t.slices.(i + 1) <- length
+
+let parse_request_line t first last =
+  let space = index t first last ' '
+  and last_space = rindex t first last ' ' in
+  if space <= first || last_space = space
+  then failwith "HttpParser: bad request line";
+  set_slice t method_slice first (space - first);
+  set_slice t target_slice (space + 1) (last_space - space - 1);
+  set_slice t version_slice (last_space + 1) (last - last_space - 1);
+  t.request_line <- true
+
+let parse_header t first last =
+  let colon = index t first last ':' in
+  if colon <= first || is_space (Lwt_bytes.unsafe_get t.data first)
+  then failwith "HttpParser: bad header";
+  if t.headers = max_headers
+  then failwith "HttpParser: too many headers";
+  let name_end = trim_right t first colon
+  and value_start = trim_left t (colon + 1) last in
+  let value_end = trim_right t value_start last
+  and i = first_header + 4 * t.headers in
+  set_slice t i first (name_end - first);
+  set_slice t (i + 2) value_start (value_end - value_start);
+  t.headers <- t.headers + 1
+
+let rec parse t =
+  if t.head_end >= 0
+  then t.head_end - t.start
+  else
+    let newline = scan t.data t.scanned t.length in
+    if newline < 0
+    then begin
+	t.scanned <- t.length;
+	if t.length - t.start = buffer_size
+	then failwith "HttpParser: head too large";
+	-1
+      end
+    else begin
+	let first = t.line_start in
+	let last =
+	  if newline > first && Lwt_bytes.get t.data (newline - 1) = '\r'
+	  then newline - 1
+	  else newline
+	in
+	t.scanned <- newline + 1;
+	t.line_start <- newline + 1;
+	(* Empty lines before the request line are skipped. *)
+	if first = last
+	then (if t.request_line then t.head_end <- newline + 1)
+	else if t.request_line
+	then parse_header t first last
+	else parse_request_line t first last;
+	parse t
+      end
+
+let read ?prefix t channel =
+  clear t;
+  begin match prefix with
+	| Some c -> Lwt_bytes.set t.data 0 c; t.length <- 1
+	| None -> ()
+  end;
+  let rec loop () =
+    Lwt_io.direct_access channel
+      begin fun da ->
+	    begin if da.Lwt_io.da_ptr < da.Lwt_io.da_max
+		  then Lwt.return_unit
+		  else da.Lwt_io.da_perform ()
+		       >>= function
+		       | 0 -> Lwt.fail End_of_file
+		       | _ -> Lwt.return_unit
+	    end
+	    >|= fun () ->
+	    let before = t.length in
+	    let added = add t da.Lwt_io.da_buffer da.Lwt_io.da_ptr (da.Lwt_io.da_max - da.Lwt_io.da_ptr) in
+	    let head_size = parse t in
+	    if head_size < 0
+	    then begin
+		da.Lwt_io.da_ptr <- da.Lwt_io.da_ptr + added;
+		false
+	      end
+	    else begin
+		(* Takes back what follows the head. *)
+		da.Lwt_io.da_ptr <- da.Lwt_io.da_ptr + head_size - before;
+		t.length <- head_size;
+		true
+	      end
+      end
+    >>= function
+    | true -> Lwt.return_unit
+    | false -> loop ()
+  in
+  loop ()
+
+let slice t i =
+  if t.head_end < 0 then invalid_arg "HttpParser: incomplete head";
+  let length = t.slices.(i + 1) in
+  let s = Bytes.create length in
+  Lwt_bytes.blit_to_bytes t.data t.slices.(i) s 0 length;
+  Bytes.unsafe_to_string s
+
+let http_method t = slice t method_slice
+let target t = slice t target_slice
+let version t = slice t version_slice
+
+let header_count t = t.headers
+
+let header_slice t i =
+  if i < 0 || i >= t.headers then invalid_arg "HttpParser: no such header";
+  first_header + 4 * i
+
+let header_name t i = slice t (header_slice t i)
+let header_value t i = slice t (header_slice t i + 2)
+
+let equal_caseless t i name =
+  let offset = t.slices.(i)
+  and length = t.slices.(i + 1) in
+  let rec loop j =
+    j = length
+    || (Char.lowercase_ascii (Lwt_bytes.unsafe_get t.data (offset + j))
+	= Char.lowercase_ascii name.[j]
+	&& loop (j + 1))
+  in
+  length = String.length name && loop 0
+
+let find t name =
+  let rec loop i =
+    if i = t.headers
+    then None
+    else if equal_caseless t (first_header + 4 * i) name
+    then Some (header_value t i)
+    else loop (i + 1)
+  in
+  loop 0
+
+let iter_headers f t =
+  for i = 0 to t.headers - 1 do
+    f (header_name t i) (header_value t i)
+  done
+
+let () =
+  assert begin
+      let text =
+	"GET /a HTTP/1.1\r\nHost: x\r\nContent-TYPE :  text/plain \r\n\r\n"
+	^ "\r\nPOST /b/c?d HTTP/1.0\nX-Empty:\n\n"
+      in
+      let data = Lwt_bytes.of_string text in
+      let t = create () in
+      (* Byte by byte, until the first head is complete. *)
+      let rec feed i = if parse t >= 0 then i else (ignore (add t data i 1); feed (i + 1)) in
+      let size = feed 0 in
+      parse t = size
+      && http_method t = "GET"
+      && target t = "/a"
+      && version t = "HTTP/1.1"
+      && header_count t = 2
+      && header_name t 1 = "Content-TYPE"
+      && find t "content-type" = Some "text/plain"
+      && add t data size (String.length text - size) = String.length text - size
+      && (next t; parse t = String.length text - size)
+      && http_method t = "POST"
+      && target t = "/b/c?d"
+      && version t = "HTTP/1.0"
+      && find t "x-empty" = Some ""
+      && find t "host" = None
+    end
@@ -0,0 +1,50 @@
+(** Incremental parser of the heads of HTTP/1.1 requests, i.e. their
+    request line and headers.
+
+    The parser owns a buffer that it reuses from request to request: parsing
+    a head only records where its parts are in the buffer, and they are
+    copied out when asked for. The buffer may hold several pipelined
+    requests, that are parsed one after the other. Heads longer than the
+    buffer, or with too many headers, are rejected with Failure. *)
+
+type t
+
+val create : unit -> t
+
+(** Size of the buffer, and of the largest head. *)
+val buffer_size : int
+
+(** [add parser buffer offset length] appends bytes to the buffer, and
+    returns how many fit. *)
+val add : t -> Lwt_bytes.t -> int -> int -> int
+
+(** Parses what was added since the last call, and returns the size of the
+    head once complete, or -1 until then. *)
+val parse : t -> int
+
+(** Moves on to the request after the complete head, whose body, if any,
+    must have been skipped. *)
+val next : t -> unit
+
+(** Forgets the data. *)
+val clear : t -> unit
+
+(** Reads the head of a request from the channel, and only it: the body and
+    the requests pipelined after it stay in the channel. The prefix is the
+    first character of the head, when it was already read. *)
+val read : ?prefix: char -> t -> Lwt_io.input_channel -> unit Lwt.t
+
+(** Parts of the complete head. *)
+
+val http_method : t -> string
+val target : t -> string
+val version : t -> string
+val header_count : t -> int
+val header_name : t -> int -> string
+val header_value : t -> int -> string
+
+(** Value of the first header of the given name, compared without case. *)
+val find : t -> string -> string option
+
+(** Calls f on the name and value of each header. *)
+val iter_headers : (string -> string -> unit) -> t -> unit
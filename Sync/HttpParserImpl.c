@@ -0,0 +1,37 @@
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Line scanner of HttpParser: finds the next '\n', 16 bytes at a time with
+ * SSE2. Most header lines are shorter than a call to memchr is worth. */
+
+static inline const uint8_t* sync_http_parser_find_newline(const uint8_t* p, const uint8_t* end)
+{
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (p + 16 <= end) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), newline));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  return memchr(p, '\n', end - p);
+}
+
+/* Returns the position of the first '\n' in data[from, to), or -1. */
+CAMLprim value sync_http_parser_scan_impl(value data, value from, value to)
+{
+  const uint8_t* base = Caml_ba_data_val(data);
+  const uint8_t* start = base + Long_val(from);
+  const uint8_t* end = base + Long_val(to);
+  const uint8_t* newline = start < end ? sync_http_parser_find_newline(start, end) : NULL;
+  return Val_long(newline == NULL ? -1 : newline - base);
+}
@@ -56,6 +56,9 @@ module Header = struct
     | Connection
     | KeepAlive
     | Expect (* Expect: 100-continue *)
+    | Range
+    | ContentRange
+    | AcceptRanges
     | Other of string
   type headers = (t, string) Hashtbl.t
   let { Mapping.tokens = all ;
@@ -70,13 +73,15 @@ module Header = struct
 		   TransferEncoding, "Transfer-Encoding" ;
 		   Connection, "Connection" ;
 		   KeepAlive, "Keep-Alive" ;
-		   Expect, "Expect" ]
+		   Expect, "Expect" ;
+		   Range, "Range" ;
+		   ContentRange, "Content-Range" ;
+		   AcceptRanges, "Accept-Ranges" ]
 		 (fun other -> Other other)
 
-  let split_value =
-    let spaces_regex = "\\([ \r\n\t]+\\)" in
-    let regex = Str.regexp (spaces_regex ^ "," ^ spaces_regex) in
-    Str.split regex
+  (* Without Str, that isn't thread safe. *)
+  let split_value value =
+    List.map String.trim (String.split_on_char ',' value)
 
   let has_content_length headers = Hashtbl.mem headers ContentLength
 
@@ -96,6 +101,8 @@ module Header = struct
 
   let chunked = TransferEncoding, "chunked"
 
+  let content_length length = ContentLength, string_of_int length
+
   let date, parse_date =
     let days = [| "Sun" ; "Mon" ; "Tue" ; "Wed" ; "Thu" ; "Fri" ; "Sat" |]
     and months = [| "Jan" ; "Feb" ; "Mar" ; "Apr" ;
@@ -206,8 +213,10 @@ module ResponseCode = struct
   type t =
     | Continue
     | OK
+    | PartialContent
     | BadRequest
     | NotFound
+    | RangeNotSatisfiable
     | Other of int
 
   let { Mapping.tokens = all ;
@@ -215,16 +224,20 @@ module ResponseCode = struct
 	print } =
     Mapping.make [ Continue, "100" ;
 		   OK, "200" ;
+		   PartialContent, "206" ;
 		   BadRequest, "400" ;
-		   NotFound, "404" ]
+		   NotFound, "404" ;
+		   RangeNotSatisfiable, "416" ]
 		 (fun code -> Other (int_of_string code))
 
   let decode code =
     match code with
     | Continue -> (100, "Continue")
     | OK -> (200, "OK")
+    | PartialContent -> (206, "Partial Content")
     | BadRequest -> (400, "Bad Request")
     | NotFound -> (404, "Not Found")
+    | RangeNotSatisfiable -> (416, "Range Not Satisfiable")
     | Other code -> (code, "Unknown Response Code")
 end
 
@@ -242,6 +255,20 @@ type start_line = {
  and headers = Header.headers
  and body = string Lwt_stream.t
 
+ (* Part of a file sent as it is, that is closed once written. It is sent
+  * with sendfile when the socket is known, i.e. the connection isn't
+  * compressed. *)
+ and file = {
+     file_descr : Lwt_unix.file_descr ;
+     file_offset : int ;
+     file_length : int ;
+     socket : Lwt_unix.file_descr option ;
+   }
+
+ and response_body =
+   | Stream of body
+   | File of file
+
  and http_request = {
      start_line: start_line ;
      request_headers: headers ;
@@ -251,7 +278,7 @@ type start_line = {
  and http_response = {
      status_line: status_line ;
      response_headers: headers ;
-     response_body: body ;
+     response_body: response_body ;
    }
 
 module StartLine = struct
@@ -362,6 +389,69 @@ module Headers = struct
   let find = Hashtbl.find
 end
 
+module ByteRange = struct
+  type t =
+    | Whole
+    | Bytes of int * int (* first and last byte *)
+    | Unsatisfiable
+
+  (* Only single ranges are served: a request for several ranges, or with
+   * a Range header that doesn't parse, gets the whole resource, as RFC
+   * 7233 allows. *)
+  let parse headers size =
+    let prefix = "bytes=" in
+    let value = if Hashtbl.mem headers Header.Range
+		then String.trim (Headers.find headers Header.Range)
+		else ""
+    and n = String.length prefix in
+    if String.length value < n
+       || String.lowercase_ascii (String.sub value 0 n) <> prefix
+       || String.contains value ','
+       || not (String.contains value '-')
+    then Whole
+    else
+      let spec = String.sub value n (String.length value - n) in
+      let dash = String.index spec '-' in
+      let first = String.trim (String.sub spec 0 dash)
+      and last = String.trim (String.sub spec (dash + 1) (String.length spec - dash - 1))
+      and number s =
+	try let n = int_of_string s in if n >= 0 then Some n else None
+	with Failure _ -> None
+      in
+      match number first, number last with
+      | None, Some suffix when first = "" ->
+	 if suffix = 0 || size = 0
+	 then Unsatisfiable
+	 else Bytes (max 0 (size - suffix), size - 1)
+      | Some first, None when last = "" ->
+	 if first >= size then Unsatisfiable else Bytes (first, size - 1)
+      | Some first, Some last when first <= last ->
+	 if first >= size then Unsatisfiable else Bytes (first, min last (size - 1))
+      | _ -> Whole
+
+  let content_range range size =
+    Header.ContentRange,
+    match range with
+    | Bytes (first, last) -> Printf.sprintf "bytes %d-%d/%d" first last size
+    | Whole | Unsatisfiable -> Printf.sprintf "bytes */%d" size
+
+  let () =
+    assert begin
+	let range value = parse (Headers.from [ Header.Range, value ]) 1000 in
+	range "bytes=0-499" = Bytes (0, 499)
+	&& range "bytes=500-" = Bytes (500, 999)
+	&& range "bytes=-200" = Bytes (800, 999)
+	&& range "bytes=-2000" = Bytes (0, 999)
+	&& range "bytes=900-2000" = Bytes (900, 999)
+	&& range "bytes=1000-" = Unsatisfiable
+	&& range "bytes=-0" = Unsatisfiable
+	&& range "bytes=5-1" = Whole
+	&& range "bytes=0-1,5-6" = Whole
+	&& range "items=0-1" = Whole
+	&& parse (Headers.from []) 1000 = Whole
+      end
+end
+
 module Body = struct
   type t = body
 
@@ -445,6 +535,39 @@ module Body = struct
     else
       AsyncUtils.fail "Unknown body encoding"
 
+  (* Calls f on the chunks of the part of the file. *)
+  let iter_file f { file_descr ; file_offset ; file_length } =
+    let buffer = Bytes.create 65536 in
+    let rec loop remaining =
+      if remaining = 0
+      then Lwt.return_unit
+      else Lwt_unix.read file_descr buffer 0 (min remaining (Bytes.length buffer))
+	   >>= function
+	   | 0 -> Lwt.fail End_of_file
+	   | n -> f buffer n >>= fun () -> loop (remaining - n)
+    in
+    Lwt_unix.lseek file_descr file_offset Unix.SEEK_SET
+    >>= fun _ -> loop file_length
+
+  let print_file b file =
+    Lwt.finalize
+      (fun () -> iter_file (fun buffer n -> Buffer.add_subbytes b buffer 0 n; Lwt.return_unit) file)
+      (fun () -> Lwt_unix.close file.file_descr)
+
+  let write_file channel file =
+    Lwt.finalize
+      begin fun () ->
+      match file.socket with
+      | Some socket ->
+	 (* The headers go first. *)
+	 Lwt_io.flush channel
+	 >>= fun () ->
+	 SendFile.send ~socket file.file_descr ~offset: file.file_offset ~length: file.file_length
+      | None ->
+	 iter_file (fun buffer n -> Lwt_io.write_from_exactly channel buffer 0 n) file
+      end
+      (fun () -> Lwt_unix.close file.file_descr)
+
   let fix_body_size headers body =
     if Header.has_content_length headers then
       Lwt.return_unit
@@ -461,7 +584,10 @@ module Body = struct
 	~print_first_line
 	~headers
 	~body =
-    fix_body_size headers body
+    begin match body with
+    | Stream body -> fix_body_size headers body
+    | File _ -> Lwt.return_unit
+    end
     >>= fun () ->
     let http_headers =
       let b = Buffer.create 80 in
@@ -471,20 +597,41 @@ module Body = struct
     in
     (* Write headers in a single Lwt_io.write call. *)
     Lwt_io.write channel http_headers
-    >>= fun () -> write channel headers body
+    >>= fun () ->
+    match body with
+    | Stream body -> write channel headers body
+    | File file -> write_file channel file
 end
 
 module HttpRequest =
   struct
     type t = http_request
 
+    (* Parsers, and their buffers, are reused from request to request. *)
+    let parsers = ref []
+
     let parse ?prefix channel =
-      StartLine.parse ?prefix channel
-      >>= fun start_line -> Headers.parse channel
-      >>= begin fun request_headers ->
-          let request_body = Body.parse channel request_headers in
-	  Lwt.return { start_line ; request_headers ; request_body }
-          end
+      let parser =
+	match !parsers with
+	| parser :: rest -> parsers := rest; parser
+	| [] -> HttpParser.create ()
+      in
+      Lwt.finalize
+	begin fun () ->
+	      HttpParser.read ?prefix parser channel
+	      >|= fun () ->
+	      let start_line =
+		{ http_method = Method.parse (HttpParser.http_method parser) ;
+		  request_target = HttpParser.target parser ;
+		  request_http_version = HttpVersion.parse (HttpParser.version parser) }
+	      and request_headers = Hashtbl.create 16 in
+	      HttpParser.iter_headers
+		(fun name value -> Hashtbl.add request_headers (Header.parse name) value)
+		parser;
+	      let request_body = Body.parse channel request_headers in
+	      { start_line ; request_headers ; request_body }
+	end
+	(fun () -> parsers := parser :: !parsers; Lwt.return_unit)
 
     let print b { start_line = start_line ;
 		  request_headers = headers ;
@@ -500,7 +647,7 @@ module HttpRequest =
 	~channel
 	~print_first_line:(fun buffer -> StartLine.print buffer start_line)
 	~headers
-	~body
+	~body:(Stream body)
   end
 
 module HttpResponse =
@@ -511,7 +658,7 @@ module HttpResponse =
       StatusLine.parse ?prefix channel
       >>= fun status_line -> Headers.parse channel
       >>= begin fun response_headers ->
-          let response_body = Body.parse channel response_headers in
+          let response_body = Stream (Body.parse channel response_headers) in
 	  Lwt.return { status_line ; response_headers ; response_body }
           end
 
@@ -520,7 +667,9 @@ module HttpResponse =
 		  response_body = body } =
       StatusLine.print b status_line;
       Headers.print b headers;
-      Body.print b headers body
+      match body with
+      | Stream body -> Body.print b headers body
+      | File file -> Body.print_file b file
 
     let write channel { status_line ;
 			response_headers = headers ;
@@ -551,8 +700,8 @@ module ExnWrapper =
 	  let module Y = Yojson.Basic in
 	  let module E = ExnTranslator in
 	  let open Y.Util in
-	  [ exn |> E.to_json |> E.repr |> Y.to_string ]
-	  |> Lwt_stream.of_list }
+	  Stream ([ exn |> E.to_json |> E.repr |> Y.to_string ]
+		  |> Lwt_stream.of_list) }
     let unwrap_value response =
       match response.status_line.response_code with
       | ResponseCode.Continue
@@ -762,7 +911,7 @@ let () =
               { status_line = { response_http_version = HttpVersion.HTTP_1_1 ;
 			        response_code = ResponseCode.OK} ;
 	        response_headers = expected_headers ;
-	        response_body = Body.empty }
+	        response_body = Stream Body.empty }
             in
             if actual.status_line <> expected.status_line then
               Lwt_io.eprintl "Status lines don't match"
@@ -22,6 +22,9 @@ sig
     | Connection
     | KeepAlive
     | Expect
+    | Range
+    | ContentRange
+    | AcceptRanges
     | Other of string
   type headers = (t, string) Hashtbl.t
   val parse : string -> t
@@ -32,6 +35,7 @@ sig
   val has_chunked_transfer_encoding : headers -> bool
   val has_expect_100_continue : headers -> bool
   val chunked : t * string
+  val content_length : int -> t * string
   val date : ?timestamp:float -> unit -> t * string
 end
 
@@ -45,7 +49,14 @@ end
 
 module ResponseCode :
 sig
-  type t = Continue | OK | BadRequest | NotFound | Other of int
+  type t =
+    | Continue
+    | OK
+    | PartialContent
+    | BadRequest
+    | NotFound
+    | RangeNotSatisfiable
+    | Other of int
   val parse : string -> t
   val print : t -> string
   val all : t array
@@ -63,6 +74,17 @@ type start_line = {
    }
  and headers = Header.headers
  and body = string Lwt_stream.t
+ (** Part of a file, sent with sendfile when the socket is given and
+     closed once written. Responses with a file set their Content-Length. *)
+ and file = {
+     file_descr : Lwt_unix.file_descr;
+     file_offset : int;
+     file_length : int;
+     socket : Lwt_unix.file_descr option;
+   }
+ and response_body =
+   | Stream of body
+   | File of file
  and http_request = {
      start_line : start_line;
      request_headers : headers;
@@ -71,7 +93,7 @@ type start_line = {
  and http_response = {
      status_line : status_line;
      response_headers : headers;
-     response_body : body;
+     response_body : response_body;
    }
 
 (** Start line of HTTP requests.
@@ -103,6 +125,20 @@ sig
   val find : headers -> Header.t -> string
 end
 
+(** Byte ranges requested by the Range header, for a resource of the
+    given size. *)
+module ByteRange :
+sig
+  type t =
+    | Whole
+    | Bytes of int * int (** First and last byte. *)
+    | Unsatisfiable
+  val parse : headers -> int -> t
+
+  (** 'Content-Range' header of the range, or of an unsatisfiable one. *)
+  val content_range : t -> int -> Header.t * string
+end
+
 module Body :
 sig
   type t = body
@@ -115,6 +151,9 @@ sig
   val print : Buffer.t -> headers -> body -> unit Lwt.t
   val write : Lwt_io.output_channel -> headers -> body -> unit Lwt.t
 
+  (** Writes the part of the file, and closes it. *)
+  val write_file : Lwt_io.output_channel -> file -> unit Lwt.t
+
   (** Adds header "Transfer-Encoding: chunked" if missing *)
   val fix_body_size : headers -> body -> unit Lwt.t
 
@@ -123,7 +162,7 @@ sig
     channel: Lwt_io.output_channel ->
     print_first_line: (Buffer.t -> unit) ->
     headers: headers ->
-    body: body ->
+    body: response_body ->
     unit Lwt.t
 end
 
@@ -1,11 +1,22 @@
 open OCamlFuse
 
-type file = { mutable contents : Buffer.t ;
+module Cookies = Map.Make (struct type t = int let compare = compare end)
+
+type file = { contents : PageStore.t ;
 	      mutable timestamp : float ;
-	      xattr : (string, string) Hashtbl.t }
+	      xattr : (string, string) Hashtbl.t ;
+	      file_ino : Lowlevel.inode ;
+	      (* Generation, offset and size of the contents in an image of
+		 the store, until they change. *)
+	      mutable saved : (int * int * int) option }
 
  and folder = { dir : (string, element) Hashtbl.t ;
-		dir_xattr : (string, string) Hashtbl.t }
+		(* Names in the order readdir lists them, by cookie. *)
+		mutable names : string Cookies.t ;
+		cookies : (string, int) Hashtbl.t ;
+		mutable next_cookie : int ;
+		dir_xattr : (string, string) Hashtbl.t ;
+		folder_ino : Lowlevel.inode }
 
  and element =
    | File of folder * file
@@ -14,9 +25,119 @@ type file = { mutable contents : Buffer.t ;
 let split_path = Utils.split_path
 let throw = ErrCode.throw
 
+(** Elements indexed by inode number, for the low-level API. *)
+let inodes : (Lowlevel.inode, element) Hashtbl.t = Hashtbl.create 1024
+
+(** Number of lookups the kernel holds on each inode. *)
+let lookups : (Lowlevel.inode, int) Hashtbl.t = Hashtbl.create 1024
+
+(** Number of handles open on each inode. *)
+let opened : (Lowlevel.inode, int) Hashtbl.t = Hashtbl.create 64
+
+(** Inodes removed from the tree but still referenced by the kernel or by
+    open handles. *)
+let unlinked : (Lowlevel.inode, unit) Hashtbl.t = Hashtbl.create 16
+
+(** Files changed since the last image of the store. *)
+let changed : (Lowlevel.inode, file) Hashtbl.t = Hashtbl.create 64
+
+let next_ino = ref Lowlevel.root_ino
+
+let new_ino () =
+  let ino = !next_ino in
+  incr next_ino;
+  ino
+
+let ino_of_element = function
+  | File (_, { file_ino }) -> file_ino
+  | Folder (_, { folder_ino }) -> folder_ino
+
+(** Adds or updates the element in the inode table. *)
+let register element =
+  Hashtbl.replace inodes (ino_of_element element) element;
+  element
+
+(** Removes the element from the inode table and releases its contents. *)
+let drop ino =
+  begin match Hashtbl.find_opt inodes ino with
+  | Some (File (_, { contents })) -> PageStore.clear contents
+  | _ -> ()
+  end;
+  Hashtbl.remove changed ino;
+  Hashtbl.remove inodes ino
+
+let referenced ino = Hashtbl.mem lookups ino || Hashtbl.mem opened ino
+
+(** Drops the element, unless the kernel or a handle still references it,
+    in which case it is dropped by [release_unlinked]. *)
+let unregister element =
+  let ino = ino_of_element element in
+  if referenced ino
+  then Hashtbl.replace unlinked ino ()
+  else drop ino
+
+(** Drops an unlinked inode once it is no longer referenced. *)
+let release_unlinked ino =
+  if Hashtbl.mem unlinked ino && not (referenced ino) then begin
+      Hashtbl.remove unlinked ino;
+      drop ino
+    end
+
+(** Open files and folders. A handle is a key of the pool, whose seed
+    detects handles used after their release, so that the operations that
+    carry a handle find their element without resolving the path or
+    inode. *)
+module Handles =
+  Pool.Make (struct
+	      type 'a t = element option ref
+	      let create () = ref None
+	    end)
+
+(* Handles are pool keys shifted by one, since the key 0 is null_handle. *)
+let key_of_handle handle = Pool.Key.key (handle - 1)
+
+let open_handle element =
+  let { Pool.key ; resource } = Handles.alloc () in
+  resource := Some element;
+  let ino = ino_of_element element in
+  Hashtbl.replace opened ino (1 + try Hashtbl.find opened ino with Not_found -> 0);
+  Pool.Key.index key + 1
+
+let find_handle handle =
+  match Handles.get (key_of_handle handle) with
+  | { contents = Some element } -> element
+  | { contents = None } -> throw ErrCode.EBADF
+  | exception (Pool.UnavailableResource | Pool.SeedMismatch | Invalid_argument _) ->
+     throw ErrCode.EBADF
+
+let close_handle handle =
+  if handle <> null_handle then begin
+      let ino = ino_of_element (find_handle handle) in
+      Handles.free (key_of_handle handle);
+      match Hashtbl.find opened ino with
+      | 1 ->
+	 Hashtbl.remove opened ino;
+	 release_unlinked ino
+      | count -> Hashtbl.replace opened ino (count - 1)
+    end
+
+let new_file () = { contents = PageStore.create () ;
+		    timestamp = Unix.gettimeofday() ;
+		    xattr = Hashtbl.create 10 ;
+		    file_ino = new_ino () ;
+		    saved = None }
+
+(* Cookies 0 and 1 are . and .. *)
+let new_folder () = { dir = Hashtbl.create 10 ;
+		      names = Cookies.empty ;
+		      cookies = Hashtbl.create 10 ;
+		      next_cookie = 2 ;
+		      dir_xattr = Hashtbl.create 10 ;
+		      folder_ino = new_ino () }
+
 let root =
-  let folder = { dir = Hashtbl.create 10 ; dir_xattr = Hashtbl.create 10 } in
-  Folder (folder, folder)
+  let folder = new_folder () in
+  register (Folder (folder, folder))
 
 let rec find_file path =
   let path = List.rev (split_path path) in
@@ -30,6 +151,10 @@ let rec find_file path =
   try aux root path
   with Not_found -> throw ErrCode.ENOENT
 
+(** The element of a handle, or at path for the null handle. *)
+let find_open path handle =
+  if handle = null_handle then find_file path else find_handle handle
+
 let find_basefolder path =
   match split_path path with
   | [] -> throw ErrCode.EINVAL
@@ -49,199 +174,897 @@ let statfs_base = {
   }
 
 let files = ref 0
-let file_size = ref 0
 
-let access ~path ~mode = ignore (find_file path)
+(* Persistence. With a store, every change is appended to a journal, which
+   flush and fsync commit, and which is compacted now and then into an
+   image of the tree. Images are mapped at startup: only the tree is read,
+   the contents of the files are loaded on first access. *)
 
-let create ~path ~mode =
-  let filename, folder = find_basefolder path in
-  if Hashtbl.mem folder.dir filename
-  then throw ErrCode.EEXIST
-  else
-    let file = { contents = Buffer.create 0 ;
-		 timestamp = Unix.gettimeofday() ;
-		 xattr = Hashtbl.create 10 } in
-    Hashtbl.add folder.dir filename
-		(File (folder, file));
-    incr files;
-    null_handle
+type change =
+  | Create of Lowlevel.inode * Lowlevel.inode * string
+  | Mkdir of Lowlevel.inode * Lowlevel.inode * string
+  | Unlink of Lowlevel.inode * string
+  | Rmdir of Lowlevel.inode * string
+  | Rename of Lowlevel.inode * string * Lowlevel.inode * string
+  | Write of Lowlevel.inode * int * string
+  | Truncate of Lowlevel.inode * int
+  | Setxattr of Lowlevel.inode * string * string
+  (* In images only: the contents of a file are a region of the image of
+     a generation, this one or an earlier one. *)
+  | Contents of Lowlevel.inode * int * int * int
+
+let encode_change change =
+  let buffer = Buffer.create 64 in
+  let int n = Buffer.add_int64_le buffer (Int64.of_int n)
+  and string s = Buffer.add_int32_le buffer (Int32.of_int (String.length s));
+		 Buffer.add_string buffer s in
+  let tag c = Buffer.add_char buffer c in
+  begin match change with
+  | Create (parent, ino, name) -> tag 'c'; int parent; int ino; string name
+  | Mkdir (parent, ino, name) -> tag 'd'; int parent; int ino; string name
+  | Unlink (parent, name) -> tag 'u'; int parent; string name
+  | Rmdir (parent, name) -> tag 'r'; int parent; string name
+  | Rename (parent, name, new_parent, new_name) ->
+     tag 'm'; int parent; string name; int new_parent; string new_name
+  | Write (ino, offset, data) -> tag 'w'; int ino; int offset; string data
+  | Truncate (ino, size) -> tag 't'; int ino; int size
+  | Setxattr (ino, key, value) -> tag 'x'; int ino; string key; string value
+  | Contents (ino, image, offset, size) -> tag 'f'; int ino; int image; int offset; int size
+  end;
+  Buffer.contents buffer
+
+let decode_change record =
+  let position = ref 1 in
+  let int () =
+    let n = Int64.to_int (String.get_int64_le record !position) in
+    position := !position + 8;
+    n
+  and string () =
+    let length = Int32.to_int (String.get_int32_le record !position) in
+    let s = String.sub record (!position + 4) length in
+    position := !position + 4 + length;
+    s in
+  (* Arguments are evaluated right to left: let-bind them in order. *)
+  match record.[0] with
+  | 'c' -> let parent = int () in let ino = int () in Create (parent, ino, string ())
+  | 'd' -> let parent = int () in let ino = int () in Mkdir (parent, ino, string ())
+  | 'u' -> let parent = int () in Unlink (parent, string ())
+  | 'r' -> let parent = int () in Rmdir (parent, string ())
+  | 'm' ->
+     let parent = int () in
+     let name = string () in
+     let new_parent = int () in
+     Rename (parent, name, new_parent, string ())
+  | 'w' -> let ino = int () in let offset = int () in Write (ino, offset, string ())
+  | 't' -> let ino = int () in Truncate (ino, int ())
+  | 'x' -> let ino = int () in let key = string () in Setxattr (ino, key, string ())
+  | 'f' ->
+     let ino = int () in
+     let image = int () in
+     let offset = int () in
+     Contents (ino, image, offset, int ())
+  | _ -> failwith "MemFs: unknown change"
 
-let mknod ~path ~mode = ignore (create ~path ~mode)
+let journal : Journal.t option ref = ref None
 
-let destroy () = ()
+let record change =
+  match !journal with
+  | Some journal -> Journal.append journal (encode_change change)
+  | None -> ()
 
-let flush ~path ~handle = ()
+(* Operations on folders and files, shared by the path based and the inode
+   based APIs. *)
 
-let getattr ~path =
-  match find_file path with
+let stat_of_element = function
   | File (_, file) -> { kind = REG ;
-			size = Buffer.length file.contents ;
+			size = PageStore.size file.contents ;
 			time = int_of_float file.timestamp }
   | Folder (_, folder) -> { kind = DIR ;
 			    size = Hashtbl.length folder.dir ;
 			    time = 0 }
 
-let fgetattr ~path ~handle = getattr ~path
+let regular = function
+  | File (_, file) -> file
+  | Folder _ -> throw ErrCode.EISDIR
 
-let find_xattr path =
-  match find_file path
-  with File (_, { xattr }) -> xattr
-     | Folder (_, { dir_xattr }) -> dir_xattr
+let xattr_of_element = function
+  | File (_, { xattr }) -> xattr
+  | Folder (_, { dir_xattr }) -> dir_xattr
+
+(** Adds an entry to a folder, after those readdir has already listed. *)
+let add_entry folder filename element =
+  Hashtbl.replace folder.dir filename element;
+  Hashtbl.replace folder.cookies filename folder.next_cookie;
+  folder.names <- Cookies.add folder.next_cookie filename folder.names;
+  folder.next_cookie <- folder.next_cookie + 1
+
+let remove_entry folder filename =
+  Hashtbl.remove folder.dir filename;
+  match Hashtbl.find folder.cookies filename with
+  | cookie ->
+     Hashtbl.remove folder.cookies filename;
+     folder.names <- Cookies.remove cookie folder.names
+  | exception Not_found -> ()
+
+(** Calls [f] on the entries of a folder from the cookie [offset], with the
+    cookie of the entry that follows, until it returns false. Cookies don't
+    move when entries are added or removed, so a listing in several calls
+    sees every entry that stays in the folder exactly once. *)
+let iter_entries parent folder ~offset f =
+  let rec aux cookie =
+    match Cookies.find_first_opt (fun c -> c >= cookie) folder.names with
+    | Some (cookie, name) ->
+       if f name (Hashtbl.find folder.dir name) (cookie + 1) then aux (cookie + 1)
+    | None -> ()
+  in
+  if (offset > 0 || f "." (Folder (parent, folder)) 1)
+     && (offset > 1 || f ".." (Folder (parent, parent)) 2)
+  then aux offset
+
+let create_in folder filename =
+  if Hashtbl.mem folder.dir filename
+  then throw ErrCode.EEXIST
+  else
+    let file = register (File (folder, new_file ())) in
+    add_entry folder filename file;
+    incr files;
+    record (Create (folder.folder_ino, ino_of_element file, filename));
+    file
+
+let mkdir_in folder filename =
+  if Hashtbl.mem folder.dir filename
+  then throw ErrCode.EEXIST
+  else
+    let subfolder = register (Folder (folder, new_folder ())) in
+    add_entry folder filename subfolder;
+    incr files;
+    record (Mkdir (folder.folder_ino, ino_of_element subfolder, filename));
+    subfolder
+
+let find_in folder filename =
+  try Hashtbl.find folder.dir filename
+  with Not_found -> throw ErrCode.ENOENT
+
+let rename_in from_folder from_filename to_folder to_filename =
+  let from_file = find_in from_folder from_filename in
+  begin
+    try
+      let to_file = Hashtbl.find to_folder.dir to_filename in
+      decr files;
+      remove_entry to_folder to_filename;
+      unregister to_file
+    with Not_found -> ()
+  end;
+  let to_file = match from_file with
+    | File (_, file) -> File (to_folder, file)
+    | Folder (_, folder) -> Folder (to_folder, folder)
+  in
+  remove_entry from_folder from_filename;
+  add_entry to_folder to_filename (register to_file);
+  record (Rename (from_folder.folder_ino, from_filename, to_folder.folder_ino, to_filename))
+
+let unlink_in folder filename =
+  match find_in folder filename with
+  | File _ as file ->
+     decr files;
+     remove_entry folder filename;
+     unregister file;
+     record (Unlink (folder.folder_ino, filename))
+  | Folder _ -> throw ErrCode.EISDIR
+
+let rmdir_in folder filename =
+  match find_in folder filename with
+  | Folder (_, subfolder) as element ->
+     if Hashtbl.length subfolder.dir = 0 then begin
+	 decr files;
+	 remove_entry folder filename;
+	 unregister element;
+	 record (Rmdir (folder.folder_ino, filename))
+       end
+     else throw ErrCode.ENOTEMPTY
+  | File _ -> throw ErrCode.ENOTDIR
+
+let read_file { contents } ~offset ~size = PageStore.read contents ~offset ~size
+
+(** Copies the file contents into a buffer owned by the C layer, without
+    allocating on the OCaml heap. *)
+let read_file_into { contents } ~offset ~buffer = PageStore.read_into contents ~offset ~buffer
+
+(* The next image saves the contents of the file again. *)
+let mark_changed file =
+  file.saved <- None;
+  Hashtbl.replace changed file.file_ino file
+
+let truncate_file ({ contents ; file_ino } as file) new_size =
+  PageStore.truncate contents new_size;
+  mark_changed file;
+  record (Truncate (file_ino, new_size))
+
+let write_file ({ contents ; file_ino } as file) ~data ~offset =
+  PageStore.write contents ~offset ~data;
+  mark_changed file;
+  record (Write (file_ino, offset, data));
+  String.length data
+
+let set_xattr element key value =
+  Hashtbl.replace (xattr_of_element element) key value;
+  record (Setxattr (ino_of_element element, key, value))
+
+(* Reads a spliced pipe up to size. Its data is already there when the
+   callback runs, so an empty non-blocking pipe means it is all read. *)
+let read_pipe fd size =
+  let data = Bytes.create size in
+  let rec read offset =
+    if offset = size then offset
+    else
+      match Unix.read fd data offset (size - offset) with
+      | 0 -> offset
+      | n -> read (offset + n)
+      | exception Unix.Unix_error ((Unix.EAGAIN | Unix.EWOULDBLOCK), _, _) -> offset in
+  Bytes.sub_string data 0 (read 0)
+
+let write_file_from file ~source ~offset =
+  match source with
+  | Memory buffer ->
+     let size = Bigarray.Array1.dim buffer in
+     PageStore.write_from file.contents ~offset ~buffer;
+     mark_changed file;
+     if !journal <> None
+     then record (Write (file.file_ino, offset, PageStore.read file.contents ~offset ~size));
+     size
+  | Pipe (fd, size) -> write_file file ~data: (read_pipe fd size) ~offset
+
+let statfs () =
+  let files = !files
+  and used, _ = PageStore.usage () in
+  let bfree = statfs_base.blocks - (used * PageStore.page_size / statfs_base.bsize) in
+  { statfs_base with
+    bfree ;
+    bavail = bfree ;
+    files ;
+    ffree = statfs_base.ffree - files }
+
+(* Replay and compaction of the store. *)
+
+let store = ref ""
+let generation = ref 0
+
+(* Size of the image files the tree refers to, by generation. *)
+let image_sizes : (int, int) Hashtbl.t = Hashtbl.create 4
+
+(* Size of the changes in the last image, i.e. of the tree. *)
+let metadata_size = ref 0
+
+(* The journal is compacted once it outgrows the tree and the files changed
+   since the last image, which is what compaction writes: a restart
+   replays little more than the tree, and compacting costs no more than
+   the writes. *)
+let min_compaction = 8 * 1024 * 1024
+
+let image_magic = "OFI2"
+
+(* An image is the contents of the files changed since the previous one,
+   each from a page boundary, then the changes that rebuild the tree, then
+   a trailer with their offset, the generation and the magic number. The
+   contents of the other files stay in the earlier images, which are
+   removed once no file refers to them. *)
+let trailer_size = 20
+
+let image_prefix = "image."
+
+let image_path generation = Filename.concat !store (image_prefix ^ string_of_int generation)
+
+(* The generation of an image file of the store, from its name. *)
+let image_generation name =
+  let prefix = String.length image_prefix in
+  if String.length name > prefix && String.sub name 0 prefix = image_prefix
+  then int_of_string_opt (String.sub name prefix (String.length name - prefix))
+  else None
+
+(* Size of the contents of a file in an image. *)
+let padded size = (size + PageStore.page_size - 1) land (lnot (PageStore.page_size - 1))
+
+let find_folder_ino ino =
+  match Hashtbl.find inodes ino with
+  | Folder (_, folder) -> folder
+  | File _ -> throw ErrCode.ENOTDIR
+
+(* Creates an element under the inode it had when the change was made. *)
+let with_ino ino create =
+  let next = !next_ino in
+  next_ino := ino;
+  ignore (create ());
+  next_ino := max next (ino + 1)
+
+let apply images = function
+  | Create (parent, ino, name) -> with_ino ino (fun () -> create_in (find_folder_ino parent) name)
+  | Mkdir (parent, ino, name) -> with_ino ino (fun () -> mkdir_in (find_folder_ino parent) name)
+  | Unlink (parent, name) -> unlink_in (find_folder_ino parent) name
+  | Rmdir (parent, name) -> rmdir_in (find_folder_ino parent) name
+  | Rename (parent, name, new_parent, new_name) ->
+     rename_in (find_folder_ino parent) name (find_folder_ino new_parent) new_name
+  | Write (ino, offset, data) -> ignore (write_file (regular (Hashtbl.find inodes ino)) ~data ~offset)
+  | Truncate (ino, size) -> truncate_file (regular (Hashtbl.find inodes ino)) size
+  | Setxattr (ino, key, value) -> set_xattr (Hashtbl.find inodes ino) key value
+  | Contents (ino, image, offset, size) ->
+     match images with
+     | Some image_of ->
+	let file = regular (Hashtbl.find inodes ino) in
+	PageStore.attach file.contents (image_of image) ~offset ~size;
+	file.saved <- Some (image, offset, size);
+	Hashtbl.remove changed ino
+     | None -> failwith "MemFs: contents outside of an image"
+
+(* Writes to a file still open after it was unlinked are journaled, but the
+   file is gone on replay. *)
+let replay images record =
+  try apply images (decode_change record)
+  with Not_found -> ()
+
+(* Maps the image of a generation, and records its size. *)
+let map_image generation =
+  let fd = Unix.openfile (image_path generation) [ Unix.O_RDONLY ; Unix.O_CLOEXEC ] 0 in
+  Fun.protect ~finally: (fun () -> Unix.close fd) begin fun () ->
+    let size = (Unix.fstat fd).Unix.st_size in
+    Hashtbl.replace image_sizes generation size;
+    PageStore.map fd size
+  end
+
+(* Removes the image files the tree doesn't refer to, and those a crash
+   left incomplete. *)
+let remove_unused_images () =
+  Array.iter (fun name ->
+	      let used = match image_generation name with
+		| Some generation -> Hashtbl.mem image_sizes generation
+		| None -> false in
+	      if not used && String.length name > String.length image_prefix
+		 && String.sub name 0 (String.length image_prefix) = image_prefix
+	      then Sys.remove (Filename.concat !store name))
+	     (Sys.readdir !store)
+
+let load_image () =
+  match List.filter_map image_generation (Array.to_list (Sys.readdir !store)) with
+  | [] -> ()
+  | generations ->
+     let newest = List.fold_left max 0 generations in
+     let path = image_path newest in
+     let channel = open_in_bin path in
+     Fun.protect ~finally: (fun () -> close_in channel) begin fun () ->
+       let size = in_channel_length channel in
+       if size < trailer_size then failwith (path ^ ": truncated image");
+       seek_in channel (size - trailer_size);
+       let trailer = really_input_string channel trailer_size in
+       if String.sub trailer 16 4 <> image_magic then failwith (path ^ ": not an image");
+       let changes_offset = Int64.to_int (String.get_int64_le trailer 0) in
+       seek_in channel changes_offset;
+       let changes = really_input_string channel (size - trailer_size - changes_offset) in
+       let images = Hashtbl.create 4 in
+       Hashtbl.replace images newest (PageStore.map (Unix.descr_of_in_channel channel) size);
+       Hashtbl.replace image_sizes newest size;
+       let image_of generation =
+	 match Hashtbl.find_opt images generation with
+	 | Some image -> image
+	 | None ->
+	    let image = map_image generation in
+	    Hashtbl.replace images generation image;
+	    image in
+       ignore (Journal.iter_records changes ~offset: 0 (replay (Some image_of)));
+       generation := Int64.to_int (String.get_int64_le trailer 8);
+       metadata_size := String.length changes
+     end;
+     remove_unused_images ()
+
+(* Writes the tree to a new image, with the contents of the files changed
+   since the last one, then attaches them to it, so that their pages are
+   released and the journal can start over. The other files keep referring
+   to the earlier images, unless most of such an image is garbage: they
+   are then written again, so that it can be removed. *)
+let compact journal =
+  let image = !generation + 1 in
+  let path = image_path image in
+  let temporary = path ^ ".new" in
+  let channel = open_out_gen [ Open_wronly ; Open_creat ; Open_trunc ; Open_binary ] 0o644 temporary in
+  let changes = Buffer.create 4096
+  and attached = ref []
+  and live = Hashtbl.create 4 in
+  Hashtbl.iter (fun ino element ->
+		match element with
+		| File (_, { saved = Some (generation, _, size) ; _ }) when not (Hashtbl.mem unlinked ino) ->
+		   Hashtbl.replace live generation
+				   (padded size + try Hashtbl.find live generation with Not_found -> 0)
+		| _ -> ())
+	       inodes;
+  let kept generation =
+    match Hashtbl.find_opt live generation, Hashtbl.find_opt image_sizes generation with
+    | Some live, Some size -> 2 * live >= size
+    | _ -> false in
+  let add change = Journal.add_record changes (encode_change change) in
+  let save_contents file =
+    match file.saved with
+    | Some (generation, offset, size) when kept generation ->
+       add (Contents (file.file_ino, generation, offset, size))
+    | _ ->
+       let offset = pos_out channel
+       and size = PageStore.size file.contents in
+       let chunk = 1024 * 1024 in
+       let rec copy position =
+	 if position < size then begin
+	     output_string channel (PageStore.read file.contents ~offset: position ~size: chunk);
+	     copy (position + chunk)
+	   end in
+       copy 0;
+       output_string channel (String.make (padded size - size) '\000');
+       add (Contents (file.file_ino, image, offset, size));
+       attached := (file, offset, size) :: !attached in
+  let save_xattr element =
+    Hashtbl.iter (fun key value -> add (Setxattr (ino_of_element element, key, value)))
+		 (xattr_of_element element) in
+  let rec save_folder folder =
+    iter_entries folder folder ~offset: 2
+		 (fun name element _ ->
+		  begin match element with
+		  | File (_, file) ->
+		     add (Create (folder.folder_ino, file.file_ino, name));
+		     save_contents file
+		  | Folder (_, subfolder) ->
+		     add (Mkdir (folder.folder_ino, subfolder.folder_ino, name));
+		     save_folder subfolder
+		  end;
+		  save_xattr element;
+		  true) in
+  save_xattr root;
+  (match root with Folder (_, folder) -> save_folder folder | File _ -> assert false);
+  let changes_offset = pos_out channel
+  and trailer = Buffer.create trailer_size in
+  Buffer.add_int64_le trailer (Int64.of_int changes_offset);
+  Buffer.add_int64_le trailer (Int64.of_int image);
+  Buffer.add_string trailer image_magic;
+  Buffer.output_buffer channel changes;
+  Buffer.output_buffer channel trailer;
+  flush channel;
+  Unix.fsync (Unix.descr_of_out_channel channel);
+  close_out channel;
+  Unix.rename temporary path;
+  Journal.sync_folder path;
+  (* The image is complete: the journal is stale from now on. *)
+  generation := image;
+  Journal.reset journal ~generation: image;
+  metadata_size := Buffer.length changes;
+  let mapped = map_image image in
+  List.iter (fun (file, offset, size) ->
+	     PageStore.attach file.contents mapped ~offset ~size;
+	     file.saved <- Some (image, offset, size))
+	    !attached;
+  Hashtbl.reset changed;
+  Hashtbl.filter_map_inplace (fun generation size ->
+			      if generation = image || kept generation then Some size else None)
+			     image_sizes;
+  remove_unused_images ()
+
+(** Commits the journal: the changes of every operation since the last
+    commit share one disk sync. *)
+let commit () =
+  match !journal with
+  | Some journal ->
+     Journal.commit journal;
+     let size = Journal.size journal in
+     if size > min_compaction && size > !metadata_size
+	&& size > Hashtbl.fold (fun _ file total -> total + PageStore.size file.contents) changed 0
+     then compact journal
+  | None -> ()
+
+(** Restores the tree from the store, and journals the changes from now
+    on. *)
+let open_store path =
+  store := path;
+  load_image ();
+  journal := Some (Journal.replay (Filename.concat path "journal")
+				  ~generation: !generation (replay None))
+
+let () =
+  assert begin
+      let path = Filename.concat (Filename.get_temp_dir_name ())
+				 ("memfs-store-" ^ string_of_int (Unix.getpid ())) in
+      let top = match root with Folder (_, folder) -> folder | File _ -> assert false in
+      (* Forgets the tree and the store, as a restart does. *)
+      let forget () =
+	Option.iter Journal.close !journal;
+	journal := None;
+	Hashtbl.fold (fun ino _ inos -> if ino = Lowlevel.root_ino then inos else ino :: inos)
+		     inodes []
+	|> List.iter drop;
+	Hashtbl.reset top.dir;
+	Hashtbl.reset top.cookies;
+	top.names <- Cookies.empty;
+	top.next_cookie <- 2;
+	next_ino := Lowlevel.root_ino + 1;
+	files := 0;
+	generation := 0;
+	metadata_size := 0;
+	Hashtbl.reset image_sizes in
+      let reopen () = forget (); open_store path in
+      let contents folder name = match find_in folder name with
+	| File (_, file) -> read_file file ~offset: 0 ~size: 100, file.file_ino
+	| Folder _ -> "", -1 in
+      let folder name = match find_in top name with
+	| Folder (_, folder) -> folder
+	| File _ -> assert false in
+      let stored generation = Sys.file_exists (image_path generation) in
+      Unix.mkdir path 0o700;
+      open_store path;
+      let a = create_in top "a" in
+      ignore (write_file (regular a) ~data: "hello world" ~offset: 0);
+      truncate_file (regular a) 5;
+      let b = ino_of_element (mkdir_in top "b") in
+      rename_in top "a" (folder "b") "c";
+      let x = create_in top "x" in
+      ignore (write_file (regular x) ~data: "gone" ~offset: 0);
+      unlink_in top "x";
+      commit ();
+      let expected = ("hello", ino_of_element a) in
+      (* From the journal only. *)
+      reopen ();
+      let replayed = contents (folder "b") "c" = expected
+		     && (folder "b").folder_ino = b
+		     && not (Hashtbl.mem top.dir "x")
+		     && not (Hashtbl.mem top.dir "a") in
+      Option.iter compact !journal;
+      (* From the image, then a journal whose last record is torn. *)
+      reopen ();
+      let compacted = contents (folder "b") "c" = expected && !generation = 1 in
+      let d = create_in top "d" in
+      ignore (write_file (regular d) ~data: "kept" ~offset: 0);
+      commit ();
+      ignore (write_file (regular d) ~data: "torn" ~offset: 4);
+      commit ();
+      let journal_path = Filename.concat path "journal" in
+      Unix.truncate journal_path ((Unix.stat journal_path).Unix.st_size - 3);
+      reopen ();
+      let torn = contents (folder "b") "c" = expected
+		 && contents top "d" = ("kept", ino_of_element d)
+		 && new_ino () > ino_of_element d in
+      (* Only d is written again: c stays in the first image, until it is
+	 removed with the last file that refers to it. *)
+      Option.iter compact !journal;
+      reopen ();
+      let incremental = stored 1 && stored 2
+			&& contents (folder "b") "c" = expected
+			&& contents top "d" = ("kept", ino_of_element d) in
+      unlink_in (folder "b") "c";
+      Option.iter compact !journal;
+      reopen ();
+      let removed = not (stored 1) && stored 2 && stored 3
+		    && not (Hashtbl.mem (folder "b").dir "c")
+		    && contents top "d" = ("kept", ino_of_element d) in
+      forget ();
+      store := "";
+      Array.iter (fun name -> Sys.remove (Filename.concat path name)) (Sys.readdir path);
+      Unix.rmdir path;
+      replayed && compacted && torn && incremental && removed
+    end
+
+(* Path based API. *)
+
+(* Every change is pushed to AttrCache, so cached attributes can live long. *)
+let attr_cache_ttl = 60.
+
+let parent_path path =
+  match String.rindex path '/' with
+  | 0 -> "/"
+  | i -> String.sub path 0 i
+  | exception Not_found -> "/"
+
+(* Adding or removing an entry changes the size of its folder too. *)
+let invalidate_entry path =
+  AttrCache.invalidate path;
+  AttrCache.invalidate (parent_path path)
+
+let access ~path ~mode = ignore (find_file path)
+
+(* Every change goes through the mount, so what the kernel cached stays
+   valid across opens, unless the caller asked to bypass the cache. *)
+let open_options flags =
+  if OpenFlags.has flags OpenFlags.DIRECT then [ DirectIo ] else [ KeepCache ]
+
+let create ~path ~mode =
+  let filename, folder = find_basefolder path in
+  let element = create_in folder filename in
+  invalidate_entry path;
+  open_handle element, [ KeepCache ]
+
+let mknod ~path ~mode =
+  let filename, folder = find_basefolder path in
+  ignore (create_in folder filename);
+  invalidate_entry path
+
+let destroy () = commit ()
+
+let flush ~path ~handle = commit ()
+
+let getattr ~path = stat_of_element (find_file path)
+
+let fgetattr ~path ~handle = stat_of_element (find_open path handle)
+
+let find_xattr path = xattr_of_element (find_file path)
 				      
 let getxattr ~path ~key =
   let xattr = find_xattr path in
   try Hashtbl.find xattr key
   with Not_found -> ""
 		      
-let setxattr ~path ~key ~value =
-  let xattr = find_xattr path in
-  Hashtbl.replace xattr key value
+let setxattr ~path ~key ~value = set_xattr (find_file path) key value
 
-let init () = ()
+(* The kernel caches writes, and sends them in large batches: every change
+   goes through the mount, so its copy can't be stale. *)
+let init ~conn =
+  AttrCache.enable ~ttl: attr_cache_ttl ~negative_ttl: attr_cache_ttl;
+  Capabilities.enable
+    { conn with Capabilities.max_write = 1024 * 1024 ;
+		max_background = 64 ;
+		congestion_threshold = 48 }
+    Capabilities.[ ASYNC_READ ; BIG_WRITES ; WRITEBACK_CACHE ]
 
 let mkdir ~path ~mode =
   let file, folder = find_basefolder path in
-  if Hashtbl.mem folder.dir file
-  then throw ErrCode.EEXIST
-  else begin
-      Hashtbl.add folder.dir file
-		  (Folder (folder, { dir = Hashtbl.create 10 ;
-				     dir_xattr = Hashtbl.create 10 }));
-      incr files
-    end
+  ignore (mkdir_in folder file);
+  invalidate_entry path
 
 let fopen ~path ~flags =
   match find_file path
-  with File _ -> null_handle
+  with File _ as element -> open_handle element, open_options flags
      | Folder _ -> throw ErrCode.EISDIR
 
 let opendir ~path =
   match find_file path
   with File _ -> throw ErrCode.ENOTDIR
-     | Folder _ -> null_handle
+     | Folder _ as element -> open_handle element
 
 let read ~path ~handle ~offset ~size =
-  match find_file path with
-  | File (_, { contents }) ->
-     let length = Buffer.length contents in
-     let offset = min offset length in
-     let size = min size (length - offset) in
-     Buffer.sub contents offset size
-  | Folder _ -> throw ErrCode.EISDIR
+  read_file (regular (find_open path handle)) ~offset ~size
+
+let read_buffer ~path ~handle ~offset ~buffer =
+  read_file_into (regular (find_open path handle)) ~offset ~buffer
 
-let readdir ~path ~handle =
-  match find_file path with
+let readdir ~path ~handle ~offset ~add =
+  match find_open path handle with
   | File _ -> throw ErrCode.ENOTDIR
-  | Folder (_, folder) ->
-     Array.of_list (Hashtbl.fold
-		      (fun name _ accu -> name :: accu)
-		      folder.dir
-		      [ "." ; ".." ])
+  | Folder (_, { folder_ino }) ->
+     (* The parent of a folder changes when it is moved: the element of the
+	handle may be stale, the one in the inode table is not. *)
+     let parent, folder = match Hashtbl.find inodes folder_ino with
+       | Folder (parent, folder) -> parent, folder
+       | File _ -> assert false in
+     iter_entries parent folder ~offset
+		  (fun name element next ->
+		   add ~name ~stat: (Some (stat_of_element element)) ~next)
 
 let rename ~from_path ~to_path =
   let from_filename, from_folder = find_basefolder from_path
   and to_filename, to_folder = find_basefolder to_path in
-  let from_file = Hashtbl.find from_folder.dir from_filename in
-  if Hashtbl.mem to_folder.dir to_filename then decr files;
-  Hashtbl.remove from_folder.dir from_filename;
-  Hashtbl.replace to_folder.dir to_filename from_file
+  rename_in from_folder from_filename to_folder to_filename;
+  AttrCache.invalidate_tree from_path;
+  AttrCache.invalidate_tree to_path;
+  invalidate_entry from_path;
+  invalidate_entry to_path
 
-let release ~path ~handle = ()
+let release ~path ~handle = close_handle handle
 
-let releasedir ~path ~handle = ()
+let releasedir ~path ~handle = close_handle handle
 
 let rmdir ~path =
-  match find_file path
-  with
-  | Folder (parent, folder) ->
-     if Hashtbl.length folder.dir = 0 then
-       let filename = List.hd (split_path path) in
-       decr files;
-       Hashtbl.remove parent.dir filename
-     else throw ErrCode.ENOTEMPTY
-  | _ -> throw ErrCode.ENOTDIR
-
-let statfs () =
-  let files = !files
-  and file_size = !file_size in
-  let bfree = statfs_base.blocks - (file_size / statfs_base.bsize) in
-  { statfs_base with
-    bfree ;
-    bavail = bfree ;
-    files ;
-    ffree = statfs_base.ffree - files }
+  let filename, folder = find_basefolder path in
+  rmdir_in folder filename;
+  invalidate_entry path
 
-let sync ~path ~handle = ()
+let sync ~path ~handle = commit ()
 
-let syncdir ~path ~handle = ()
+let syncdir ~path ~handle = commit ()
 
 let truncate ~path ~size: new_size =
   match find_file path
   with Folder _ -> throw ErrCode.EISDIR
      | File (_, file) ->
-	let old_size = Buffer.length file.contents in
-	if old_size < new_size then
-	  Buffer.add_string file.contents (String.make (new_size-old_size) '\000')
-	else if old_size > new_size then
-	  let contents = Buffer.contents file.contents in
-	  Buffer.reset file.contents;
-	  Buffer.add_substring file.contents contents 0 new_size
+	truncate_file file new_size;
+	AttrCache.invalidate path
 
-let ftruncate ~path ~handle ~size: new_size = truncate ~path ~size: new_size
+let ftruncate ~path ~handle ~size: new_size =
+  truncate_file (regular (find_open path handle)) new_size;
+  AttrCache.invalidate path
 
 let unlink ~path =
-  match find_file path
-  with
-  | File (parent, file) ->
-     let filename = List.hd (split_path path) in
-     Hashtbl.remove parent.dir filename
-  | _ -> throw ErrCode.ENOTDIR
+  let filename, folder = find_basefolder path in
+  unlink_in folder filename;
+  invalidate_entry path
 
 let write ~path ~handle ~data ~offset =
-  match (find_file path) with
-  | File (_, file) ->
-     file_size := !file_size + String.length data;
-     if offset = Buffer.length file.contents then
-       Buffer.add_string file.contents data
-     else
-       (let contents = Buffer.contents file.contents in
-	Buffer.reset file.contents;
-	Buffer.add_substring file.contents contents 0 offset;
-	Buffer.add_string file.contents data;
-	Buffer.add_substring file.contents
-			     contents
-			     offset
-			     (String.length contents - offset));
-     String.length data
-  | Folder _ -> throw ErrCode.EISDIR
+  let written = write_file (regular (find_open path handle)) ~data ~offset in
+  AttrCache.invalidate path;
+  written
+
+let write_buffer ~path ~handle ~source ~offset =
+  let written = write_file_from (regular (find_open path handle)) ~source ~offset in
+  AttrCache.invalidate path;
+  written
+
+(** Inode based API. *)
+module Inodes =
+  struct
+    let find ino =
+      try Hashtbl.find inodes ino
+      with Not_found -> throw ErrCode.ENOENT
+
+    let find_folder ino =
+      match find ino with
+      | Folder (_, folder) -> folder
+      | File _ -> throw ErrCode.ENOTDIR
+
+    let find_regular ino = regular (find ino)
+
+    (** The file of a handle, or of the inode for the null handle. *)
+    let find_open ino handle =
+      regular (if handle = null_handle then find ino else find_handle handle)
+
+    let count_lookup ino =
+      let count = try Hashtbl.find lookups ino with Not_found -> 0 in
+      Hashtbl.replace lookups ino (count + 1)
+
+    let entry_of_element element =
+      { Lowlevel.ino = ino_of_element element ; attr = stat_of_element element }
+
+    (** Returns the entry of an element and counts the kernel reference. *)
+    let entry element =
+      let entry = entry_of_element element in
+      count_lookup entry.Lowlevel.ino;
+      entry
+
+    let lookup ~parent ~name = entry (find_in (find_folder parent) name)
+
+    let forget ~ino ~nlookup =
+      let count = (try Hashtbl.find lookups ino with Not_found -> 0) - nlookup in
+      if count > 0
+      then Hashtbl.replace lookups ino count
+      else begin
+	  Hashtbl.remove lookups ino;
+	  release_unlinked ino
+	end
+
+    let getattr ~ino = stat_of_element (find ino)
+
+    let truncate ~ino ~size =
+      truncate_file (find_regular ino) size;
+      getattr ~ino
+
+    let access ~ino ~mode = ignore (find ino)
+
+    let mkdir ~parent ~name ~mode = entry (mkdir_in (find_folder parent) name)
+
+    let mknod ~parent ~name ~mode = entry (create_in (find_folder parent) name)
+
+    let create ~parent ~name ~mode =
+      let element = create_in (find_folder parent) name in
+      entry element, open_handle element, [ KeepCache ]
+
+    let unlink ~parent ~name = unlink_in (find_folder parent) name
+
+    let rmdir ~parent ~name = rmdir_in (find_folder parent) name
+
+    let rename ~parent ~name ~new_parent ~new_name =
+      rename_in (find_folder parent) name (find_folder new_parent) new_name
+
+    let fopen ~ino ~flags =
+      let element = find ino in
+      ignore (regular element);
+      open_handle element, open_options flags
+
+    let read ~ino ~handle ~offset ~size = read_file (find_open ino handle) ~offset ~size
+
+    let read_buffer ~ino ~handle ~offset ~buffer =
+      read_file_into (find_open ino handle) ~offset ~buffer
+
+    let write ~ino ~handle ~data ~offset = write_file (find_open ino handle) ~data ~offset
+
+    let write_buffer ~ino ~handle ~source ~offset =
+      write_file_from (find_open ino handle) ~source ~offset
+
+    let flush ~ino ~handle = commit ()
+
+    let release ~ino ~handle = close_handle handle
+
+    let sync ~ino ~handle = commit ()
+
+    let opendir ~ino = ignore (find_folder ino); null_handle
+
+    let readdir ~ino ~handle ~offset ~add =
+      match find ino with
+      | File _ -> throw ErrCode.ENOTDIR
+      | Folder (parent, folder) ->
+	 iter_entries parent folder ~offset
+		      (fun name element next ->
+		       add ~name ~ino: (ino_of_element element)
+			   ~kind: (stat_of_element element).kind ~next)
+
+    let readdirplus ~ino ~handle ~offset ~add =
+      match find ino with
+      | File _ -> throw ErrCode.ENOTDIR
+      | Folder (parent, folder) ->
+	 iter_entries parent folder ~offset
+		      (fun name element next ->
+		       let entry = entry_of_element element in
+		       add ~name ~entry ~next
+		       && (if name <> "." && name <> ".." then count_lookup entry.Lowlevel.ino;
+			   true))
+
+    let releasedir ~ino ~handle = ()
+
+    let syncdir ~ino ~handle = commit ()
+
+    let getxattr ~ino ~key =
+      try Hashtbl.find (xattr_of_element (find ino)) key
+      with Not_found -> ""
+
+    let setxattr ~ino ~key ~value = set_xattr (find ino) key value
+  end
+
+(** The path based filesystem. *)
+let filesystem =
+  { access ;
+    create ;
+    mknod ;
+    destroy ;
+    flush ;
+    getattr ;
+    fgetattr ;
+    getxattr ;
+    setxattr ;
+    init ;
+    mkdir ;
+    fopen ;
+    opendir ;
+    read ;
+    read_buffer = Some read_buffer ;
+    readdir ;
+    rename ;
+    release ;
+    releasedir ;
+    rmdir ;
+    statfs ;
+    sync ;
+    syncdir ;
+    truncate ;
+    ftruncate ;
+    unlink ;
+    write ;
+    write_buffer = Some write_buffer }
 
-let _ =
-  start
-    "/Users/rpavy/Documents/Sync/MemFs"
-    [ `Debug ; `Foreground ] (*[ `SingleThreaded ; `Foreground ]*)
-    { access ;
-      create ;
-      mknod ;
-      destroy ;
-      flush ;
-      getattr ;
-      fgetattr ;
-      getxattr ;
-      setxattr ;
-      init ;
-      mkdir ;
-      fopen ;
-      opendir ;
-      read ;
-      readdir ;
-      rename ;
-      release ;
-      releasedir ;
-      rmdir ;
-      statfs ;
-      sync ;
-      syncdir ;
-      truncate ;
-      ftruncate ;
-      unlink ;
-      write }
+(** The inode based filesystem. *)
+let lowlevel_filesystem =
+  let open Inodes in
+  { Lowlevel.init ;
+    destroy ;
+    lookup ;
+    forget ;
+    getattr ;
+    truncate ;
+    access ;
+    mkdir ;
+    mknod ;
+    create ;
+    unlink ;
+    rmdir ;
+    rename ;
+    fopen ;
+    read ;
+    read_buffer = Some read_buffer ;
+    write ;
+    write_buffer = Some write_buffer ;
+    flush ;
+    release ;
+    sync ;
+    opendir ;
+    readdir ;
+    readdirplus = Some readdirplus ;
+    releasedir ;
+    syncdir ;
+    statfs ;
+    getxattr ;
+    setxattr }
@@ -0,0 +1,42 @@
+open OCamlFuse
+
+let mountpoint, lowlevel, batch, store_path, read_ahead =
+  let mountpoint = ref "/Users/rpavy/Documents/Sync/MemFs"
+  and lowlevel = ref false
+  and batch = ref 0
+  and store_path = ref ""
+  and read_ahead = ref 0 in
+  let specs = [ "mountpoint", Arg.Set_string mountpoint,
+		"<dir> Folder where MemFs is mounted" ;
+		"lowlevel", Arg.Set lowlevel,
+		" Serve MemFs through the inode based low-level API" ;
+		"batch", Arg.Set_int batch,
+		"<n> Run up to n operations per acquisition of the runtime lock" ;
+		"store", Arg.Set_string store_path,
+		"<dir> Folder where MemFs persists its files, none by default" ;
+		"read_ahead", Arg.Set_int read_ahead,
+		"<n> Read sequential reads ahead in chunks of n MiB, path based API only" ]
+  in
+  Sync_Utils_CommandLine.parse specs;
+  !mountpoint, !lowlevel, !batch, !store_path, !read_ahead
+
+let () = if store_path <> "" then MemFs.open_store store_path
+
+let () = if read_ahead > 0 then ReadAhead.enable ~chunk_size: (read_ahead * 1024 * 1024)
+
+(* Every change goes through the mount, so the kernel can cache for long. *)
+let kernel_cache =
+  [ `EntryTimeout MemFs.attr_cache_ttl ; `AttrTimeout MemFs.attr_cache_ttl ; `KernelCache ]
+
+let dispatch = if batch > 0 then [ `Batched batch ] else []
+
+let _ =
+  if lowlevel
+  then Lowlevel.start
+	 mountpoint
+	 ([ `Debug ; `Foreground ] @ kernel_cache @ dispatch)
+	 MemFs.lowlevel_filesystem
+  else start
+	 mountpoint
+	 ([ `Debug ; `Foreground ] @ kernel_cache @ dispatch) (*[ `SingleThreaded ; `Foreground ]*)
+	 MemFs.filesystem
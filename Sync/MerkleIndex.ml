@@ -0,0 +1,221 @@
+type kind = File | Dir
+
+type entry = {
+    name : string ;
+    kind : kind ;
+    mtime : float ;
+    size : int ;
+    content : int ;
+    hash : Digest.t ;
+    children : entry list ;
+  }
+
+type t = {
+    path : string ;
+    mutable root : entry ;
+    lock : Mutex.t ;
+  }
+
+let file_name = ".sync-index"
+
+(* Bumped whenever entry changes, so that an index of an older format is
+ * dropped instead of being unmarshalled as the new one. *)
+let version = 1
+
+let partial_prefix = ".sync-partial."
+
+let partial name = partial_prefix ^ name
+
+let skipped name =
+  let n = String.length partial_prefix in
+  name = file_name || name = file_name ^ ".tmp"
+  || (String.length name >= n && String.sub name 0 n = partial_prefix)
+
+let file name ~mtime ~size ~content =
+  { name ; kind = File ; mtime ; size ; content ;
+    hash = Digest.string (Printf.sprintf "F%s\000%d\000%d" name size content) ;
+    children = [] }
+
+(* Hashes are fixed length, so their concatenation is unambiguous. *)
+let dir name ~mtime children =
+  let children = List.sort (fun a b -> compare a.name b.name) children in
+  let buffer = Buffer.create (16 * (List.length children + 1)) in
+  Buffer.add_char buffer 'D';
+  Buffer.add_string buffer name;
+  Buffer.add_char buffer '\000';
+  List.iter (fun child -> Buffer.add_string buffer child.hash) children;
+  { name ; kind = Dir ; mtime ; size = 0 ; content = 0 ;
+    hash = Digest.string (Buffer.contents buffer) ;
+    children }
+
+let empty = dir "" ~mtime: 0. []
+
+let shallow entry =
+  { entry with children = [] }
+
+let root t = t.root
+
+let find t path =
+  let rec aux entry = function
+    | [] -> Some entry
+    | name :: path ->
+       match List.find (fun child -> child.name = name) entry.children with
+       | child -> aux child path
+       | exception Not_found -> None
+  in aux t.root (List.rev path)
+
+let load path =
+  match open_in_bin (Filename.concat path file_name) with
+  | exception Sys_error _ -> empty
+  | channel ->
+     let stored = try Some (Marshal.from_channel channel : int * entry)
+		  with End_of_file | Failure _ -> None
+     in
+     close_in channel;
+     match stored with
+     | Some (stored_version, root) when stored_version = version -> root
+     | Some _ | None -> empty
+
+let save t =
+  let temp_path = Filename.concat t.path (file_name ^ ".tmp") in
+  let channel = open_out_bin temp_path in
+  Marshal.to_channel channel (version, t.root) [];
+  close_out channel;
+  Sys.rename temp_path (Filename.concat t.path file_name)
+
+(* Returns old itself when nothing changed under it, so that refresh can
+ * tell whether to save. The root's mtime is not compared, since saving
+ * the index changes it. A shallow walk of a directory reads its names
+ * but keeps the entries it already had. *)
+let rec walk ?(shallow = false) ~root path name old =
+  match Unix.LargeFile.lstat path with
+  | exception Unix.Unix_error _ -> None
+  | stats ->
+     let mtime = stats.Unix.LargeFile.st_mtime
+     and size = Int64.to_int stats.Unix.LargeFile.st_size in
+     match stats.Unix.LargeFile.st_kind, old with
+     | Unix.S_REG, Some ({ kind = File } as old) when old.mtime = mtime && old.size = size ->
+	Some old
+     | Unix.S_REG, _ ->
+	begin match Delta.hash_file path with
+	| content -> Some (file name ~mtime ~size ~content)
+	| exception Unix.Unix_error _ -> None
+	end
+     | Unix.S_DIR, _ ->
+	let names = try Sys.readdir path with Sys_error _ -> [||] in
+	Array.sort compare names;
+	(* Both sorted by name: old children are found by merging. *)
+	let old_children = ref (match old with Some { kind = Dir ; children } -> children | _ -> []) in
+	let rec old_child name =
+	  match !old_children with
+	  | child :: rest when child.name < name -> old_children := rest; old_child name
+	  | child :: rest when child.name = name -> old_children := rest; Some child
+	  | _ -> None
+	in
+	let children =
+	  Array.fold_left
+	    begin fun accu child ->
+		  if skipped child then accu
+		  else match old_child child with
+		       | Some entry when shallow -> entry :: accu
+		       | old ->
+			  match walk ~root: false (Filename.concat path child) child old with
+			  | Some entry -> entry :: accu
+			  | None -> accu
+	    end
+	    [] names
+	  |> List.rev
+	in
+	begin match old with
+	| Some ({ kind = Dir } as old) when (root || old.mtime = mtime)
+					    && List.length children = List.length old.children
+					    && List.for_all2 (==) children old.children ->
+	   Some old
+	| Some _ | None -> Some (dir name ~mtime children)
+	end
+     | _ -> None
+
+let with_lock t f =
+  Mutex.lock t.lock;
+  match f () with
+  | root ->
+     if root != t.root
+     then begin
+	 t.root <- root;
+	 try save t with Sys_error _ -> ()
+       end;
+     Mutex.unlock t.lock
+  | exception exn -> Mutex.unlock t.lock; raise exn
+
+let refresh t =
+  with_lock t
+	    begin fun () ->
+		  match walk ~root: true t.path "" (Some t.root) with
+		  | Some root -> root
+		  | None -> empty
+	    end
+
+(* Walks the entry at path, innermost name first, and hashes its
+ * ancestors again. A path under an entry the index doesn't have walks
+ * that entry instead, as does a path under a file. *)
+let update_path ~deep t root path =
+  let rec aux parent_path parent = function
+    | [] -> parent
+    | name :: rest ->
+       let child_path = Filename.concat parent_path name in
+       let old = try Some (List.find (fun child -> child.name = name) parent.children)
+		 with Not_found -> None
+       in
+       let updated =
+	 match rest, old with
+	 | _, _ when skipped name -> old
+	 | _ :: _, Some ({ kind = Dir } as old) -> Some (aux child_path old rest)
+	 | _, _ -> walk ~shallow: (not deep) ~root: false child_path name old
+       in
+       match updated, old with
+       | Some updated, Some old when updated == old -> parent
+       | None, None -> parent
+       | _, _ ->
+	  let children = List.filter (fun child -> child.name <> name) parent.children in
+	  let children = match updated with Some entry -> entry :: children | None -> children in
+	  let mtime = try (Unix.LargeFile.lstat parent_path).Unix.LargeFile.st_mtime
+		      with Unix.Unix_error _ -> parent.mtime
+	  in dir parent.name ~mtime children
+  in aux t.path root (List.rev path)
+
+let update t ~deep ~shallow =
+  with_lock t
+	    begin fun () ->
+		  let root = List.fold_left (update_path ~deep: true t) t.root deep in
+		  List.fold_left (update_path ~deep: false t) root shallow
+	    end
+
+let indexes = Hashtbl.create 16
+let indexes_lock = Mutex.create ()
+
+let get path =
+  Mutex.lock indexes_lock;
+  let index =
+    try Hashtbl.find indexes path
+    with Not_found ->
+      let index = { path ; root = load path ; lock = Mutex.create () } in
+      Hashtbl.add indexes path index;
+      index
+  in
+  Mutex.unlock indexes_lock;
+  index
+
+let () = assert begin
+  let a = file "a" ~mtime: 1. ~size: 1 ~content: 1
+  and b = file "b" ~mtime: 1. ~size: 2 ~content: 2 in
+  let tree = dir "" ~mtime: 1. [ b ; dir "d" ~mtime: 1. [ a ] ] in
+  let index = { path = "" ; root = tree ; lock = Mutex.create () } in
+  (dir "" ~mtime: 2. [ dir "d" ~mtime: 3. [ file "a" ~mtime: 4. ~size: 1 ~content: 1 ] ; b ]).hash
+  = tree.hash
+  && (dir "" ~mtime: 1. [ b ; dir "d" ~mtime: 1. [ file "a" ~mtime: 1. ~size: 1 ~content: 3 ] ]).hash
+     <> tree.hash
+  && (dir "" ~mtime: 1. [ b ; dir "e" ~mtime: 1. [ a ] ]).hash <> tree.hash
+  && (match find index [ "a" ; "d" ] with Some entry -> entry == a | None -> false)
+  && find index [ "b" ; "d" ] = None
+  && (shallow tree).children = []
+end
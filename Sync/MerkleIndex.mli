@@ -0,0 +1,61 @@
+(** Merkle tree of a shared directory, persisted in it, so that two peers
+    find the subtrees they differ on by comparing hashes top down instead
+    of listing both trees.
+
+    Entries hash their name, kind, size and content, not their mtime, so
+    that a file copied from a peer hashes the same on both sides. Files
+    are only hashed again when their mtime or size changed. *)
+
+type kind = File | Dir
+
+type entry = {
+    name : string ;
+    kind : kind ;
+    mtime : float ;
+    size : int ;
+    content : int ;         (* Delta.hash of a file, 0 for a directory. *)
+    hash : Digest.t ;
+    children : entry list ; (* Sorted by name. *)
+  }
+
+type t
+
+(** Name of the file the index of a directory is persisted in, at its root.
+    Walks skip it. *)
+val file_name : string
+
+(** Name of the temporary file a file is fetched into before it replaces
+    it. *)
+val partial : string -> string
+
+(** Whether a name is the index's own, its temporary file, or a partial
+    file, which are neither indexed nor synced. *)
+val skipped : string -> bool
+
+(** Index of the directory at the given path, loaded from its file the
+    first time, empty when there is none or it can't be read. *)
+val get : string -> t
+
+(** Walks the directory to bring the index up to date, and persists it if
+    it changed. Blocks: run it off the main thread. *)
+val refresh : t -> unit
+
+(** Brings the entries at the given paths up to date, innermost name first
+    as for the paths of [Sync], and persists the index if it changed. The
+    directories of [deep] paths are walked whole, the ones of [shallow]
+    paths only for the names they hold: it is for a watcher that reports
+    the changes of their entries on their own paths. Blocks as
+    [refresh]. *)
+val update : t -> deep: string list list -> shallow: string list list -> unit
+
+val root : t -> entry
+
+(** Entry at a path relative to the root, innermost name first as for the
+    paths of [Sync]. *)
+val find : t -> string list -> entry option
+
+(** The entry without its children, as sent to a peer. *)
+val shallow : entry -> entry
+
+val file : string -> mtime: float -> size: int -> content: int -> entry
+val dir : string -> mtime: float -> entry list -> entry
@@ -0,0 +1,90 @@
+(** Compares the requests per second of HttpParser with the ones of the
+    StartLine and Headers parsers of HttpProtocol, on pipelined requests
+    read from memory, and prints them as JSON. *)
+
+open Lwt.Infix
+
+module HttpParser = Sync_HttpParser
+module HttpProtocol = Sync_HttpProtocol
+
+let requests =
+  let requests = ref (100 * 1000) in
+  let specs = [ "requests", Arg.Set_int requests,
+		"<n> Requests per run" ]
+  in
+  Sync_Utils_CommandLine.parse specs;
+  !requests
+
+(* A request of a browser to the file handler. *)
+let request =
+  String.concat "\r\n"
+    [ "GET /files/some/folder/file.html?view=raw HTTP/1.1" ;
+      "Host: 127.0.0.1:8080" ;
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0" ;
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" ;
+      "Accept-Language: en-US,en;q=0.5" ;
+      "Accept-Encoding: gzip, deflate" ;
+      "Connection: keep-alive" ;
+      "Range: bytes=0-1023" ;
+      "" ; "" ]
+
+let pipelined =
+  Lwt_bytes.of_string (String.concat "" (Array.to_list (Array.make requests request)))
+
+let channel () =
+  Lwt_io.of_bytes ~mode: Lwt_io.input pipelined
+
+let rec repeat n f =
+  if n = 0 then Lwt.return_unit else f () >>= fun () -> repeat (n - 1) f
+
+let headers () =
+  let channel = channel () in
+  repeat requests
+	 (fun () -> HttpProtocol.StartLine.parse channel
+		    >>= fun _ -> HttpProtocol.Headers.parse channel
+		    >|= ignore)
+
+let parser_channel () =
+  let channel = channel ()
+  and parser = HttpParser.create () in
+  repeat requests (fun () -> HttpParser.read parser channel)
+
+let request_parse () =
+  let channel = channel () in
+  repeat requests (fun () -> HttpProtocol.HttpRequest.parse channel >|= ignore)
+
+(* Parses the requests straight from the buffer, as they are added. *)
+let parser_buffer () =
+  let parser = HttpParser.create ()
+  and length = Lwt_bytes.length pipelined in
+  let rec loop offset parsed =
+    if HttpParser.parse parser >= 0
+    then (HttpParser.next parser; loop offset (parsed + 1))
+    else if offset < length
+    then loop (offset + HttpParser.add parser pipelined offset (length - offset)) parsed
+    else parsed
+  in
+  if loop 0 0 = requests
+  then Lwt.return_unit
+  else Lwt.fail_with "Requests missed"
+
+let measure (name, run) =
+  let start = Unix.gettimeofday () in
+  run ()
+  >|= fun () ->
+  let seconds = Unix.gettimeofday () -. start in
+  `Assoc [ "parser", `String name ;
+	   "requests", `Int requests ;
+	   "seconds", `Float seconds ;
+	   "requests_per_second", `Float (float_of_int requests /. seconds) ]
+
+let perf () =
+  Lwt_list.map_s measure
+		 [ "start_line_and_headers", headers ;
+		   "http_request_parse", request_parse ;
+		   "http_parser_channel", parser_channel ;
+		   "http_parser_buffer", parser_buffer ]
+  >|= fun results ->
+  print_endline (Yojson.Basic.pretty_to_string (`List results))
+
+let () = Lwt_main.run (perf ())
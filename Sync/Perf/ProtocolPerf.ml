@@ -0,0 +1,116 @@
+(** Compares the round trip latency and the throughput of the binary
+    protocol with the ones of NativeProtocol.Async, between two peers of
+    the same process over loopback TCP, and prints them as JSON. *)
+
+open Lwt.Infix
+
+module BinaryProtocol = Sync_BinaryProtocol
+module NativeProtocol = Sync_NativeProtocol
+module Rpc = Sync_Rpc
+module SyncTypes = Sync_SyncTypes
+
+let port, calls, concurrency =
+  let port = ref 8181
+  and calls = ref (20 * 1000)
+  and concurrency = ref 64 in
+  let specs = [ "port", Arg.Set_int port,
+		"<port> Port of the server" ;
+		"calls", Arg.Set_int calls,
+		"<n> Calls per run, scaled down for payloads over 4 KiB" ;
+		"concurrency", Arg.Set_int concurrency,
+		"<n> Calls outstanding at once in throughput runs" ]
+  in
+  Sync_Utils_CommandLine.parse specs;
+  !port, !calls, !concurrency
+
+let ip = "127.0.0.1"
+
+let echo =
+  BinaryProtocol.register_operation
+    1 BinaryProtocol.string BinaryProtocol.string
+    (fun payload connection -> Lwt.return payload)
+
+let call_of_protocol connection = function
+  | `Binary -> fun payload -> BinaryProtocol.call connection echo payload
+  | `Native -> fun payload -> NativeProtocol.Async.call connection (fun _ -> Lwt.return payload)
+
+let name = function
+  | `Binary -> "binary"
+  | `Native -> "native_async"
+
+let serve connection =
+  let rec loop () = Rpc.respond connection >>= loop in
+  Lwt.async (fun () -> Lwt.catch loop (fun _ -> Lwt.return_unit))
+
+let root =
+  { SyncTypes.root_name = "perf" ;
+    server = { SyncTypes.ip ;
+	       port ;
+	       shutdown = (fun () -> ()) ;
+	       onshutdown = fst (Lwt.wait ()) } ;
+    connections = Hashtbl.create 1 ;
+    storage = (module SyncTypes.Storage) }
+
+let percentile sorted p =
+  sorted.(min (Array.length sorted - 1) (int_of_float (p *. float_of_int (Array.length sorted))))
+
+(* Calls one at a time, for latency. *)
+let latency call payload calls =
+  let times = Array.make calls 0. in
+  let rec aux i =
+    if i = calls
+    then Lwt.return_unit
+    else
+      let start = Unix.gettimeofday () in
+      call payload
+      >>= fun _ ->
+      times.(i) <- Unix.gettimeofday () -. start;
+      aux (i + 1)
+  in
+  aux 0
+  >|= fun () ->
+  Array.sort compare times;
+  percentile times 0.5, percentile times 0.99
+
+(* Keeps concurrency calls outstanding, for throughput. *)
+let throughput call payload calls =
+  let start = Unix.gettimeofday () in
+  let rec worker n =
+    if n = 0 then Lwt.return_unit else call payload >>= fun _ -> worker (n - 1)
+  in
+  Lwt.join (Array.to_list (Array.make concurrency ()) |> List.map (fun () -> worker (calls / concurrency)))
+  >|= fun () -> Unix.gettimeofday () -. start
+
+let measure connection (protocol, size) =
+  let call = call_of_protocol connection protocol
+  and payload = String.make size 'x'
+  and calls = max concurrency (calls * 4096 / max 4096 size) in
+  latency call payload calls
+  >>= fun (p50, p99) ->
+  throughput call payload calls
+  >|= fun seconds ->
+  let total = float_of_int (calls / concurrency * concurrency) in
+  `Assoc [ "protocol", `String (name protocol) ;
+	   "payload", `Int size ;
+	   "calls", `Int calls ;
+	   "concurrency", `Int concurrency ;
+	   "p50_us", `Float (p50 *. 1e6) ;
+	   "p99_us", `Float (p99 *. 1e6) ;
+	   "calls_per_second", `Float (total /. seconds) ;
+	   "mb_per_second", `Float (2. *. total *. float_of_int size /. seconds /. 1e6) ]
+
+let perf () =
+  let root = Rpc.establish_server ~ip ~port root serve in
+  Rpc.open_connection ~ip ~port root
+  >>= fun connection ->
+  serve connection;
+  let runs =
+    List.concat
+      (List.map (fun size -> [ `Native, size ; `Binary, size ]) [ 0 ; 1024 ; 65536 ; 1024 * 1024 ])
+  in
+  Lwt_list.map_s (measure connection) runs
+  >|= fun results ->
+  print_endline (Yojson.Basic.pretty_to_string (`List results));
+  root.SyncTypes.server.SyncTypes.shutdown ()
+
+let () = Lwt_main.run (perf ())
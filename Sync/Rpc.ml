@@ -60,26 +60,24 @@ let shutdown_fd wakener fd =
 	    then Lwt.return_unit
 	    else (once := true; Lazy.force x)
 
-let create_connection ?buffer_size root fd sockaddr =
+let create_connection ?buffer_size ?(compression = true) ~role root fd sockaddr =
   (try Lwt_unix.set_close_on_exec fd with Invalid_argument _ -> ());
   let onclose_waiter, onclose_wakener = Lwt.wait () in
   let close = shutdown_fd onclose_wakener fd in
-  let create_buffer () =
-    Lwt_bytes.create
-      begin
-	match buffer_size with
-	| None -> 1024
-	| Some x -> x
-      end
+  let traffic = Compression.traffic () in
+  let input, output =
+    Compression.channels ?buffer_size ~role ~enabled: compression ~close traffic fd
   in
   { root;
     peer_name = "";
     sockaddr = sockaddr;
     lock = Lwt_mutex.create ();
-    input = Lwt_io.of_fd ~buffer:(create_buffer()) ~mode:Lwt_io.input ~close fd;
-    output = Lwt_io.of_fd ~buffer:(create_buffer()) ~mode:Lwt_io.output ~close fd;
+    input;
+    output;
     onclose = onclose_waiter;
     close = close;
+    traffic;
+    socket = fd;
   }
 
 type accept_or_shutdown =
@@ -104,7 +102,7 @@ let establish_server ?buffer_size ?(backlog = 5) ~ip ~port root callback =
   let rec loop () =
     Lwt.pick [Lwt_unix.accept sock >|= (fun x -> Accept x); abort_waiter] >>= function
     | Accept(fd, sockaddr) ->
-       callback (create_connection ?buffer_size root fd sockaddr);
+       callback (create_connection ?buffer_size ~role: Compression.Server root fd sockaddr);
        loop ()
     | Shutdown ->
        let close_server_socket () =
@@ -125,16 +123,17 @@ let establish_server ?buffer_size ?(backlog = 5) ~ip ~port root callback =
   AsyncUtils.async ~onerror: "Server loop" loop;
   root
 
-let open_connection ?buffer_size ~ip ~port root =
+let open_connection ?buffer_size ?compression ~ip ~port root =
   let sockaddr = Unix.ADDR_INET(Unix.inet_addr_of_string ip, port) in
   let fd = Lwt_unix.socket (Unix.domain_of_sockaddr sockaddr) Unix.SOCK_STREAM 0 in
   Lwt_unix.connect fd sockaddr
-  >|= fun () -> create_connection ?buffer_size root fd sockaddr
+  >|= fun () -> create_connection ?buffer_size ?compression ~role: Compression.Client root fd sockaddr
 
 let () =
   register_protocol (module JsonProtocol.Sync);
   register_protocol (module JsonProtocol.Async);
   register_protocol (module NativeProtocol.Sync);
   register_protocol (module NativeProtocol.Async);
+  register_protocol (module BinaryProtocol.Frames);
   List.iter (fun m -> register_protocol m)
 	    HttpProtocol.modules
@@ -2,7 +2,8 @@
     Uses the first letter to determine the protocol implementation to use. *)
 val respond : SyncTypes.connection -> unit Lwt.t
 
-(** Starts an RPC server that listens on the given IP and port number. *)
+(** Starts an RPC server that listens on the given IP and port number.
+    Connections are compressed when the client asks for it. *)
 val establish_server :
   ?buffer_size: int ->
   ?backlog: int ->
@@ -10,9 +11,11 @@ val establish_server :
   port: int ->
   SyncTypes.root -> (SyncTypes.connection -> unit) -> SyncTypes.root
 
-(** Opens a connection to the given IP and port number. *)
+(** Opens a connection to the given IP and port number, compressed unless
+    [compression] is false. *)
 val open_connection :
   ?buffer_size: int ->
+  ?compression: bool ->
   ip: string ->
   port: int ->
   SyncTypes.root ->
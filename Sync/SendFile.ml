@@ -0,0 +1,24 @@
+open Lwt.Infix
+
+external available : unit -> bool = "sync_sendfile_available_impl"
+external sendfile : Unix.file_descr -> Unix.file_descr -> int -> int -> int = "sync_sendfile_impl"
+
+let available = available ()
+
+(* Bytes sent per call at most, so that each call returns quickly. *)
+let chunk_size = 1 lsl 20
+
+let send ~socket fd ~offset ~length =
+  let file = Lwt_unix.unix_file_descr fd
+  and unix_socket = Lwt_unix.unix_file_descr socket in
+  let rec loop offset length =
+    if length = 0
+    then Lwt.return_unit
+    else Lwt_unix.wrap_syscall
+	   Lwt_unix.Write socket
+	   (fun () -> sendfile unix_socket file offset (min length chunk_size))
+	 >>= function
+	 | 0 -> Lwt.fail End_of_file
+	 | n -> loop (offset + n) (length - n)
+  in
+  loop offset length
@@ -0,0 +1,14 @@
+(** Sends files to sockets with sendfile(2), without copying them through
+    user space. *)
+
+(** Whether the system supports it, i.e. Linux. *)
+val available : bool
+
+(** [send ~socket fd ~offset ~length] sends length bytes of the file from
+    offset. Fails with End_of_file when the file is shorter. *)
+val send :
+  socket: Lwt_unix.file_descr ->
+  Lwt_unix.file_descr ->
+  offset: int ->
+  length: int ->
+  unit Lwt.t
@@ -0,0 +1,50 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
+
+#include <errno.h>
+#include <sys/types.h>
+
+/* Copies of files to sockets within the kernel, for SendFile. */
+
+#ifdef __linux__
+
+#include <sys/sendfile.h>
+
+CAMLprim value sync_sendfile_available_impl(value unit)
+{
+  return Val_true;
+}
+
+/* Sends up to length bytes of fd from offset to socket, and returns how
+ * many were sent: fewer when the socket buffer fills up, 0 at the end of
+ * the file. Raises EAGAIN when nothing can be sent yet. */
+CAMLprim value sync_sendfile_impl(value socket, value fd, value offset, value length)
+{
+  CAMLparam4(socket, fd, offset, length);
+  off_t position = Long_val(offset);
+  ssize_t sent;
+  caml_release_runtime_system();
+  sent = sendfile(Int_val(socket), Int_val(fd), &position, Long_val(length));
+  caml_acquire_runtime_system();
+  if (sent < 0) {
+    uerror("sendfile", Nothing);
+  }
+  CAMLreturn(Val_long(sent));
+}
+
+#else
+
+CAMLprim value sync_sendfile_available_impl(value unit)
+{
+  return Val_false;
+}
+
+CAMLprim value sync_sendfile_impl(value socket, value fd, value offset, value length)
+{
+  unix_error(ENOSYS, "sendfile", Nothing);
+  return Val_unit;
+}
+
+#endif
@@ -58,6 +58,7 @@ let ls path =
 	  let stats = Lwt_stream.filter_map_s
 			begin function
 			  | "." | ".." -> Lwt.return_none
+			  | filename when MerkleIndex.skipped filename -> Lwt.return_none
 			  | filename -> stat (filename :: path) >|= fun stat -> Some stat
 			end
 			files
@@ -98,91 +99,239 @@ and list_shared_dirs peer =
     end
     shared_dirs []
 
+let rec remove_local stat =
+  let ignore_failure f = Lwt.catch f (fun _ -> Lwt.return_unit) in
+  let path = join stat.path in
+  match stat.kind with
+  | File | Null -> ignore_failure (fun () -> Lwt_unix.unlink path)
+  | Dir -> ls stat.path
+	   >>= Lwt_list.iter_s remove_local
+	   >>= fun () -> ignore_failure (fun () -> Lwt_unix.rmdir path)
+
 let delete_local job stat =
-  let rec aux stat =
-    let ignore_failure f = Lwt.catch f (fun _ -> Lwt.return_unit) in
-    let path = join stat.path in
-    match stat.kind with
-    | File | Null -> ignore_failure (fun () -> Lwt_unix.unlink path)
-    | Dir -> ls stat.path
-	     >>= Lwt_list.iter_s aux
-	     >>= fun () -> ignore_failure (fun () -> Lwt_unix.rmdir path)
-  in job (fun () -> aux stat)
+  job (fun () -> remove_local stat)
 
-let copy_file job shared_dir relative_path =
-  ()
+let make_dir shared_dir relative_path =
+  Lwt.catch
+    (fun () -> Lwt_unix.mkdir (join (relative_path @ shared_dir.local_path)) 0o755)
+    begin function
+      | Unix.Unix_error (Unix.EEXIST, _, _) -> Lwt.return_unit
+      | exn -> Lwt.fail exn
+    end
 
-let update_file job shared_dir relative_path local_stat =
+(* Brings the local file up to date with the remote one: the peer is sent
+ * the signature of the local file and answers with deltas against it,
+ * which are patched into a partial file renamed over the local one. Each
+ * call asks for the delta from where the previous one ended, so that the
+ * literal bytes in flight stay bounded. The checksums run in threads, so
+ * that large files don't stall the other connections of either peer, and
+ * the local file stays open until the patches copy its blocks. A missing
+ * local file has an empty signature. The partial file reaches the disk
+ * before the rename, so that a crash never leaves a renamed file without
+ * its data. *)
+let fetch_file job shared_dir relative_path =
   let aux () =
+    let shared_dir_name = shared_dir.name
+    and path = relative_path @ shared_dir.local_path in
+    let temp_path = join (MerkleIndex.partial (List.hd path) :: List.tl path)
+    and path = join path in
+    Lwt_preemptive.detach
+      begin fun () ->
+	    let flags = [ Unix.O_RDONLY ; Unix.O_CLOEXEC ] in
+	    let old = try Unix.openfile path flags 0
+		      with Unix.Unix_error (Unix.ENOENT, _, _) -> Unix.openfile Filename.null flags 0 in
+	    match Delta.signature old with
+	    | signature -> old, signature
+	    | exception exn -> Unix.close old; raise exn
+      end
+      ()
+    >>= fun (old, signature) ->
+    let diff start =
+      NativeProtocol.Async.call shared_dir.peer
+	begin fun peer ->
+	      let shared_dirs = remote_shared_dirs peer in
+	      let shared_dir = Hashtbl.find shared_dirs (peer.peer_name, shared_dir_name) in
+	      let path = join (relative_path @ shared_dir.local_path) in
+	      Lwt_preemptive.detach
+		begin fun () ->
+		      let fd = Unix.openfile path [ Unix.O_RDONLY ; Unix.O_CLOEXEC ] 0 in
+		      Fun.protect ~finally: (fun () -> Unix.close fd)
+				  (fun () -> Delta.diff ~start signature fd, (Unix.fstat fd).Unix.st_perm)
+		end
+		()
+	end
+    in
+    (* Patches the deltas from start into into, and returns the
+     * permissions of the remote file. *)
+    let rec patch into start =
+      diff start
+      >>= fun (delta, perm) ->
+      Lwt_preemptive.detach (fun () -> Delta.patch ~old delta ~into) ()
+      >>= fun () ->
+      match delta.Delta.hash with
+      | None -> patch into delta.Delta.delta_end
+      | Some _ -> Lwt.return perm
+    in
+    Lwt.finalize
+      begin fun () ->
+	    Lwt_preemptive.detach
+	      (fun () -> Unix.openfile temp_path [ Unix.O_RDWR ; Unix.O_CREAT ; Unix.O_TRUNC ; Unix.O_CLOEXEC ] 0o600)
+	      ()
+	    >>= fun into ->
+	    Lwt.catch
+	      begin fun () ->
+		    patch into 0
+		    >>= fun perm ->
+		    Lwt_preemptive.detach
+		      begin fun () ->
+			    Unix.fchmod into perm;
+			    Unix.fsync into;
+			    Unix.close into
+		      end
+		      ()
+	      end
+	      (fun exn -> Unix.close into; Unix.unlink temp_path; Lwt.fail exn)
+      end
+      (fun () -> Unix.close old; Lwt.return_unit)
+    >>= fun () -> Lwt_unix.rename temp_path path
   in job aux
 
+let copy_file job shared_dir relative_path =
+  fetch_file job shared_dir relative_path
+
+let update_file job shared_dir relative_path local_stat =
+  fetch_file job shared_dir relative_path
+
+(* Brings the Merkle index of a shared directory up to date, on the paths
+ * its watcher saw change when it has one. *)
+let refresh_index path =
+  let index = MerkleIndex.get path in
+  match Watcher.get path with
+  | Some watcher ->
+     begin match Watcher.take watcher with
+     | Watcher.Everything -> Lwt_preemptive.detach MerkleIndex.refresh index
+     | Watcher.Paths ([], []) -> Lwt.return_unit
+     | Watcher.Paths (deep, shallow) ->
+	Lwt_preemptive.detach (fun () -> MerkleIndex.update index ~deep ~shallow) ()
+     end
+  | None -> Lwt_preemptive.detach MerkleIndex.refresh index
+
+(* Compares the Merkle indexes of both sides from the top: subtrees that
+ * hash the same are skipped, and only the listings of directories that
+ * differ travel. Indexes are refreshed when syncing from the root. *)
 let rec sync_dir ~job ~peer ~shared_dir ~relative_path =
   let aux () =
     let call = NativeProtocol.Async.call peer in
     let last_sync = shared_dir.last_sync
     and shared_dir_name = shared_dir.name
     and local_path = relative_path @ shared_dir.local_path in
-    let local_dir = ls local_path
-    and remote_dir =
-      call begin
-	  fun peer ->
-	  let shared_dirs = remote_shared_dirs peer in
-	  let shared_dir = Hashtbl.find shared_dirs (peer.peer_name, shared_dir_name) in
-	  let local_path = relative_path @ shared_dir.local_path in
-	  ls local_path
-	end
-    in
-    let module NameSet = Set.Make(struct type t = string let compare = compare end) in
-    let names = ref NameSet.empty in
-    let hash_dir dir =
-      let h = Hashtbl.create (List.length dir) in
-      List.iter begin fun stat ->
-		      let name = List.hd stat.path in
-		      names := NameSet.add name !names;
-		      Hashtbl.add h name stat
-		end
-		dir;
-      Lwt.return h
+    let local_index = MerkleIndex.get (join shared_dir.local_path) in
+    begin if relative_path = []
+	  then refresh_index (join shared_dir.local_path)
+	  else Lwt.return_unit
+    end
+    >>= fun () ->
+    let local_dir = MerkleIndex.find local_index relative_path in
+    let local_hash = match local_dir with
+      | Some entry -> Some entry.MerkleIndex.hash
+      | None -> None
     in
-    local_dir >>= hash_dir >>= fun local_dir ->
-    remote_dir >>= hash_dir >>= fun remote_dir ->
-    let names = !names in
-    NameSet.iter
-      begin fun name ->
-	    let local_stat = try Some (Hashtbl.find local_dir name)
-			     with Not_found -> None
-	    and remote_stat = try Some (Hashtbl.find remote_dir name)
-			      with Not_found -> None
-	    in
-	    match local_stat, remote_stat with
-	    | Some local_stat, Some remote_stat ->
-	       (* if local is Dir and remote is Dir, sync sub-dirs *)
-	       if local_stat.kind = Dir && remote_stat.kind = Dir
-	       then sync_dir ~job ~peer ~shared_dir ~relative_path: (name :: relative_path)
-	       else
-	      	 if remote_stat.mtime > last_sync
-		    && remote_stat.mtime > local_stat.mtime
-		 then (* remote changed since last sync and is newer than local.
-		       * add to job to copy from remote to local. *)
-		   update_file job shared_dir (name :: relative_path) local_stat
-	    | None, Some remote_stat -> 
-	       if remote_stat.mtime > last_sync
-	       then (* remote is new. *)
-		 copy_file job shared_dir (name :: relative_path)
-	       else (* delete remote. *)
-		 ()
-	    | Some local_stat, None ->
-	       if local_stat.mtime > last_sync
-	       then (* local is new. *)
-		 ()
-	       else (* delete local. *)
-		 delete_local job local_stat
-	    | None, None -> failwith "Impossible"
+    call begin
+	fun peer ->
+	let shared_dirs = remote_shared_dirs peer in
+	let shared_dir = Hashtbl.find shared_dirs (peer.peer_name, shared_dir_name) in
+	let index = MerkleIndex.get (join shared_dir.local_path) in
+	begin if relative_path = []
+	      then refresh_index (join shared_dir.local_path)
+	      else Lwt.return_unit
+	end
+	>|= fun () ->
+	match MerkleIndex.find index relative_path with
+	| Some entry when Some entry.MerkleIndex.hash = local_hash -> None
+	| Some entry -> Some (List.map MerkleIndex.shallow entry.MerkleIndex.children)
+	| None -> Some []
       end
-      names;
-    Lwt.return_unit
+    >|= function
+    | None -> () (* Same subtree on both sides. *)
+    | Some remote_dir ->
+       let module NameSet = Set.Make(struct type t = string let compare = compare end) in
+       let names = ref NameSet.empty in
+       let hash_dir dir =
+	 let h = Hashtbl.create (List.length dir) in
+	 List.iter begin fun entry ->
+			 let name = entry.MerkleIndex.name in
+			 names := NameSet.add name !names;
+			 Hashtbl.add h name entry
+		   end
+		   dir;
+	 h
+       in
+       let local_dir = hash_dir (match local_dir with
+				 | Some entry -> entry.MerkleIndex.children
+				 | None -> [])
+       and remote_dir = hash_dir remote_dir in
+       let stat_of_entry entry =
+	 { path = entry.MerkleIndex.name :: local_path ;
+	   kind = (match entry.MerkleIndex.kind with MerkleIndex.File -> File | MerkleIndex.Dir -> Dir) ;
+	   mtime = entry.MerkleIndex.mtime ;
+	   perm = 0 }
+       in
+       NameSet.iter
+	 begin fun name ->
+	       let local_entry = try Some (Hashtbl.find local_dir name)
+				 with Not_found -> None
+	       and remote_entry = try Some (Hashtbl.find remote_dir name)
+				  with Not_found -> None
+	       in
+	       let open MerkleIndex in
+	       match local_entry, remote_entry with
+	       | Some local_entry, Some remote_entry ->
+		  if local_entry.hash = remote_entry.hash
+		  then (* same contents. *)
+		    ()
+		  else if local_entry.kind = Dir && remote_entry.kind = Dir
+		  then sync_dir ~job ~peer ~shared_dir ~relative_path: (name :: relative_path)
+		  else
+		    if remote_entry.mtime > last_sync
+		       && remote_entry.mtime > local_entry.mtime
+		    then (* remote changed since last sync and is newer than local.
+			  * add to job to copy from remote to local. *)
+		      if local_entry.kind = remote_entry.kind
+		      then update_file job shared_dir (name :: relative_path) (stat_of_entry local_entry)
+		      else (* a file replaced a directory, or the reverse. *)
+			job begin fun () ->
+			      remove_local (stat_of_entry local_entry)
+			      >|= fun () ->
+			      fetch_entry ~job ~peer ~shared_dir ~relative_path: (name :: relative_path) remote_entry
+			    end
+	       | None, Some remote_entry ->
+		  if remote_entry.mtime > last_sync
+		  then (* remote is new. *)
+		    fetch_entry ~job ~peer ~shared_dir ~relative_path: (name :: relative_path) remote_entry
+		  else (* delete remote. *)
+		    ()
+	       | Some local_entry, None ->
+		  if local_entry.mtime > last_sync
+		  then (* local is new. *)
+		    ()
+		  else (* delete local. *)
+		    delete_local job (stat_of_entry local_entry)
+	       | None, None -> failwith "Impossible"
+	 end
+	 !names
   in job aux
 
+(* Creates a new remote entry locally: directories are made and synced
+ * from the peer, files are fetched. *)
+and fetch_entry ~job ~peer ~shared_dir ~relative_path remote_entry =
+  match remote_entry.MerkleIndex.kind with
+  | MerkleIndex.Dir ->
+     job begin fun () ->
+	   make_dir shared_dir relative_path
+	   >|= fun () -> sync_dir ~job ~peer ~shared_dir ~relative_path
+	 end
+  | MerkleIndex.File -> copy_file job shared_dir relative_path
+
 
 module Test =
   struct
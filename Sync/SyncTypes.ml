@@ -46,4 +46,14 @@ type root = {
      output : Lwt_io.output_channel;
      close : unit -> unit Lwt.t;
      onclose : unit Lwt.t;
+     traffic : traffic;
+     socket : Lwt_unix.file_descr;
+   }
+
+ and traffic = {
+     mutable compressed : bool;
+     mutable raw_sent : int;
+     mutable wire_sent : int;
+     mutable raw_received : int;
+     mutable wire_received : int;
    }
@@ -42,4 +42,16 @@ type root = {
      output : Lwt_io.output_channel;
      close : unit -> unit Lwt.t; (* Closes the connection. *)
      onclose : unit Lwt.t; (* Thead that wakes up when the connection is closed. *)
+     traffic : traffic; (* Bytes through the connection. *)
+     socket : Lwt_unix.file_descr; (* Written to directly only when traffic isn't compressed. *)
+   }
+
+ (** Bytes sent and received on a connection, before (raw) and after (wire)
+     compression. *)
+ and traffic = {
+     mutable compressed : bool; (* Whether the peers negotiated compression. *)
+     mutable raw_sent : int;
+     mutable wire_sent : int;
+     mutable raw_received : int;
+     mutable wire_received : int;
    }
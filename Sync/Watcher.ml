@@ -0,0 +1,212 @@
+open Lwt.Infix
+
+type t = {
+    root : string ;
+    fd : Unix.file_descr ;
+    lwt_fd : Lwt_unix.file_descr ;
+    (* Directory of each watch. *)
+    watches : (int, string list) Hashtbl.t ;
+    (* Directories that could not be watched. *)
+    unwatched : (string list, unit) Hashtbl.t ;
+    deep : (string list, unit) Hashtbl.t ;
+    shallow : (string list, unit) Hashtbl.t ;
+    mutable overflow : bool ;
+    mutable closed : bool ;
+  }
+
+type changes =
+  | Everything
+  | Paths of string list list * string list list
+
+external init : unit -> Unix.file_descr = "sync_watcher_init_impl"
+external add : Unix.file_descr -> string -> int = "sync_watcher_add_impl"
+external remove : Unix.file_descr -> int -> unit = "sync_watcher_remove_impl"
+external read : Unix.file_descr -> (int * int * string) list = "sync_watcher_read_impl"
+
+(* Flags of the events, as WatcherImpl.c sets them. *)
+let changed = 1
+and removed = 2
+and is_dir = 4
+and overflow = 8
+and gone = 16
+and created = 32
+
+let has flags flag =
+  flags land flag <> 0
+
+(* Dirty paths kept before falling back to a full rescan. *)
+let max_dirty = 65536
+
+let full_path t path =
+  List.fold_right (fun name path -> Filename.concat path name) path t.root
+
+(* Whether path is dir or under it. *)
+let is_under path dir =
+  let rec drop n l = if n = 0 then l else drop (n - 1) (List.tl l) in
+  let extra = List.length path - List.length dir in
+  extra >= 0 && drop extra path = dir
+
+let rec watch_tree t path =
+  match add t.fd (full_path t path) with
+  | wd ->
+     Hashtbl.replace t.watches wd path;
+     let names = try Sys.readdir (full_path t path) with Sys_error _ -> [||] in
+     Array.iter
+       (fun name -> if not (MerkleIndex.skipped name) then watch_tree t (name :: path))
+       names
+  | exception Unix.Unix_error ((Unix.ENOTDIR | Unix.ENOENT | Unix.ELOOP), _, _) -> ()
+  | exception Unix.Unix_error _ -> Hashtbl.replace t.unwatched path ()
+
+let unwatch_tree t path =
+  let wds = Hashtbl.fold (fun wd dir wds -> if is_under dir path then wd :: wds else wds)
+			 t.watches []
+  in
+  List.iter (fun wd -> Hashtbl.remove t.watches wd; remove t.fd wd) wds;
+  let dirs = Hashtbl.fold (fun dir () dirs -> if is_under dir path then dir :: dirs else dirs)
+			  t.unwatched []
+  in
+  List.iter (Hashtbl.remove t.unwatched) dirs
+
+let mark set path =
+  Hashtbl.replace set path ()
+
+let handle t (wd, flags, name) =
+  if has flags overflow
+  then t.overflow <- true
+  else
+    match Hashtbl.find t.watches wd with
+    | exception Not_found -> ()
+    | [] when has flags gone -> (* The root itself moved or went. *)
+       t.overflow <- true
+    | _ when has flags gone ->
+       (* Reported as removed in the parent too, which is what the index
+	* goes by. A moved directory keeps its watch, under a stale path. *)
+       Hashtbl.remove t.watches wd;
+       remove t.fd wd
+    | dir when name = "" -> mark t.shallow dir
+    | _ when MerkleIndex.skipped name -> ()
+    | dir ->
+       let path = name :: dir in
+       if has flags is_dir && has flags removed then unwatch_tree t path;
+       if has flags is_dir && has flags created
+       then begin
+	   watch_tree t path;
+	   mark t.deep path
+	 end
+       else if has flags (changed lor removed)
+       then mark t.shallow path
+
+let drain t =
+  let rec aux () =
+    match read t.fd with
+    | [] -> ()
+    | events -> List.iter (handle t) events; aux ()
+  in
+  aux ();
+  if Hashtbl.length t.deep + Hashtbl.length t.shallow > max_dirty
+  then t.overflow <- true;
+  if t.overflow
+  then begin
+      Hashtbl.reset t.deep;
+      Hashtbl.reset t.shallow
+    end
+
+let create root =
+  let fd = init () in
+  let t = { root ; fd ;
+	    lwt_fd = Lwt_unix.of_unix_file_descr ~blocking: false ~set_flags: false fd ;
+	    watches = Hashtbl.create 1024 ;
+	    unwatched = Hashtbl.create 16 ;
+	    deep = Hashtbl.create 64 ;
+	    shallow = Hashtbl.create 256 ;
+	    overflow = true ;
+	    closed = false }
+  in
+  watch_tree t [];
+  (* Drains the kernel's queue as events come, so that it overflows less
+   * between two syncs. *)
+  let rec loop () =
+    Lwt_unix.wait_read t.lwt_fd
+    >>= fun () ->
+    if t.closed then Lwt.return_unit
+    else begin
+	drain t;
+	loop ()
+      end
+  in
+  Lwt.async (fun () -> Lwt.catch loop (fun _ -> Lwt.return_unit));
+  t
+
+let take t =
+  drain t;
+  let keys set = Hashtbl.fold (fun path () paths -> path :: paths) set [] in
+  let changes =
+    if t.overflow
+    then Everything
+    else Paths (keys t.deep @ keys t.unwatched, keys t.shallow)
+  in
+  t.overflow <- false;
+  Hashtbl.reset t.deep;
+  Hashtbl.reset t.shallow;
+  changes
+
+let close t =
+  t.closed <- true;
+  Lwt_unix.close t.lwt_fd
+
+let watchers = Hashtbl.create 16
+
+let get root =
+  try Hashtbl.find watchers root
+  with Not_found ->
+    let watcher = try Some (create root) with Unix.Unix_error _ -> None in
+    Hashtbl.add watchers root watcher;
+    watcher
+
+(* rm -r d; mkdir d, as read in one batch: d must stay watched. *)
+let () = assert begin
+  match init () with
+  | exception Unix.Unix_error _ -> true
+  | fd ->
+     let root = Filename.concat (Filename.get_temp_dir_name ())
+				("sync-watcher-" ^ string_of_int (Unix.getpid ())) in
+     let d = Filename.concat root "d" in
+     Unix.mkdir root 0o700;
+     Unix.mkdir d 0o700;
+     let t = { root ; fd ;
+	       lwt_fd = Lwt_unix.of_unix_file_descr ~blocking: false ~set_flags: false fd ;
+	       watches = Hashtbl.create 4 ;
+	       unwatched = Hashtbl.create 1 ;
+	       deep = Hashtbl.create 1 ;
+	       shallow = Hashtbl.create 1 ;
+	       overflow = false ;
+	       closed = false }
+     in
+     watch_tree t [];
+     let wd_of path = Hashtbl.fold (fun wd dir found -> if dir = path then Some wd else found)
+				   t.watches None in
+     let root_wd = wd_of [] and old_wd = wd_of [ "d" ] in
+     Unix.rmdir d;
+     Unix.mkdir d 0o700;
+     begin match root_wd, old_wd with
+	   | Some root_wd, Some old_wd ->
+	      List.iter (handle t)
+			[ old_wd, gone, "" ;
+			  root_wd, removed lor is_dir, "d" ;
+			  root_wd, changed lor created lor is_dir, "d" ]
+	   | _ -> ()
+     end;
+     let new_wd = wd_of [ "d" ] in
+     Unix.rmdir d;
+     Unix.rmdir root;
+     Unix.close fd;
+     new_wd <> None && new_wd <> old_wd && Hashtbl.mem t.deep [ "d" ]
+end
+
+let () = assert begin
+  is_under [ "c" ; "b" ; "a" ] [ "b" ; "a" ]
+  && is_under [ "a" ] []
+  && is_under [ "b" ; "a" ] [ "b" ; "a" ]
+  && not (is_under [ "b" ; "a" ] [ "c" ; "b" ; "a" ])
+  && not (is_under [ "c" ; "b" ; "a" ] [ "b" ; "x" ])
+end
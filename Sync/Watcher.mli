@@ -0,0 +1,32 @@
+(** Journal of the changes under a directory, from inotify, so that its
+    Merkle index is brought up to date by walking the paths that changed
+    instead of the whole tree.
+
+    Events are coalesced into sets of dirty paths, innermost name first as
+    for the paths of [Sync]. When events are lost, because the kernel's
+    queue or the sets overflowed, the next [take] asks for a full rescan.
+    Directories that can't be watched, e.g. past the limit of watches, are
+    rescanned whole at every [take]. *)
+
+type t
+
+type changes =
+  | Everything
+  (* Deep paths, to walk whole, and shallow ones, to walk without the
+   * entries they already had: see MerkleIndex.update. *)
+  | Paths of string list list * string list list
+
+(** Starts watching the tree of a directory. Raises [Unix.Unix_error] when
+    the system has no inotify. *)
+val create : string -> t
+
+(** Watcher of a directory, started the first time, or [None] when the
+    system has no inotify. *)
+val get : string -> t option
+
+(** Returns the changes since the last call, and forgets them. The first
+    call returns [Everything], since the changes before [create] are
+    unknown. *)
+val take : t -> changes
+
+val close : t -> unit Lwt.t
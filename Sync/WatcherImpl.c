@@ -0,0 +1,147 @@
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+/* Change notifications of Watcher, on inotify. Events are returned with
+ * the flags below rather than inotify's masks, so that Watcher needs no
+ * constants from C. */
+
+#define SYNC_WATCHER_CHANGED 1
+#define SYNC_WATCHER_REMOVED 2
+#define SYNC_WATCHER_DIR 4
+#define SYNC_WATCHER_OVERFLOW 8
+#define SYNC_WATCHER_GONE 16
+#define SYNC_WATCHER_CREATED 32
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+
+#define SYNC_WATCHER_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB	\
+			   | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO		\
+			   | IN_DELETE_SELF | IN_MOVE_SELF			\
+			   | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/* Enough for a few hundred events of long names: a read returns as many
+ * whole events as fit. */
+#define SYNC_WATCHER_BUFFER_SIZE 65536
+
+CAMLprim value sync_watcher_init_impl(value unit)
+{
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    uerror("inotify_init1", Nothing);
+  }
+  return Val_int(fd);
+}
+
+CAMLprim value sync_watcher_add_impl(value fd, value path)
+{
+  int wd = inotify_add_watch(Int_val(fd), String_val(path), SYNC_WATCHER_MASK);
+  if (wd < 0) {
+    uerror("inotify_add_watch", path);
+  }
+  return Val_int(wd);
+}
+
+/* Fails with EINVAL when the watch is already gone, which is no error
+ * here. */
+CAMLprim value sync_watcher_remove_impl(value fd, value wd)
+{
+  inotify_rm_watch(Int_val(fd), Int_val(wd));
+  return Val_unit;
+}
+
+static int sync_watcher_flags(uint32_t mask)
+{
+  int flags = 0;
+  if (mask & (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO)) {
+    flags |= SYNC_WATCHER_CHANGED;
+  }
+  if (mask & (IN_CREATE | IN_MOVED_TO)) {
+    flags |= SYNC_WATCHER_CREATED;
+  }
+  if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+    flags |= SYNC_WATCHER_REMOVED;
+  }
+  if (mask & IN_ISDIR) {
+    flags |= SYNC_WATCHER_DIR;
+  }
+  if (mask & IN_Q_OVERFLOW) {
+    flags |= SYNC_WATCHER_OVERFLOW;
+  }
+  if (mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+    flags |= SYNC_WATCHER_GONE;
+  }
+  return flags;
+}
+
+/* Returns the pending events as a list of (watch, flags, name), in the
+ * order of the kernel, or [] when there is none. name is "" for events of
+ * the watched directory itself. */
+CAMLprim value sync_watcher_read_impl(value fd)
+{
+  CAMLparam1(fd);
+  CAMLlocal4(events, event, cell, last);
+  static char buffer[SYNC_WATCHER_BUFFER_SIZE]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  events = Val_emptylist;
+  /* The buffer is shared: reads are serialized by the runtime lock, which
+   * is kept since the descriptor doesn't block. */
+  ssize_t length = read(Int_val(fd), buffer, sizeof(buffer));
+  if (length < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      CAMLreturn(Val_emptylist);
+    }
+    uerror("read", Nothing);
+  }
+  for (char* p = buffer; p < buffer + length; ) {
+    struct inotify_event* e = (struct inotify_event*) p;
+    event = caml_alloc_tuple(3);
+    Store_field(event, 0, Val_int(e->wd));
+    Store_field(event, 1, Val_int(sync_watcher_flags(e->mask)));
+    Store_field(event, 2, caml_copy_string(e->len > 0 ? e->name : ""));
+    cell = caml_alloc_small(2, 0);
+    Field(cell, 0) = event;
+    Field(cell, 1) = Val_emptylist;
+    /* Appended, as handling events out of order mixes up the watches of
+     * a directory removed and created again. */
+    if (events == Val_emptylist) {
+      events = cell;
+    } else {
+      Store_field(last, 1, cell);
+    }
+    last = cell;
+    p += sizeof(struct inotify_event) + e->len;
+  }
+  CAMLreturn(events);
+}
+
+#else
+
+CAMLprim value sync_watcher_init_impl(value unit)
+{
+  unix_error(ENOSYS, "inotify_init1", Nothing);
+}
+
+CAMLprim value sync_watcher_add_impl(value fd, value path)
+{
+  unix_error(ENOSYS, "inotify_add_watch", path);
+}
+
+CAMLprim value sync_watcher_remove_impl(value fd, value wd)
+{
+  return Val_unit;
+}
+
+CAMLprim value sync_watcher_read_impl(value fd)
+{
+  return Val_emptylist;
+}
+
+#endif